@@ -9,6 +9,9 @@
 #include <new>
 #include <vector>
 
+// The tests have the sender put faults into its own datagrams
+#define RSE_TEST_FAULTS
+
 #include "rse_debug.h"
 #include "rse_sockets.h"
 #include "rse_perf.h"
@@ -18,17 +21,353 @@
 #include "rse_tests.h"
 
 // Blast udp
-int main() {
+int main(int argc, char** argv) {
 
     if (!rse::test::TestBitmap()) {
         printf("bitmap test failed\n");
         return false;
     }
+    if (!rse::test::TestLossReport()) {
+        printf("loss report test failed\n");
+        return false;
+    }
+    if (!rse::test::TestCrc32c()) {
+        printf("crc32c test failed\n");
+        return false;
+    }
+    if (!rse::test::TestHash64()) {
+        printf("hash64 test failed\n");
+        return false;
+    }
+    if (!rse::test::TestIsZero()) {
+        printf("zero scan test failed\n");
+        return false;
+    }
+    if (!rse::test::TestLz()) {
+        printf("lz test failed\n");
+        return false;
+    }
+    if (!rse::test::TestFec()) {
+        printf("fec test failed\n");
+        return false;
+    }
     if (!rse::test::TestMemMap()) {
         printf("memmap test failed\n");
         return false;
     }
     if (!rse::test::TestRBUDP()) printf("rbudp test failed\n");
 
+    rse::rbudp::SendOptions send_options;
+    rse::rbudp::ReceiveOptions receive_options;
+    send_options.segmentation_offload = true;
+    receive_options.receive_offload = true;
+    if (!rse::test::TestRBUDP("segmentation offload", send_options, receive_options)) printf("rbudp offload test failed\n");
+
+    // Sends from the map without copying, and waits for the kernel to let go of every send
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.zero_copy = true;
+    if (!rse::test::TestZeroCopy("zero copy", send_options, receive_options)) printf("rbudp zero copy test failed\n");
+
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.rate_mbps = 400;
+    if (!rse::test::TestPacedTransfer("paced 400 Mbps", send_options, receive_options)) printf("rbudp paced test failed\n");
+
+    // A receiver that keeps state for fewer blocks than the file has turns it away in the handshake
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    receive_options.max_blocks = 16;
+    if (!rse::test::TestRefusedTransfer("refused, too many blocks", send_options, receive_options)) printf("rbudp refused test failed\n");
+
+    // A receiver from before lanes and features, which must not be sent them
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.lanes = 4;
+    send_options.checksum = true;
+    send_options.pipelined = true;
+    send_options.fec_group_size = 8;
+    receive_options.protocol_version = 2;
+    if (!rse::test::TestOlderReceiver("version 2 receiver", send_options, receive_options)) printf("rbudp version 2 receiver test failed\n");
+
+    // A window much smaller than the file, so both ends keep moving it
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.map_window_size = 1024 * 1024;
+    receive_options.map_window_size = 1024 * 1024;
+    if (!rse::test::TestRBUDP("1 MB map window", send_options, receive_options)) printf("rbudp map window test failed\n");
+
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.lanes = 4;
+    if (!rse::test::TestRBUDP("4 lanes", send_options, receive_options)) printf("rbudp lanes test failed\n");
+
+    // Both ends through io_uring, which has to be there for this to pass
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.uring = true;
+    receive_options.uring = true;
+    if (!rse::test::TestUring("io_uring", send_options, receive_options)) printf("rbudp io_uring test failed\n");
+
+    send_options.uring_sqpoll = true;
+    send_options.segmentation_offload = true;
+    receive_options.receive_offload = true;
+    if (!rse::test::TestUring("io_uring sqpoll offload", send_options, receive_options)) printf("rbudp io_uring sqpoll test failed\n");
+
+    // Blocks go to disk from a writer thread instead of through the map
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.lanes = 4;
+    receive_options.sink = rse::rbudp::ReceiveSink::WRITER;
+    receive_options.direct_io = true;
+    receive_options.sync = true;
+    if (!rse::test::TestRBUDP("write-behind direct io 4 lanes", send_options, receive_options)) printf("rbudp write-behind test failed\n");
+
+    send_options = rse::rbudp::SendOptions();
+    send_options.uring = true;
+    receive_options = rse::rbudp::ReceiveOptions();
+    receive_options.sink = rse::rbudp::ReceiveSink::WRITER;
+    receive_options.uring = true;
+    if (!rse::test::TestRBUDP("write-behind io_uring", send_options, receive_options)) printf("rbudp write-behind io_uring test failed\n");
+
+    // The sender reads the file on threads of its own instead of sending from the map
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.read_ahead = true;
+    if (!rse::test::TestRBUDP("read-ahead", send_options, receive_options)) printf("rbudp read-ahead test failed\n");
+
+    send_options.lanes = 4;
+    send_options.segmentation_offload = true;
+    receive_options.receive_offload = true;
+    if (!rse::test::TestRBUDP("read-ahead offload 4 lanes", send_options, receive_options)) printf("rbudp read-ahead lanes test failed\n");
+
+#ifdef RSE_TEST_FAULTS
+    // Datagrams that turn up after the flag that ends their round
+    rse::rbudp::TestFaults faults;
+    faults.late_datagrams = 4;
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.faults = &faults;
+    if (!rse::test::TestLateDatagrams("late datagrams", send_options, receive_options)) printf("rbudp late datagrams test failed\n");
+#endif
+
+    // Loss is NACKed while the blast is still going instead of after it
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.pipelined = true;
+    if (!rse::test::TestRBUDP("pipelined", send_options, receive_options)) printf("rbudp pipelined test failed\n");
+
+    send_options.rate_mbps = 400;
+    if (!rse::test::TestPipelinedTransfer("pipelined paced, nothing wasted", send_options, receive_options)) printf("rbudp pipelined resend test failed\n");
+    send_options.rate_mbps = 0;
+
+    send_options.lanes = 4;
+    send_options.read_ahead = true;
+    if (!rse::test::TestRBUDP("pipelined read-ahead 4 lanes", send_options, receive_options)) printf("rbudp pipelined lanes test failed\n");
+
+    // Every block is checked against the CRC32C in its header, and the file against a digest of them
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.checksum = true;
+    if (!rse::test::TestRBUDP("checksums", send_options, receive_options)) printf("rbudp checksum test failed\n");
+
+    send_options.read_ahead = true;
+    send_options.uring = true;
+    receive_options.uring = true;
+    receive_options.sink = rse::rbudp::ReceiveSink::WRITER;
+    if (!rse::test::TestRBUDP("checksums read-ahead io_uring write-behind", send_options, receive_options)) printf("rbudp checksum io_uring test failed\n");
+
+#ifdef RSE_TEST_FAULTS
+    // Corrupt blocks are dropped and sent again
+    faults = rse::rbudp::TestFaults();
+    faults.corrupt_percentage = 5;
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.checksum = true;
+    send_options.lanes = 2;
+    send_options.faults = &faults;
+    if (!rse::test::TestCorruptBlocks("checksums corrupt blocks 2 lanes", send_options, receive_options)) printf("rbudp corrupt blocks test failed\n");
+#endif
+
+    // Parity for every group of blocks lets the receiver rebuild what it lost without another round
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.fec_group_size = 8;
+    if (!rse::test::TestRBUDP("fec xor 8+1", send_options, receive_options)) printf("rbudp fec xor test failed\n");
+
+    send_options.fec_group_size = 16;
+    send_options.fec_parity = 2;
+    send_options.read_ahead = true;
+    send_options.lanes = 4;
+    send_options.checksum = true;
+    receive_options.sink = rse::rbudp::ReceiveSink::WRITER;
+    if (!rse::test::TestRBUDP("fec reed-solomon 16+2 read-ahead checksums 4 lanes", send_options, receive_options)) printf("rbudp fec reed-solomon test failed\n");
+
+#ifdef RSE_TEST_FAULTS
+    // and so needs fewer rounds than resending would
+    faults = rse::rbudp::TestFaults();
+    faults.loss_percentage = 5;
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.fec_group_size = 8;
+    send_options.faults = &faults;
+    if (!rse::test::TestFecTransfer("fec xor 8+1 5% loss", send_options, receive_options)) printf("rbudp fec loss test failed\n");
+
+    send_options.fec_group_size = 16;
+    send_options.fec_parity = 2;
+    send_options.lanes = 4;
+    send_options.read_ahead = true;
+    if (!rse::test::TestFecTransfer("fec reed-solomon 16+2 5% loss read-ahead 4 lanes", send_options, receive_options)) printf("rbudp fec loss lanes test failed\n");
+#endif
+
+    // Only the blocks that differ from the receiver's old copy of the file are sent
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.delta = true;
+    if (!rse::test::TestDeltaTransfer("delta", send_options, receive_options)) printf("rbudp delta test failed\n");
+
+    send_options.lanes = 4;
+    send_options.read_ahead = true;
+    send_options.checksum = true;
+    receive_options.sink = rse::rbudp::ReceiveSink::WRITER;
+    if (!rse::test::TestDeltaTransfer("delta read-ahead checksums write-behind 4 lanes", send_options, receive_options)) printf("rbudp delta lanes test failed\n");
+
+    // Blocks of zeros go as just their header and stay holes in the received file
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.zero_blocks = true;
+    send_options.segmentation_offload = true;
+    receive_options.receive_offload = true;
+    if (!rse::test::TestZeroBlockTransfer("zero blocks segmentation offload", send_options, receive_options)) printf("rbudp zero blocks test failed\n");
+
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.zero_blocks = true;
+    send_options.delta = true;
+    send_options.read_ahead = true;
+    send_options.checksum = true;
+    send_options.fec_group_size = 8;
+    receive_options.sink = rse::rbudp::ReceiveSink::WRITER;
+    if (!rse::test::TestZeroBlockTransfer("zero blocks delta read-ahead checksums fec write-behind", send_options, receive_options)) printf("rbudp zero blocks delta test failed\n");
+
+    // Blocks that shrink go compressed, until it stops paying
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.compression = true;
+    send_options.segmentation_offload = true;
+    receive_options.receive_offload = true;
+    if (!rse::test::TestCompressionTransfer("compression segmentation offload", true, send_options, receive_options)) printf("rbudp compression test failed\n");
+
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.compression = true;
+    send_options.read_ahead = true;
+    send_options.checksum = true;
+    send_options.fec_group_size = 8;
+    send_options.lanes = 4;
+    send_options.uring = true;
+    receive_options.uring = true;
+    receive_options.sink = rse::rbudp::ReceiveSink::WRITER;
+    if (!rse::test::TestCompressionTransfer("compression read-ahead checksums fec io_uring write-behind 4 lanes", true, send_options, receive_options)) printf("rbudp compression lanes test failed\n");
+
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.compression = true;
+    send_options.checksum = true;
+    if (!rse::test::TestCompressionTransfer("compression bypassed on noise", false, send_options, receive_options)) printf("rbudp compression bypass test failed\n");
+
+    // Packets carry the session and round, and the receiver drops the ones that aren't current
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.sessions = true;
+    send_options.pipelined = true;
+    send_options.lanes = 4;
+    if (!rse::test::TestRBUDP("session ids pipelined 4 lanes", send_options, receive_options)) printf("rbudp session ids test failed\n");
+
+#ifdef RSE_TEST_FAULTS
+    faults = rse::rbudp::TestFaults();
+    faults.replayed_datagrams = 4;
+    send_options = rse::rbudp::SendOptions();
+    send_options.sessions = true;
+    send_options.lanes = 2;
+    send_options.faults = &faults;
+    if (!rse::test::TestStalePackets("session ids stale and foreign packets 2 lanes", send_options, receive_options)) printf("rbudp stale packets test failed\n");
+#endif
+
+    // Picks up from the checkpoint an interrupted transfer left, checkpointing as often as it can
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.resume = true;
+    receive_options.checkpoint_interval_ms = 1;
+    if (!rse::test::TestResumeTransfer("resume", send_options, receive_options)) printf("rbudp resume test failed\n");
+
+    send_options.pipelined = true;
+    send_options.checksum = true;
+    send_options.delta = true;
+    send_options.lanes = 4;
+    receive_options.sink = rse::rbudp::ReceiveSink::WRITER;
+    if (!rse::test::TestResumeTransfer("resume pipelined checksums delta write-behind 4 lanes", send_options, receive_options)) printf("rbudp resume lanes test failed\n");
+
+#ifdef RSE_TEST_FAULTS
+    // and from the checkpoint a sender that gave up partway left
+    send_options = rse::rbudp::SendOptions();
+    receive_options = rse::rbudp::ReceiveOptions();
+    send_options.resume = true;
+    if (!rse::test::TestInterruptedTransfer("resume interrupted", send_options, receive_options)) printf("rbudp resume interrupted test failed\n");
+
+    send_options.checksum = true;
+    send_options.lanes = 4;
+    receive_options.sink = rse::rbudp::ReceiveSink::WRITER;
+    if (!rse::test::TestInterruptedTransfer("resume interrupted checksums write-behind 4 lanes", send_options, receive_options)) printf("rbudp resume interrupted lanes test failed\n");
+#endif
+
+    // Many senders at once to one receiver that stays up
+    rse::rbudp::DaemonOptions daemon_options;
+    daemon_options.max_sessions = 4;
+    send_options = rse::rbudp::SendOptions();
+    send_options.lanes = 2;
+    if (!rse::test::TestDaemon("daemon 12 senders 4 at once", 12, daemon_options, send_options)) printf("rbudp daemon test failed\n");
+
+    // and all of them on one udp port
+    daemon_options.shared_port = true;
+    send_options.sessions = true;
+    send_options.lanes = 4;
+    if (!rse::test::TestDaemon("daemon shared port 12 senders 4 at once 4 lanes", 12, daemon_options, send_options)) printf("rbudp daemon shared port test failed\n");
+
+#ifdef RSE_TEST_FAULTS
+    // where the demux drops what senders replay from earlier rounds
+    faults = rse::rbudp::TestFaults();
+    faults.replayed_datagrams = 4;
+    send_options.faults = &faults;
+    if (!rse::test::TestDaemon("daemon shared port stale and foreign packets 12 senders 4 at once 4 lanes", 12, daemon_options, send_options)) printf("rbudp daemon stale packets test failed\n");
+#endif
+
+    // Senders that go quiet don't keep the daemon's slots, or keep it from stopping
+    if (!rse::test::TestDaemonIdleSessions()) printf("rbudp daemon idle sessions test failed\n");
+
+    // Moves a sparse file of just over 4 GB, so only on request
+    if (argc > 1 && strcmp(argv[1], "--large") == 0) {
+        if (!rse::test::BenchmarkLargeFile()) printf("rbudp large file benchmark failed\n");
+    }
+    // Shows at which rates compression pays
+    if (argc > 1 && strcmp(argv[1], "--compression") == 0) {
+        if (!rse::test::BenchmarkCompression()) printf("rbudp compression benchmark failed\n");
+    }
+
+    // Shows how transfers scale with lanes
+    if (argc > 1 && strcmp(argv[1], "--lanes") == 0) {
+        if (!rse::test::BenchmarkLanes()) printf("rbudp lanes benchmark failed\n");
+    }
+
+    // Shows what reading ahead buys when the file isn't in the page cache
+    if (argc > 1 && strcmp(argv[1], "--read-ahead") == 0) {
+        if (!rse::test::BenchmarkReadAhead()) printf("rbudp read ahead benchmark failed\n");
+    }
+
+    // Shows how a receiver daemon does with dozens of transfers at once
+    if (argc > 1 && strcmp(argv[1], "--daemon") == 0) {
+        if (!rse::test::BenchmarkDaemon()) printf("rbudp daemon benchmark failed\n");
+    }
+
     return 1;
-}
\ No newline at end of file
+}
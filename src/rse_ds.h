@@ -2,10 +2,25 @@
 #include <stdio.h>
 #include <string.h>
 #include <cstdint>
+#include <atomic>
+#include <new>
 #include <assert.h>
+#include "rse_debug.h"
+#include <errno.h>
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+    #include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32)
+    #include <arm_acle.h>
+#endif
 
 #ifdef __linux__
     #include <sys/time.h>
+    #include <time.h>
 #endif
 
 
@@ -51,11 +66,363 @@ namespace rse {
    }
 #endif
 
+    // Monotonic clock in nanoseconds. Only differences between two calls mean anything.
+    uint64_t NowNs() {
+#ifdef _WIN32
+        LARGE_INTEGER freq, now;
+        QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&now);
+        return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#elif __linux__
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+    }
+
+    // Sleeps for roughly ns nanoseconds. The OS may oversleep, so callers
+    // that need to be precise sleep for less and spin on NowNs for the rest.
+    void SleepNs(uint64_t ns) {
+#ifdef _WIN32
+        Sleep((DWORD)(ns / 1000000));
+#elif __linux__
+        timespec ts;
+        ts.tv_sec = ns / 1000000000ull;
+        ts.tv_nsec = ns % 1000000000ull;
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {}
+#endif
+    }
+
+    // Bit twiddling helpers. These map to single instructions (popcnt/tzcnt) where the compiler has them.
+    inline int PopCount64(uint64_t x) {
+#if defined(_MSC_VER)
+        return (int)__popcnt64(x);
+#else
+        return __builtin_popcountll(x);
+#endif
+    }
+
+    // Undefined for 0
+    inline int CountTrailingZeros64(uint64_t x) {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward64(&index, x);
+        return (int)index;
+#else
+        return __builtin_ctzll(x);
+#endif
+    }
+
+    // *word |= bits, safe against other threads doing the same
+    inline void AtomicOr64(uint64_t* word, uint64_t bits) {
+#if defined(_MSC_VER)
+        _InterlockedOr64((volatile long long*)word, (long long)bits);
+#else
+        __atomic_fetch_or(word, bits, __ATOMIC_RELAXED);
+#endif
+    }
+
+    // Returns the index of the first word in words[0, count) that isn't all ones, or count if they all are
+    inline size_t FindFirstNotAllOnes(const uint64_t* words, size_t count) {
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256i ones = _mm256_set1_epi64x(-1);
+        for (; i + 4 <= count; i += 4) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(words + i));
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(v, ones)) != -1) break;
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        // Comparing 32 bit lanes is enough to tell if a 64 bit word is all ones
+        const __m128i ones = _mm_set1_epi32(-1);
+        for (; i + 4 <= count; i += 4) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(words + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(words + i + 2));
+            __m128i both = _mm_and_si128(_mm_cmpeq_epi32(a, ones), _mm_cmpeq_epi32(b, ones));
+            if (_mm_movemask_epi8(both) != 0xFFFF) break;
+        }
+#endif
+        for (; i < count; i++) {
+            if (words[i] != ~0ull) return i;
+        }
+        return count;
+    }
+
+    // Index of the first bit at or after from in the first num_bits bits of words that equals value,
+    // or num_bits if there is none. Whole words that can't match are skipped 64 bits at a time.
+    inline size_t FindNextBit(const uint64_t* words, size_t num_bits, size_t from, bool value) {
+        if (from >= num_bits) return num_bits;
+
+        uint64_t flip = value ? 0 : ~0ull; // turns the bits we are looking for into ones
+        size_t w = from / 64;
+        uint64_t match = (words[w] ^ flip) & (~0ull << (from % 64));
+        size_t num_words = (num_bits + 63) / 64;
+        while (!match) {
+            if (++w >= num_words) return num_bits;
+            match = words[w] ^ flip;
+        }
+
+        size_t index = w * 64 + CountTrailingZeros64(match);
+        return index < num_bits ? index : num_bits;
+    }
+
+    // CRC32C (Castagnoli), the checksum SSE4.2 and ARMv8 have an instruction for.
+    // The build doesn't assume either, so x86 picks the instruction at run time and
+    // everything else falls back to slicing by 8, which still does 8 bytes per step.
+    constexpr uint32_t CRC32C_POLY = 0x82F63B78; // reflected
+
+    struct Crc32cTables {
+        uint32_t t[8][256];
+
+        Crc32cTables() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t crc = i;
+                for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+                t[0][i] = crc;
+            }
+            for (uint32_t i = 0; i < 256; i++) {
+                for (int s = 1; s < 8; s++) t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+            }
+        }
+    };
+
+    // Works on the inverted crc, callers do the pre and post inversion
+    inline uint32_t Crc32cSoftware(uint32_t crc, const uint8_t* p, size_t n) {
+        static const Crc32cTables tables;
+        const uint32_t (*t)[256] = tables.t;
+        for (; n >= 8; n -= 8, p += 8) {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            v ^= crc;
+            crc = t[7][v & 0xFF] ^ t[6][(v >> 8) & 0xFF] ^ t[5][(v >> 16) & 0xFF] ^ t[4][(v >> 24) & 0xFF] ^
+                t[3][(v >> 32) & 0xFF] ^ t[2][(v >> 40) & 0xFF] ^ t[1][(v >> 48) & 0xFF] ^ t[0][v >> 56];
+        }
+        for (; n > 0; n--, p++) crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+        return crc;
+    }
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #define RSE_CRC32C_HARDWARE
+    __attribute__((target("sse4.2")))
+    inline uint32_t Crc32cHardware(uint32_t crc, const uint8_t* p, size_t n) {
+        uint64_t c = crc;
+        for (; n >= 8; n -= 8, p += 8) {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            c = _mm_crc32_u64(c, v);
+        }
+        crc = (uint32_t)c;
+        for (; n > 0; n--, p++) crc = _mm_crc32_u8(crc, *p);
+        return crc;
+    }
+
+    inline bool Crc32cHardwareSupported() {
+        static const bool supported = __builtin_cpu_supports("sse4.2");
+        return supported;
+    }
+#elif defined(_M_X64)
+    #define RSE_CRC32C_HARDWARE
+    inline uint32_t Crc32cHardware(uint32_t crc, const uint8_t* p, size_t n) {
+        uint64_t c = crc;
+        for (; n >= 8; n -= 8, p += 8) {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            c = _mm_crc32_u64(c, v);
+        }
+        crc = (uint32_t)c;
+        for (; n > 0; n--, p++) crc = _mm_crc32_u8(crc, *p);
+        return crc;
+    }
+
+    inline bool Crc32cHardwareSupported() {
+        static const bool supported = [] {
+            int info[4];
+            __cpuid(info, 1);
+            return (info[2] & (1 << 20)) != 0; // ECX bit 20 is SSE4.2
+        }();
+        return supported;
+    }
+#elif defined(__ARM_FEATURE_CRC32)
+    #define RSE_CRC32C_HARDWARE
+    inline uint32_t Crc32cHardware(uint32_t crc, const uint8_t* p, size_t n) {
+        for (; n >= 8; n -= 8, p += 8) {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            crc = __crc32cd(crc, v);
+        }
+        for (; n > 0; n--, p++) crc = __crc32cb(crc, *p);
+        return crc;
+    }
+
+    inline bool Crc32cHardwareSupported() { return true; }
+#endif
+
+    // CRC32C of n bytes of data, continuing from crc. Start with 0, and feeding the result back in
+    // with the next piece gives the same answer as doing it all at once.
+    inline uint32_t Crc32c(uint32_t crc, const void* data, size_t n) {
+        const uint8_t* p = (const uint8_t*)data;
+        crc = ~crc;
+#ifdef RSE_CRC32C_HARDWARE
+        if (Crc32cHardwareSupported()) return ~Crc32cHardware(crc, p, n);
+#endif
+        return ~Crc32cSoftware(crc, p, n);
+    }
+
+    // Zero scans. Most blocks that aren't zero give themselves away in their first bytes, and ones that
+    // are have to be read to the end, so whole vectors are ORed together and only tested every 128 bytes.
+    // The build doesn't assume AVX2, so it is picked at run time over SSE2.
+    inline bool IsZeroScalar(const uint8_t* p, size_t n) {
+        uint64_t acc = 0;
+        for (; n >= 8; n -= 8, p += 8) {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            acc |= v;
+        }
+        for (; n > 0; n--, p++) acc |= *p;
+        return acc == 0;
+    }
+
+#if defined(__SSE2__) || defined(_M_X64)
+    inline bool IsZeroSse2(const uint8_t* p, size_t n) {
+        const __m128i zero = _mm_setzero_si128();
+        for (; n >= 128; n -= 128, p += 128) {
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            for (int k = 1; k < 8; k++) v = _mm_or_si128(v, _mm_loadu_si128((const __m128i*)(p + 16 * k)));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF) return false;
+        }
+        return IsZeroScalar(p, n);
+    }
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #define RSE_ZERO_SCAN_AVX2
+    __attribute__((target("avx2")))
+    inline bool IsZeroAvx2(const uint8_t* p, size_t n) {
+        for (; n >= 128; n -= 128, p += 128) {
+            __m256i v = _mm256_or_si256(
+                _mm256_or_si256(_mm256_loadu_si256((const __m256i*)p), _mm256_loadu_si256((const __m256i*)(p + 32))),
+                _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p + 64)), _mm256_loadu_si256((const __m256i*)(p + 96))));
+            if (!_mm256_testz_si256(v, v)) return false;
+        }
+        return IsZeroSse2(p, n);
+    }
+
+    inline bool IsZeroAvx2Supported() {
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+    }
+#endif
+
+    // Whether n bytes of data are all zero
+    inline bool IsZero(const void* data, size_t n) {
+        const uint8_t* p = (const uint8_t*)data;
+#ifdef RSE_ZERO_SCAN_AVX2
+        if (IsZeroAvx2Supported()) return IsZeroAvx2(p, n);
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+        return IsZeroSse2(p, n);
+#else
+        return IsZeroScalar(p, n);
+#endif
+    }
+
+    // xxHash64. Not cryptographic, but fast enough to hash a file at disk speed and with 64 bits
+    // no two different blocks of one file will collide in practice.
+    constexpr uint64_t HASH64_PRIME1 = 0x9E3779B185EBCA87ull;
+    constexpr uint64_t HASH64_PRIME2 = 0xC2B2AE3D27D4EB4Full;
+    constexpr uint64_t HASH64_PRIME3 = 0x165667B19E3779F9ull;
+    constexpr uint64_t HASH64_PRIME4 = 0x85EBCA77C2B2AE63ull;
+    constexpr uint64_t HASH64_PRIME5 = 0x27D4EB2F165667C5ull;
+
+    inline uint64_t RotateLeft64(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    inline uint64_t Hash64Round(uint64_t acc, uint64_t input) {
+        acc += input * HASH64_PRIME2;
+        return RotateLeft64(acc, 31) * HASH64_PRIME1;
+    }
+
+    inline uint64_t Hash64Merge(uint64_t acc, uint64_t v) {
+        acc ^= Hash64Round(0, v);
+        return acc * HASH64_PRIME1 + HASH64_PRIME4;
+    }
+
+    inline uint64_t Hash64(const void* data, size_t n, uint64_t seed = 0) {
+        const uint8_t* p = (const uint8_t*)data;
+        const uint8_t* end = p + n;
+        uint64_t h;
+
+        // Four independent lanes of 8 bytes, so the multiplies overlap
+        if (n >= 32) {
+            uint64_t v1 = seed + HASH64_PRIME1 + HASH64_PRIME2;
+            uint64_t v2 = seed + HASH64_PRIME2;
+            uint64_t v3 = seed;
+            uint64_t v4 = seed - HASH64_PRIME1;
+            for (; p + 32 <= end; p += 32) {
+                uint64_t w[4];
+                memcpy(w, p, 32);
+                v1 = Hash64Round(v1, w[0]);
+                v2 = Hash64Round(v2, w[1]);
+                v3 = Hash64Round(v3, w[2]);
+                v4 = Hash64Round(v4, w[3]);
+            }
+            h = RotateLeft64(v1, 1) + RotateLeft64(v2, 7) + RotateLeft64(v3, 12) + RotateLeft64(v4, 18);
+            h = Hash64Merge(h, v1);
+            h = Hash64Merge(h, v2);
+            h = Hash64Merge(h, v3);
+            h = Hash64Merge(h, v4);
+        }
+        else {
+            h = seed + HASH64_PRIME5;
+        }
+        h += (uint64_t)n;
+
+        for (; p + 8 <= end; p += 8) {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            h ^= Hash64Round(0, v);
+            h = RotateLeft64(h, 27) * HASH64_PRIME1 + HASH64_PRIME4;
+        }
+        if (p + 4 <= end) {
+            uint32_t v;
+            memcpy(&v, p, 4);
+            h ^= (uint64_t)v * HASH64_PRIME1;
+            h = RotateLeft64(h, 23) * HASH64_PRIME2 + HASH64_PRIME3;
+            p += 4;
+        }
+        for (; p < end; p++) {
+            h ^= (*p) * HASH64_PRIME5;
+            h = RotateLeft64(h, 11) * HASH64_PRIME1;
+        }
+
+        h ^= h >> 33;
+        h *= HASH64_PRIME2;
+        h ^= h >> 29;
+        h *= HASH64_PRIME3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    // A bitmap stored as 64 bit words with a summary level on top that has a bit per word,
+    // set when that word is full. Finding the next clear bit skips full words 64 at a time and
+    // the number of set bits is kept as we go, so checking for completion is O(1).
+    // The bytes in Data() are laid out bit i -> byte i / 8, bit i % 8 on little endian machines.
+    // Threads may Set bits concurrently as long as each owns whole words, i.e. ranges of 64 bits
+    // aligned to that. The summary and the count are updated atomically so they stay right.
+    constexpr size_t BITMAP_WORD_BITS = 64;
+
     struct Bitmap {
 
-        uint8_t* bitmap = nullptr;
+        uint64_t* bitmap = nullptr;
+        uint64_t* summary = nullptr;
         size_t size = 0;
-        size_t capacity = 0;
+        size_t capacity = 0; // in bytes
+        size_t num_words = 0;
+        size_t num_summary_words = 0;
+        std::atomic<size_t> count{ 0 }; // number of set bits
+        uint64_t* changed = nullptr; // with TrackChanges, a bit per chunk of words that changed since TakeChanged
+        size_t num_changed_words = 0;
+        size_t chunk_shift = 0; // a chunk is 1 << chunk_shift words
 
         Bitmap(size_t size_in) {
             Allocate(size_in);
@@ -65,55 +432,227 @@ namespace rse {
         size_t Capacity() { return capacity; }
         size_t SizeOf() { return Capacity(); }
 
+        // Sizes can come off the wire, so running out of memory leaves an empty bitmap that
+        // Allocated says isn't there, instead of throwing
         void Allocate(size_t size_in) {
             delete[] bitmap;
+            delete[] summary;
+            delete[] changed;
             bitmap = nullptr;
+            summary = nullptr;
+            changed = nullptr;
+            num_changed_words = 0;
             size = size_in;
-            capacity = (size / 8) + 1;
-            bitmap = new uint8_t[capacity];
-            memset(bitmap, 0, sizeof(uint8_t) * capacity);
+            count = 0;
+            // always at least (size / 8) + 1 bytes, which is what goes over the wire
+            num_words = (size / 64) + 1;
+            capacity = num_words * sizeof(uint64_t);
+            num_summary_words = (num_words / 64) + 1;
+            bitmap = new (std::nothrow) uint64_t[num_words];
+            summary = new (std::nothrow) uint64_t[num_summary_words];
+            if (bitmap == nullptr || summary == nullptr) {
+                delete[] bitmap;
+                delete[] summary;
+                bitmap = nullptr;
+                summary = nullptr;
+                size = capacity = num_words = num_summary_words = 0;
+                return;
+            }
+            memset(bitmap, 0, capacity);
+
+            // Summary bits past the last word are set so they never look like they need searching
+            memset(summary, 0, num_summary_words * sizeof(uint64_t));
+            for (size_t w = num_words; w < num_summary_words * 64; w++) {
+                summary[w / 64] |= 1ull << (w % 64);
+            }
+            for (size_t w = 0; w < num_words; w++) UpdateSummary(w);
+        }
+        uint8_t* Data() { return (uint8_t*)bitmap; }
+        bool Allocated() { return bitmap != nullptr; }
+
+        // Bits of a word that are past the end of the bitmap. They are never set
+        // in the data but count as set when deciding if a word is full.
+        uint64_t PaddingMask(size_t word_index) {
+            size_t first_bit = word_index * 64;
+            if (first_bit + 64 <= size) return 0;
+            if (first_bit >= size) return ~0ull;
+            return ~0ull << (size - first_bit);
+        }
+
+        void UpdateSummary(size_t word_index) {
+            bool full = (bitmap[word_index] | PaddingMask(word_index)) == ~0ull;
+            uint64_t bit = 1ull << (word_index % 64);
+            if (full) summary[word_index / 64] |= bit;
+            else summary[word_index / 64] &= ~bit;
+            MarkChanged(word_index);
+        }
+
+        // Starts keeping a bit per chunk of chunk_words words, a power of two, that is set whenever a bit in
+        // the chunk changes. A copy of the bitmap can then be brought up to date without comparing all of it.
+        bool TrackChanges(size_t chunk_words) {
+            delete[] changed;
+            chunk_shift = CountTrailingZeros64(chunk_words);
+            num_changed_words = ((num_words >> chunk_shift) / 64) + 1;
+            changed = new (std::nothrow) uint64_t[num_changed_words]();
+            if (changed == nullptr) num_changed_words = 0;
+            return changed != nullptr;
+        }
+
+        void MarkChanged(size_t word_index) {
+            if (changed == nullptr) return;
+            size_t chunk = word_index >> chunk_shift;
+            uint64_t bit = 1ull << (chunk % 64);
+            if (!(changed[chunk / 64] & bit)) AtomicOr64(&changed[chunk / 64], bit);
         }
-        uint8_t* Data() { return bitmap; }
 
-        void Set(size_t index) {
-            size_t byte_index = index / 8;
-            size_t bit_index = index % 8;
-            if (byte_index >= capacity) throw;
-            bitmap[byte_index] |= 1 << bit_index;
+        // The changed bits of chunks [64 * i, 64 * i + 64), which are cleared. Not while bits are being set.
+        uint64_t TakeChanged(size_t i) {
+            uint64_t bits = changed[i];
+            changed[i] = 0;
+            return bits;
+        }
+
+        // Returns true if the bit wasn't already set
+        bool Set(size_t index) {
+            assert(index < size);
+            uint64_t bit = 1ull << (index % 64);
+            uint64_t& word = bitmap[index / 64];
+            if (word & bit) return false;
+            word |= bit;
+            count++;
+            size_t w = index / 64;
+            if ((word | PaddingMask(w)) == ~0ull) AtomicOr64(&summary[w / 64], 1ull << (w % 64));
+            MarkChanged(w);
+            return true;
         }
 
         void Unset(size_t index) {
-            size_t byte_index = index / 8;
-            size_t bit_index = index % 8;
-            if (byte_index >= capacity) throw;
-            bitmap[byte_index] &= ~(1 << bit_index);
+            assert(index < size);
+            uint64_t bit = 1ull << (index % 64);
+            uint64_t& word = bitmap[index / 64];
+            if (!(word & bit)) return;
+            word &= ~bit;
+            count--;
+            size_t w = index / 64;
+            summary[w / 64] &= ~(1ull << (w % 64));
+            MarkChanged(w);
         }
 
         bool Get(size_t index) {
-            size_t byte_index = index / 8;
-            size_t bit_index = index % 8;
-            if (byte_index >= capacity) throw;
-            return bitmap[byte_index] & (1 << bit_index);
+            assert(index < size);
+            return (bitmap[index / 64] >> (index % 64)) & 1;
         }
 
         bool operator[](size_t index) {
             return Get(index);
         }
 
-        void Print() {
+        // Number of set bits
+        size_t Count() { return count; }
+
+        bool AllSet() { return count == size; }
+
+        // Index of the first clear bit at or after from, or Size() if there is none
+        size_t FindNextClear(size_t from) {
+            if (from >= size) return size;
+
+            size_t w = from / 64;
+            uint64_t clear = ~(bitmap[w] | PaddingMask(w)) & (~0ull << (from % 64));
+            if (clear) return w * 64 + CountTrailingZeros64(clear);
+
+            // Find the next word that isn't full through the summary
+            w++;
+            size_t s = w / 64;
+            if (s >= num_summary_words) return size;
+            uint64_t not_full = ~summary[s] & (~0ull << (w % 64));
+            if (!not_full) {
+                s = s + 1 + FindFirstNotAllOnes(summary + s + 1, num_summary_words - s - 1);
+                if (s >= num_summary_words) return size;
+                not_full = ~summary[s];
+            }
+            w = s * 64 + CountTrailingZeros64(not_full);
+            if (w >= num_words) return size;
+
+            clear = ~(bitmap[w] | PaddingMask(w));
+            return w * 64 + CountTrailingZeros64(clear);
+        }
+
+        // Number of set bits in [start, start + num)
+        size_t CountRange(size_t start, size_t num) {
+            assert(start + num <= size);
+            size_t total = 0;
+            size_t end = start + num;
+            while (start < end) {
+                size_t bit = start % 64;
+                size_t bits = 64 - bit < end - start ? 64 - bit : end - start;
+                uint64_t mask = (bits == 64 ? ~0ull : ((1ull << bits) - 1)) << bit;
+                total += PopCount64(bitmap[start / 64] & mask);
+                start += bits;
+            }
+            return total;
+        }
+
+        // Index of the first set bit at or after from, or Size() if there is none
+        size_t FindNextSet(size_t from) {
+            return FindNextBit(bitmap, size, from, true);
+        }
+
+        // Sets or clears count bits starting at start, a word at a time
+        void SetRange(size_t start, size_t num, bool value = true) {
+            assert(start + num <= size);
+            size_t end = start + num;
+            while (start < end) {
+                size_t w = start / 64;
+                size_t bit = start % 64;
+                size_t bits = 64 - bit < end - start ? 64 - bit : end - start;
+                uint64_t mask = (bits == 64 ? ~0ull : ((1ull << bits) - 1)) << bit;
+
+                count -= PopCount64(bitmap[w] & mask);
+                if (value) bitmap[w] |= mask;
+                else bitmap[w] &= ~mask;
+                count += PopCount64(bitmap[w] & mask);
+                UpdateSummary(w);
 
+                start += bits;
+            }
+        }
+
+        void UnsetRange(size_t start, size_t num) {
+            SetRange(start, num, false);
+        }
+
+        void SetAll() { SetRange(0, size, true); }
+        void ClearAll() { SetRange(0, size, false); }
+
+        // Replaces the contents with num_bytes raw bytes laid out like Data(), e.g. straight off the wire
+        void Load(const uint8_t* bytes, size_t num_bytes) {
+            if (num_bytes > capacity) num_bytes = capacity;
+            memcpy(bitmap, bytes, num_bytes);
+            memset((uint8_t*)bitmap + num_bytes, 0, capacity - num_bytes);
+
+            size_t total = 0;
+            for (size_t w = 0; w < num_words; w++) {
+                bitmap[w] &= ~PaddingMask(w);
+                total += PopCount64(bitmap[w]);
+                UpdateSummary(w);
+            }
+            count = total;
+        }
+
+        // Only prints in debug builds. It walks every bit, and it is called once per packet.
+        void Print() {
+#ifdef RSE_DEBUG
             for (size_t i = 0; i < size; i++) {
-                size_t byte_index = i / 8;
-                size_t bit_index = i % 8;
-                int a = bitmap[byte_index] & (1 << bit_index);
-               // if (a) printf("1");
-                //else printf("0");
+                printf(Get(i) ? "1" : "0");
             }
-           // printf("\n");
+            printf("\n");
+#endif
         }
 
         ~Bitmap() {
             delete[] bitmap;
+            delete[] summary;
+            delete[] changed;
         }
     };
 }
\ No newline at end of file
@@ -0,0 +1,191 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "rse_ds.h"
+
+namespace rse {
+
+    // Erasure coding over GF(2^8) for forward error correction.
+    // A group of up to MAX_GROUP_SIZE data blocks gets up to MAX_PARITY parity blocks, and any
+    // of the data blocks can be rebuilt from as many parity blocks as went missing.
+    namespace fec {
+
+        constexpr uint32_t MAX_PARITY = 16;
+        constexpr uint32_t MAX_GROUP_SIZE = 256 - MAX_PARITY; // data blocks in a group, so every point of the code is distinct
+        constexpr uint32_t GF_POLY = 0x11D; // x^8 + x^4 + x^3 + x^2 + 1
+
+        struct GfTables {
+            uint8_t exp[512]; // doubled so exp[log a + log b] needs no modulo
+            uint8_t log[256];
+            uint8_t mul[256][256];
+
+            GfTables() {
+                uint32_t x = 1;
+                for (int i = 0; i < 255; i++) {
+                    exp[i] = (uint8_t)x;
+                    log[x] = (uint8_t)i;
+                    x <<= 1;
+                    if (x & 0x100) x ^= GF_POLY;
+                }
+                for (int i = 255; i < 512; i++) exp[i] = exp[i - 255];
+                log[0] = 0;
+                for (int a = 0; a < 256; a++) {
+                    for (int b = 0; b < 256; b++) {
+                        mul[a][b] = (a == 0 || b == 0) ? 0 : exp[log[a] + log[b]];
+                    }
+                }
+            }
+        };
+
+        inline const GfTables& Tables() {
+            static const GfTables tables;
+            return tables;
+        }
+
+        inline uint8_t Mul(uint8_t a, uint8_t b) {
+            return Tables().mul[a][b];
+        }
+
+        // Undefined for 0
+        inline uint8_t Inv(uint8_t a) {
+            const GfTables& t = Tables();
+            return t.exp[255 - t.log[a]];
+        }
+
+        // The weight of data block index in parity block row. It is a Cauchy matrix, 1 / (x_row + y_index)
+        // with x_row = 255 - row and y_index = index, so every square piece of it can be inverted,
+        // scaled by column so row 0 is all ones. A single parity block is then just the XOR of the group.
+        inline uint8_t Coefficient(uint32_t row, uint32_t index) {
+            uint8_t y = (uint8_t)index;
+            return Mul((uint8_t)(255 ^ y), Inv((uint8_t)((255 - row) ^ y)));
+        }
+
+        // dst ^= src, n bytes
+        inline void XorRegion(uint8_t* dst, const uint8_t* src, size_t n) {
+            size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+            for (; i + 16 <= n; i += 16) {
+                __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+                __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+                _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, s));
+            }
+#endif
+            for (; i < n; i++) dst[i] ^= src[i];
+        }
+
+        inline void MulAddRegionTable(uint8_t* dst, const uint8_t* src, uint8_t c, size_t n) {
+            const uint8_t* row = Tables().mul[c];
+            for (size_t i = 0; i < n; i++) dst[i] ^= row[src[i]];
+        }
+
+        // The SIMD kernels split every byte into nibbles and look both up in 16 entry tables of
+        // c times each nibble with a byte shuffle, 16 or 32 bytes at a time. The build doesn't
+        // assume SSSE3 or AVX2, so they are picked at run time.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+        #define RSE_FEC_SIMD
+        inline void NibbleTables(uint8_t c, uint8_t* lo, uint8_t* hi) {
+            const uint8_t* row = Tables().mul[c];
+            for (int x = 0; x < 16; x++) {
+                lo[x] = row[x];
+                hi[x] = row[x << 4];
+            }
+        }
+
+        __attribute__((target("ssse3")))
+        inline void MulAddRegionSsse3(uint8_t* dst, const uint8_t* src, uint8_t c, size_t n) {
+            uint8_t lo[16], hi[16];
+            NibbleTables(c, lo, hi);
+            const __m128i table_lo = _mm_loadu_si128((const __m128i*)lo);
+            const __m128i table_hi = _mm_loadu_si128((const __m128i*)hi);
+            const __m128i mask = _mm_set1_epi8(0x0F);
+            size_t i = 0;
+            for (; i + 16 <= n; i += 16) {
+                __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+                __m128i l = _mm_shuffle_epi8(table_lo, _mm_and_si128(s, mask));
+                __m128i h = _mm_shuffle_epi8(table_hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+                __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+                _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+            }
+            if (i < n) MulAddRegionTable(dst + i, src + i, c, n - i);
+        }
+
+        __attribute__((target("avx2")))
+        inline void MulAddRegionAvx2(uint8_t* dst, const uint8_t* src, uint8_t c, size_t n) {
+            uint8_t lo[16], hi[16];
+            NibbleTables(c, lo, hi);
+            const __m256i table_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)lo));
+            const __m256i table_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)hi));
+            const __m256i mask = _mm256_set1_epi8(0x0F);
+            size_t i = 0;
+            for (; i + 32 <= n; i += 32) {
+                __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+                __m256i l = _mm256_shuffle_epi8(table_lo, _mm256_and_si256(s, mask));
+                __m256i h = _mm256_shuffle_epi8(table_hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+                __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+                _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+            }
+            if (i < n) MulAddRegionTable(dst + i, src + i, c, n - i);
+        }
+
+        typedef void (*MulAddKernel)(uint8_t* dst, const uint8_t* src, uint8_t c, size_t n);
+
+        inline MulAddKernel PickMulAddKernel() {
+            static const MulAddKernel kernel =
+                __builtin_cpu_supports("avx2") ? MulAddRegionAvx2 :
+                __builtin_cpu_supports("ssse3") ? MulAddRegionSsse3 : MulAddRegionTable;
+            return kernel;
+        }
+#endif
+
+        // dst ^= c * src, n bytes
+        inline void MulAddRegion(uint8_t* dst, const uint8_t* src, uint8_t c, size_t n) {
+            if (c == 0) return;
+            if (c == 1) {
+                XorRegion(dst, src, n);
+                return;
+            }
+#ifdef RSE_FEC_SIMD
+            PickMulAddKernel()(dst, src, c, n);
+#else
+            MulAddRegionTable(dst, src, c, n);
+#endif
+        }
+
+        // Inverts the n x n row major matrix m in place. Returns false if it can't be.
+        inline bool Invert(uint8_t* m, int n) {
+            uint8_t inverse[MAX_PARITY * MAX_PARITY];
+            if (n < 1 || n > (int)MAX_PARITY) return false;
+            memset(inverse, 0, sizeof(inverse));
+            for (int i = 0; i < n; i++) inverse[i * n + i] = 1;
+
+            for (int col = 0; col < n; col++) {
+                int pivot = col;
+                while (pivot < n && m[pivot * n + col] == 0) pivot++;
+                if (pivot == n) return false;
+                if (pivot != col) {
+                    for (int k = 0; k < n; k++) {
+                        uint8_t t = m[col * n + k]; m[col * n + k] = m[pivot * n + k]; m[pivot * n + k] = t;
+                        t = inverse[col * n + k]; inverse[col * n + k] = inverse[pivot * n + k]; inverse[pivot * n + k] = t;
+                    }
+                }
+                uint8_t scale = Inv(m[col * n + col]);
+                for (int k = 0; k < n; k++) {
+                    m[col * n + k] = Mul(m[col * n + k], scale);
+                    inverse[col * n + k] = Mul(inverse[col * n + k], scale);
+                }
+                for (int row = 0; row < n; row++) {
+                    uint8_t factor = m[row * n + col];
+                    if (row == col || factor == 0) continue;
+                    for (int k = 0; k < n; k++) {
+                        m[row * n + k] ^= Mul(factor, m[col * n + k]);
+                        inverse[row * n + k] ^= Mul(factor, inverse[col * n + k]);
+                    }
+                }
+            }
+            memcpy(m, inverse, (size_t)n * n);
+            return true;
+        }
+
+    }
+
+}
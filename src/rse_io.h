@@ -4,25 +4,34 @@
 #elif __linux__
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #endif
+#include <stdlib.h>
+#include <new>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "rse_ds.h"
+#include "rse_thread.h"
 
 namespace rse {
 
 	namespace io {
 
 		enum class MemMapIO {
-			READ_WRITE,
-			READ_ONLY
+			READ_WRITE, // creates the file, replacing any that is there
+			READ_ONLY,
+			READ_WRITE_EXISTING, // writes to a file that is already there without truncating it
+			READ_WRITE_KEEP // creates the file, or resizes the one that is there keeping what it holds
 		};
 
 		// Attempts top open a file and read it's content into an allocated
 		// buffer with malloc. It's up to you to free this.
 		char* AllocateIntoBuffer(const char* filename, size_t &out_size) {
-			FILE *file = fopen("test.txt", "rb");
+			FILE *file = fopen(filename, "rb");
 			if (file == NULL) {
-				printf("Failed to open test file!");
+				printf("Failed to open [%s]\n", filename);
 				return nullptr;
 			}
 			fseek(file, 0, SEEK_END);
@@ -40,6 +49,63 @@ namespace rse {
 			return buffer;
 		}
 
+		// Size of a file in bytes, including ones bigger than 4 GB
+		bool GetFileSize(const char* filename, uint64_t& out_size) {
+#ifdef _WIN32
+			struct _stat64 info;
+			if (_stat64(filename, &info) != 0) return false;
+#else
+			struct stat info;
+			if (stat(filename, &info) != 0) return false;
+#endif
+			out_size = (uint64_t)info.st_size;
+			return true;
+		}
+
+		// Cuts or grows a file that is already there to size bytes
+		bool SetFileSize(const char* filename, uint64_t size) {
+#ifdef _WIN32
+			HANDLE h_file = CreateFileA(filename, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (h_file == INVALID_HANDLE_VALUE) return false;
+			LARGE_INTEGER end;
+			end.QuadPart = (LONGLONG)size;
+			bool ok = SetFilePointerEx(h_file, end, NULL, FILE_BEGIN) && SetEndOfFile(h_file);
+			CloseHandle(h_file);
+			return ok;
+#else
+			return truncate(filename, (off_t)size) == 0;
+#endif
+		}
+
+		// When a file was last modified, in nanoseconds since the epoch or as close as the platform says
+		bool GetFileModified(const char* filename, uint64_t& out_ns) {
+#ifdef _WIN32
+			struct _stat64 info;
+			if (_stat64(filename, &info) != 0) return false;
+			out_ns = (uint64_t)info.st_mtime * 1000000000ull;
+#else
+			struct stat info;
+			if (stat(filename, &info) != 0) return false;
+			out_ns = (uint64_t)info.st_mtim.tv_sec * 1000000000ull + (uint64_t)info.st_mtim.tv_nsec;
+#endif
+			return true;
+		}
+
+		// Drops a file from the page cache, so the next read of it goes to the disk. Only what is
+		// already on the disk can be dropped, so it is synced first. Windows has no way to do this.
+		bool EvictFile(const char* filename) {
+#ifdef _WIN32
+			(void)filename;
+			return false;
+#else
+			int fd = open(filename, O_RDONLY);
+			if (fd == -1) return false;
+			bool ok = fdatasync(fd) == 0 && posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+			close(fd);
+			return ok;
+#endif
+		}
+
 		// This is mostly just for windows
 		struct MemMap {
 			void* ptr = nullptr;
@@ -69,6 +135,38 @@ namespace rse {
 			#endif
 		}
 
+#ifdef _WIN32
+		// Lets a file have holes, so the parts of it that are never written take no space
+		void MarkSparse(HANDLE h_file) {
+			DWORD returned = 0;
+			DeviceIoControl(h_file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL);
+		}
+#endif
+
+#ifdef __linux__
+		// Creates or truncates filename and allocates size bytes for it, so writes through a
+		// mapping can't fail half way for lack of space. Falls back to a sparse file on
+		// filesystems without fallocate. With keep a file that is already there is cut or
+		// grown to size instead, and keeps what it holds. With sparse nothing is allocated,
+		// so whatever is never written stays a hole. Returns the open fd or -1.
+		int CreateFileOfSize(const char* filename, uint64_t size, bool keep = false, bool sparse = false) {
+			int fd = open(filename, keep ? O_RDWR | O_CREAT : O_RDWR | O_CREAT | O_TRUNC, 0644);
+			if (fd == -1) return -1;
+			if ((keep || sparse) && ftruncate(fd, (off_t)size) != 0) {
+				close(fd);
+				return -1;
+			}
+			if (sparse) return fd;
+			if (fallocate(fd, 0, 0, (off_t)size) != 0) {
+				if (ftruncate(fd, (off_t)size) != 0) {
+					close(fd);
+					return -1;
+				}
+			}
+			return fd;
+		}
+#endif
+
 		// Because windows is stupid we need an api
 		// to do file mapping that is cross platform
 		// This is not thread safe
@@ -91,6 +189,14 @@ namespace rse {
 				map_view_io = FILE_MAP_READ;
 				access_type = OPEN_ALWAYS;
 				break;
+			case MemMapIO::READ_WRITE_EXISTING:
+				map_view_io = FILE_MAP_ALL_ACCESS;
+				access_type = OPEN_EXISTING;
+				break;
+			case MemMapIO::READ_WRITE_KEEP:
+				map_view_io = FILE_MAP_ALL_ACCESS;
+				access_type = OPEN_ALWAYS;
+				break;
 			default:
 				map_view_io = FILE_MAP_ALL_ACCESS;
 				break;
@@ -134,32 +240,27 @@ namespace rse {
 				return false;
 			}
 #elif __linux__
-			
-			// create a file on disk of the right size
-			FILE* f = nullptr;
-			f = fopen(filename, "w");
-			if (f == nullptr) {
-				debug_printf("Failed to open file [%d][%s]\n", errno, strerror(errno));
-				return false;
-			}
-			fseek(f, size , SEEK_SET);
-			int fputresult = fputc('\0', f); // expand the file to the set size
-			fclose(f);
-			if (fputresult == EOF) {
-				debug_printf("Failed to open file [%d][%s]\n", errno, strerror(errno));
-				return false;
-			}
 
 			int fd = -1;
 			int prot = 0;
 			switch (io) {
 				case MemMapIO::READ_ONLY:
+					// The file must already exist, never truncate what we are about to read
 					prot = PROT_READ;
-					fd = open(filename, O_CREAT | O_RDONLY);
+					fd = open(filename, O_RDONLY);
 					break;
 				case MemMapIO::READ_WRITE:
+					// create a file on disk of the right size
+					prot = PROT_READ | PROT_WRITE;
+					fd = CreateFileOfSize(filename, size);
+					break;
+				case MemMapIO::READ_WRITE_EXISTING:
+					prot = PROT_READ | PROT_WRITE;
+					fd = open(filename, O_RDWR);
+					break;
+				case MemMapIO::READ_WRITE_KEEP:
 					prot = PROT_READ | PROT_WRITE;
-					fd = open(filename, O_CREAT | O_RDWR);
+					fd = CreateFileOfSize(filename, size, true);
 					break;
 			}
 
@@ -168,7 +269,8 @@ namespace rse {
 				return false;
 			}
 
-			char *ptr = (char*)mmap(nullptr, size, prot, MAP_PRIVATE, fd, 0);	
+			// Shared so that writes through the mapping end up in the file
+			char *ptr = (char*)mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
 			close(fd);
 			if (ptr == MAP_FAILED) {
 				debug_printf("Failed to map file [%d][%s]\n", errno, strerror(errno));
@@ -182,6 +284,724 @@ namespace rse {
 			return true;
 		}
 
+		// Windowed memory mapping
+		// --> Maps one fixed size window of a file at a time instead of the whole thing
+		// --> The window slides to wherever the next access is, so resident memory stays
+		//     bounded by the window size however big the file is
+		// --> Sequential access is hinted ahead of the window, and the pages it leaves
+		//     behind are dropped from the page cache
+
+		struct WindowedMap {
+			MemMapIO io = MemMapIO::READ_ONLY;
+			uint64_t file_size = 0;
+			uint64_t window_size = 0; // bytes mapped at once, a multiple of the alignment
+			uint64_t alignment = 0; // window offsets must be a multiple of this
+			char* ptr = nullptr; // start of the current window
+			uint64_t offset = 0; // file offset of the current window
+			uint64_t num_bytes = 0; // bytes in the current window
+			uint64_t remaps = 0; // number of times the window moved
+			#ifdef _WIN32
+			HANDLE h_file = INVALID_HANDLE_VALUE;
+			HANDLE h_mapping_obj = 0;
+			#else
+			int fd = -1;
+			#endif
+		};
+
+		// A window_size of 0, or one bigger than the file, maps the whole file. A file that is created or
+		// grown is allocated in full, since a write through the map to a hole the disk has no room for
+		// faults instead of failing. Leave holes afterwards with PunchHoles.
+		bool OpenWindowedMap(const char* filename, uint64_t size, MemMapIO io, uint64_t window_size, WindowedMap& m) {
+
+			if (size == 0) return false;
+			m = WindowedMap();
+			m.io = io;
+			m.file_size = size;
+
+#ifdef _WIN32
+			SYSTEM_INFO info;
+			GetSystemInfo(&info);
+			m.alignment = info.dwAllocationGranularity;
+
+			bool read_only = io == MemMapIO::READ_ONLY;
+			DWORD creation = io == MemMapIO::READ_WRITE ? CREATE_ALWAYS : io == MemMapIO::READ_WRITE_KEEP ? OPEN_ALWAYS : OPEN_EXISTING;
+			m.h_file = CreateFileA(filename, read_only ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE,
+				FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, creation, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if (m.h_file == INVALID_HANDLE_VALUE) return false;
+
+			// The mapping object grows a file but never cuts one that is too big
+			if (io == MemMapIO::READ_WRITE_KEEP) {
+				LARGE_INTEGER end;
+				end.QuadPart = (LONGLONG)size;
+				if (!SetFilePointerEx(m.h_file, end, NULL, FILE_BEGIN) || !SetEndOfFile(m.h_file)) {
+					CloseHandle(m.h_file);
+					return false;
+				}
+			}
+
+			// Creating the mapping object at the full size extends a new file to it
+			m.h_mapping_obj = CreateFileMappingA(m.h_file, NULL, read_only ? PAGE_READONLY : PAGE_READWRITE, size >> 32, (DWORD)size, NULL);
+			if (m.h_mapping_obj == NULL) {
+				CloseHandle(m.h_file);
+				return false;
+			}
+#elif __linux__
+			m.alignment = (uint64_t)sysconf(_SC_PAGESIZE);
+			if (io == MemMapIO::READ_ONLY) m.fd = open(filename, O_RDONLY);
+			else if (io == MemMapIO::READ_WRITE_EXISTING) m.fd = open(filename, O_RDWR);
+			else m.fd = CreateFileOfSize(filename, size, io == MemMapIO::READ_WRITE_KEEP);
+			if (m.fd == -1) {
+				debug_printf("Failed to open file [%d][%s]\n", errno, strerror(errno));
+				return false;
+			}
+			if (io == MemMapIO::READ_ONLY) posix_fadvise(m.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+			if (window_size == 0 || window_size > size) window_size = size;
+			m.window_size = (window_size + m.alignment - 1) / m.alignment * m.alignment;
+			return true;
+		}
+
+		// Lets go of the current window. With drop the pages are also evicted from the page cache,
+		// after starting writeback on dirty ones, since we are not coming back to them soon.
+		void ReleaseWindow(WindowedMap& m, bool drop) {
+			if (m.ptr == nullptr) return;
+#ifdef _WIN32
+			if (m.io != MemMapIO::READ_ONLY) FlushViewOfFile(m.ptr, m.num_bytes);
+			UnmapViewOfFile(m.ptr);
+#elif __linux__
+			if (drop) madvise(m.ptr, m.num_bytes, MADV_DONTNEED);
+			munmap(m.ptr, m.num_bytes);
+			if (drop) {
+				if (m.io != MemMapIO::READ_ONLY) sync_file_range(m.fd, (off64_t)m.offset, (off64_t)m.num_bytes, SYNC_FILE_RANGE_WRITE);
+				posix_fadvise(m.fd, (off_t)m.offset, (off_t)m.num_bytes, POSIX_FADV_DONTNEED);
+			}
+#endif
+			m.ptr = nullptr;
+			m.num_bytes = 0;
+		}
+
+		bool InWindow(const WindowedMap& m, uint64_t offset, uint64_t num_bytes) {
+			return m.ptr != nullptr && offset >= m.offset && offset + num_bytes <= m.offset + m.num_bytes;
+		}
+
+		// Returns a pointer to num_bytes of the file at offset, moving the window there if it isn't
+		// already mapped. Moving the window invalidates pointers into the old one. Returns nullptr
+		// if the range is outside the file or too big for a window, or if mapping fails.
+		char* MapRange(WindowedMap& m, uint64_t offset, uint64_t num_bytes) {
+
+			if (InWindow(m, offset, num_bytes)) return m.ptr + (offset - m.offset);
+			if (offset + num_bytes > m.file_size) return nullptr;
+
+			uint64_t start = offset / m.alignment * m.alignment;
+			if (offset + num_bytes > start + m.window_size) return nullptr;
+
+			// Moving forwards means we are done with what is behind us
+			ReleaseWindow(m, start > m.offset);
+
+			uint64_t length = m.file_size - start < m.window_size ? m.file_size - start : m.window_size;
+
+#ifdef _WIN32
+			DWORD access = m.io == MemMapIO::READ_ONLY ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS;
+			char* ptr = (char*)MapViewOfFile(m.h_mapping_obj, access, (DWORD)(start >> 32), (DWORD)start, (SIZE_T)length);
+			if (ptr == NULL) return nullptr;
+#elif __linux__
+			int prot = m.io == MemMapIO::READ_ONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+			char* ptr = (char*)mmap(nullptr, length, prot, MAP_SHARED, m.fd, (off_t)start);
+			if (ptr == MAP_FAILED) {
+				debug_printf("Failed to map window [%d][%s]\n", errno, strerror(errno));
+				return nullptr;
+			}
+			madvise(ptr, length, MADV_SEQUENTIAL);
+			if (m.io == MemMapIO::READ_ONLY) madvise(ptr, length, MADV_WILLNEED);
+#endif
+
+			m.ptr = ptr;
+			m.offset = start;
+			m.num_bytes = length;
+			m.remaps++;
+			return m.ptr + (offset - m.offset);
+		}
+
+		void CloseWindowedMap(WindowedMap& m) {
+			ReleaseWindow(m, false);
+#ifdef _WIN32
+			if (m.h_mapping_obj) CloseHandle(m.h_mapping_obj);
+			if (m.h_file != INVALID_HANDLE_VALUE) CloseHandle(m.h_file);
+#elif __linux__
+			if (m.fd != -1) close(m.fd);
+#endif
+			m = WindowedMap();
+		}
+
+		// Gives back the space of the blocks set in blocks, which must already read as zeros, so they
+		// are holes in the file. Blocks past file_size are left alone.
+		bool PunchHoles(const char* filename, Bitmap& blocks, uint32_t block_size, uint64_t file_size) {
+#ifdef _WIN32
+			HANDLE h_file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (h_file == INVALID_HANDLE_VALUE) return false;
+			MarkSparse(h_file);
+#elif __linux__
+			int fd = open(filename, O_RDWR);
+			if (fd == -1) return false;
+#endif
+			bool ok = true;
+			for (size_t first = blocks.FindNextSet(0); first < blocks.Size() && ok; ) {
+				size_t end = blocks.FindNextClear(first);
+				uint64_t start = (uint64_t)first * block_size;
+				uint64_t stop = (uint64_t)end * block_size < file_size ? (uint64_t)end * block_size : file_size;
+				if (start >= stop) break;
+#ifdef _WIN32
+				FILE_ZERO_DATA_INFORMATION zero;
+				zero.FileOffset.QuadPart = (LONGLONG)start;
+				zero.BeyondFinalZero.QuadPart = (LONGLONG)stop;
+				DWORD returned = 0;
+				ok = DeviceIoControl(h_file, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero), NULL, 0, &returned, NULL) != 0;
+#elif __linux__
+				ok = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)start, (off_t)(stop - start)) == 0;
+#endif
+				first = end < blocks.Size() ? blocks.FindNextSet(end) : end;
+			}
+#ifdef _WIN32
+			CloseHandle(h_file);
+#elif __linux__
+			close(fd);
+#endif
+			return ok;
+		}
+
+		// Flushes the current window and then the whole file to disk, so everything written
+		// through the map survives a crash
+		bool SyncWindowedMap(WindowedMap& m) {
+#ifdef _WIN32
+			if (m.ptr != nullptr && !FlushViewOfFile(m.ptr, m.num_bytes)) return false;
+			return m.h_file == INVALID_HANDLE_VALUE || FlushFileBuffers(m.h_file);
+#elif __linux__
+			if (m.ptr != nullptr && msync(m.ptr, m.num_bytes, MS_SYNC) != 0) return false;
+			return m.fd == -1 || fdatasync(m.fd) == 0;
+#endif
+		}
+
+		// Write-behind block storage
+		// --> The network thread copies received blocks into a ring and moves on. A writer thread
+		//     takes them off and writes them to the file, so a slow disk never stalls the socket
+		// --> Each ring has one producer and one consumer and needs no locks. The writer sleeps on a
+		//     signal every ring rings when blocks are pushed, rather than polling them
+		// --> Runs of consecutive blocks are gathered into one write
+		// --> With direct io the writes bypass the page cache, where the file system and the
+		//     block size allow it
+		// --> Nothing is on disk for sure until CloseBlockWriter has synced the file
+
+		constexpr uint64_t BLOCK_RING_SKIP = ~0ull; // id of a slot the writer should pass over
+		constexpr int MAX_BLOCK_RINGS = 16;
+		constexpr int MAX_WRITE_BLOCKS = 256; // most blocks gathered into one write
+		constexpr uint64_t DIRECT_IO_ALIGNMENT = 4096;
+
+		struct BlockRing {
+			char* slots = nullptr; // capacity slots of slot_size bytes, aligned for direct io
+			uint64_t* ids = nullptr; // block id held by each slot
+			uint32_t capacity = 0;
+			uint32_t slot_size = 0;
+			std::atomic<uint64_t> head{ 0 }; // next slot the writer takes, only moved by the writer
+			std::atomic<uint64_t> tail{ 0 }; // next slot the producer fills, only moved by the producer
+			th::Signal* bell = nullptr; // rung on every push, if the consumer sleeps on one
+		};
+
+		char* AlignedAlloc(size_t size, size_t alignment) {
+#ifdef _WIN32
+			return (char*)_aligned_malloc(size, alignment);
+#else
+			void* ptr = nullptr;
+			if (posix_memalign(&ptr, alignment, size) != 0) return nullptr;
+			return (char*)ptr;
+#endif
+		}
+
+		void AlignedFree(char* ptr) {
+#ifdef _WIN32
+			_aligned_free(ptr);
+#else
+			free(ptr);
+#endif
+		}
+
+		bool CreateBlockRing(BlockRing& ring, uint32_t capacity, uint32_t slot_size) {
+			if (capacity == 0) capacity = 1;
+			ring.capacity = capacity;
+			ring.slot_size = slot_size;
+			ring.head.store(0);
+			ring.tail.store(0);
+			ring.slots = AlignedAlloc((size_t)capacity * slot_size, DIRECT_IO_ALIGNMENT);
+			ring.ids = new (std::nothrow) uint64_t[capacity];
+			if (ring.slots == nullptr || ring.ids == nullptr) {
+				AlignedFree(ring.slots);
+				delete[] ring.ids;
+				ring.slots = nullptr;
+				ring.ids = nullptr;
+				return false;
+			}
+			return true;
+		}
+
+		void DestroyBlockRing(BlockRing& ring) {
+			AlignedFree(ring.slots);
+			delete[] ring.ids;
+			ring.slots = nullptr;
+			ring.ids = nullptr;
+			ring.capacity = 0;
+		}
+
+		// Slots the producer can fill right now
+		inline uint32_t BlockRingFree(const BlockRing& ring) {
+			uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+			return ring.capacity - (uint32_t)(tail - ring.head.load(std::memory_order_acquire));
+		}
+
+		// The slot count places past the tail, and the id of the block in it. Only the producer
+		// fills slots, and only ones BlockRingFree says are free.
+		inline char* BlockRingSlot(BlockRing& ring, uint32_t count) {
+			uint64_t position = (ring.tail.load(std::memory_order_relaxed) + count) % ring.capacity;
+			return ring.slots + position * ring.slot_size;
+		}
+
+		inline uint64_t& BlockRingId(BlockRing& ring, uint32_t count) {
+			return ring.ids[(ring.tail.load(std::memory_order_relaxed) + count) % ring.capacity];
+		}
+
+		// Hands the next count slots to the consumer
+		inline void BlockRingPush(BlockRing& ring, uint32_t count) {
+			ring.tail.store(ring.tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+			if (ring.bell != nullptr) th::RingSignal(*ring.bell);
+		}
+
+		// Slots the consumer can take right now
+		inline uint32_t BlockRingFilled(const BlockRing& ring) {
+			return (uint32_t)(ring.tail.load(std::memory_order_acquire) - ring.head.load(std::memory_order_relaxed));
+		}
+
+		// The filled slot count places past the head. Only the consumer reads them.
+		inline char* BlockRingHeadSlot(BlockRing& ring, uint32_t count) {
+			uint64_t position = (ring.head.load(std::memory_order_relaxed) + count) % ring.capacity;
+			return ring.slots + position * ring.slot_size;
+		}
+
+		inline uint64_t& BlockRingHeadId(BlockRing& ring, uint32_t count) {
+			return ring.ids[(ring.head.load(std::memory_order_relaxed) + count) % ring.capacity];
+		}
+
+		// Gives the next count slots back to the producer
+		inline void BlockRingPop(BlockRing& ring, uint32_t count) {
+			ring.head.store(ring.head.load(std::memory_order_relaxed) + count, std::memory_order_release);
+		}
+
+		struct BlockWriter {
+			BlockRing* rings[MAX_BLOCK_RINGS];
+			int num_rings = 0;
+			uint32_t block_size = 0;
+			bool direct = false; // writes bypass the page cache
+			th::ThreadHandle thread;
+			th::Signal bell; // rung by every ring's pushes and by CloseBlockWriter
+			bool started = false;
+			std::atomic<bool> stop{ false };
+			std::atomic<bool> failed{ false };
+			uint64_t writes = 0; // write calls, only touched by the writer thread
+			uint64_t bytes = 0;
+#ifdef _WIN32
+			HANDLE h_file = INVALID_HANDLE_VALUE;
+#else
+			int fd = -1;
+#endif
+		};
+
+		// Writes count blocks starting at the block first_id, gathered from their slots
+		bool WriteBlocks(BlockWriter& w, char** blocks, int count, uint64_t first_id) {
+			uint64_t offset = first_id * w.block_size;
+#ifdef _WIN32
+			for (int i = 0; i < count; i++, offset += w.block_size) {
+				OVERLAPPED overlapped = {};
+				overlapped.Offset = (DWORD)offset;
+				overlapped.OffsetHigh = (DWORD)(offset >> 32);
+				DWORD written = 0;
+				if (!WriteFile(w.h_file, blocks[i], w.block_size, &written, &overlapped) || written != w.block_size) return false;
+			}
+			w.writes += count;
+#elif __linux__
+			iovec iov[MAX_WRITE_BLOCKS];
+			for (int i = 0; i < count; i++) {
+				iov[i].iov_base = blocks[i];
+				iov[i].iov_len = w.block_size;
+			}
+
+			// A write can stop short, carry on from where it got to
+			iovec* next = iov;
+			int left = count;
+			while (left > 0) {
+				w.writes++;
+				ssize_t written = pwritev(w.fd, next, left, (off_t)offset);
+				if (written < 0) {
+					if (errno == EINTR) continue;
+					debug_printf("block write failed [%d][%s]\n", errno, strerror(errno));
+					return false;
+				}
+				offset += written;
+				while (left > 0 && (size_t)written >= next->iov_len) {
+					written -= next->iov_len;
+					next++;
+					left--;
+				}
+				if (left > 0) {
+					next->iov_base = (char*)next->iov_base + written;
+					next->iov_len -= written;
+				}
+			}
+#endif
+			w.bytes += (uint64_t)count * w.block_size;
+			return true;
+		}
+
+		// Writes out everything waiting in the ring. Returns how many slots were taken off it.
+		uint64_t DrainBlockRing(BlockWriter& w, BlockRing& ring) {
+			uint64_t head = ring.head.load(std::memory_order_relaxed);
+			uint64_t tail = ring.tail.load(std::memory_order_acquire);
+			uint64_t start = head;
+			char* blocks[MAX_WRITE_BLOCKS];
+
+			while (head < tail) {
+				uint64_t first_id = ring.ids[head % ring.capacity];
+				if (first_id == BLOCK_RING_SKIP) {
+					head++;
+					continue;
+				}
+
+				// Gather the run of consecutive blocks that starts here
+				int count = 0;
+				while (head + count < tail && count < MAX_WRITE_BLOCKS && ring.ids[(head + count) % ring.capacity] == first_id + count) {
+					blocks[count] = ring.slots + ((head + count) % ring.capacity) * ring.slot_size;
+					count++;
+				}
+				if (!WriteBlocks(w, blocks, count, first_id)) {
+					w.failed.store(true);
+					break;
+				}
+				head += count;
+
+				// Give the slots back as soon as they are written
+				ring.head.store(head, std::memory_order_release);
+			}
+			ring.head.store(head, std::memory_order_release);
+			return head - start;
+		}
+
+		void BlockWriterThread(void* arg) {
+			BlockWriter& w = *(BlockWriter*)arg;
+			while (!w.failed.load()) {
+
+				// Read before the rings, so whatever was pushed before stop was set gets written
+				bool stopping = w.stop.load(std::memory_order_acquire);
+
+				uint64_t taken = 0;
+				for (int i = 0; i < w.num_rings; i++) taken += DrainBlockRing(w, *w.rings[i]);
+				if (taken > 0) continue;
+				if (stopping) break;
+
+				// Nothing to do, sleep until a ring is pushed to or we are stopped. A push since the
+				// rings were drained has already rung, so the wait returns straight away.
+				th::WaitSignal(w.bell);
+			}
+		}
+
+		// Creates filename at size bytes for a writer of block_size blocks. With direct the page cache
+		// is bypassed if the file system allows it and the block size is a multiple of the alignment.
+		// With keep a file that is already there is resized rather than emptied, and with sparse
+		// nothing is allocated for the blocks that are never written.
+		// Rings are added with AddBlockRing before StartBlockWriter.
+		bool OpenBlockWriter(const char* filename, uint64_t size, uint32_t block_size, bool direct, BlockWriter& w,
+			bool keep = false, bool sparse = false) {
+			w.num_rings = 0;
+			w.block_size = block_size;
+			w.direct = false;
+			w.started = false;
+			w.stop.store(false);
+			w.failed.store(false);
+			w.writes = 0;
+			w.bytes = 0;
+#ifdef _WIN32
+			w.h_file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, keep ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (w.h_file == INVALID_HANDLE_VALUE) return false;
+			if (sparse) MarkSparse(w.h_file);
+			LARGE_INTEGER end;
+			end.QuadPart = (LONGLONG)size;
+			if (!SetFilePointerEx(w.h_file, end, NULL, FILE_BEGIN) || !SetEndOfFile(w.h_file)) {
+				CloseHandle(w.h_file);
+				w.h_file = INVALID_HANDLE_VALUE;
+				return false;
+			}
+#elif __linux__
+			w.fd = CreateFileOfSize(filename, size, keep, sparse);
+			if (w.fd == -1) {
+				debug_printf("Failed to create file [%d][%s]\n", errno, strerror(errno));
+				return false;
+			}
+			if (direct && block_size % DIRECT_IO_ALIGNMENT == 0) {
+				int flags = fcntl(w.fd, F_GETFL);
+				if (flags != -1 && fcntl(w.fd, F_SETFL, flags | O_DIRECT) == 0) w.direct = true;
+				else debug_printf("direct io not supported here [%d][%s]\n", errno, strerror(errno));
+			}
+#endif
+			th::InitSignal(w.bell);
+			return true;
+		}
+
+		bool AddBlockRing(BlockWriter& w, BlockRing& ring) {
+			if (w.num_rings >= MAX_BLOCK_RINGS) return false;
+			w.rings[w.num_rings++] = &ring;
+			ring.bell = &w.bell;
+			return true;
+		}
+
+		bool StartBlockWriter(BlockWriter& w) {
+			w.started = th::StartThread(w.thread, BlockWriterThread, &w);
+			return w.started;
+		}
+
+		// True once a write has failed. The producer should give up, nothing more will be written.
+		inline bool BlockWriterFailed(const BlockWriter& w) {
+			return w.failed.load(std::memory_order_relaxed);
+		}
+
+		// Waits for the writer to finish what is in the rings, then with sync flushes the file to
+		// disk. Returns false if any write or the sync failed.
+		bool CloseBlockWriter(BlockWriter& w, bool sync) {
+			if (w.started) {
+				w.stop.store(true, std::memory_order_release);
+				th::RingSignal(w.bell);
+				th::JoinThread(w.thread);
+				w.started = false;
+			}
+			bool ok = !w.failed.load();
+#ifdef _WIN32
+			if (w.h_file != INVALID_HANDLE_VALUE) {
+				if (ok && sync && !FlushFileBuffers(w.h_file)) ok = false;
+				CloseHandle(w.h_file);
+				w.h_file = INVALID_HANDLE_VALUE;
+				th::DestroySignal(w.bell);
+			}
+#elif __linux__
+			if (w.fd != -1) {
+				if (ok && sync && fdatasync(w.fd) != 0) ok = false;
+				close(w.fd);
+				w.fd = -1;
+				th::DestroySignal(w.bell);
+			}
+#endif
+			return ok;
+		}
+
+		// Notes how far every ring has been filled, a mark per ring
+		void MarkBlockWriter(const BlockWriter& w, uint64_t* marks) {
+			for (int i = 0; i < w.num_rings; i++) marks[i] = w.rings[i]->tail.load(std::memory_order_acquire);
+		}
+
+		// True once everything that was in the rings when the marks were taken is in the file.
+		// Never true again after a write fails.
+		bool BlockWriterPassed(const BlockWriter& w, const uint64_t* marks) {
+			for (int i = 0; i < w.num_rings; i++) {
+				if (w.rings[i]->head.load(std::memory_order_acquire) < marks[i]) return false;
+			}
+			return !w.failed.load();
+		}
+
+		// Read-ahead block source
+		// --> Reads runs of consecutive blocks into scattered buffers with one call, so a thread can
+		//     fill a ring of packets ahead of the socket
+		// --> Tells the kernel which part of the file comes next, so the disk is busy before the
+		//     reads get there
+
+		constexpr int MAX_READ_BLOCKS = 256; // most blocks gathered by one read
+
+		struct BlockReader {
+			uint64_t size = 0; // of the file
+			uint64_t advised_end = 0; // the file up to here has been asked for already
+			uint64_t reads = 0; // read calls
+			uint64_t bytes = 0;
+#ifdef _WIN32
+			HANDLE h_file = INVALID_HANDLE_VALUE;
+#else
+			int fd = -1;
+#endif
+		};
+
+		bool OpenBlockReader(const char* filename, BlockReader& r) {
+			r = BlockReader();
+			if (!GetFileSize(filename, r.size)) return false;
+#ifdef _WIN32
+			r.h_file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if (r.h_file == INVALID_HANDLE_VALUE) return false;
+#elif __linux__
+			r.fd = open(filename, O_RDONLY);
+			if (r.fd == -1) {
+				debug_printf("Failed to open file [%d][%s]\n", errno, strerror(errno));
+				return false;
+			}
+#endif
+			return true;
+		}
+
+		void CloseBlockReader(BlockReader& r) {
+#ifdef _WIN32
+			if (r.h_file != INVALID_HANDLE_VALUE) CloseHandle(r.h_file);
+#elif __linux__
+			if (r.fd != -1) close(r.fd);
+#endif
+			r = BlockReader();
+		}
+
+		// Asks the kernel to start reading [offset, offset + num_bytes) in the background. Ranges
+		// already asked for are skipped, and nothing is asked until half the range is new.
+		void AdviseBlockReader(BlockReader& r, uint64_t offset, uint64_t num_bytes) {
+			uint64_t end = offset + num_bytes;
+			if (end > r.size) end = r.size;
+			if (end <= r.advised_end + num_bytes / 2) return;
+			uint64_t start = offset > r.advised_end ? offset : r.advised_end;
+#ifdef __linux__
+			posix_fadvise(r.fd, (off_t)start, (off_t)(end - start), POSIX_FADV_WILLNEED);
+#endif
+			r.advised_end = end;
+		}
+
+		// Reads count blocks of block_size starting at offset into their buffers. The part of a
+		// block past the end of the file is zeroed.
+		bool ReadBlocks(BlockReader& r, char** blocks, int count, uint64_t offset, uint32_t block_size) {
+			uint64_t first = offset;
+			uint64_t end = offset + (uint64_t)count * block_size;
+			uint64_t file_end = end < r.size ? end : r.size;
+			uint64_t left = file_end > offset ? file_end - offset : 0;
+			r.bytes += left;
+#ifdef _WIN32
+			for (int i = 0; i < count && left > 0; i++) {
+				DWORD wanted = left < block_size ? (DWORD)left : block_size;
+				OVERLAPPED overlapped = {};
+				overlapped.Offset = (DWORD)offset;
+				overlapped.OffsetHigh = (DWORD)(offset >> 32);
+				DWORD got = 0;
+				if (!ReadFile(r.h_file, blocks[i], wanted, &got, &overlapped) || got != wanted) return false;
+				r.reads++;
+				offset += wanted;
+				left -= wanted;
+			}
+#elif __linux__
+			iovec iov[MAX_READ_BLOCKS];
+			int num_iov = 0;
+			for (uint64_t covered = 0; num_iov < count && covered < left; num_iov++) {
+				uint64_t wanted = left - covered < block_size ? left - covered : block_size;
+				iov[num_iov].iov_base = blocks[num_iov];
+				iov[num_iov].iov_len = (size_t)wanted;
+				covered += wanted;
+			}
+
+			// A read can stop short, carry on from where it got to
+			iovec* next = iov;
+			while (num_iov > 0) {
+				r.reads++;
+				ssize_t got = preadv(r.fd, next, num_iov, (off_t)offset);
+				if (got < 0) {
+					if (errno == EINTR) continue;
+					debug_printf("block read failed [%d][%s]\n", errno, strerror(errno));
+					return false;
+				}
+				if (got == 0) {
+					debug_printf("file shrank while reading it\n");
+					return false;
+				}
+				offset += got;
+				while (num_iov > 0 && (size_t)got >= next->iov_len) {
+					got -= next->iov_len;
+					next++;
+					num_iov--;
+				}
+				if (num_iov > 0) {
+					next->iov_base = (char*)next->iov_base + got;
+					next->iov_len -= got;
+				}
+			}
+#endif
+
+			// Pad out the final short block, and any block wholly past the end
+			uint64_t block_start = first;
+			for (int i = 0; i < count; i++, block_start += block_size) {
+				if (block_start + block_size <= r.size) continue;
+				uint64_t have = r.size > block_start ? r.size - block_start : 0;
+				memset(blocks[i] + have, 0, block_size - have);
+			}
+			return true;
+		}
+
+
+		// Side files
+		// --> Small files of state kept next to the one being moved, read and written a piece at a
+		//     time at known offsets
+
+		struct SideFile {
+#ifdef _WIN32
+			HANDLE h_file = INVALID_HANDLE_VALUE;
+#else
+			int fd = -1;
+#endif
+		};
+
+		// Opens filename to read and write. With create it is emptied, or made if it isn't there.
+		bool OpenSideFile(const char* filename, bool create, SideFile& f) {
+			f = SideFile();
+#ifdef _WIN32
+			f.h_file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			return f.h_file != INVALID_HANDLE_VALUE;
+#else
+			f.fd = open(filename, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+			return f.fd != -1;
+#endif
+		}
+
+		void CloseSideFile(SideFile& f) {
+#ifdef _WIN32
+			if (f.h_file != INVALID_HANDLE_VALUE) CloseHandle(f.h_file);
+#else
+			if (f.fd != -1) close(f.fd);
+#endif
+			f = SideFile();
+		}
+
+		// Reads or writes size bytes at offset. Fails on a short read, i.e. past the end of the file.
+		bool SideFileIO(SideFile& f, void* data, size_t size, uint64_t offset, bool write) {
+			char* p = (char*)data;
+			while (size > 0) {
+#ifdef _WIN32
+				DWORD wanted = size < (1u << 30) ? (DWORD)size : (1u << 30);
+				OVERLAPPED overlapped = {};
+				overlapped.Offset = (DWORD)offset;
+				overlapped.OffsetHigh = (DWORD)(offset >> 32);
+				DWORD done = 0;
+				BOOL ok = write ? WriteFile(f.h_file, p, wanted, &done, &overlapped) : ReadFile(f.h_file, p, wanted, &done, &overlapped);
+				if (!ok || done == 0) return false;
+#else
+				ssize_t done = write ? pwrite(f.fd, p, size, (off_t)offset) : pread(f.fd, p, size, (off_t)offset);
+				if (done < 0 && errno == EINTR) continue;
+				if (done <= 0) return false;
+#endif
+				p += done;
+				size -= (size_t)done;
+				offset += (uint64_t)done;
+			}
+			return true;
+		}
+
+		bool ReadSideFile(SideFile& f, void* data, size_t size, uint64_t offset) {
+			return SideFileIO(f, data, size, offset, false);
+		}
+
+		bool WriteSideFile(SideFile& f, const void* data, size_t size, uint64_t offset) {
+			return SideFileIO(f, (void*)data, size, offset, true);
+		}
+
 	}
 
 
@@ -0,0 +1,182 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "rse_ds.h"
+
+namespace rse {
+
+    // A fast LZ77 block compressor in the LZ4 block format. Every sequence is a token with the
+    // literal and match lengths in its two nibbles, longer lengths carried on in bytes of 255, the
+    // literals, then a 2 byte offset back to the match. The last sequence is literals only.
+    // Matches are found through a hash table of 4 byte prefixes and skip ahead faster the longer
+    // nothing matches, so data that doesn't compress goes by quickly.
+    namespace lz {
+
+        constexpr uint32_t MIN_MATCH = 4;
+        constexpr uint32_t LAST_LITERALS = 5; // the format ends on at least this many literals
+        constexpr uint32_t MATCH_LIMIT = 12; // and no match starts this close to the end
+        constexpr uint32_t MAX_OFFSET = 65535;
+        constexpr size_t MAX_SIZE = 65536; // positions in the hash table are 16 bit, plenty for a block
+        constexpr uint32_t HASH_LOG = 12;
+        constexpr uint32_t SKIP_SHIFT = 6; // every 64 bytes without a match the search steps one more
+
+        inline uint32_t Read32(const uint8_t* p) {
+            uint32_t v;
+            memcpy(&v, p, 4);
+            return v;
+        }
+
+        inline uint32_t HashPrefix(uint32_t v) {
+            return (v * 2654435761u) >> (32 - HASH_LOG);
+        }
+
+        // Bytes a and b have in common, up to limit
+        inline size_t MatchLength(const uint8_t* a, const uint8_t* b, const uint8_t* limit) {
+            const uint8_t* start = a;
+            while (a + 8 <= limit) {
+                uint64_t x, y;
+                memcpy(&x, a, 8);
+                memcpy(&y, b, 8);
+                uint64_t diff = x ^ y;
+                if (diff != 0) {
+#if defined(__GNUC__) || defined(__clang__)
+                    return (size_t)(a - start) + (__builtin_ctzll(diff) >> 3);
+#else
+                    while (*a == *b) { a++; b++; }
+                    return (size_t)(a - start);
+#endif
+                }
+                a += 8;
+                b += 8;
+            }
+            while (a < limit && *a == *b) { a++; b++; }
+            return (size_t)(a - start);
+        }
+
+        // A length of 15 or more is carried on after the token
+        inline uint8_t* WriteLength(uint8_t* op, size_t length) {
+            for (length -= 15; length >= 255; length -= 255) *op++ = 255;
+            *op++ = (uint8_t)length;
+            return op;
+        }
+
+        // Appends literals and then a match, or just the literals with match_length 0. Returns
+        // nullptr if it would go past end.
+        inline uint8_t* WriteSequence(uint8_t* op, const uint8_t* end, const uint8_t* literals, size_t literal_length,
+            size_t offset, size_t match_length) {
+
+            size_t needed = 1 + literal_length / 255 + 1 + literal_length + (match_length > 0 ? 2 + match_length / 255 + 1 : 0);
+            if (needed > (size_t)(end - op)) return nullptr;
+
+            size_t m = match_length > 0 ? match_length - MIN_MATCH : 0;
+            uint8_t* token = op++;
+            *token = (uint8_t)((literal_length < 15 ? literal_length : 15) << 4);
+            if (literal_length >= 15) op = WriteLength(op, literal_length);
+            memcpy(op, literals, literal_length);
+            op += literal_length;
+            if (match_length == 0) return op;
+
+            *op++ = (uint8_t)offset;
+            *op++ = (uint8_t)(offset >> 8);
+            *token |= (uint8_t)(m < 15 ? m : 15);
+            if (m >= 15) op = WriteLength(op, m);
+            return op;
+        }
+
+        // Compresses n bytes of src, at most MAX_SIZE, into dst. Returns the compressed size, or 0 if it
+        // doesn't fit in capacity.
+        inline size_t Compress(const void* src, size_t n, void* dst, size_t capacity) {
+            if (n > MAX_SIZE) return 0;
+            const uint8_t* base = (const uint8_t*)src;
+            const uint8_t* ip = base;
+            const uint8_t* anchor = base;
+            const uint8_t* in_end = base + n;
+            uint8_t* op = (uint8_t*)dst;
+            const uint8_t* out_end = op + capacity;
+
+            if (n > MATCH_LIMIT) {
+                // Every candidate is checked against the bytes it points at, so an empty slot can just say 0
+                uint16_t table[1 << HASH_LOG] = { 0 };
+                const uint8_t* match_end = in_end - LAST_LITERALS;
+                const uint8_t* search_end = in_end - MATCH_LIMIT;
+                while (ip < search_end) {
+                    uint32_t prefix = Read32(ip);
+                    uint32_t h = HashPrefix(prefix);
+                    const uint8_t* ref = base + table[h];
+                    table[h] = (uint16_t)(ip - base);
+                    if (ref >= ip || (size_t)(ip - ref) > MAX_OFFSET || Read32(ref) != prefix) {
+                        ip += 1 + ((size_t)(ip - anchor) >> SKIP_SHIFT);
+                        continue;
+                    }
+
+                    size_t length = MIN_MATCH + MatchLength(ip + MIN_MATCH, ref + MIN_MATCH, match_end);
+                    op = WriteSequence(op, out_end, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), length);
+                    if (op == nullptr) return 0;
+                    ip += length;
+                    anchor = ip;
+                }
+            }
+
+            op = WriteSequence(op, out_end, anchor, (size_t)(in_end - anchor), 0, 0);
+            if (op == nullptr) return 0;
+            return (size_t)(op - (uint8_t*)dst);
+        }
+
+        // Decompresses n bytes of src into dst. The input is checked as it goes, so nothing is read or
+        // written out of bounds whatever it holds. Returns the decompressed size, or SIZE_MAX if it is bad
+        // or doesn't fit in capacity.
+        inline size_t Decompress(const void* src, size_t n, void* dst, size_t capacity) {
+            const uint8_t* ip = (const uint8_t*)src;
+            const uint8_t* in_end = ip + n;
+            uint8_t* base = (uint8_t*)dst;
+            uint8_t* op = base;
+            uint8_t* out_end = base + capacity;
+
+            while (ip < in_end) {
+                uint8_t token = *ip++;
+
+                size_t literal_length = token >> 4;
+                if (literal_length == 15) {
+                    uint8_t b;
+                    do {
+                        if (ip == in_end) return SIZE_MAX;
+                        b = *ip++;
+                        literal_length += b;
+                    } while (b == 255);
+                }
+                if (literal_length > (size_t)(in_end - ip) || literal_length > (size_t)(out_end - op)) return SIZE_MAX;
+                memcpy(op, ip, literal_length);
+                ip += literal_length;
+                op += literal_length;
+                if (ip == in_end) break;
+
+                if (in_end - ip < 2) return SIZE_MAX;
+                size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+                ip += 2;
+                if (offset == 0 || offset > (size_t)(op - base)) return SIZE_MAX;
+
+                size_t match_length = token & 15;
+                if (match_length == 15) {
+                    uint8_t b;
+                    do {
+                        if (ip == in_end) return SIZE_MAX;
+                        b = *ip++;
+                        match_length += b;
+                    } while (b == 255);
+                }
+                match_length += MIN_MATCH;
+                if (match_length > (size_t)(out_end - op)) return SIZE_MAX;
+
+                // Matches may overlap what they write, a run of one byte most of all
+                const uint8_t* ref = op - offset;
+                if (offset >= match_length) memcpy(op, ref, match_length);
+                else if (offset == 1) memset(op, *ref, match_length);
+                else for (size_t i = 0; i < match_length; i++) op[i] = ref[i];
+                op += match_length;
+            }
+            return (size_t)(op - base);
+        }
+
+    }
+
+}
@@ -5,13 +5,51 @@
 #include "rse_ds.h"
 #include "rse_io.h"
 #include "rse_sockets.h"
+#include "rse_thread.h"
+#include "rse_fec.h"
+#include "rse_lz.h"
+
+// For testing, lets a sender put faults into its own datagrams, see TestFaults
+//#define RSE_TEST_FAULTS
 
 namespace rse {
 
     // Reliable Blast UDP
     namespace rbudp {
 
-        constexpr int PACKET_HEADER_SIZE = 4; // in bytes
+        constexpr int PACKET_HEADER_SIZE = 8; // in bytes
+        constexpr int CHECKSUM_HEADER_SIZE = 12; // the id and the block's CRC32C, with FEATURE_CHECKSUM
+        constexpr int CODEC_HEADER_SIZE = 16; // the id, the CRC32C and how the payload is coded, with FEATURE_COMPRESSION
+        constexpr int SESSION_HEADER_SIZE = 24; // all of that and the session and round, with FEATURE_SESSION
+
+        // Handshake. The sender opens with the magic and the newest protocol version it speaks,
+        // the receiver answers with the version both ends will use. Version 1 was the original
+        // 32 bit wire format, which had no magic or version and capped transfers at 4 GB.
+        // Version 3 added lanes. Version 4 added a word of features the sender asks for, which
+        // the receiver answers with the ones it agreed to. Version 5 added the udp port of the first
+        // lane to the reply, since a receiver daemon gives every session ports of its own.
+        // Version 6 moved everything past the version 2 handshake to after the receiver's version,
+        // since a receiver older than the sender read those fields as the path.
+        // Version 7 added the size of the file to the extensions, so the receiver cuts the last block to it.
+        constexpr uint32_t PROTOCOL_MAGIC = 0x44554252; // "RBUD"
+        constexpr uint32_t PROTOCOL_VERSION = 7;
+        constexpr uint32_t EXTENSIONS_AFTER_VERSION = 6; // senders from this version send their extensions once they know ours
+
+        constexpr uint32_t FEATURE_PIPELINED = 1; // streaming NACKs while the blast is going, see "Streaming NACKs"
+        constexpr uint32_t FEATURE_CHECKSUM = 2; // a CRC32C per block in the packet header, see "Checksums"
+        constexpr uint32_t FEATURE_FEC = 4; // parity blocks for every group of blocks, see "Forward error correction"
+        constexpr uint32_t FEATURE_DELTA = 8; // only send the blocks the receiver's copy of the file doesn't have, see "Delta transfers"
+        constexpr uint32_t FEATURE_ZERO_BLOCKS = 16; // blocks of all zeros go as just their header, see "Zero blocks"
+        constexpr uint32_t FEATURE_COMPRESSION = 32; // blocks that shrink go compressed, see "Compression"
+        constexpr uint32_t FEATURE_SESSION = 64; // every packet says which transfer and round it is from, see "Sessions"
+        constexpr uint32_t FEATURE_RESUME = 128; // pick up from where an interrupted transfer of the file got to, see "Resuming"
+        constexpr uint32_t MIN_PROTOCOL_VERSION = 2;
+
+        // What the sender says on the control connection once it has blasted a round, or is done.
+        // Receivers older than FLAG_ABORTED take it for the end of a round, and fail once the sender hangs up.
+        constexpr uint8_t FLAG_DONE = 0;
+        constexpr uint8_t FLAG_ROUND_OVER = 1;
+        constexpr uint8_t FLAG_ABORTED = 2; // the sender gave up before every block was in
 
         constexpr int MAX_DATAGRAM_SIZE = 65536;
         constexpr int ASSUMED_PORT_SIZE = 65536;
@@ -20,32 +58,138 @@ namespace rse {
         // since that is the max size a udp datagram can be.
 
         constexpr int DEFAULT_BLOCK_SIZE = 4096;
+        constexpr uint64_t DEFAULT_MAX_BLOCKS = 1ull << 28; // most blocks a receiver takes, 1 TB of 4K blocks. Each costs bitmap and report bits
         constexpr int PATH_SIZE = 2048; // includes null terminator
 
-        // A packet consists of a header which is 16 bytes.
+        // Number of datagrams moved per socket call in the blast loops
+        constexpr int DEFAULT_BATCH_DEPTH = 64;
+
+        // Packet headers the sender keeps in flight, in multiples of the batch depth
+        constexpr int HEADER_RING_BATCHES = 4;
+
+        // Pacing. A paced sender releases at most PACER_BURST_NS worth of data at once, and
+        // only sleeps when it is more than PACER_SPIN_NS early since sleeps overshoot.
+        constexpr uint64_t PACER_BURST_NS = 200000;
+        constexpr uint64_t PACER_SPIN_NS = 100000;
+
+        // Adaptive blasting. Rounds are stop and wait, so a blast has to last several round trips
+        // to keep the link busy. The window then grows while loss is low and shrinks when it is high.
+        constexpr uint32_t MIN_PACKETS_PER_TRANSMISSION = 16;
+        constexpr double BLAST_BDP_MULTIPLE = 8;
+        constexpr double BLAST_LOSS_LOW = 0.01;
+        constexpr double BLAST_LOSS_HIGH = 0.05;
+        constexpr double MIN_BLAST_RATE_MBPS = 10; // random loss that slowing down doesn't fix must not stall us
+
+        // Socket buffer size each end asks for. The receiver doesn't read udp while the sender
+        // blasts, so its buffer bounds how big a blast can be.
+        constexpr int DEFAULT_SOCKET_BUFFER_SIZE = 8 * 1024 * 1024;
+
+        // How much of the file each end keeps mapped at once. 0 maps the whole file.
+        constexpr uint64_t DEFAULT_MAP_WINDOW_SIZE = 64 * 1024 * 1024;
+
+        // Bytes of received blocks that can wait for the receiver's writer thread, shared between
+        // the lanes. When it is full the lanes stop reading until the writer catches up.
+        constexpr uint64_t DEFAULT_WRITER_QUEUE_SIZE = 32 * 1024 * 1024;
+
+        // Bytes of ready made packets each sender lane's reader thread keeps ahead of the socket
+        // with SendOptions::read_ahead. The kernel is asked to fetch the same again beyond that.
+        // Either side that runs dry backs off between READ_AHEAD_IDLE_MIN_NS and READ_AHEAD_IDLE_MAX_NS.
+        constexpr uint64_t DEFAULT_READ_AHEAD_SIZE = 8 * 1024 * 1024;
+        constexpr uint64_t READ_AHEAD_IDLE_MIN_NS = 5 * 1000;
+        constexpr uint64_t READ_AHEAD_IDLE_MAX_NS = 200 * 1000;
+
+        // End of round. The flag saying a blast is over can overtake its last packets, so the
+        // receiver waits for the lanes to go quiet before it reports. Quiet is DRAIN_QUIET_GAPS of
+        // the usual gaps between datagrams, but never more than a round trip, since past that a
+        // resend would have been quicker, nor more than DRAIN_QUIET_MAX_MS.
+        constexpr uint64_t DRAIN_QUIET_GAPS = 32;
+        constexpr int DRAIN_QUIET_MAX_MS = 20;
+
+        // Streaming NACKs. See "Streaming NACKs" below.
+        constexpr int DEFAULT_NACK_INTERVAL_MS = 2;
+        constexpr uint64_t NACK_REORDER_BLOCKS = 16; // a gap this close to the newest block may just be late
+        constexpr uint32_t NACK_QUEUE_RANGES = 4096; // ranges a sender lane can have waiting to be resent
+        constexpr int NACK_LISTEN_POLL_MS = 1; // how quickly the sender's listener notices the blast is over
+        constexpr int NACK_QUIET_MS = 2 * DEFAULT_NACK_INTERVAL_MS; // on top of the RTT, how long a sender out of blocks waits for more NACKs
+
+        // Delta transfers. See "Delta transfers" below.
+        constexpr int DELTA_HASH_THREADS = 4; // threads each end hashes its copy of the file on
+        constexpr uint64_t DELTA_HASH_MIN_BLOCKS = 1024; // fewer blocks than this per thread aren't worth one
+        constexpr int DELTA_HASH_RUN = 64; // blocks read at once by a hashing thread
+        constexpr uint64_t DELTA_HASHES_PER_SEND = 64 * 1024; // block hashes per socket call
+
+        // Resuming. See "Resuming" below.
+        constexpr int DEFAULT_CHECKPOINT_INTERVAL_MS = 1000;
+        constexpr size_t CHECKPOINT_CHUNK_WORDS = 512; // words of the bitmap tracked and written together, a page of them
+        constexpr uint32_t CHECKPOINT_MAGIC = 0x4b434252; // "RBCK"
+        constexpr const char* CHECKPOINT_SUFFIX = ".rbudp-resume"; // the checkpoint sits next to the file, under its name and this
+
+        // Receiver daemon. See "Receiver daemon" below.
+        constexpr uint32_t DEFAULT_MAX_SESSIONS = 16;
+        constexpr uint32_t SESSION_SLOT_BITS = 8; // the low bits of a session id are the daemon's slot for it, see "Sessions"
+        constexpr uint32_t MAX_SESSIONS = 1u << SESSION_SLOT_BITS;
+        constexpr int DAEMON_POLL_MS = 20; // how quickly the daemon notices it was stopped, or that a session ended
+        constexpr int DEFAULT_SESSION_IDLE_MS = 60 * 1000; // a daemon session hearing nothing from its sender this long gives up
+        constexpr uint64_t DEMUX_WAIT_NS = 50 * 1000; // how often a session looks whether the shared port's demux has caught up
+
+        // Striping. A transfer can be split into lanes, each carrying its own contiguous range of
+        // blocks over its own udp socket and thread at both ends. Lane ranges are whole words
+        // of the bitmap so the lanes can set bits in it at the same time.
+        constexpr uint32_t MAX_LANES = 16;
+
+        // A packet consists of a header which is 8 bytes.
         // The packet header consists of:
-        //      The first 4 bytes is the header ID. Which is unsigned 32 bit integer.
+        //      The first 8 bytes is the header ID. Which is unsigned 64 bit integer.
         // The packet body is user defined. By default it is 4kb
 
         struct PacketHeader {
-            uint32_t id;
+            uint64_t id;
+            uint32_t crc; // only on the wire with FEATURE_CHECKSUM or FEATURE_COMPRESSION
+            uint32_t codec; // only on the wire with FEATURE_COMPRESSION
+            uint32_t session; // only on the wire with FEATURE_SESSION
+            uint32_t epoch; // the round, only on the wire with FEATURE_SESSION
         };
 
         struct TransmissionInfo {
-            uint32_t number_packets = 0;
-            uint32_t block_size = 0; // in bytes. Does not include the 4 byte header to a packet.
+            uint32_t protocol_version = 0; // agreed in the handshake
+            uint64_t number_packets = 0;
+            uint32_t block_size = 0; // in bytes. Does not include the 8 byte header to a packet.
+            uint32_t header_size = PACKET_HEADER_SIZE; // bytes of PacketHeader on the wire, see HeaderSize
             uint32_t packet_size = 0; // packet size which is the block size + the packet header size
-            uint32_t bitmap_size = 0; // (number of packets / 8) + 1
-            uint32_t summation_block_size; // summation of all blocks for every packet
-            uint32_t total_transmission_size = 0;
+            uint64_t bitmap_size = 0; // (number of packets / 8) + 1
+            uint64_t summation_block_size; // summation of all blocks for every packet
+            uint64_t file_size = 0; // bytes in the file, which the last block may be short of. From version 7, before it every block is whole
+            uint64_t total_transmission_size = 0;
             uint32_t max_packets_per_transmission = 0; // the max number of packets that can be sent given a port has a max size of 65536
+            uint32_t receiver_buffer_size = 0; // bytes the receiver's udp socket buffer holds, sent back in the handshake reply
+            uint32_t num_lanes = 1; // lanes the receiver opened, at most as many as the sender asked for
+            int data_port = 0; // udp port of the first lane, the rest are on the ports after it
+            uint64_t rtt_ns = 0; // round trip of the first handshake request and its reply, as measured by the sender
+            bool pipelined = false; // both ends agreed to FEATURE_PIPELINED
+            bool checksum = false; // both ends agreed to FEATURE_CHECKSUM
+            uint32_t fec_group_size = 0; // data blocks per FEC group both ends agreed to, 0 without FEATURE_FEC
+            uint32_t fec_parity = 0; // parity blocks per FEC group
+            bool delta = false; // both ends agreed to FEATURE_DELTA
+            bool zero_blocks = false; // both ends agreed to FEATURE_ZERO_BLOCKS
+            bool compression = false; // both ends agreed to FEATURE_COMPRESSION
+            bool sessions = false; // both ends agreed to FEATURE_SESSION
+            uint32_t session_id = 0; // with FEATURE_SESSION, picked by the receiver
+            bool shared_port = false; // with FEATURE_SESSION, every lane is on data_port, see "Shared port"
+            bool resume = false; // both ends agreed to FEATURE_RESUME
+            uint64_t resume_token = 0; // with FEATURE_RESUME, which version of which file the sender has, see ResumeToken
             char path_name[PATH_SIZE]; // file path that you want to write to. Must include null terminator
         };
 
+        struct DemuxRoute;
+
         struct ReceiverSockets {
-            sk::SocketHandle socket_udp;
-            sk::SocketHandle socket_listen;
-            sk::SocketHandle socket_sender;
+            sk::SocketHandle socket_udp = sk::SK_INVALID_SOCKET;
+            sk::SocketHandle socket_listen = sk::SK_INVALID_SOCKET; // not used by daemon sessions
+            sk::SocketHandle socket_sender = sk::SK_INVALID_SOCKET;
+            sk::SocketHandle lane_sockets[MAX_LANES]; // the first is socket_udp
+            uint32_t num_lanes = 0;
+            DemuxRoute* route = nullptr; // a daemon session on a shared port gets its packets through this instead
+            uint32_t session_id = 0; // the id to give the sender, 0 to make one up
         };
 
         struct SenderSockets {
@@ -53,362 +197,4583 @@ namespace rse {
             sk::SocketHandle socket_udp;
         };
 
+#ifdef RSE_TEST_FAULTS
+        // Faults a test can have the sender put into its own datagrams, to drive the receiver's handling
+        // of a bad network over loopback
+        struct TestFaults {
+            uint32_t loss_percentage = 0; // datagrams in a hundred dropped instead of sent
+            uint32_t corrupt_percentage = 0; // datagrams in a hundred sent with the last byte of their payload flipped
+            uint32_t late_datagrams = 0; // datagrams each lane holds back every round and sends after the flag that ends it
+            uint32_t late_delay_us = 200; // how long after the flag those go
+            uint32_t replayed_datagrams = 0; // with sessions, datagrams each lane copies from a round and sends again in the next, one also as another session
+            uint32_t abort_after_rounds = 0; // the sender gives up after this many rounds, as though it died. 0 never
+        };
+#endif
+
+        struct SendOptions {
+            int batch_depth = DEFAULT_BATCH_DEPTH; // datagrams per sendmmsg, clamped to sk::SK_MAX_BATCH_DEPTH
+            bool zero_copy = false; // send with MSG_ZEROCOPY where the kernel supports it. Not with read_ahead, FEC or compression
+            bool segmentation_offload = false; // pack several packets into each send with UDP_SEGMENT (GSO)
+            double rate_mbps = 0; // target blast rate in megabits per second. 0 sends as fast as possible
+            bool adaptive = true; // size blasts from the RTT and receiver buffer and adapt window and rate to loss
+            int socket_buffer_size = DEFAULT_SOCKET_BUFFER_SIZE;
+            uint64_t map_window_size = DEFAULT_MAP_WINDOW_SIZE; // bytes of the file mapped at once, 0 for all of it
+            uint32_t lanes = 1; // lanes to ask the receiver for, up to MAX_LANES
+            bool uring = false; // send through io_uring where the kernel has it, otherwise sendmmsg
+            bool uring_sqpoll = false; // with uring, let a kernel thread submit the sends
+            bool read_ahead = false; // read the file on a thread per lane into ready made packets, instead of sending from a map
+            uint64_t read_ahead_size = DEFAULT_READ_AHEAD_SIZE; // with read_ahead, bytes of packets each lane keeps ready
+            bool pipelined = false; // ask for streaming NACKs and blast without stopping for the bitmap, if the receiver agrees
+            bool checksum = false; // ask to carry a CRC32C per block and check the whole file against a digest of them
+            uint32_t fec_group_size = 0; // data blocks per forward error correction group, up to fec::MAX_GROUP_SIZE. 0 sends no parity
+            uint32_t fec_parity = 1; // parity blocks per group, up to fec::MAX_PARITY. 1 is plain XOR parity
+            bool delta = false; // ask for hashes of the receiver's copy of the file, if it has one, and only send the blocks that differ
+            bool zero_blocks = false; // send blocks that are all zeros as just their header
+            bool compression = false; // compress blocks that shrink, for as long as that pays
+            bool sessions = false; // stamp every packet with the session and round, which a daemon on a shared port needs
+            bool resume = false; // ask the receiver to checkpoint what it has, and to start from its checkpoint of an earlier try if there is one
+#ifdef RSE_TEST_FAULTS
+            const TestFaults* faults = nullptr;
+#endif
+        };
+
+        // Where the receiver puts the blocks it gets
+        enum class ReceiveSink {
+            MAP, // straight into a shared mapping of the file, written back by the kernel
+            WRITER // into a ring a writer thread empties into the file, off the network thread
+        };
+
+        struct ReceiveOptions {
+            int batch_depth = DEFAULT_BATCH_DEPTH; // datagrams per recvmmsg, clamped to sk::SK_MAX_BATCH_DEPTH
+            bool receive_offload = false; // let the kernel merge datagrams with UDP_GRO. Pairs with SendOptions::segmentation_offload
+            int socket_buffer_size = DEFAULT_SOCKET_BUFFER_SIZE; // advertised to the sender, which sizes its blasts to fit
+            uint64_t map_window_size = DEFAULT_MAP_WINDOW_SIZE; // bytes of the file mapped at once, 0 for all of it
+            uint32_t max_lanes = MAX_LANES; // most lanes we will open for a sender
+            uint64_t max_blocks = DEFAULT_MAX_BLOCKS; // most blocks we will take from a sender, since we keep state for each
+            uint32_t protocol_version = PROTOCOL_VERSION; // newest handshake we speak, lower to act like an older receiver
+            bool uring = false; // receive through io_uring where the kernel has it, otherwise recvmmsg
+            ReceiveSink sink = ReceiveSink::MAP;
+            bool direct_io = false; // with ReceiveSink::WRITER, bypass the page cache (O_DIRECT) where the file system allows
+            uint64_t writer_queue_size = DEFAULT_WRITER_QUEUE_SIZE; // with ReceiveSink::WRITER, bytes of blocks waiting to be written
+            bool sync = false; // flush the file to disk before the transfer counts as received, at the cost of waiting on it
+            int nack_interval_ms = DEFAULT_NACK_INTERVAL_MS; // how often to NACK in a pipelined transfer. 0 refuses to pipeline
+            bool drain_quiet = true; // wait for the lanes to go quiet before reporting, instead of just emptying them
+            bool checksum = true; // agree to check blocks against their CRC32C when the sender asks
+            bool fec = true; // agree to forward error correction when the sender asks
+            bool delta = true; // agree to keep the blocks of a file already at the path that match the sender's
+            bool zero_blocks = true; // agree to take blocks of all zeros as just their header, and leave holes for them in the file
+            bool compression = true; // agree to take compressed blocks
+            bool sessions = true; // agree to packets stamped with the session and round, and drop the ones that aren't ours
+            bool resume = true; // agree to checkpoint what has been received, and to pick up from an earlier checkpoint of the same file
+            int checkpoint_interval_ms = DEFAULT_CHECKPOINT_INTERVAL_MS; // with resume, the least time between checkpoints
+            int idle_timeout_ms = 0; // give up on a sender we hear nothing from for this long, 0 waits forever. Has to outlast its hashing with delta
+        };
+
+        // Counters for one lane of a transfer
+        struct LaneStats {
+            uint64_t bytes = 0;
+            uint64_t datagrams = 0;
+            uint64_t datagram_syscalls = 0;
+            uint64_t map_remaps = 0;
+            double seconds = 0; // time spent blasting or draining
+        };
+
+        // Counters for a single transfer. Both SendFile and WaitToReceive can fill one in.
+        struct TransferStats {
+            uint64_t bytes = 0; // payload bytes moved over udp
+            uint64_t datagrams = 0; // udp packets moved, counted before any segmentation offload merges them
+            uint64_t datagram_syscalls = 0; // socket calls it took to move them
+            uint32_t rounds = 0; // blast rounds, i.e. bitmap exchanges
+            uint64_t zerocopy_sends = 0; // datagrams sent with MSG_ZEROCOPY
+            uint64_t zerocopy_copied = 0; // of those, how many the kernel copied anyway (always the case over loopback)
+            uint64_t zerocopy_completed = 0; // of those, how many the kernel said it was done with
+            uint64_t misplaced_blocks = 0; // received blocks that missed their guessed slot and had to be copied
+            uint64_t duplicate_blocks = 0; // blocks the receiver already had, i.e. wasted resends
+            uint64_t late_datagrams = 0; // datagrams the receiver read while waiting for a round to go quiet
+            uint64_t srtt_ns = 0; // the receiver's smoothed time from a report to the next round's first packet
+            uint64_t poll_wakeups = 0; // times the receiver's event loop woke up
+            uint64_t datagrams_during_blast = 0; // datagrams the receiver read before the sender said the blast was over
+            double target_rate_mbps = 0; // the rate the sender was asked to pace to, 0 if unpaced
+            double blast_seconds = 0; // time the sender spent blasting, not counting waits for the bitmap
+            uint64_t map_remaps = 0; // times the mapped window of the file moved
+            uint64_t control_bytes = 0; // bytes sent and received over the tcp control connection
+            uint64_t report_bytes = 0; // of those, how many were loss reports
+            uint32_t reports_by_encoding[4] = { 0 }; // how often each ReportEncoding was picked
+            uint32_t window = 0; // packets per blast the sender finished on
+            double rate_mbps = 0; // rate the sender finished on, 0 if it never paced
+            double seconds = 0;
+            uint32_t num_lanes = 0;
+            uint32_t uring_lanes = 0; // lanes that moved their datagrams through io_uring
+            uint64_t disk_writes = 0; // write calls made by the receiver's writer thread
+            uint64_t disk_reads = 0; // read calls made by the sender's read ahead threads
+            uint64_t disk_bytes = 0; // bytes they wrote or read
+            uint64_t read_stalls = 0; // times a sender lane had nothing to send and waited on its reader
+            uint64_t nacks = 0; // streaming NACKs sent or received
+            uint64_t nacked_blocks = 0; // blocks they asked for again
+            uint64_t repair_passes = 0; // times the sender's lanes went back for NACKed blocks before ending a round
+            bool direct_io = false; // whether those writes bypassed the page cache
+            uint64_t sink_stalls = 0; // times a lane found the writer's queue full
+            bool checksum = false; // whether blocks carried a CRC32C
+            uint64_t corrupt_blocks = 0; // blocks the receiver dropped because they failed their checksum
+            uint32_t file_digest = 0; // CRC32C over the blocks' CRCs in order, 0 without checksums
+            uint64_t parity_blocks = 0; // forward error correction blocks sent or received
+            uint64_t rebuilt_blocks = 0; // blocks the receiver rebuilt from parity instead of waiting for them to be resent
+            bool delta = false; // whether the receiver's copy of the file was hashed for blocks it already had
+            uint64_t delta_blocks = 0; // blocks of it that matched the sender's, so were never sent
+            uint64_t zero_blocks = 0; // blocks of all zeros sent or received as just their header
+            bool compression = false; // whether blocks could go compressed
+            uint64_t compressed_blocks = 0; // blocks sent or received compressed
+            uint64_t compressed_bytes = 0; // what those came to on the wire
+            uint64_t bypassed_blocks = 0; // blocks the sender didn't try to compress since it wasn't paying
+            uint64_t codec_ns = 0; // time spent compressing or decompressing, over every lane
+            uint64_t stale_packets = 0; // packets the receiver dropped for being from another session or an earlier round
+            uint64_t bad_packets = 0; // packets the receiver dropped for being cut short or for a block that isn't in the file
+            bool resume = false; // whether the receiver kept a checkpoint to resume from
+            uint64_t resumed_blocks = 0; // blocks an earlier, interrupted transfer got there, so were never sent
+            uint32_t checkpoints = 0; // checkpoints the receiver wrote
+            uint64_t checkpoint_bytes = 0; // bytes of them it wrote, the first included
+            LaneStats lanes[MAX_LANES];
+        };
+
+        // Folds a lane's counters into the transfer's
+        void AddLaneStats(TransferStats& stats, uint32_t lane, const LaneStats& lane_stats) {
+            stats.bytes += lane_stats.bytes;
+            stats.datagrams += lane_stats.datagrams;
+            stats.datagram_syscalls += lane_stats.datagram_syscalls;
+            stats.map_remaps += lane_stats.map_remaps;
+            if (lane < MAX_LANES) stats.lanes[lane] = lane_stats;
+        }
+
+        // The blocks [first, end) a lane carries. Every lane but the last gets the same number
+        // of blocks, rounded up to whole words of the bitmap, so later lanes may be empty.
+        void LaneRange(const TransmissionInfo& handshake, uint32_t lane, uint64_t& first, uint64_t& end) {
+            uint64_t num_lanes = handshake.num_lanes > 0 ? handshake.num_lanes : 1;
+            uint64_t per_lane = (handshake.number_packets + num_lanes - 1) / num_lanes;
+            per_lane = (per_lane + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS * BITMAP_WORD_BITS;
+            first = lane * per_lane;
+            if (first > handshake.number_packets) first = handshake.number_packets;
+            end = first + per_lane;
+            if (end > handshake.number_packets) end = handshake.number_packets;
+        }
+
+
+        // Checksums
+        // --> With FEATURE_CHECKSUM every packet carries the CRC32C of its block, zero padded to the block size,
+        //     carried on over the block's id so a packet whose id got damaged can't pass for another block.
+        // --> The receiver drops blocks that don't match. Their bit stays clear, so they are sent again.
+        // --> The file digest is the CRC32C of every block's CRC in block order. The sender keeps them as it
+        //     seals blocks, the receiver reads its file back once it is closed, so the digest covers what
+        //     reached the file and not just what came off the wire.
+
+        uint32_t HeaderCrc(uint32_t block_crc, uint64_t id) {
+            return Crc32c(block_crc, &id, sizeof(id));
+        }
+
+        uint32_t FileDigest(const uint32_t* block_crcs, uint64_t number_packets) {
+            return Crc32c(0, block_crcs, number_packets * sizeof(uint32_t));
+        }
+
+        // Checks a received block against its header and remembers its CRC in block_crcs if it is good
+        // and there is one. Parity blocks aren't part of the file, so they aren't remembered.
+        bool CheckBlock(const PacketHeader& header, const char* payload, int payload_size, uint32_t block_size, uint32_t* block_crcs) {
+            if (payload_size != (int)block_size) return false;
+            uint32_t crc = Crc32c(0, payload, payload_size);
+            if (HeaderCrc(crc, header.id) != header.crc) return false;
+            if (block_crcs != nullptr) block_crcs[header.id] = crc;
+            return true;
+        }
+
+        // The CRC a sender puts in a block's header. A short final block is checked as if it were
+        // padded out with zeros, as it is on the wire. The block's own CRC is kept for the digest.
+        uint32_t SealBlock(uint64_t id, const char* block, uint32_t size, const char* zero_padding, uint32_t block_size, uint32_t* block_crcs) {
+            uint32_t crc = Crc32c(0, block, size);
+            if (size < block_size) crc = Crc32c(crc, zero_padding, block_size - size);
+            block_crcs[id] = crc;
+            return HeaderCrc(crc, id);
+        }
+
+
+        // Zero blocks
+        // --> With FEATURE_ZERO_BLOCKS the sender sends a block of all zeros as just its header, and with
+        //     checksums that carries the CRC of a whole block of zeros. A packet with no payload is one of them.
+        // --> It ends the datagram it is in, since a segmented send can only end on a short packet.
+        // --> The receiver sets its bit without writing anything. The writer sink creates the file sparse, so the
+        //     block stays a hole. The map can't take a sparse file, since writing to a hole the disk has no room
+        //     for faults, so there the file is allocated in full and the zero blocks are punched out of it once
+        //     it is complete. Zeros are only written where the block may hold something else, which is where a
+        //     delta transfer kept an older copy of the file, or where a wrong guess landed a packet in the map.
+
+        uint32_t ZeroBlockCrc(uint32_t block_size) {
+            static const char zeros[4096] = { 0 };
+            uint32_t crc = 0;
+            for (uint32_t done = 0; done < block_size; done += sizeof(zeros)) {
+                crc = Crc32c(crc, zeros, block_size - done < sizeof(zeros) ? block_size - done : sizeof(zeros));
+            }
+            return crc;
+        }
+
+        // SealBlock for a zero block
+        uint32_t SealZeroBlock(uint64_t id, uint32_t zero_crc, uint32_t* block_crcs) {
+            block_crcs[id] = zero_crc;
+            return HeaderCrc(zero_crc, id);
+        }
+
+        // CheckBlock for a zero block
+        bool CheckZeroBlock(const PacketHeader& header, uint32_t zero_crc, uint32_t* block_crcs) {
+            if (HeaderCrc(zero_crc, header.id) != header.crc) return false;
+            if (block_crcs != nullptr) block_crcs[header.id] = zero_crc;
+            return true;
+        }
+
+        // Compression
+        // --> With FEATURE_COMPRESSION the header grows a codec word, and a block that lz::Compress shrinks goes
+        //     as CODEC_LZ with just the compressed bytes. Checksums and parity are of the block as it is in the file.
+        // --> A compressed packet is short, so like a zero block it ends the datagram it is in.
+        // --> Each lane of the sender decides for itself whether compressing pays. Every COMPRESS_SAMPLE_BLOCKS
+        //     blocks it looks at how much it saved and how long that took. If it saved less than COMPRESS_MIN_SAVING,
+        //     or took longer than sending the bytes it saved would at the lane's rate, it sends the next blocks
+        //     raw without trying, twice as many each time it finds it still doesn't pay.
+        // --> The lane's rate is the one it is paced to. Unpaced it is what the sample went out at, less the time
+        //     spent compressing it.
+
+        constexpr uint32_t CODEC_RAW = 0;
+        constexpr uint32_t CODEC_LZ = 1;
+        constexpr uint32_t COMPRESS_SAMPLE_BLOCKS = 256;
+        constexpr double COMPRESS_MIN_SAVING = 0.1;
+        constexpr uint64_t COMPRESS_BYPASS_MIN_BLOCKS = 1024;
+        constexpr uint64_t COMPRESS_BYPASS_MAX_BLOCKS = 64 * 1024;
+
+        // Blocks a file of file_size goes as. The last one may be short, and an empty file is still one block.
+        uint64_t BlockCount(uint64_t file_size, uint32_t block_size) {
+            uint64_t count = file_size / block_size + (file_size % block_size != 0 ? 1 : 0);
+            return count > 0 ? count : 1;
+        }
+
+        uint32_t HeaderSize(const TransmissionInfo& handshake) {
+            if (handshake.sessions) return SESSION_HEADER_SIZE;
+            if (handshake.compression) return CODEC_HEADER_SIZE;
+            return handshake.checksum ? CHECKSUM_HEADER_SIZE : PACKET_HEADER_SIZE;
+        }
+
+        struct CodecControl {
+            bool enabled = false;
+            double rate_mbps = 0; // what the lane is paced to, 0 to go by what each sample went out at
+            uint32_t sampled = 0; // blocks tried since the last look
+            uint64_t sample_start_ns = 0;
+            uint64_t sample_bytes = 0;
+            uint64_t sample_saved = 0;
+            uint64_t sample_ns = 0;
+            uint64_t bypass_left = 0; // blocks still to send raw without trying
+            uint64_t bypass_blocks = COMPRESS_BYPASS_MIN_BLOCKS; // how long the next bypass lasts
+            uint64_t compressed_blocks = 0;
+            uint64_t compressed_bytes = 0;
+            uint64_t bypassed_blocks = 0;
+            uint64_t codec_ns = 0;
+        };
+
+        void JudgeCompression(CodecControl& codec) {
+            double saving = (double)codec.sample_saved / codec.sample_bytes;
+            double rate_mbps = codec.rate_mbps;
+            uint64_t elapsed_ns = NowNs() - codec.sample_start_ns;
+            if (rate_mbps == 0 && elapsed_ns > codec.sample_ns) {
+                rate_mbps = (double)(codec.sample_bytes - codec.sample_saved) * 8 * 1000 / (elapsed_ns - codec.sample_ns);
+            }
+            double wire_ns = rate_mbps > 0 ? codec.sample_saved * 8 * 1000 / rate_mbps : 0;
+            bool pays = saving >= COMPRESS_MIN_SAVING && codec.sample_ns < wire_ns;
+            debug_printf("[sender]: compression saved [%.1lf]%% in [%llu]ns at [%.0lf] Mbps, [%s]\n", saving * 100,
+                (unsigned long long)codec.sample_ns, rate_mbps, pays ? "pays" : "bypassing");
+            if (pays) codec.bypass_blocks = COMPRESS_BYPASS_MIN_BLOCKS;
+            else {
+                codec.bypass_left = codec.bypass_blocks;
+                if (codec.bypass_blocks < COMPRESS_BYPASS_MAX_BLOCKS) codec.bypass_blocks *= 2;
+            }
+            codec.sampled = 0;
+            codec.sample_bytes = 0;
+            codec.sample_saved = 0;
+            codec.sample_ns = 0;
+        }
+
+        // Compresses size bytes of block into out, which holds as many, if that is worth it. Returns
+        // the compressed size, or 0 to send it raw.
+        uint32_t CompressBlock(CodecControl& codec, const char* block, uint32_t size, char* out) {
+            if (!codec.enabled || size == 0) return 0;
+            if (codec.bypass_left > 0) {
+                codec.bypass_left--;
+                codec.bypassed_blocks++;
+                return 0;
+            }
+            uint64_t start_ns = NowNs();
+            if (codec.sampled == 0) codec.sample_start_ns = start_ns;
+            uint32_t packed = (uint32_t)lz::Compress(block, size, out, size - 1);
+            uint64_t spent_ns = NowNs() - start_ns;
+            codec.codec_ns += spent_ns;
+            codec.sample_ns += spent_ns;
+            codec.sample_bytes += size;
+            if (packed > 0) {
+                codec.sample_saved += size - packed;
+                codec.compressed_blocks++;
+                codec.compressed_bytes += packed;
+            }
+            if (++codec.sampled == COMPRESS_SAMPLE_BLOCKS) JudgeCompression(codec);
+            return packed;
+        }
+
+        // Receiver side. Decompresses size bytes at packed into a whole block, zero padded like a short
+        // one. Returns false if they are no good.
+        bool UnpackBlock(const char* packed, uint32_t size, char* block, uint32_t block_size, uint64_t& codec_ns) {
+            uint64_t start_ns = NowNs();
+            size_t unpacked = lz::Decompress(packed, size, block, block_size);
+            if (unpacked != SIZE_MAX) memset(block + unpacked, 0, block_size - unpacked);
+            codec_ns += NowNs() - start_ns;
+            return unpacked != SIZE_MAX;
+        }
+
+        // Sessions
+        // --> With FEATURE_SESSION every packet carries the session id the receiver picked in the handshake
+        //     and the round it was sent in. That grows the header to SESSION_HEADER_SIZE whatever else is on.
+        // --> The receiver drops packets of any other session, which are left over from an earlier transfer
+        //     to the same port or just stray, and packets of an earlier round, which its report has already
+        //     asked for again. Without sessions those are taken for blocks of this transfer, or fail it.
+        // --> The round moves on just before the receiver sends its report, so the sender's next blast,
+        //     which waits for the report, is never taken for a late one.
+        // --> The id comes in the handshake reply, with whether every lane is on the one port.
+        // --> The low SESSION_SLOT_BITS of the id are the daemon's slot for the session, so a shared port
+        //     finds it without a search. See "Shared port".
+
+        uint32_t NewSessionId(uint32_t slot) {
+            uint64_t seed = NowNs();
+            uint32_t id = (uint32_t)(Hash64(&seed, sizeof(seed)) << SESSION_SLOT_BITS) | (slot & (MAX_SESSIONS - 1));
+            return id != 0 ? id : MAX_SESSIONS;
+        }
+
+        // Forward error correction
+        // --> With FEATURE_FEC each lane splits its blocks into groups of fec_group_size, and the first time
+        //     the sender gets to the end of a group it follows it with fec_parity parity blocks, see fec::Coefficient.
+        // --> The receiver folds every block it gets into a syndrome per parity block of the group. Once a group
+        //     has as many parity blocks in as it has blocks missing, it rebuilds them and sets their bits, so the
+        //     loss never makes it into a report.
+        // --> Parity packets have FEC_PARITY_ID set in their id, then the group's first block and the parity row.
+        //     That leaves 55 bits for the block, so neither end agrees to FEC for files of FEC_MAX_BLOCKS or more.
+
+        constexpr uint64_t FEC_PARITY_ID = 1ull << 63;
+        constexpr uint64_t FEC_MAX_BLOCKS = 1ull << 55;
+        constexpr uint32_t FEC_OPEN_GROUPS = 64; // groups a receiver lane keeps syndromes for at once
+        constexpr uint32_t FEC_PARITY_SETS = 8; // groups of parity the sender can have waiting in a batch
+
+        uint64_t ParityId(uint64_t group_first, uint32_t row) {
+            return FEC_PARITY_ID | (group_first << 8) | row;
+        }
+
+        bool IsParityId(uint64_t id) {
+            return (id & FEC_PARITY_ID) != 0;
+        }
+
+        uint64_t ParityGroupFirst(uint64_t id) {
+            return (id & ~FEC_PARITY_ID) >> 8;
+        }
+
+        uint32_t ParityRow(uint64_t id) {
+            return (uint32_t)(id & 0xFF);
+        }
+
+        // Groups start at the lane's first block, and the last one of a lane may be short
+        struct FecGroups {
+            uint32_t group_size = 0; // 0 when the transfer has no FEC
+            uint32_t parity = 0;
+            uint32_t block_size = 0;
+            uint64_t lane_first = 0;
+            uint64_t lane_end = 0;
+        };
+
+        void InitFecGroups(FecGroups& groups, const TransmissionInfo& handshake, uint64_t lane_first, uint64_t lane_end) {
+            groups.group_size = handshake.fec_group_size;
+            groups.parity = handshake.fec_parity;
+            groups.block_size = handshake.block_size;
+            groups.lane_first = lane_first;
+            groups.lane_end = lane_end;
+        }
+
+        uint64_t GroupFirst(const FecGroups& groups, uint64_t id) {
+            return groups.lane_first + (id - groups.lane_first) / groups.group_size * groups.group_size;
+        }
+
+        uint64_t GroupEnd(const FecGroups& groups, uint64_t group_first) {
+            uint64_t end = group_first + groups.group_size;
+            return end < groups.lane_end ? end : groups.lane_end;
+        }
+
+        // Builds the parity of each group on the sender, a block at a time. Groups are only built the first
+        // time their blocks go out, in order, which is how the first pass over the file sends them.
+        struct FecEncoder {
+            FecGroups groups;
+            uint32_t num_sets = 0;
+            uint8_t* sets = nullptr; // num_sets sets of parity blocks, so sent ones can wait in a batch while the next is built
+            uint64_t* sent_in = nullptr; // per set, the batch it was queued in, UINT64_MAX if none
+            uint32_t current = 0; // the set being built
+            uint64_t next = 0; // the next block to fold in
+        };
+
+        void CreateFecEncoder(FecEncoder& encoder, const TransmissionInfo& handshake, uint64_t lane_first, uint64_t lane_end, uint32_t num_sets) {
+            InitFecGroups(encoder.groups, handshake, lane_first, lane_end);
+            encoder.next = lane_first;
+            if (encoder.groups.group_size == 0) return;
+            encoder.num_sets = num_sets;
+            encoder.sets = new uint8_t[(size_t)num_sets * encoder.groups.parity * encoder.groups.block_size];
+            encoder.sent_in = new uint64_t[num_sets];
+            for (uint32_t i = 0; i < num_sets; i++) encoder.sent_in[i] = UINT64_MAX;
+        }
+
+        void DestroyFecEncoder(FecEncoder& encoder) {
+            delete[] encoder.sets;
+            delete[] encoder.sent_in;
+            encoder.sets = nullptr;
+            encoder.sent_in = nullptr;
+        }
+
+        uint8_t* ParityBlock(FecEncoder& encoder, uint32_t row) {
+            return encoder.sets + ((size_t)encoder.current * encoder.groups.parity + row) * encoder.groups.block_size;
+        }
+
+        // Whether folding block id in would start building a group
+        bool StartsFecGroup(const FecEncoder& encoder, uint64_t id) {
+            return encoder.groups.group_size > 0 && id >= encoder.next && id == GroupFirst(encoder.groups, id);
+        }
+
+        // Folds size bytes of block id into its group's parity if it is the next one. Returns true when that
+        // finishes the group, and the parity is ready in ParityBlock until FinishFecGroup.
+        bool FoldFecBlock(FecEncoder& encoder, uint64_t id, const char* block, uint32_t size) {
+            FecGroups& groups = encoder.groups;
+            if (groups.group_size == 0) return false;
+            uint64_t group_first = GroupFirst(groups, id);
+            if (id != encoder.next) {
+                if (id < encoder.next || id != group_first) return false;
+                encoder.next = id; // something got skipped, start again from this group
+            }
+            uint32_t index = (uint32_t)(id - group_first);
+            if (index == 0) memset(ParityBlock(encoder, 0), 0, (size_t)groups.parity * groups.block_size);
+            for (uint32_t row = 0; row < groups.parity; row++) {
+                fec::MulAddRegion(ParityBlock(encoder, row), (const uint8_t*)block, fec::Coefficient(row, index), size);
+            }
+            encoder.next = id + 1;
+            return encoder.next == GroupEnd(groups, group_first);
+        }
+
+        // The parity just finished went out in batch, build the next group's in another set
+        void FinishFecGroup(FecEncoder& encoder, uint64_t batch) {
+            encoder.sent_in[encoder.current] = batch;
+            encoder.current = (encoder.current + 1) % encoder.num_sets;
+        }
+
+        // A group the receiver is collecting. Each syndrome starts as the parity block and has every data
+        // block that arrives taken back out, leaving just the missing blocks in it.
+        struct FecGroup {
+            uint64_t first = UINT64_MAX; // UINT64_MAX when the slot is free
+            uint32_t size = 0; // data blocks in the group
+            uint32_t received = 0; // data blocks folded in
+            uint32_t parity_rows = 0; // a bit per parity block folded in
+        };
+
+        struct FecDecoder {
+            FecGroups groups;
+            FecGroup open[FEC_OPEN_GROUPS]; // by group number, newer groups take over older ones' slots
+            uint8_t* syndromes = nullptr; // parity blocks per slot
+            uint64_t parity_to = 0; // one past the last group we got parity for, where the next parity is expected
+            bool ready = false; // some group has enough to be rebuilt
+            uint64_t parity_blocks = 0;
+            uint64_t rebuilt_blocks = 0;
+        };
+
+        void CreateFecDecoder(FecDecoder& decoder, const TransmissionInfo& handshake, uint64_t lane_first, uint64_t lane_end) {
+            InitFecGroups(decoder.groups, handshake, lane_first, lane_end);
+            decoder.parity_to = lane_first;
+            if (decoder.groups.group_size == 0) return;
+            decoder.syndromes = new uint8_t[(size_t)FEC_OPEN_GROUPS * decoder.groups.parity * decoder.groups.block_size];
+        }
+
+        void DestroyFecDecoder(FecDecoder& decoder) {
+            delete[] decoder.syndromes;
+            decoder.syndromes = nullptr;
+        }
+
+        uint8_t* Syndrome(FecDecoder& decoder, uint32_t slot, uint32_t row) {
+            return decoder.syndromes + ((size_t)slot * decoder.groups.parity + row) * decoder.groups.block_size;
+        }
+
+        // The slot collecting the group that starts at group_first, or -1 if it can't be. A group is only
+        // taken on before any of its blocks arrive, since those would be missing from its syndromes.
+        int OpenFecGroup(FecDecoder& decoder, Bitmap& bitmap, uint64_t group_first) {
+            FecGroups& groups = decoder.groups;
+            uint64_t number = (group_first - groups.lane_first) / groups.group_size;
+            int slot = (int)(number % FEC_OPEN_GROUPS);
+            FecGroup& group = decoder.open[slot];
+            if (group.first == group_first) return slot;
+            if (group.first != UINT64_MAX && group.first > group_first) return -1;
+
+            uint64_t group_end = GroupEnd(groups, group_first);
+            if (bitmap.FindNextSet(group_first) < group_end) return -1;
+            group.first = group_first;
+            group.size = (uint32_t)(group_end - group_first);
+            group.received = 0;
+            group.parity_rows = 0;
+            memset(Syndrome(decoder, slot, 0), 0, (size_t)groups.parity * groups.block_size);
+            return slot;
+        }
+
+        void NoteFecProgress(FecDecoder& decoder, int slot) {
+            FecGroup& group = decoder.open[slot];
+            if (group.received == group.size) group.first = UINT64_MAX; // nothing to rebuild
+            else if ((uint32_t)PopCount64(group.parity_rows) >= group.size - group.received) decoder.ready = true;
+        }
+
+        // Takes a block the receiver hasn't had before out of its group's syndromes
+        void AddFecBlock(FecDecoder& decoder, Bitmap& bitmap, uint64_t id, const char* block, int size) {
+            FecGroups& groups = decoder.groups;
+            if (groups.group_size == 0) return;
+            uint64_t group_first = GroupFirst(groups, id);
+            int slot = OpenFecGroup(decoder, bitmap, group_first);
+            if (slot < 0) return;
+            uint32_t index = (uint32_t)(id - group_first);
+            for (uint32_t row = 0; row < groups.parity; row++) {
+                fec::MulAddRegion(Syndrome(decoder, slot, row), (const uint8_t*)block, fec::Coefficient(row, index), size);
+            }
+            decoder.open[slot].received++;
+            NoteFecProgress(decoder, slot);
+        }
+
+        void AddFecParity(FecDecoder& decoder, Bitmap& bitmap, uint64_t id, const char* block, int size) {
+            FecGroups& groups = decoder.groups;
+            uint64_t group_first = ParityGroupFirst(id);
+            uint32_t row = ParityRow(id);
+            decoder.parity_blocks++;
+            uint64_t group_end = GroupEnd(groups, group_first);
+            if (group_end > decoder.parity_to) decoder.parity_to = group_end;
+            if (size != (int)groups.block_size) return;
+
+            int slot = OpenFecGroup(decoder, bitmap, group_first);
+            if (slot < 0 || (decoder.open[slot].parity_rows & (1u << row))) return;
+            fec::XorRegion(Syndrome(decoder, slot, row), (const uint8_t*)block, size);
+            decoder.open[slot].parity_rows |= 1u << row;
+            NoteFecProgress(decoder, slot);
+        }
+
+
+        // Loss reports
+        // --> After every blast the receiver tells the sender which blocks it has
+        // --> It sends whichever of these encodings is smallest:
+        //      RAW     the bitmap as is
+        //      RANGES  (start, count) pairs of missing blocks, 8 bytes each
+        //      RUNS    varint lengths of alternating missing/received runs, starting with missing
+        //      DELTA   RUNS, but of only the blocks received since the last report
+        // --> On the wire a report is a 1 byte encoding, a 4 byte payload size and then the payload
+        // --> A NACK travels the same way but is never the report that ends a round
+
+        enum class ReportEncoding : uint8_t {
+            RAW = 0,
+            RANGES = 1,
+            RUNS = 2,
+            DELTA = 3,
+            NACK = 4
+        };
+
+        constexpr int REPORT_HEADER_SIZE = 5;
+
+        // Writes into a fixed buffer, remembering if it ran out of room
+        struct ReportWriter {
+            uint8_t* data = nullptr;
+            size_t size = 0;
+            size_t capacity = 0;
+            bool overflow = false;
+        };
+
+        inline void WriteBytes(ReportWriter& w, const void* bytes, size_t n) {
+            if (w.size + n > w.capacity) { w.overflow = true; return; }
+            memcpy(w.data + w.size, bytes, n);
+            w.size += n;
+        }
+
+        inline void WriteVarint(ReportWriter& w, uint64_t value) {
+            uint8_t bytes[10];
+            size_t n = 0;
+            do {
+                uint8_t byte = value & 0x7F;
+                value >>= 7;
+                bytes[n++] = byte | (value ? 0x80 : 0);
+            } while (value);
+            WriteBytes(w, bytes, n);
+        }
+
+        inline bool ReadVarint(const uint8_t*& p, const uint8_t* end, uint64_t& value) {
+            value = 0;
+            for (int shift = 0; shift < 64 && p < end; shift += 7) {
+                uint8_t byte = *p++;
+                value |= (uint64_t)(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) return true;
+            }
+            return false;
+        }
+
+        // Alternating runs of clear and set bits, starting with clear
+        bool EncodeRuns(const uint64_t* words, size_t num_bits, ReportWriter& w) {
+            size_t pos = 0;
+            bool value = false;
+            while (pos < num_bits && !w.overflow) {
+                size_t next = FindNextBit(words, num_bits, pos, !value);
+                WriteVarint(w, next - pos);
+                pos = next;
+                value = !value;
+            }
+            return !w.overflow;
+        }
+
+        bool EncodeMissingRanges(const uint64_t* words, size_t num_bits, ReportWriter& w) {
+            size_t pos = FindNextBit(words, num_bits, 0, false);
+            while (pos < num_bits && !w.overflow) {
+                size_t end = FindNextBit(words, num_bits, pos, true);
+                uint64_t range[2] = { pos, end - pos };
+                WriteBytes(w, range, sizeof(range));
+                pos = FindNextBit(words, num_bits, end, false);
+            }
+            return !w.overflow;
+        }
+
+        // Receiver side state for building reports
+        struct LossReporter {
+            uint64_t* last_reported = nullptr; // the bitmap as of the last report
+            uint64_t* delta = nullptr; // blocks received since then
+            uint8_t* message = nullptr; // the report to send, header included
+            uint8_t* scratch = nullptr; // where the next candidate encoding is tried
+            size_t num_words = 0;
+            size_t bitmap_size = 0; // bytes in a RAW report
+        };
+
+        void DestroyLossReporter(LossReporter& reporter) {
+            delete[] reporter.last_reported;
+            delete[] reporter.delta;
+            delete[] reporter.message;
+            delete[] reporter.scratch;
+            reporter = LossReporter();
+        }
+
+        // False if we ran out of memory, in which case the reporter is left empty
+        bool CreateLossReporter(LossReporter& reporter, Bitmap& bitmap, size_t bitmap_size) {
+            reporter.num_words = bitmap.SizeOf() / sizeof(uint64_t);
+            reporter.bitmap_size = bitmap_size;
+            reporter.last_reported = new (std::nothrow) uint64_t[reporter.num_words]();
+            reporter.delta = new (std::nothrow) uint64_t[reporter.num_words];
+            reporter.message = new (std::nothrow) uint8_t[REPORT_HEADER_SIZE + bitmap_size];
+            reporter.scratch = new (std::nothrow) uint8_t[REPORT_HEADER_SIZE + bitmap_size];
+            if (reporter.last_reported == nullptr || reporter.delta == nullptr ||
+                reporter.message == nullptr || reporter.scratch == nullptr) {
+                DestroyLossReporter(reporter);
+                return false;
+            }
+            return true;
+        }
+
+        // Encodes the bitmap in whichever encoding is smallest into reporter.message,
+        // remembers it as the last report and returns the size of the whole message.
+        size_t EncodeLossReport(LossReporter& reporter, Bitmap& bitmap) {
+
+            const uint64_t* words = (const uint64_t*)bitmap.Data();
+            size_t num_bits = bitmap.Size();
+
+            ReportEncoding best = ReportEncoding::RAW;
+            size_t best_size = reporter.bitmap_size;
+            memcpy(reporter.message + REPORT_HEADER_SIZE, words, reporter.bitmap_size);
+
+            for (size_t i = 0; i < reporter.num_words; i++) {
+                reporter.delta[i] = words[i] & ~reporter.last_reported[i];
+            }
+
+            const ReportEncoding candidates[] = { ReportEncoding::DELTA, ReportEncoding::RANGES, ReportEncoding::RUNS };
+            for (ReportEncoding encoding : candidates) {
+
+                // Only worth keeping if it beats the best so far
+                ReportWriter w;
+                w.data = reporter.scratch + REPORT_HEADER_SIZE;
+                w.capacity = best_size - 1;
+
+                bool ok = false;
+                switch (encoding) {
+                    case ReportEncoding::DELTA: ok = EncodeRuns(reporter.delta, num_bits, w); break;
+                    case ReportEncoding::RANGES: ok = EncodeMissingRanges(words, num_bits, w); break;
+                    case ReportEncoding::RUNS: ok = EncodeRuns(words, num_bits, w); break;
+                    default: break;
+                }
+                if (!ok) continue;
+
+                uint8_t* swap = reporter.message;
+                reporter.message = reporter.scratch;
+                reporter.scratch = swap;
+                best = encoding;
+                best_size = w.size;
+            }
+
+            reporter.message[0] = (uint8_t)best;
+            uint32_t payload_size = (uint32_t)best_size;
+            memcpy(reporter.message + 1, &payload_size, 4);
+
+            memcpy(reporter.last_reported, words, reporter.num_words * sizeof(uint64_t));
+            return REPORT_HEADER_SIZE + best_size;
+        }
+
+        // Applies alternating clear/set runs. Returns false if they don't describe exactly num_bits bits.
+        bool ApplyRuns(Bitmap& bitmap, const uint8_t* p, const uint8_t* end, bool set_only) {
+            size_t pos = 0;
+            bool value = false;
+            while (p < end) {
+                uint64_t run;
+                if (!ReadVarint(p, end, run) || run > bitmap.Size() - pos) return false;
+                if (value) bitmap.SetRange(pos, run);
+                else if (!set_only) bitmap.UnsetRange(pos, run);
+                pos += run;
+                value = !value;
+            }
+            return pos == bitmap.Size();
+        }
+
+        // Sender side. Updates the bitmap from a report's payload. Returns false if the report is malformed.
+        bool DecodeLossReport(ReportEncoding encoding, const uint8_t* payload, size_t size, Bitmap& bitmap, size_t bitmap_size) {
+            switch (encoding) {
+                case ReportEncoding::RAW:
+                    if (size != bitmap_size) return false;
+                    bitmap.Load(payload, size);
+                    return true;
+                case ReportEncoding::RANGES: {
+                    if (size % 16 != 0) return false;
+                    bitmap.SetAll();
+                    for (size_t i = 0; i < size; i += 16) {
+                        uint64_t range[2];
+                        memcpy(range, payload + i, sizeof(range));
+                        if (range[0] >= bitmap.Size() || range[1] > bitmap.Size() - range[0]) return false;
+                        bitmap.UnsetRange(range[0], range[1]);
+                    }
+                    return true;
+                }
+                case ReportEncoding::RUNS:
+                    return ApplyRuns(bitmap, payload, payload + size, false);
+                case ReportEncoding::DELTA:
+                    return ApplyRuns(bitmap, payload, payload + size, true);
+                default:
+                    return false;
+            }
+        }
+
+
+        // Delta transfers
+        // --> With FEATURE_DELTA the receiver hashes whatever is already at the path before the first blast,
+        //     a block at a time and zero padded like the blocks on the wire, and sends the hashes. It sends
+        //     a count of 0 if there is nothing there.
+        // --> The sender hashes the same blocks of its file and answers with a report of the ones that match,
+        //     in whichever loss report encoding is smallest. Both ends set those in their bitmaps, so only
+        //     the blocks that changed are blasted, and the receiver keeps the file instead of truncating it.
+        // --> With checksums each end works out the CRCs of the matched blocks from its own copy, so the file
+        //     digest still catches a hash that matched blocks that differ.
+
+        // Reads and hashes blocks [first_block, end_block) of a file. On the sender it also compares them with
+        // the receiver's hashes. Threads are given whole words of the bitmap so they can set bits together.
+        struct BlockHasher {
+            const char* filename = nullptr;
+            uint32_t block_size = 0;
+            uint64_t first_block = 0;
+            uint64_t end_block = 0;
+            uint64_t* hashes = nullptr; // by block. Filled in on the receiver, compared against on the sender, null for just the CRCs
+            Bitmap* matched = nullptr; // on the sender, where the blocks that match are set
+            uint32_t* block_crcs = nullptr; // with checksums, the CRC of every block hashed, or on the sender every block matched
+            bool ok = false;
+        };
+
+        void HashBlocksThread(void* arg) {
+            BlockHasher& h = *(BlockHasher*)arg;
+            io::BlockReader reader;
+            if (!io::OpenBlockReader(h.filename, reader)) return;
+
+            char* buffer = new char[(size_t)DELTA_HASH_RUN * h.block_size];
+            char* blocks[DELTA_HASH_RUN];
+            for (int i = 0; i < DELTA_HASH_RUN; i++) blocks[i] = buffer + (size_t)i * h.block_size;
+
+            h.ok = true;
+            for (uint64_t id = h.first_block; id < h.end_block && h.ok; ) {
+                int count = h.end_block - id < (uint64_t)DELTA_HASH_RUN ? (int)(h.end_block - id) : DELTA_HASH_RUN;
+                if (!io::ReadBlocks(reader, blocks, count, id * h.block_size, h.block_size)) {
+                    h.ok = false;
+                    break;
+                }
+                for (int i = 0; i < count; i++, id++) {
+                    if (h.hashes != nullptr) {
+                        uint64_t hash = Hash64(blocks[i], h.block_size);
+                        if (h.matched == nullptr) h.hashes[id] = hash;
+                        else if (hash != h.hashes[id]) continue;
+                        else h.matched->Set(id);
+                    }
+                    if (h.block_crcs != nullptr) h.block_crcs[id] = Crc32c(0, blocks[i], h.block_size);
+                }
+            }
+            delete[] buffer;
+            io::CloseBlockReader(reader);
+        }
+
+        // Hashes blocks [0, count) of filename on up to DELTA_HASH_THREADS threads, see BlockHasher.
+        // Returns false if the file couldn't be read.
+        bool HashBlocks(const char* filename, uint32_t block_size, uint64_t count, uint64_t* hashes,
+            Bitmap* matched, uint32_t* block_crcs) {
+
+            uint64_t per_thread = (count + DELTA_HASH_THREADS - 1) / DELTA_HASH_THREADS;
+            per_thread = (per_thread + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS * BITMAP_WORD_BITS;
+            if (per_thread < DELTA_HASH_MIN_BLOCKS) per_thread = DELTA_HASH_MIN_BLOCKS;
+
+            BlockHasher hashers[DELTA_HASH_THREADS];
+            void* args[DELTA_HASH_THREADS];
+            int num_threads = 0;
+            for (uint64_t first = 0; first < count; first += per_thread, num_threads++) {
+                BlockHasher& h = hashers[num_threads];
+                h.filename = filename;
+                h.block_size = block_size;
+                h.first_block = first;
+                h.end_block = count - first < per_thread ? count : first + per_thread;
+                h.hashes = hashes;
+                h.matched = matched;
+                h.block_crcs = block_crcs;
+                args[num_threads] = &h;
+            }
+            th::RunOnThreads(HashBlocksThread, args, num_threads);
+
+            bool ok = true;
+            for (int i = 0; i < num_threads; i++) ok = ok && hashers[i].ok;
+            return ok;
+        }
+
+        // Reads a report of the blocks the other end has, which comes like a loss report, into bitmap
+        bool RecvBlockReport(sk::SocketHandle socket, const TransmissionInfo& handshake, uint8_t* payload, Bitmap& bitmap,
+            TransferStats& stats) {
+
+            uint8_t header[REPORT_HEADER_SIZE];
+            uint32_t payload_size = 0;
+            sk::SocketError result = sk::RecvAll(socket, (char*)header, REPORT_HEADER_SIZE, 0);
+            if (sk::IsError(result)) return false;
+            memcpy(&payload_size, header + 1, 4);
+            if (payload_size > handshake.bitmap_size) return false;
+            result = sk::RecvAll(socket, (char*)payload, (int)payload_size, 0);
+            if (sk::IsError(result)) return false;
+            stats.control_bytes += REPORT_HEADER_SIZE + payload_size;
+            return DecodeLossReport((ReportEncoding)header[0], payload, payload_size, bitmap, handshake.bitmap_size);
+        }
+
+        // Receiver side. Sends the hashes of the file already at the path, then sets the blocks the sender
+        // says match in bitmap and, with checksums, their CRCs in block_crcs.
+        bool ExchangeBlockHashes(sk::SocketHandle socket_sender, const TransmissionInfo& handshake, Bitmap& bitmap,
+            uint32_t* block_crcs, uint64_t& stale_blocks, TransferStats& stats) {
+
+            sk::SocketError result;
+            uint64_t file_size = 0;
+            uint64_t count = 0;
+            if (io::GetFileSize(handshake.path_name, file_size)) {
+                count = (file_size + handshake.block_size - 1) / handshake.block_size;
+                if (count > handshake.number_packets) count = handshake.number_packets;
+            }
+            stale_blocks = count;
+
+            // A file we can't read is as good as none
+            bool ok = false;
+            uint64_t* hashes = new (std::nothrow) uint64_t[count > 0 ? count : 1];
+            uint8_t* payload = new (std::nothrow) uint8_t[handshake.bitmap_size];
+            if (hashes == nullptr || payload == nullptr) {
+                debug_printf("[receiver]: out of memory for block hashes\n");
+                goto label_cleanup;
+            }
+            if (count > 0 && !HashBlocks(handshake.path_name, handshake.block_size, count, hashes, nullptr, block_crcs)) {
+                debug_printf("[receiver]: failed to read [%s] for a delta, taking all of it\n", handshake.path_name);
+                count = 0;
+            }
+            debug_printf("[receiver]: sending [%llu] block hashes\n", (unsigned long long)count);
+
+            result = sk::SendAll(socket_sender, (char*)&count, sizeof(count), 0);
+            if (sk::IsError(result)) goto label_cleanup;
+            for (uint64_t sent = 0; sent < count; sent += DELTA_HASHES_PER_SEND) {
+                uint64_t n = count - sent < DELTA_HASHES_PER_SEND ? count - sent : DELTA_HASHES_PER_SEND;
+                result = sk::SendAll(socket_sender, (char*)(hashes + sent), (int)(n * sizeof(uint64_t)), 0);
+                if (sk::IsError(result)) goto label_cleanup;
+            }
+            stats.control_bytes += sizeof(count) + count * sizeof(uint64_t);
+
+            // The blocks that matched come back like a loss report
+            if (!RecvBlockReport(socket_sender, handshake, payload, bitmap, stats) ||
+                bitmap.CountRange(count, handshake.number_packets - count) != 0) {
+                debug_printf("[receiver]: bad report of matching blocks\n");
+                goto label_cleanup;
+            }
+            stats.delta_blocks = bitmap.CountRange(0, handshake.number_packets);
+            ok = true;
+
+        label_cleanup:
+            delete[] payload;
+            delete[] hashes;
+            return ok;
+        }
+
+        // Sender side. Sets the blocks whose hashes match the receiver's in bitmap, with checksums their CRCs
+        // in block_crcs, and tells the receiver which they are.
+        bool MatchBlockHashes(sk::SocketHandle socket_receiver, const TransmissionInfo& handshake, const char* filename,
+            Bitmap& bitmap, uint32_t* block_crcs, TransferStats& stats) {
+
+            sk::SocketError result;
+            uint64_t count = 0;
+            result = sk::RecvAll(socket_receiver, (char*)&count, sizeof(count), 0);
+            if (sk::IsError(result)) return false;
+            if (count > handshake.number_packets) {
+                debug_printf("[sender]: receiver sent [%llu] block hashes for [%llu] blocks\n",
+                    (unsigned long long)count, (unsigned long long)handshake.number_packets);
+                return false;
+            }
+
+            bool ok = false;
+            LossReporter reporter;
+            size_t report_size = 0;
+            uint64_t* hashes = new (std::nothrow) uint64_t[count > 0 ? count : 1];
+            if (hashes == nullptr) goto label_cleanup;
+            for (uint64_t got = 0; got < count; got += DELTA_HASHES_PER_SEND) {
+                uint64_t n = count - got < DELTA_HASHES_PER_SEND ? count - got : DELTA_HASHES_PER_SEND;
+                result = sk::RecvAll(socket_receiver, (char*)(hashes + got), (int)(n * sizeof(uint64_t)), 0);
+                if (sk::IsError(result)) goto label_cleanup;
+            }
+            stats.control_bytes += sizeof(count) + count * sizeof(uint64_t);
+
+            if (count > 0 && !HashBlocks(filename, handshake.block_size, count, hashes, &bitmap, block_crcs)) {
+                debug_printf("[sender]: failed to read [%s] for a delta\n", filename);
+                goto label_cleanup;
+            }
+            stats.delta_blocks = bitmap.CountRange(0, handshake.number_packets);
+            debug_printf("[sender]: [%llu] of [%llu] blocks match the receiver's\n",
+                (unsigned long long)stats.delta_blocks, (unsigned long long)handshake.number_packets);
+
+            if (!CreateLossReporter(reporter, bitmap, handshake.bitmap_size)) goto label_cleanup;
+            report_size = EncodeLossReport(reporter, bitmap);
+            result = sk::SendAll(socket_receiver, (char*)reporter.message, (int)report_size, 0);
+            if (sk::IsError(result)) goto label_cleanup;
+            stats.control_bytes += report_size;
+            ok = true;
+
+        label_cleanup:
+            DestroyLossReporter(reporter);
+            delete[] hashes;
+            return ok;
+        }
+
+        // Resuming
+        // --> With FEATURE_RESUME the sender names the version of the file it has with a token, see ResumeToken,
+        //     and the receiver keeps a checkpoint of its bitmap next to the file it writes, under CHECKPOINT_SUFFIX.
+        // --> A checkpoint is a header with the token, then the words of the bitmap. The bitmap marks the chunks
+        //     of words that change as bits are set, and every checkpoint interval the receiver writes only those,
+        //     so a checkpoint costs what arrived since the one before.
+        // --> Bits only go in once their blocks are in the file. With the writer sink the bitmap is copied and
+        //     only written once the writer has got past where its rings were, so the lanes never wait for it.
+        // --> Right after the handshake the receiver sends the bitmap of a checkpoint with the sender's token, for
+        //     a file of the size it should be, like a loss report. It is empty if there is none. Both ends start
+        //     from it, so only what is missing is sent. With blocks to resume there is no delta, and the file is kept.
+        // --> The checkpoint goes once every block is in. It covers the receiver dying, not the machine, since
+        //     neither it nor the file is flushed to disk as it goes.
+        // --> With checksums the resumed blocks were checked when they arrived. The digest covers them too, since
+        //     the receiver reads its whole file back for it, and the sender reads its file once to work out theirs.
+
+        // Names the version of filename the sender has, going to path_to_write. Checkpoints only resume
+        // transfers with the same token.
+        uint64_t ResumeToken(const char* filename, const char* path_to_write, uint64_t file_size, uint32_t block_size) {
+            uint64_t modified_ns = 0;
+            io::GetFileModified(filename, modified_ns);
+            uint64_t stamp[3] = { file_size, modified_ns, block_size };
+            uint64_t seed = Hash64(path_to_write, strlen(path_to_write), Hash64(filename, strlen(filename)));
+            return Hash64(stamp, sizeof(stamp), seed);
+        }
+
+        struct CheckpointHeader {
+            uint32_t magic;
+            uint32_t block_size;
+            uint64_t number_packets;
+            uint64_t token;
+        };
+
+        struct Checkpoint {
+            char filename[PATH_SIZE + 16];
+            io::SideFile file;
+            bool open = false; // false without FEATURE_RESUME, or once the checkpoint can't be written
+            size_t num_words = 0;
+            size_t num_chunks = 0;
+            uint64_t* pending = nullptr; // the chunks of the bitmap that changed, copied while the writer catches up with them
+            uint64_t* chunks = nullptr; // a bit per chunk still to be written
+            bool has_pending = false;
+            uint64_t marks[io::MAX_BLOCK_RINGS]; // with the writer sink, where its rings were when pending was copied
+            size_t count = 0; // bits set in the last copy
+            uint64_t interval_ns = 0;
+            uint64_t next_ns = 0;
+        };
+
+        // Loads the checkpoint of an earlier try of this transfer into bitmap if there is one, otherwise starts
+        // one with what bitmap has, which every block of has to be in the file. Returns false if there is none
+        // and one can't be made.
+        bool OpenCheckpoint(Checkpoint& cp, const TransmissionInfo& handshake, const ReceiveOptions& options, Bitmap& bitmap,
+            TransferStats& stats) {
+
+            snprintf(cp.filename, sizeof(cp.filename), "%s%s", handshake.path_name, CHECKPOINT_SUFFIX);
+            cp.num_words = bitmap.num_words;
+            cp.num_chunks = (cp.num_words + CHECKPOINT_CHUNK_WORDS - 1) / CHECKPOINT_CHUNK_WORDS;
+            cp.pending = new (std::nothrow) uint64_t[cp.num_words]();
+            cp.chunks = new (std::nothrow) uint64_t[cp.num_chunks / 64 + 1]();
+            if (cp.pending == nullptr || cp.chunks == nullptr) return false;
+            cp.interval_ns = options.checkpoint_interval_ms > 0 ? (uint64_t)options.checkpoint_interval_ms * 1000000 : 0;
+            cp.next_ns = NowNs() + cp.interval_ns;
+            size_t words_size = cp.num_words * sizeof(uint64_t);
+
+            // Only a checkpoint of the same version of the file, next to a file of the size it left, will do
+            CheckpointHeader header = {};
+            uint64_t file_size = 0;
+            if (io::OpenSideFile(cp.filename, false, cp.file)) {
+                bool same = io::ReadSideFile(cp.file, &header, sizeof(header), 0) && header.magic == CHECKPOINT_MAGIC &&
+                    header.token == handshake.resume_token && header.number_packets == handshake.number_packets &&
+                    header.block_size == handshake.block_size &&
+                    io::GetFileSize(handshake.path_name, file_size) && file_size == handshake.summation_block_size &&
+                    io::ReadSideFile(cp.file, cp.pending, words_size, sizeof(header));
+                if (same) {
+                    bitmap.Load((const uint8_t*)cp.pending, words_size);
+                    if (!bitmap.TrackChanges(CHECKPOINT_CHUNK_WORDS)) return false;
+                    cp.count = bitmap.count.load();
+                    cp.open = true;
+                    stats.resumed_blocks = cp.count;
+                    debug_printf("[receiver]: resuming with [%llu] of [%llu] blocks\n",
+                        (unsigned long long)cp.count, (unsigned long long)handshake.number_packets);
+                    return true;
+                }
+                io::CloseSideFile(cp.file);
+            }
+            if (!bitmap.TrackChanges(CHECKPOINT_CHUNK_WORDS)) return false;
+
+            // The words go in before the header, so a checkpoint cut short never looks like one of this transfer
+            header.magic = CHECKPOINT_MAGIC;
+            header.block_size = handshake.block_size;
+            header.number_packets = handshake.number_packets;
+            header.token = handshake.resume_token;
+            if (!io::OpenSideFile(cp.filename, true, cp.file)) return false;
+            if (!io::WriteSideFile(cp.file, bitmap.bitmap, words_size, sizeof(header)) ||
+                !io::WriteSideFile(cp.file, &header, sizeof(header), 0)) {
+                io::CloseSideFile(cp.file);
+                remove(cp.filename);
+                return false;
+            }
+            stats.checkpoint_bytes += sizeof(header) + words_size;
+            cp.open = true;
+            return true;
+        }
+
+        // Copies the chunks of the bitmap that changed since the last call into pending, and marks them to be written
+        void CopyChangedChunks(Checkpoint& cp, Bitmap& bitmap) {
+            for (size_t i = 0; i < bitmap.num_changed_words; i++) {
+                uint64_t bits = bitmap.TakeChanged(i);
+                cp.chunks[i] |= bits;
+                for (; bits != 0; bits &= bits - 1) {
+                    size_t first = (i * 64 + CountTrailingZeros64(bits)) * CHECKPOINT_CHUNK_WORDS;
+                    size_t n = cp.num_words - first < CHECKPOINT_CHUNK_WORDS ? cp.num_words - first : CHECKPOINT_CHUNK_WORDS;
+                    memcpy(cp.pending + first, bitmap.bitmap + first, n * sizeof(uint64_t));
+                }
+            }
+        }
+
+        // Writes the runs of chunks marked in the checkpoint from words. The bits in it only ever get set,
+        // so one cut short still holds blocks that are in the file.
+        bool WriteCheckpoint(Checkpoint& cp, const uint64_t* words, TransferStats& stats) {
+            size_t chunk = 0;
+            while ((chunk = FindNextBit(cp.chunks, cp.num_chunks, chunk, true)) < cp.num_chunks) {
+                size_t end = FindNextBit(cp.chunks, cp.num_chunks, chunk, false);
+                size_t first = chunk * CHECKPOINT_CHUNK_WORDS;
+                size_t last = end * CHECKPOINT_CHUNK_WORDS < cp.num_words ? end * CHECKPOINT_CHUNK_WORDS : cp.num_words;
+
+                size_t size = (last - first) * sizeof(uint64_t);
+                if (!io::WriteSideFile(cp.file, words + first, size, sizeof(CheckpointHeader) + first * sizeof(uint64_t))) return false;
+                for (; chunk < end; chunk++) cp.chunks[chunk / 64] &= ~(1ull << (chunk % 64));
+                stats.checkpoint_bytes += size;
+            }
+            stats.checkpoints++;
+            return true;
+        }
+
+        // Takes a checkpoint if one is due. With a writer what changed is copied, and written once the writer
+        // has caught up with it, on a later call if it hasn't yet. Not to be called while lanes are draining.
+        void UpdateCheckpoint(Checkpoint& cp, Bitmap& bitmap, const io::BlockWriter* writer, TransferStats& stats) {
+            if (!cp.open) return;
+            uint64_t now = NowNs();
+            if (!cp.has_pending) {
+                if (now < cp.next_ns) return;
+                size_t count = bitmap.count.load();
+                if (count == cp.count) {
+                    cp.next_ns = now + cp.interval_ns;
+                    return;
+                }
+                CopyChangedChunks(cp, bitmap);
+                if (writer != nullptr) io::MarkBlockWriter(*writer, cp.marks);
+                cp.count = count;
+                cp.has_pending = true;
+            }
+            if (writer != nullptr && !io::BlockWriterPassed(*writer, cp.marks)) return;
+            cp.has_pending = false;
+            cp.next_ns = now + cp.interval_ns;
+            if (!WriteCheckpoint(cp, cp.pending, stats)) {
+                debug_printf("[receiver]: failed to write the checkpoint [%s], going on without\n", cp.filename);
+                io::CloseSideFile(cp.file);
+                cp.open = false;
+            }
+        }
+
+        // Once every block is in the checkpoint goes. Otherwise, if every block in bitmap is in the file,
+        // it is brought up to date so the next try starts from there.
+        void CloseCheckpoint(Checkpoint& cp, Bitmap& bitmap, bool in_file, TransferStats& stats) {
+            if (cp.open) {
+                bool complete = bitmap.count.load() == bitmap.Size();
+                if (!complete && in_file) CopyChangedChunks(cp, bitmap);
+                if (!complete && in_file && !WriteCheckpoint(cp, bitmap.bitmap, stats)) {
+                    debug_printf("[receiver]: failed to write the checkpoint [%s]\n", cp.filename);
+                }
+                io::CloseSideFile(cp.file);
+                if (complete) remove(cp.filename);
+            }
+            delete[] cp.pending;
+            delete[] cp.chunks;
+            cp.pending = nullptr;
+            cp.chunks = nullptr;
+            cp.open = false;
+        }
+
+        // Shared port
+        // --> A daemon with DaemonOptions::shared_port takes every session's packets on one udp socket,
+        //     instead of a range of ports per session, so only one port has to be open to it.
+        // --> One demux thread reads the socket and sorts datagrams by the session in their header, see
+        //     "Sessions", then by lane, into an inbox per lane, and rings the lane's doorbell. The lane
+        //     takes its packets from there as it would from its own socket, at the cost of one more copy.
+        // --> Datagrams of no session, too short, or for no lane are stray and are dropped. So are stale
+        //     ones, from an earlier round of their session, and ones whose inbox is full, which are lost
+        //     and sent again like any other. A session's inboxes hold what its sockets would have.
+        // --> A session only joins once it has agreed to FEATURE_SESSION, and leaves before its inboxes go.
+        //     The demux could be half way through a datagram for it, so leaving waits a pass of the demux.
+        //     So does the end of every round, so nothing that arrived in time is left unsorted and goes stale.
+        // --> The shared socket's buffer is split between the sessions open when one joins, and the share
+        //     is what the session advertises to its sender.
+        // --> Receive offload isn't used on the shared socket, since a merged datagram could hold packets
+        //     of more than one lane.
+
+        struct Demux;
+
+        // Where one session's packets go
+        struct DemuxRoute {
+            Demux* demux = nullptr;
+            std::atomic<uint32_t> session_id{ 0 }; // 0 while the route is closed
+            std::atomic<uint32_t> epoch{ 0 }; // the session's round, older packets are stale
+            uint32_t num_lanes = 0;
+            uint64_t lane_ends[MAX_LANES]; // lane l takes blocks before lane_ends[l]
+            io::BlockRing inboxes[MAX_LANES]; // datagrams for each lane, with their length as the id
+            sk::Doorbell doorbells[MAX_LANES];
+            uint32_t rung = 0; // lanes to ring at the end of the demux's batch. Only the demux touches it
+            bool open = false; // only the session touches it
+            bool counted = false; // in the demux's open_routes
+        };
+
+        struct Demux {
+            sk::SocketHandle socket = sk::SK_INVALID_SOCKET;
+            sk::Poller poller;
+            sk::DatagramBatch batch;
+            char* buffers = nullptr; // a datagram's worth for every slot of the batch
+            DemuxRoute* routes = nullptr; // one per daemon slot
+            uint32_t num_routes = 0;
+            uint32_t socket_buffer_size = 0; // what the shared socket ended up with
+            std::atomic<uint32_t> open_routes{ 0 }; // sessions sharing it right now
+            uint32_t* touched = nullptr; // routes with lanes to ring
+            sk::Doorbell kick; // sends the demux round its loop without waiting for a datagram
+            th::ThreadHandle thread;
+            bool started = false;
+            std::atomic<bool> stop{ false };
+            std::atomic<bool> running{ false }; // false once the thread has given up or been stopped
+            std::atomic<uint64_t> requests{ 0 }; // sessions waiting for the demux to catch up, see WaitDemuxPass
+            std::atomic<uint64_t> served{ 0 }; // the requests it had seen when it last read a socket buffer's worth, or found it empty
+            uint64_t datagrams = 0;
+            uint64_t stray_datagrams = 0;
+            uint64_t stale_datagrams = 0;
+            uint64_t overflow_datagrams = 0;
+        };
+
+        // The lane a packet belongs to, or num_lanes if none
+        uint32_t RouteLane(const DemuxRoute& route, uint64_t id) {
+            uint64_t block = IsParityId(id) ? ParityGroupFirst(id) : id;
+            for (uint32_t lane = 0; lane < route.num_lanes; lane++) {
+                if (block < route.lane_ends[lane]) return lane;
+            }
+            return route.num_lanes;
+        }
+
+        // Sets up the inboxes for a session that agreed to the lanes in info, and starts taking its packets.
+        // Each inbox holds a socket buffer's worth. Returns the bytes a lane can have on its way, which the
+        // shared socket can also hold for all of them, or 0 if it couldn't be set up.
+        uint32_t OpenRoute(DemuxRoute& route, const TransmissionInfo& info, const ReceiveOptions& options) {
+            uint32_t capacity = (uint32_t)options.socket_buffer_size / info.packet_size;
+            if (capacity < (uint32_t)options.batch_depth) capacity = options.batch_depth;
+
+            route.num_lanes = 0;
+            route.epoch.store(0);
+            for (uint32_t lane = 0; lane < info.num_lanes; lane++) {
+                if (!io::CreateBlockRing(route.inboxes[lane], capacity, info.packet_size)) break;
+                if (!sk::CreateDoorbell(route.doorbells[lane])) {
+                    io::DestroyBlockRing(route.inboxes[lane]);
+                    break;
+                }
+                uint64_t first;
+                LaneRange(info, lane, first, route.lane_ends[lane]);
+                route.num_lanes++;
+            }
+            route.open = true;
+            if (route.num_lanes < info.num_lanes) return 0;
+            route.counted = true;
+
+            route.session_id.store(info.session_id);
+            uint32_t sharing = route.demux->open_routes.fetch_add(1) + 1;
+            uint32_t shared = route.demux->socket_buffer_size / sharing / route.num_lanes;
+            return capacity * info.packet_size < shared ? capacity * info.packet_size : shared;
+        }
+
+        // Returns once the demux has sorted everything that was in the shared socket when it was called,
+        // and is done with any route it had looked up before then
+        void WaitDemuxPass(Demux& demux) {
+            uint64_t request = demux.requests.fetch_add(1) + 1;
+            sk::RingDoorbell(demux.kick);
+            while (demux.served.load() < request && demux.running.load()) SleepNs(DEMUX_WAIT_NS);
+        }
+
+        // Stops taking the session's packets and frees its inboxes. Safe to call more than once.
+        void CloseRoute(DemuxRoute& route) {
+            if (!route.open) return;
+            route.session_id.store(0);
+            WaitDemuxPass(*route.demux);
+
+            for (uint32_t lane = 0; lane < route.num_lanes; lane++) {
+                io::DestroyBlockRing(route.inboxes[lane]);
+                sk::DestroyDoorbell(route.doorbells[lane]);
+            }
+            if (route.counted) route.demux->open_routes.fetch_sub(1);
+            route.num_lanes = 0;
+            route.open = false;
+            route.counted = false;
+        }
+
+        // Files one datagram from the shared socket into its lane's inbox, or counts why it was dropped
+        void RouteDatagram(Demux& demux, const char* data, int length, uint32_t& num_touched) {
+            PacketHeader header;
+            if (length < (int)SESSION_HEADER_SIZE) {
+                demux.stray_datagrams++;
+                return;
+            }
+            memcpy(&header, data, SESSION_HEADER_SIZE);
+            uint32_t slot = header.session & (MAX_SESSIONS - 1);
+            DemuxRoute* route = slot < demux.num_routes ? &demux.routes[slot] : nullptr;
+            if (route == nullptr || header.session == 0 || route->session_id.load() != header.session) {
+                demux.stray_datagrams++;
+                return;
+            }
+            if (header.epoch != route->epoch.load(std::memory_order_relaxed)) {
+                demux.stale_datagrams++;
+                return;
+            }
+            uint32_t lane = RouteLane(*route, header.id);
+            if (lane == route->num_lanes || (uint32_t)length > route->inboxes[lane].slot_size) {
+                demux.stray_datagrams++;
+                return;
+            }
+            io::BlockRing& inbox = route->inboxes[lane];
+            if (io::BlockRingFree(inbox) == 0) {
+                demux.overflow_datagrams++;
+                return;
+            }
+            memcpy(io::BlockRingSlot(inbox, 0), data, length);
+            io::BlockRingId(inbox, 0) = (uint64_t)length;
+            io::BlockRingPush(inbox, 1);
+            demux.datagrams++;
+            if (route->rung == 0) demux.touched[num_touched++] = slot;
+            route->rung |= 1u << lane;
+        }
+
+        void DemuxThread(void* arg) {
+            Demux& demux = *(Demux*)arg;
+
+            while (!demux.stop.load(std::memory_order_relaxed)) {
+
+                sk::SocketHandle ready[2];
+                sk::SocketError result = sk::PollerWait(demux.poller, ready, 2, DAEMON_POLL_MS);
+                if (sk::IsError(result)) {
+                    debug_printf("[receiver]: demux failed to poll the shared port\n");
+                    break;
+                }
+                for (int i = 0; i < result; i++) {
+                    if (ready[i] == sk::DoorbellHandle(demux.kick)) sk::ClearDoorbell(demux.kick);
+                }
+
+                // Edge triggered, so read until it would block. The socket held no more than its buffer
+                // when the sessions that asked before this did, so once that much has been read they
+                // have everything that had arrived by then, even if the socket never runs dry.
+                uint64_t requests = demux.requests.load();
+                uint64_t pass_bytes = 0;
+                while (true) {
+                    sk::ClearBatch(demux.batch);
+                    for (int i = 0; i < demux.batch.depth; i++) {
+                        sk::BatchAppend(demux.batch, demux.buffers + (size_t)i * MAX_DATAGRAM_SIZE, MAX_DATAGRAM_SIZE);
+                    }
+                    result = sk::RecvFromBatch(demux.socket, demux.batch, 0);
+                    if (sk::IsError(result)) {
+                        debug_printf("[receiver]: demux failed to read the shared port\n");
+                        demux.stop.store(true);
+                        break;
+                    }
+                    if (result == 0) break;
+
+                    uint32_t num_touched = 0;
+                    for (int i = 0; i < result; i++) {
+                        RouteDatagram(demux, sk::BatchBuffer(demux.batch, i), sk::BatchLength(demux.batch, i), num_touched);
+                        pass_bytes += sk::BatchLength(demux.batch, i);
+                    }
+                    for (uint32_t t = 0; t < num_touched; t++) {
+                        DemuxRoute& route = demux.routes[demux.touched[t]];
+                        for (uint32_t lane = 0; lane < route.num_lanes; lane++) {
+                            if (route.rung & (1u << lane)) sk::RingDoorbell(route.doorbells[lane]);
+                        }
+                        route.rung = 0;
+                    }
+                    if (pass_bytes >= demux.socket_buffer_size) {
+                        demux.served.store(requests);
+                        requests = demux.requests.load();
+                        pass_bytes = 0;
+                    }
+                }
+                demux.served.store(requests);
+            }
+            demux.running.store(false);
+        }
+
+        // Every route must be closed first
+        void StopDemux(Demux& demux) {
+            if (demux.routes == nullptr) return;
+            demux.stop.store(true);
+            if (demux.started) th::JoinThread(demux.thread);
+            demux.started = false;
+            sk::DestroyDatagramBatch(demux.batch);
+            sk::DestroyPoller(demux.poller);
+            sk::CloseSocket(demux.socket);
+            sk::DestroyDoorbell(demux.kick);
+            delete[] demux.buffers;
+            delete[] demux.routes;
+            delete[] demux.touched;
+            demux.buffers = nullptr;
+            demux.routes = nullptr;
+            demux.touched = nullptr;
+            demux.num_routes = 0;
+            demux.socket = sk::SK_INVALID_SOCKET;
+        }
+
+        // Binds the shared port and starts sorting its datagrams between num_routes sessions
+        bool StartDemux(Demux& demux, int port_num, uint32_t num_routes, int socket_buffer_size, int batch_depth) {
+            if (!sk::CreateDoorbell(demux.kick)) {
+                debug_printf("[receiver]: no doorbells to wake lanes with on this platform\n");
+                return false;
+            }
+
+            demux.socket = sk::CreateUDPSocketReceiver(port_num);
+            if (sk::IsInvalidSocket(demux.socket)) {
+                debug_printf("[receiver]: failed to create the shared udp socket on port [%d]\n", port_num);
+                sk::DestroyDoorbell(demux.kick);
+                return false;
+            }
+            demux.socket_buffer_size = sk::SetReceiveBufferSize(demux.socket, socket_buffer_size);
+            if (!sk::SetBlocking(demux.socket, false) || !sk::CreatePoller(demux.poller) || !sk::PollerAdd(demux.poller, demux.socket, true) ||
+                !sk::PollerAdd(demux.poller, sk::DoorbellHandle(demux.kick), true) || !sk::CreateDatagramBatch(batch_depth, demux.batch, 1)) {
+                sk::DestroyPoller(demux.poller);
+                sk::CloseSocket(demux.socket);
+                sk::DestroyDoorbell(demux.kick);
+                return false;
+            }
+
+            demux.buffers = new char[(size_t)demux.batch.depth * MAX_DATAGRAM_SIZE];
+            demux.routes = new DemuxRoute[num_routes];
+            demux.touched = new uint32_t[num_routes];
+            demux.num_routes = num_routes;
+            for (uint32_t slot = 0; slot < num_routes; slot++) demux.routes[slot].demux = &demux;
+            demux.stop.store(false);
+            demux.running.store(true);
+            demux.started = th::StartThread(demux.thread, DemuxThread, &demux);
+            if (!demux.started) {
+                demux.running.store(false);
+                StopDemux(demux);
+                return false;
+            }
+            return true;
+        }
+
+        bool ReceiveConnections(const char* hostname, const char* port, int port_num, ReceiverSockets& out) {
+
+            sk::SocketHandle& socket_udp = out.socket_udp;
+            sk::SocketHandle& socket_listen = out.socket_listen;
+            sk::SocketHandle& socket_sender = out.socket_sender;
+
+            debug_printf("[receiver]: creating udp socket\n");
+            socket_udp = sk::CreateUDPSocketReceiver(port_num);
+            if (sk::IsInvalidSocket(socket_udp)) { debug_printf("[receiver]: failed to create udp socket\n"); return false; }
+            out.lane_sockets[0] = socket_udp;
+            out.num_lanes = 1;
+
+            debug_printf("[receiver]: creating listen socket\n");
+            socket_listen = rse::sk::CreateListenSocket(hostname, port, true);
+            if (sk::IsInvalidSocket(socket_listen)) {
+                sk::CloseSocket(socket_udp);
+                return false;
+            }
+
+            // Will wait until it connects
+            debug_printf("[receiver]: waiting for connection...\n");
+            socket_sender = sk::AcceptFirstConnectionOnListenSocket(socket_listen);
+
+            return true;
+        }
+
+        void CloseReceiverSockets(ReceiverSockets& sockets) {
+            sk::CloseSocket(sockets.socket_udp);
+            sk::CloseSocket(sockets.socket_listen);
+            sk::CloseSocket(sockets.socket_sender);
+            // lane 0 is socket_udp
+            for (uint32_t lane = 1; lane < sockets.num_lanes; lane++) {
+                sk::CloseSocket(sockets.lane_sockets[lane]);
+            }
+            sockets.num_lanes = 0;
+            if (sockets.route != nullptr) CloseRoute(*sockets.route);
+        }
+
+        // Opens a udp socket for every extra lane the sender asked for, on the ports after port_num,
+        // and sets up every lane's receive buffer. Returns the buffer the smallest lane ended up with.
+        uint32_t OpenReceiverLanes(ReceiverSockets& sockets, int port_num, uint32_t requested_lanes, const ReceiveOptions& options) {
+
+            uint32_t max_lanes = options.max_lanes < MAX_LANES ? options.max_lanes : MAX_LANES;
+            if (requested_lanes > max_lanes) requested_lanes = max_lanes;
+
+            for (uint32_t lane = 1; lane < requested_lanes; lane++) {
+                sk::SocketHandle socket = sk::CreateUDPSocketReceiver(port_num + lane);
+                if (sk::IsInvalidSocket(socket)) {
+                    debug_printf("[receiver]: failed to open lane [%u], using [%u] lanes\n", lane, lane);
+                    break;
+                }
+                sockets.lane_sockets[lane] = socket;
+                sockets.num_lanes = lane + 1;
+            }
+
+            uint32_t receiver_buffer_size = 0;
+            for (uint32_t lane = 0; lane < sockets.num_lanes; lane++) {
+                uint32_t size = sk::SetReceiveBufferSize(sockets.lane_sockets[lane], options.socket_buffer_size);
+                if (lane == 0 || size < receiver_buffer_size) receiver_buffer_size = size;
+            }
+            debug_printf("[receiver]: [%u] lanes with udp receive buffers of [%u]\n", sockets.num_lanes, receiver_buffer_size);
+            return receiver_buffer_size;
+        }
+
+        // What the sender asks for past the version 2 handshake
+        struct HandshakeExtensions {
+            uint32_t requested_lanes = 1;
+            uint32_t features = 0;
+            uint32_t fec_group_size = 0;
+            uint32_t fec_parity = 0;
+            uint64_t resume_token = 0;
+            uint64_t file_size = 0;
+        };
+
+        // Receiver side of the extensions to the handshake: from version 3 4 bytes for the number of lanes
+        // the sender wants, from version 4 4 more for the features it asks for, then 8 more if those include
+        // FEC and 8 more if they include resuming, and from version 7 8 more for the size of the file.
+        // Senders from version 6 send them after our version.
+        bool RecvHandshakeExtensions(sk::SocketHandle socket_sender, uint32_t version, HandshakeExtensions& ext,
+            TransferStats& stats) {
+
+            sk::SocketError result;
+            if (version >= 3) {
+                result = sk::RecvAll(socket_sender, (char*)&ext.requested_lanes, 4, 0);
+                if (sk::IsError(result)) { return false; }
+                stats.control_bytes += 4;
+            }
+            if (version >= 4) {
+                result = sk::RecvAll(socket_sender, (char*)&ext.features, 4, 0);
+                if (sk::IsError(result)) { return false; }
+                stats.control_bytes += 4;
+            }
+            if (ext.features & FEATURE_FEC) {
+                result = sk::RecvAll(socket_sender, (char*)&ext.fec_group_size, 4, 0);
+                if (sk::IsError(result)) { return false; }
+                result = sk::RecvAll(socket_sender, (char*)&ext.fec_parity, 4, 0);
+                if (sk::IsError(result)) { return false; }
+                stats.control_bytes += 4 + 4;
+            }
+            if (ext.features & FEATURE_RESUME) {
+                result = sk::RecvAll(socket_sender, (char*)&ext.resume_token, 8, 0);
+                if (sk::IsError(result)) { return false; }
+                stats.control_bytes += 8;
+            }
+            if (version >= 7) {
+                result = sk::RecvAll(socket_sender, (char*)&ext.file_size, 8, 0);
+                if (sk::IsError(result)) { return false; }
+                stats.control_bytes += 8;
+            }
+            return true;
+        }
+
+        // port_num is where sockets.socket_udp is bound. moved_port says it isn't the port the sender
+        // connected to, which senders before version 5 can't be told.
+        bool ReceiveTransmissionInfoAndReply(ReceiverSockets& sockets, int port_num, const ReceiveOptions& options,
+            TransmissionInfo& info, TransferStats& stats, bool moved_port = false) {
+
+            sk::SocketHandle socket_sender = sockets.socket_sender;
+            sk::SocketError result;
+            info = {};
+
+            // First 4 bytes are the magic, next 4 the newest version the sender speaks.
+            // Then 8 bytes for the number packets and 4 bytes for the size of the packets,
+            // the extensions if the sender is from version 3 to 5, and last the path.
+            uint32_t magic = 0;
+            uint32_t sender_version = 0;
+            HandshakeExtensions ext;
+            if (options.idle_timeout_ms > 0 && !sk::SetReceiveTimeout(socket_sender, options.idle_timeout_ms)) {
+                debug_printf("[receiver]: can't time out the control connection, a silent sender holds it\n");
+            }
+            result = sk::RecvAll(socket_sender, (char*)&magic, 4, 0);
+            if (sk::IsError(result)) { return false; }
+            if (magic != PROTOCOL_MAGIC) {
+                debug_printf("[receiver]: not an rbudp sender, or one older than version 2\n");
+                return false;
+            }
+            result = sk::RecvAll(socket_sender, (char*)&sender_version, 4, 0);
+            if (sk::IsError(result)) { return false; }
+            result = sk::RecvAll(socket_sender, (char*)&info.number_packets, 8, 0);
+            if (sk::IsError(result)) { return false; }
+            result = sk::RecvAll(socket_sender, (char*)&info.block_size, 4, 0);
+            if (sk::IsError(result)) { return false; }
+            stats.control_bytes += 4 + 4 + 8 + 4;
+            if (sender_version >= 3 && sender_version < EXTENSIONS_AFTER_VERSION &&
+                !RecvHandshakeExtensions(socket_sender, sender_version, ext, stats)) {
+                return false;
+            }
+            result = sk::RecvAll(socket_sender, info.path_name, rbudp::PATH_SIZE, 0);
+            if (sk::IsError(result)) { return false; }
+            info.path_name[PATH_SIZE - 1] = '\0';
+            stats.control_bytes += PATH_SIZE;
+
+            uint32_t our_version = options.protocol_version < PROTOCOL_VERSION ? options.protocol_version : PROTOCOL_VERSION;
+            info.protocol_version = sender_version < our_version ? sender_version : our_version;
+
+            // Refuse anything we can't speak or keep track of
+            uint8_t flag = 1;
+            if (info.protocol_version < MIN_PROTOCOL_VERSION) {
+                debug_printf("[receiver]: sender version [%u] is too old\n", sender_version);
+                flag = 0;
+            }
+            if (info.number_packets > options.max_blocks) {
+                debug_printf("[receiver]: [%llu] blocks is more than the [%llu] we take\n",
+                    (unsigned long long)info.number_packets, (unsigned long long)options.max_blocks);
+                flag = 0;
+            }
+
+            // From version 6 the sender only sends its extensions once it knows we will read them.
+            // Ones we don't speak were never read, so a sender newer than us is asked for none of them.
+            if (info.protocol_version >= EXTENSIONS_AFTER_VERSION) {
+                result = sk::Send(socket_sender, (char*)&flag, sizeof(flag), 0);
+                if (sk::IsError(result)) return false;
+                result = sk::Send(socket_sender, (char*)&info.protocol_version, 4, 0);
+                if (sk::IsError(result)) return false;
+                stats.control_bytes += sizeof(flag) + 4;
+                if (flag == 0) return false;
+                if (!RecvHandshakeExtensions(socket_sender, info.protocol_version, ext, stats)) return false;
+            }
+            else if (info.protocol_version < 4) {
+                ext.features = 0;
+                if (info.protocol_version < 3) ext.requested_lanes = 1;
+            }
+
+            // Agree to whatever we know and are allowed to do
+            uint32_t features = ext.features;
+            uint32_t allowed = 0;
+            if (options.nack_interval_ms > 0) allowed |= FEATURE_PIPELINED;
+            if (options.checksum) allowed |= FEATURE_CHECKSUM;
+            if (options.fec && info.number_packets < FEC_MAX_BLOCKS && ext.fec_group_size >= 1 && ext.fec_group_size <= fec::MAX_GROUP_SIZE &&
+                ext.fec_parity >= 1 && ext.fec_parity <= fec::MAX_PARITY) allowed |= FEATURE_FEC;
+            if (options.delta) allowed |= FEATURE_DELTA;
+            if (options.zero_blocks) allowed |= FEATURE_ZERO_BLOCKS;
+            if (options.compression) allowed |= FEATURE_COMPRESSION;
+            if (options.sessions) allowed |= FEATURE_SESSION;
+            if (options.resume) allowed |= FEATURE_RESUME;
+            features &= allowed;
+            info.pipelined = (features & FEATURE_PIPELINED) != 0;
+            info.checksum = (features & FEATURE_CHECKSUM) != 0;
+            info.delta = (features & FEATURE_DELTA) != 0;
+            info.zero_blocks = (features & FEATURE_ZERO_BLOCKS) != 0;
+            info.compression = (features & FEATURE_COMPRESSION) != 0;
+            info.sessions = (features & FEATURE_SESSION) != 0;
+            info.resume = (features & FEATURE_RESUME) != 0;
+            if (info.resume) info.resume_token = ext.resume_token;
+            if (features & FEATURE_FEC) {
+                info.fec_group_size = ext.fec_group_size;
+                info.fec_parity = ext.fec_parity;
+            }
+            info.header_size = HeaderSize(info);
+
+            // Refuse what we can't do with what was agreed, or that would overflow the file size
+            if (info.protocol_version < 5 && moved_port) {
+                debug_printf("[receiver]: sender version [%u] can't be told its udp port\n", sender_version);
+                flag = 0;
+            }
+            if (sockets.route != nullptr && !info.sessions) {
+                debug_printf("[receiver]: sender has to stamp its packets with the session to share the port\n");
+                flag = 0;
+            }
+            if (info.number_packets == 0 || info.block_size == 0 ||
+                info.block_size > MAX_DATAGRAM_SIZE - info.header_size ||
+                info.number_packets > UINT64_MAX / info.block_size ||
+                (info.protocol_version >= 7 && BlockCount(ext.file_size, info.block_size) != info.number_packets)) {
+                debug_printf("[receiver]: bad transmission info\n");
+                flag = 0;
+            }
+
+            info.bitmap_size = (info.number_packets / 8) + 1;
+            info.packet_size = info.block_size + info.header_size;
+            info.total_transmission_size = info.number_packets * info.block_size;
+            info.summation_block_size = info.block_size * info.number_packets;
+            info.file_size = info.protocol_version >= 7 ? ext.file_size : info.summation_block_size;
+            info.max_packets_per_transmission = ASSUMED_PORT_SIZE / info.packet_size;
+            info.session_id = sockets.session_id != 0 ? sockets.session_id : NewSessionId(0);
+            info.shared_port = sockets.route != nullptr;
+            info.data_port = port_num;
+            if (sockets.route == nullptr) {
+                info.receiver_buffer_size = OpenReceiverLanes(sockets, port_num, ext.requested_lanes, options);
+                info.num_lanes = sockets.num_lanes;
+            }
+            else {
+                uint32_t max_lanes = options.max_lanes < MAX_LANES ? options.max_lanes : MAX_LANES;
+                info.num_lanes = ext.requested_lanes < max_lanes ? ext.requested_lanes : max_lanes;
+                if (info.num_lanes < 1) info.num_lanes = 1;
+                if (flag == 1) info.receiver_buffer_size = OpenRoute(*sockets.route, info, options);
+                if (info.receiver_buffer_size == 0) flag = 0;
+            }
+
+            debug_printf("[receiver]: transmission info [%llu][%u][%s]\n", (unsigned long long)info.number_packets, info.block_size, info.path_name);
+
+            // Send a reply saying whether to start transmission, the version we agreed on (from version 6
+            // already sent, followed by the flag again now that we know the rest), how much our udp sockets
+            // can buffer, from version 3 how many lanes we opened, from version 4 the features we agreed to
+            // and from version 5 the port of the first lane, then the session id and whether the lanes share
+            // a port if we agreed to stamp packets with it
+            debug_printf("[receiver]: sending reply to start transmission\n");
+            result = sk::Send(socket_sender, (char*)&flag, sizeof(flag), 0);
+            if (sk::IsError(result)) return false;
+            stats.control_bytes += sizeof(flag);
+            if (info.protocol_version < EXTENSIONS_AFTER_VERSION) {
+                result = sk::Send(socket_sender, (char*)&info.protocol_version, 4, 0);
+                if (sk::IsError(result)) return false;
+                stats.control_bytes += 4;
+            }
+            result = sk::Send(socket_sender, (char*)&info.receiver_buffer_size, 4, 0);
+            if (sk::IsError(result)) return false;
+            stats.control_bytes += 4;
+            if (info.protocol_version >= 3) {
+                result = sk::Send(socket_sender, (char*)&info.num_lanes, 4, 0);
+                if (sk::IsError(result)) return false;
+                stats.control_bytes += 4;
+            }
+            if (info.protocol_version >= 4) {
+                result = sk::Send(socket_sender, (char*)&features, 4, 0);
+                if (sk::IsError(result)) return false;
+                stats.control_bytes += 4;
+            }
+            if (info.protocol_version >= 5) {
+                result = sk::Send(socket_sender, (char*)&info.data_port, 4, 0);
+                if (sk::IsError(result)) return false;
+                stats.control_bytes += 4;
+            }
+            if (info.sessions) {
+                uint32_t shared_port = info.shared_port ? 1 : 0;
+                result = sk::Send(socket_sender, (char*)&info.session_id, 4, 0);
+                if (sk::IsError(result)) return false;
+                result = sk::Send(socket_sender, (char*)&shared_port, 4, 0);
+                if (sk::IsError(result)) return false;
+                stats.control_bytes += 4 + 4;
+            }
+
+            return flag == 1;
+        }
+
+        // Guesses which blocks the sender will send next. SendPackets walks the bitmap in order,
+        // so that is the missing blocks from `from` up to `end`. With FEC, groups we haven't had parity
+        // for yet are followed by no_guess once per parity block. Returns the number of guesses made.
+        int GuessNextBlocks(Bitmap& bitmap, uint64_t from, uint64_t end, uint64_t* guesses, int max_guesses,
+            const FecDecoder& fec, uint64_t no_guess) {
+            int num_guesses = 0;
+            for (size_t i = bitmap.FindNextClear(from); i < end && num_guesses < max_guesses; i = bitmap.FindNextClear(i + 1)) {
+                guesses[num_guesses++] = i;
+                if (fec.groups.group_size == 0 || i + 1 <= fec.parity_to || i + 1 != GroupEnd(fec.groups, GroupFirst(fec.groups, i))) continue;
+                for (uint32_t row = 0; row < fec.groups.parity && num_guesses < max_guesses; row++) guesses[num_guesses++] = no_guess;
+            }
+            return num_guesses;
+        }
+
+        // A datagram the demux has already read into a buffer of its own
+        struct InboxDatagram {
+            char* data;
+            int length;
+        };
+
+        // One lane of the receiver. Every round it drains its own socket into its own range of blocks.
+        struct ReceiveLane {
+            const TransmissionInfo* handshake = nullptr;
+            Bitmap* bitmap = nullptr; // shared by every lane
+            sk::SocketHandle socket = sk::SK_INVALID_SOCKET;
+            sk::SocketHandle wake_handle = sk::SK_INVALID_SOCKET; // what the event loop waits on for this lane
+            uint64_t first_block = 0; // the lane carries blocks [first_block, end_block)
+            uint64_t end_block = 0;
+            int packets_per_datagram = 1;
+            int num_slots = 0;
+            sk::Uring ring; // only active when receiving through io_uring
+            InboxDatagram* received = nullptr; // on a shared port, the datagrams taken from the inbox
+            io::BlockRing* queue = nullptr; // with ReceiveSink::WRITER, blocks waiting for the writer thread
+            uint64_t sink_stalls = 0;
+            sk::DatagramBatch batch;
+            PacketHeader* headers = nullptr;
+            char** landings = nullptr; // where each packet's payload was received to
+            uint64_t* guesses = nullptr;
+            char* spill = nullptr; // for packets with no guess, and wrong guesses
+            io::WindowedMap memmap;
+            uint64_t first_missing = 0; // every block of the lane before this has been received
+            uint64_t next_guess = 0; // where the sender should be up to in this round's blast
+            uint64_t high_water = 0; // one past the newest block received this round
+            uint64_t nack_from = 0; // gaps before this have been NACKed this round
+            uint64_t misplaced_blocks = 0;
+            uint64_t duplicate_blocks = 0;
+            uint32_t* block_crcs = nullptr; // with checksums, the CRC of every block received. Shared by every lane
+            uint64_t corrupt_blocks = 0;
+            uint32_t zero_crc = 0; // with checksums and zero blocks, the CRC of a block of zeros
+            uint64_t stale_end = 0; // blocks before this may still hold an older copy's data, so zero blocks there are written
+            Bitmap* holes = nullptr; // with the map, the zero blocks to punch out of the file once it is complete. Shared by every lane
+            uint64_t zero_blocks = 0;
+            char* unpacked = nullptr; // with compression, a block to decompress through
+            uint64_t compressed_blocks = 0;
+            uint64_t compressed_bytes = 0;
+            uint64_t codec_ns = 0;
+            uint32_t epoch = 0; // with sessions, the round packets have to be from
+            uint64_t stale_packets = 0;
+            uint64_t bad_packets = 0;
+            io::BlockRing* inbox = nullptr; // on a shared port, where the demux puts the lane's datagrams
+            sk::Doorbell* doorbell = nullptr; // and how it says there are some
+            FecDecoder fec;
+            LaneStats stats;
+            bool ok = true; // false once a round has failed
+            bool drain = false; // whether the lane's worker drains it next time the workers run
+        };
+
+        // With a route the lane has no socket of its own and takes its datagrams from the route's inbox
+        bool CreateReceiveLane(ReceiveLane& lane, const TransmissionInfo& handshake, const ReceiveOptions& options,
+            Bitmap& bitmap, sk::SocketHandle socket, uint32_t lane_index, io::MemMapIO map_io, io::BlockRing* queue, uint32_t* block_crcs,
+            DemuxRoute* route = nullptr) {
+
+            lane.handshake = &handshake;
+            lane.bitmap = &bitmap;
+            lane.socket = socket;
+            LaneRange(handshake, lane_index, lane.first_block, lane.end_block);
+            lane.first_missing = lane.first_block;
+            lane.next_guess = lane.first_block;
+            lane.nack_from = lane.first_block;
+            lane.queue = queue;
+            lane.block_crcs = block_crcs;
+            if (handshake.checksum && handshake.zero_blocks) lane.zero_crc = ZeroBlockCrc(handshake.block_size);
+            if (handshake.compression) lane.unpacked = new char[handshake.block_size];
+            CreateFecDecoder(lane.fec, handshake, lane.first_block, lane.end_block);
+
+            // The event loop is edge triggered, so the socket is read until it would block
+            if (route == nullptr && !sk::SetBlocking(socket, false)) {
+                return false;
+            }
+
+            // Create the file, or open the one the first lane created, and map it a window at a time.
+            // With a writer thread the file is its business.
+            if (queue == nullptr && !io::OpenWindowedMap(handshake.path_name, handshake.summation_block_size, map_io, options.map_window_size, lane.memmap)) {
+                debug_printf("failed to memory map path [%s]\n", handshake.path_name);
+                return false;
+            }
+
+            // The demux has already read the datagrams, so they are copied out of the inbox
+            if (route != nullptr) {
+                lane.inbox = &route->inboxes[lane_index];
+                lane.doorbell = &route->doorbells[lane_index];
+                lane.wake_handle = sk::DoorbellHandle(*lane.doorbell);
+                lane.num_slots = options.batch_depth;
+                lane.received = new InboxDatagram[lane.num_slots];
+                return true;
+            }
+
+            // With receive offload the kernel can hand us many packets back to back in one datagram,
+            // so every datagram in the batch gets room for as many packets as one can hold.
+            if (options.receive_offload && sk::EnableReceiveOffload(socket)) {
+                lane.packets_per_datagram = (MAX_DATAGRAM_SIZE + handshake.packet_size - 1) / handshake.packet_size;
+                if (lane.packets_per_datagram > sk::SK_MAX_GSO_SEGMENTS) lane.packets_per_datagram = sk::SK_MAX_GSO_SEGMENTS;
+            }
+
+            lane.wake_handle = socket;
+            if (!sk::CreateDatagramBatch(options.batch_depth, lane.batch, 2 * lane.packets_per_datagram)) {
+                io::CloseWindowedMap(lane.memmap);
+                return false;
+            }
+            lane.num_slots = lane.batch.depth * lane.packets_per_datagram;
+
+            // With io_uring the batch goes in as one chain of receives instead of a recvmmsg, scattered the same way
+            if (options.uring && !sk::CreateUring(lane.ring, lane.batch.depth, lane.batch.depth, false)) {
+                debug_printf("[receiver]: io_uring not available, using recvmmsg\n");
+                sk::DestroyUring(lane.ring);
+            }
+
+            // Each packet is scattered so its header lands in a small buffer and its payload lands
+            // straight in the memory map, at the block we guess the sender will send next. A wrong
+            // guess costs one copy and nothing else, since the guessed block had not arrived yet.
+            lane.headers = new PacketHeader[lane.num_slots];
+            lane.landings = new char*[lane.num_slots];
+            lane.guesses = new uint64_t[lane.num_slots];
+            if (queue == nullptr) lane.spill = new char[(size_t)handshake.block_size * lane.num_slots];
+            return true;
+        }
+
+        void DestroyReceiveLane(ReceiveLane& lane) {
+            lane.stats.datagram_syscalls += lane.batch.syscalls;
+            lane.stats.map_remaps += lane.memmap.remaps;
+            sk::DestroyDatagramBatch(lane.batch);
+            sk::DestroyUring(lane.ring);
+            delete[] lane.received;
+            delete[] lane.headers;
+            delete[] lane.landings;
+            delete[] lane.guesses;
+            delete[] lane.spill;
+            delete[] lane.unpacked;
+            lane.headers = nullptr;
+            lane.landings = nullptr;
+            lane.guesses = nullptr;
+            lane.spill = nullptr;
+            lane.received = nullptr;
+            lane.unpacked = nullptr;
+            DestroyFecDecoder(lane.fec);
+            io::CloseWindowedMap(lane.memmap);
+        }
+
+        // Whether a packet belongs to the lane, as a block or as parity for one of its groups. Nothing a bad
+        // id is used for then reaches past the lane's words of the bitmap.
+        bool IdInLane(const ReceiveLane& lane, uint64_t id) {
+            if (!IsParityId(id)) return id >= lane.first_block && id < lane.end_block;
+            const FecGroups& groups = lane.fec.groups;
+            uint64_t group_first = ParityGroupFirst(id);
+            return groups.group_size > 0 && ParityRow(id) < groups.parity &&
+                group_first >= lane.first_block && group_first < lane.end_block &&
+                (group_first - lane.first_block) % groups.group_size == 0;
+        }
+
+        // Whether a packet is from this session and round, see "Sessions". Without sessions they all are.
+        bool IsCurrentPacket(const ReceiveLane& lane, const PacketHeader& header) {
+            return !lane.handshake->sessions || (header.session == lane.handshake->session_id && header.epoch == lane.epoch);
+        }
+
+        // Rebuilds the missing blocks of every group that has enough parity for them, straight into the
+        // map or the writer's ring. A group the ring has no room for yet waits for the next call.
+        bool RebuildFecGroups(ReceiveLane& lane) {
+            FecDecoder& decoder = lane.fec;
+            if (!decoder.ready) return true;
+            decoder.ready = false;
+
+            const TransmissionInfo& handshake = *lane.handshake;
+            Bitmap& packet_bitmap = *lane.bitmap;
+            const uint32_t block_size = handshake.block_size;
+            for (uint32_t slot = 0; slot < FEC_OPEN_GROUPS; slot++) {
+                FecGroup& group = decoder.open[slot];
+                if (group.first == UINT64_MAX) continue;
+                uint32_t missing = group.size - group.received;
+                if ((uint32_t)PopCount64(group.parity_rows) < missing) continue;
+
+                uint64_t lost[fec::MAX_PARITY];
+                uint32_t rows[fec::MAX_PARITY];
+                uint32_t num_lost = 0;
+                for (uint64_t id = packet_bitmap.FindNextClear(group.first); id < group.first + group.size && num_lost < missing; id = packet_bitmap.FindNextClear(id + 1)) {
+                    lost[num_lost++] = id;
+                }
+                uint32_t num_rows = 0;
+                for (uint32_t row = 0; num_rows < missing; row++) {
+                    if (group.parity_rows & (1u << row)) rows[num_rows++] = row;
+                }
+
+                // syndrome[r] = sum over c of Coefficient(rows[r], lost[c]), so the blocks are the inverse times the syndromes
+                uint8_t matrix[fec::MAX_PARITY * fec::MAX_PARITY];
+                for (uint32_t r = 0; r < missing; r++) {
+                    for (uint32_t c = 0; c < missing; c++) matrix[r * missing + c] = fec::Coefficient(rows[r], (uint32_t)(lost[c] - group.first));
+                }
+                if (num_lost != missing || !fec::Invert(matrix, (int)missing)) {
+                    group.first = UINT64_MAX;
+                    continue;
+                }
+                if (lane.queue != nullptr && io::BlockRingFree(*lane.queue) < missing) {
+                    decoder.ready = true;
+                    continue;
+                }
+
+                for (uint32_t c = 0; c < missing; c++) {
+                    uint8_t* block = nullptr;
+                    if (lane.queue != nullptr) {
+                        block = (uint8_t*)io::BlockRingSlot(*lane.queue, c);
+                        io::BlockRingId(*lane.queue, c) = lost[c];
+                    }
+                    else {
+                        block = (uint8_t*)io::MapRange(lane.memmap, lost[c] * block_size, block_size);
+                        if (block == nullptr) {
+                            debug_printf("[receiver]: failed to map block [%llu]\n", (unsigned long long)lost[c]);
+                            return false;
+                        }
+                    }
+                    memset(block, 0, block_size);
+                    for (uint32_t r = 0; r < missing; r++) {
+                        fec::MulAddRegion(block, Syndrome(decoder, slot, rows[r]), matrix[c * missing + r], block_size);
+                    }
+                    if (lane.block_crcs != nullptr) lane.block_crcs[lost[c]] = Crc32c(0, block, block_size);
+                    packet_bitmap.Set(lost[c]);
+                }
+                if (lane.queue != nullptr) io::BlockRingPush(*lane.queue, missing);
+                decoder.rebuilt_blocks += missing;
+                group.first = UINT64_MAX;
+            }
+            return true;
+        }
+
+        // Decompresses the payload that landed at landing over itself, and from then on it is a whole block
+        bool UnpackLanding(ReceiveLane& lane, char* landing, int& payload_size) {
+            const uint32_t block_size = lane.handshake->block_size;
+            memcpy(lane.unpacked, landing, payload_size);
+            if (!UnpackBlock(lane.unpacked, payload_size, landing, block_size, lane.codec_ns)) return false;
+            lane.compressed_blocks++;
+            lane.compressed_bytes += payload_size;
+            payload_size = block_size;
+            return true;
+        }
+
+        // Takes count datagrams that are each in a buffer of their own, from a shared port's inbox. Their
+        // payloads are copied to the map or the writer's ring, so the buffers can go straight back.
+        bool ReceiveDatagrams(ReceiveLane& lane, const InboxDatagram* received, int count) {
+
+            const TransmissionInfo& handshake = *lane.handshake;
+            Bitmap& packet_bitmap = *lane.bitmap;
+
+            // With receive offload a datagram can hold many packets back to back
+            int num_received = 0;
+            int num_zero = 0;
+            uint64_t payload_bytes = 0;
+            uint32_t queued = 0;
+            uint32_t queue_free = lane.queue != nullptr ? io::BlockRingFree(*lane.queue) : 0;
+            for (int i = 0; i < count; i++) {
+                const char* data = received[i].data;
+                int length = received[i].length;
+                payload_bytes += length - (length + handshake.packet_size - 1) / handshake.packet_size * handshake.header_size;
+                for (int offset = 0; offset + (int)handshake.header_size <= length; offset += handshake.packet_size) {
+
+                    PacketHeader header;
+                    memcpy(&header, data + offset, handshake.header_size);
+                    uint64_t id = header.id;
+                    if (!IsCurrentPacket(lane, header)) {
+                        lane.stale_packets++;
+                        continue;
+                    }
+                    if (!IdInLane(lane, id)) {
+                        debug_printf("[receiver]: dropped a packet for block [%llu]\n", (unsigned long long)id);
+                        lane.bad_packets++;
+                        continue;
+                    }
+                    num_received++;
+                    if (IsParityId(id)) {
+                        const char* parity = data + offset + handshake.header_size;
+                        int parity_size = length - offset - handshake.header_size;
+                        if (parity_size > (int)handshake.block_size) parity_size = handshake.block_size;
+                        if (handshake.checksum && !CheckBlock(header, parity, parity_size, handshake.block_size, nullptr)) lane.corrupt_blocks++;
+                        else AddFecParity(lane.fec, packet_bitmap, id, parity, parity_size);
+                        continue;
+                    }
+                    if (packet_bitmap[id]) {
+                        lane.duplicate_blocks++;
+                        continue;
+                    }
+
+                    const char* payload = data + offset + handshake.header_size;
+                    int payload_size = length - offset - handshake.header_size;
+                    if (payload_size > (int)handshake.block_size) payload_size = handshake.block_size;
+                    bool zero_block = handshake.zero_blocks && payload_size == 0;
+                    if (handshake.compression && header.codec == CODEC_LZ) {
+                        if (!UnpackBlock(payload, payload_size, lane.unpacked, handshake.block_size, lane.codec_ns)) {
+                            lane.corrupt_blocks++;
+                            continue;
+                        }
+                        lane.compressed_blocks++;
+                        lane.compressed_bytes += payload_size;
+                        payload = lane.unpacked;
+                        payload_size = handshake.block_size;
+                    }
+                    if (handshake.checksum && !(zero_block ? CheckZeroBlock(header, lane.zero_crc, lane.block_crcs) :
+                        CheckBlock(header, payload, payload_size, handshake.block_size, lane.block_crcs))) {
+                        lane.corrupt_blocks++;
+                        continue;
+                    }
+                    // The datagram has already left the socket, so with the writer behind it
+                    // is dropped and sent again next round
+                    bool hole = zero_block && id >= lane.stale_end;
+                    if (lane.queue != nullptr && !hole && queued == queue_free) {
+                        lane.sink_stalls++;
+                        continue;
+                    }
+                    AddFecBlock(lane.fec, packet_bitmap, id, payload, payload_size);
+                    if (zero_block) num_zero++;
+                    if (hole && lane.holes != nullptr) lane.holes->Set(id);
+                    // A zero block left as a hole has nothing to write
+                    if (lane.queue != nullptr && !hole) {
+                        char* slot = io::BlockRingSlot(*lane.queue, queued);
+                        memcpy(slot, payload, payload_size);
+                        memset(slot + payload_size, 0, handshake.block_size - payload_size);
+                        io::BlockRingId(*lane.queue, queued++) = id;
+                    }
+                    else if (lane.queue == nullptr && !hole) {
+                        char* mem_ptr = io::MapRange(lane.memmap, id * handshake.block_size, handshake.block_size);
+                        if (mem_ptr == nullptr) {
+                            debug_printf("[receiver]: failed to map block [%llu]\n", (unsigned long long)id);
+                            return false;
+                        }
+                        memcpy(mem_ptr, payload, payload_size);
+                        memset(mem_ptr + payload_size, 0, handshake.block_size - payload_size);
+                    }
+                    packet_bitmap.Set(id);
+                    if (id >= lane.high_water) lane.high_water = id + 1;
+
+                    debug_printf("[receiver]: read packet [%llu]\n", (unsigned long long)id);
+                }
+            }
+            if (queued > 0) io::BlockRingPush(*lane.queue, queued);
+            if (!RebuildFecGroups(lane)) return false;
+
+            lane.first_missing = packet_bitmap.FindNextClear(lane.first_missing);
+
+            lane.zero_blocks += num_zero;
+            lane.stats.datagrams += num_received;
+            lane.stats.bytes += payload_bytes;
+            return true;
+        }
+
+        // DrainLane for a lane on a shared port. The demux has put its datagrams in the inbox.
+        bool DrainLaneInbox(ReceiveLane& lane) {
+
+            io::BlockRing& inbox = *lane.inbox;
+            uint64_t start_ns = NowNs();
+            sk::ClearDoorbell(*lane.doorbell);
+
+            while (true) {
+                uint32_t count = io::BlockRingFilled(inbox);
+                if (count == 0) break;
+                if (count > (uint32_t)lane.num_slots) count = lane.num_slots;
+                for (uint32_t i = 0; i < count; i++) {
+                    lane.received[i].data = io::BlockRingHeadSlot(inbox, i);
+                    lane.received[i].length = (int)io::BlockRingHeadId(inbox, i);
+                }
+                bool ok = ReceiveDatagrams(lane, lane.received, (int)count);
+                io::BlockRingPop(inbox, count);
+                if (!ok) return false;
+            }
+
+            lane.stats.seconds += (NowNs() - start_ns) / 1e9;
+            return true;
+        }
+
+        // Drains the lane's udp socket a batch at a time until it is empty. Called whenever the
+        // socket becomes readable during a blast and once more after the sender says it is over.
+        bool DrainLane(ReceiveLane& lane) {
+
+            if (lane.inbox != nullptr) return DrainLaneInbox(lane);
+
+            sk::SocketError result;
+            const TransmissionInfo& handshake = *lane.handshake;
+            Bitmap& packet_bitmap = *lane.bitmap;
+            sk::DatagramBatch& batch = lane.batch;
+            PacketHeader* headers = lane.headers;
+            char** landings = lane.landings;
+            uint64_t* guesses = lane.guesses;
+            char* spill = lane.spill;
+            int packets_per_datagram = lane.packets_per_datagram;
+            int num_slots = lane.num_slots;
+            uint64_t start_ns = NowNs();
+            uint64_t& next_guess = lane.next_guess;
+
+            while (true) {
+
+                int num_guesses = 0;
+                int slots = num_slots;
+                if (lane.queue != nullptr) {
+                    // Payloads land straight in the writer's ring, in as much of it as is free. When
+                    // there is none the rest stays in the socket until the writer catches up.
+                    uint32_t queue_free = io::BlockRingFree(*lane.queue);
+                    if (queue_free < (uint32_t)slots) slots = (int)queue_free;
+                    slots -= slots % packets_per_datagram;
+                    if (slots == 0) {
+                        lane.sink_stalls++;
+                        break;
+                    }
+                }
+                else {
+                    // A zero or compressed block ends its datagram early, which throws the guesses after it off
+                    // by the rest of the datagram. Packets landing on the wrong blocks would fill holes and cost
+                    // copies, so with coalesced datagrams only the first is received in place.
+                    bool short_packets = handshake.zero_blocks || handshake.compression;
+                    int guess_slots = short_packets && packets_per_datagram > 1 ? packets_per_datagram : num_slots;
+                    num_guesses = GuessNextBlocks(packet_bitmap, next_guess, lane.end_block, guesses, guess_slots, lane.fec, handshake.number_packets);
+                }
+
+                // Only guesses inside one window of the file can be received in place.
+                // Where parity is expected there is no guess and it goes to the spill buffer.
+                if (num_guesses > 0) {
+                    if (io::MapRange(lane.memmap, guesses[0] * handshake.block_size, handshake.block_size) == nullptr) {
+                        debug_printf("[receiver]: failed to map block [%llu]\n", (unsigned long long)guesses[0]);
+                        return false;
+                    }
+                    int in_window = 1;
+                    while (in_window < num_guesses && (guesses[in_window] == handshake.number_packets ||
+                        io::InWindow(lane.memmap, guesses[in_window] * handshake.block_size, handshake.block_size))) in_window++;
+                    num_guesses = in_window;
+                }
+
+                sk::ClearBatch(batch);
+                for (int j = 0; j < slots; j++) {
+                    if (j < num_guesses && guesses[j] != handshake.number_packets) landings[j] = io::MapRange(lane.memmap, guesses[j] * handshake.block_size, handshake.block_size);
+                    else if (lane.queue != nullptr) landings[j] = io::BlockRingSlot(*lane.queue, j);
+                    else landings[j] = spill + (size_t)j * handshake.block_size;
+
+                    if (j % packets_per_datagram == 0) sk::BatchStartDatagram(batch);
+                    sk::BatchAppendBuffer(batch, (char*)&headers[j], handshake.header_size);
+                    sk::BatchAppendBuffer(batch, landings[j], handshake.block_size);
+                }
+
+                debug_printf("[receiver]: recvfrom sender\n");
+                result = lane.ring.active ? sk::UringRecvBatch(lane.ring, lane.socket, batch, 0) : sk::RecvFromBatch(lane.socket, batch, 0);
+                if (sk::IsError(result)) {
+                    debug_printf("[receiver]: error reading packet\n");
+                    return false;
+                }
+                if (result == 0) break;
+
+                // Split every datagram back into packets, marking which slots hold one
+                int num_received = 0;
+                uint64_t payload_bytes = 0;
+                for (int i = 0; i < result; i++) {
+
+                    int length = sk::BatchLength(batch, i);
+                    int packets = (length + (int)handshake.packet_size - 1) / (int)handshake.packet_size;
+                    if (packets == 0 || packets > packets_per_datagram) {
+                        lane.bad_packets++;
+                        packets = 0;
+                    }
+                    else payload_bytes += length - packets * handshake.header_size;
+
+                    for (int k = 0; k < packets; k++) {
+                        int j = i * packets_per_datagram + k;
+                        // Packets cut short are dropped like unused slots
+                        if (length - k * (int)handshake.packet_size < (int)handshake.header_size) {
+                            headers[j].id = handshake.number_packets;
+                            lane.bad_packets++;
+                            continue;
+                        }
+
+                        // and so are packets from another session or an earlier round
+                        if (!IsCurrentPacket(lane, headers[j])) {
+                            headers[j].id = handshake.number_packets;
+                            lane.stale_packets++;
+                            continue;
+                        }
+
+                        // and ones for blocks that aren't the lane's. This check ensures that the data we
+                        // access via the bitmap is valid, and that no other lane touches the same words
+                        if (!IdInLane(lane, headers[j].id)) {
+                            debug_printf("[receiver]: dropped a packet for block [%llu]\n", (unsigned long long)headers[j].id);
+                            headers[j].id = handshake.number_packets;
+                            lane.bad_packets++;
+                            continue;
+                        }
+                    }
+
+                    // Unused slots at the end of a datagram are marked so they get skipped
+                    for (int k = packets; k < packets_per_datagram; k++) {
+                        headers[i * packets_per_datagram + k].id = handshake.number_packets;
+                    }
+                    num_received += packets;
+                }
+                int used_slots = result * packets_per_datagram;
+
+                // Payloads that landed on the wrong block are moved out of the way first,
+                // since a wrong guess can sit on top of another packet's real block.
+                // After this every payload not already in place is in the spill buffer,
+                // so the window is free to move.
+                for (int j = 0; j < used_slots; j++) {
+                    if (j >= num_guesses || headers[j].id == guesses[j] || headers[j].id == handshake.number_packets) continue;
+                    char* spill_ptr = spill + (size_t)j * handshake.block_size;
+                    if (landings[j] == spill_ptr) continue;
+                    memcpy(spill_ptr, landings[j], handshake.block_size);
+                    landings[j] = spill_ptr;
+                }
+
+                // Then every payload is looked at while the ones in place are still mapped. Unused slots,
+                // duplicates, blocks that fail their checksum and parity are marked as unused, so the
+                // writer skips them too, as it does zero blocks left as holes. The rest are fed to FEC
+                // and have their bits set.
+                int num_zero = 0;
+                for (int j = 0; j < used_slots; j++) {
+
+                    uint64_t id = headers[j].id;
+                    if (id == handshake.number_packets) {
+                        if (lane.queue != nullptr) io::BlockRingId(*lane.queue, j) = io::BLOCK_RING_SKIP;
+                        continue;
+                    }
+
+                    int i = j / packets_per_datagram;
+                    int offset = (j % packets_per_datagram) * handshake.packet_size + handshake.header_size;
+                    int payload_size = sk::BatchLength(batch, i) - offset;
+                    if (payload_size > (int)handshake.block_size) payload_size = handshake.block_size;
+
+                    bool zero_block = handshake.zero_blocks && payload_size == 0;
+                    bool compressed = handshake.compression && headers[j].codec == CODEC_LZ;
+                    bool fresh = false;
+                    if (IsParityId(id)) {
+                        if (handshake.checksum && !CheckBlock(headers[j], landings[j], payload_size, handshake.block_size, nullptr)) lane.corrupt_blocks++;
+                        else AddFecParity(lane.fec, packet_bitmap, id, landings[j], payload_size);
+                    }
+                    else if (packet_bitmap[id]) lane.duplicate_blocks++;
+                    else if (compressed && !UnpackLanding(lane, landings[j], payload_size)) lane.corrupt_blocks++;
+                    else if (handshake.checksum && !(zero_block ? CheckZeroBlock(headers[j], lane.zero_crc, lane.block_crcs) :
+                        CheckBlock(headers[j], landings[j], payload_size, handshake.block_size, lane.block_crcs))) lane.corrupt_blocks++;
+                    else fresh = true;
+
+                    bool hole = zero_block && id >= lane.stale_end;
+                    if (lane.queue != nullptr) io::BlockRingId(*lane.queue, j) = fresh && !hole ? id : io::BLOCK_RING_SKIP;
+                    if (!fresh) {
+                        headers[j].id = handshake.number_packets;
+                        continue;
+                    }
+
+                    if (zero_block) num_zero++;
+                    if (hole && lane.holes != nullptr) lane.holes->Set(id);
+                    AddFecBlock(lane.fec, packet_bitmap, id, landings[j], payload_size);
+                    packet_bitmap.Set(id);
+                    if (lane.queue != nullptr && payload_size < (int)handshake.block_size) {
+                        // Whole blocks are written, so a short one is padded out
+                        memset(landings[j] + payload_size, 0, handshake.block_size - payload_size);
+                    }
+                }
+
+                // Last the misplaced blocks are copied to where they go, which may move the window.
+                // A zero block only needs writing where its block isn't zeros already, which is where an
+                // older copy of the file had data or a wrong guess landed. Reading a hole doesn't fill it.
+                for (int j = 0; j < used_slots; j++) {
+
+                    uint64_t id = headers[j].id;
+                    if (id == handshake.number_packets) continue;
+
+                    bool in_place = j < num_guesses && id == guesses[j];
+                    int i = j / packets_per_datagram;
+                    int offset = (j % packets_per_datagram) * handshake.packet_size + handshake.header_size;
+                    int payload_size = sk::BatchLength(batch, i) - offset;
+                    if (payload_size > (int)handshake.block_size) payload_size = handshake.block_size;
+                    if (handshake.compression && headers[j].codec == CODEC_LZ) payload_size = handshake.block_size; // unpacked in place
+                    bool zero_block = handshake.zero_blocks && payload_size == 0;
+                    if (lane.queue == nullptr && (zero_block || !in_place)) {
+                        char* mem_ptr = io::MapRange(lane.memmap, id * handshake.block_size, handshake.block_size);
+                        if (mem_ptr == nullptr) {
+                            debug_printf("[receiver]: failed to map block [%llu]\n", (unsigned long long)id);
+                            return false;
+                        }
+                        if (zero_block) {
+                            if (!IsZero(mem_ptr, handshake.block_size)) memset(mem_ptr, 0, handshake.block_size);
+                        }
+                        else {
+                            memcpy(mem_ptr, landings[j], payload_size);
+                            lane.misplaced_blocks++;
+                        }
+                    }
+
+                    next_guess = id + 1;
+                    if (id >= lane.high_water) lane.high_water = id + 1;
+
+                    debug_printf("[receiver]: read packet [%llu]\n", (unsigned long long)id);
+                    debug_printf("[receiver]: bitmap ");
+                    packet_bitmap.Print();
+                }
+                if (lane.queue != nullptr) io::BlockRingPush(*lane.queue, used_slots);
+                if (!RebuildFecGroups(lane)) return false;
+
+                lane.first_missing = packet_bitmap.FindNextClear(lane.first_missing);
+
+                lane.zero_blocks += num_zero;
+                lane.stats.datagrams += num_received;
+                lane.stats.bytes += payload_bytes;
+            }
+
+            lane.stats.seconds += (NowNs() - start_ns) / 1e9;
+            return true;
+        }
+
+        // Receiver side timing, to tell a blast that has finished from one that has paused
+        struct ArrivalEstimator {
+            uint64_t srtt_ns = 0; // smoothed time from sending a report to the next round's first packet
+            uint64_t gap_ns = 0; // smoothed time between datagrams during a blast
+            uint64_t last_arrival_ns = 0; // when datagrams were last read, 0 between rounds
+            uint64_t report_sent_ns = 0; // when the last report went, 0 once the next round has started
+        };
+
+        // Feeds in that datagrams were read just now. Both averages move an eighth of the way to
+        // each new sample.
+        void NoteArrivals(ArrivalEstimator& e, uint64_t datagrams) {
+            if (datagrams == 0) return;
+            uint64_t now = NowNs();
+            if (e.report_sent_ns != 0) {
+                uint64_t sample = now - e.report_sent_ns;
+                e.srtt_ns = e.srtt_ns == 0 ? sample : (7 * e.srtt_ns + sample) / 8;
+                e.report_sent_ns = 0;
+            }
+            if (e.last_arrival_ns != 0) {
+                uint64_t sample = (now - e.last_arrival_ns) / datagrams;
+                e.gap_ns = e.gap_ns == 0 ? sample : (7 * e.gap_ns + sample) / 8;
+            }
+            e.last_arrival_ns = now;
+        }
+
+        void NoteReportSent(ArrivalEstimator& e) {
+            e.report_sent_ns = NowNs();
+            e.last_arrival_ns = 0; // the gap to the next round isn't a gap between datagrams
+        }
+
+        // How long the lanes have to be quiet before a round counts as over, in whole milliseconds
+        // since that is what the poller waits in. Before there are gaps to go on, a round trip or
+        // failing that DRAIN_QUIET_MAX_MS.
+        int QuietPeriodMs(const ArrivalEstimator& e) {
+            uint64_t quiet_ns = e.gap_ns > 0 ? DRAIN_QUIET_GAPS * e.gap_ns : (uint64_t)DRAIN_QUIET_MAX_MS * 1000000;
+            if (e.srtt_ns > 0 && quiet_ns > e.srtt_ns) quiet_ns = e.srtt_ns;
+            int quiet_ms = (int)((quiet_ns + 999999) / 1000000);
+            return quiet_ms < DRAIN_QUIET_MAX_MS ? quiet_ms : DRAIN_QUIET_MAX_MS;
+        }
+
+        void DrainLaneThread(void* arg) {
+            ReceiveLane* lane = (ReceiveLane*)arg;
+            if (!lane->drain) return;
+            lane->drain = false;
+            lane->ok = DrainLane(*lane);
+        }
+
+        // Drains every lane the poller woke up for and adds up what they read. Notes if the
+        // control connection was among them. More than one lane is drained on the lane workers,
+        // so lanes read in parallel during the blast too.
+        bool DrainReadyLanes(ReceiveLane* lanes, uint32_t num_lanes, th::Workers& workers, const sk::SocketHandle* ready,
+            int num_ready, sk::SocketHandle control, bool& control_ready, uint64_t& datagrams) {
+
+            control_ready = false;
+            datagrams = 0;
+            uint32_t num_draining = 0;
+            uint32_t last = 0;
+            for (int i = 0; i < num_ready; i++) {
+                if (ready[i] == control) {
+                    control_ready = true;
+                    continue;
+                }
+                for (uint32_t lane = 0; lane < num_lanes; lane++) {
+                    if (lanes[lane].wake_handle != ready[i] || lanes[lane].drain) continue;
+                    lanes[lane].drain = true;
+                    num_draining++;
+                    last = lane;
+                }
+            }
+            if (num_draining == 0) return true;
+
+            uint64_t before = 0;
+            for (uint32_t lane = 0; lane < num_lanes; lane++) before += lanes[lane].stats.datagrams;
+            if (num_draining == 1) DrainLaneThread(&lanes[last]);
+            else th::RunOnWorkers(workers);
+
+            bool ok = true;
+            uint64_t after = 0;
+            for (uint32_t lane = 0; lane < num_lanes; lane++) {
+                ok = ok && lanes[lane].ok;
+                after += lanes[lane].stats.datagrams;
+            }
+            datagrams = after - before;
+            return ok;
+        }
+
+
+        // Streaming NACKs
+        // --> In a pipelined transfer the receiver doesn't leave all the loss to the report at the
+        //     end of the round. Every nack interval it tells the sender which blocks it has found
+        //     missing since the last NACK, and the sender resends them ahead of new blocks.
+        // --> A lane sends its blocks in order, so a gap behind the newest block it has received,
+        //     less NACK_REORDER_BLOCKS of slack, is a lost block
+        // --> The payload is varint pairs of (gap since the end of the previous range, length),
+        //     and is never bigger than a RAW report. Gaps that don't fit wait for the next NACK.
+        // --> The sender isn't held to its window and doesn't stop for a report. Each lane blasts every
+        //     block it is missing, resending NACKed ones ahead of new ones as the NACKs come in. Once
+        //     it is out of new blocks it carries on with just the resends, and the round is over once
+        //     no NACK has come for NACK_QUIET_MS more than the RTT.
+        // --> Each gap is NACKed once a round. The report at the end of the round is only a backstop, for a
+        //     lost resend, a dropped NACK and the last few blocks of a lane, which are never NACKed.
+
+        // Writes a NACK for every lane's new gaps into reporter.message. Returns the size of the
+        // whole message, or 0 if there is nothing to NACK.
+        size_t EncodeNack(LossReporter& reporter, Bitmap& bitmap, ReceiveLane* lanes, uint32_t num_lanes, uint64_t& nacked_blocks) {
+
+            ReportWriter w;
+            w.data = reporter.message + REPORT_HEADER_SIZE;
+            w.capacity = reporter.bitmap_size;
+            uint64_t prev_end = 0;
+            bool full = false;
+
+            for (uint32_t l = 0; l < num_lanes && !full; l++) {
+                ReceiveLane& lane = lanes[l];
+                if (lane.high_water < lane.nack_from + NACK_REORDER_BLOCKS) continue;
+                uint64_t limit = lane.high_water - NACK_REORDER_BLOCKS;
+
+                uint64_t pos = bitmap.FindNextClear(lane.nack_from);
+                while (pos < limit) {
+                    uint64_t end = bitmap.FindNextSet(pos);
+                    if (end > limit) end = limit;
+                    size_t before = w.size;
+                    WriteVarint(w, pos - prev_end);
+                    WriteVarint(w, end - pos);
+                    if (w.overflow) {
+                        w.size = before;
+                        full = true;
+                        break;
+                    }
+                    nacked_blocks += end - pos;
+                    prev_end = end;
+                    pos = bitmap.FindNextClear(end);
+                }
+                lane.nack_from = pos < limit ? pos : limit;
+            }
+            if (w.size == 0) return 0;
+
+            reporter.message[0] = (uint8_t)ReportEncoding::NACK;
+            uint32_t payload_size = (uint32_t)w.size;
+            memcpy(reporter.message + 1, &payload_size, 4);
+            return REPORT_HEADER_SIZE + w.size;
+        }
+
+        bool ReceiveFile(const ReceiverSockets &rc_sockets, const TransmissionInfo &handshake,
+            const ReceiveOptions& options, TransferStats& stats) {
+
+            sk::SocketError result;
+            sk::SocketHandle socket_sender = rc_sockets.socket_sender;
+
+            rse::Bitmap packet_bitmap(handshake.number_packets);
+            LossReporter reporter;
+            bool allocated = packet_bitmap.Allocated() && CreateLossReporter(reporter, packet_bitmap, handshake.bitmap_size);
+
+            // The map can't write to a sparse file, so its zero blocks are punched out at the end
+            bool punch_holes = handshake.zero_blocks && options.sink == ReceiveSink::MAP;
+            rse::Bitmap holes(punch_holes ? handshake.number_packets : 0);
+            allocated = allocated && holes.Allocated();
+
+            // The first lane creates the file and the rest open it. Every lane gets a worker that
+            // stays up for the whole transfer to drain it.
+            ReceiveLane lanes[MAX_LANES];
+            void* lane_args[MAX_LANES];
+            uint32_t num_lanes = 0;
+            th::Workers workers;
+            bool return_val = false;
+
+            // With the writer sink each lane hands its blocks to one writer thread through a ring
+            // of its own, so the network threads never wait on the disk
+            bool use_writer = options.sink == ReceiveSink::WRITER;
+            io::BlockWriter writer;
+            io::BlockRing queues[MAX_LANES];
+            int wait_ms = -1;
+            uint64_t next_nack_ns = 0;
+            uint64_t heard_ns = 0;
+            ArrivalEstimator arrivals;
+            uint32_t* block_crcs = handshake.checksum ? new (std::nothrow) uint32_t[handshake.number_packets]() : nullptr;
+            uint32_t sender_digest = 0;
+            bool check_digest = false;
+            uint64_t stale_blocks = 0;
+            Checkpoint checkpoint;
+            bool keep_file = false;
+
+            // One event loop waits on the control connection and every lane's udp socket together.
+            // Packets are drained as they arrive, instead of piling up in the socket buffer until
+            // the sender says the blast is over. The control socket is level triggered since it is
+            // read a message at a time.
+            sk::Poller poller;
+            sk::SocketHandle ready[sk::SK_MAX_POLL_SOCKETS];
+            if (!allocated || (handshake.checksum && block_crcs == nullptr)) {
+                debug_printf("[receiver]: out of memory for [%llu] blocks\n", (unsigned long long)handshake.number_packets);
+                DestroyLossReporter(reporter);
+                delete[] block_crcs;
+                return false;
+            }
+            if (!sk::CreatePoller(poller)) {
+                DestroyLossReporter(reporter);
+                delete[] block_crcs;
+                return false;
+            }
+            if (!sk::PollerAdd(poller, socket_sender, false)) goto label_cleanup;
+
+            // Find out what we already have before the file is opened for writing, which keeps those blocks.
+            // That is what an earlier try left if there was one, see "Resuming", otherwise the blocks that match.
+            if (handshake.resume) {
+                if (!OpenCheckpoint(checkpoint, handshake, options, packet_bitmap, stats)) {
+                    debug_printf("[receiver]: can't keep a checkpoint next to [%s]\n", handshake.path_name);
+                }
+                size_t report_size = EncodeLossReport(reporter, packet_bitmap);
+                result = sk::SendAll(socket_sender, (char*)reporter.message, (int)report_size, 0);
+                if (sk::IsError(result)) {
+                    use_writer = false;
+                    goto label_cleanup;
+                }
+                stats.control_bytes += report_size;
+                if (stats.resumed_blocks > 0) stale_blocks = handshake.number_packets;
+            }
+            if (handshake.delta && stats.resumed_blocks == 0 && !ExchangeBlockHashes(socket_sender, handshake, packet_bitmap, block_crcs, stale_blocks, stats)) {
+                use_writer = false;
+                goto label_cleanup;
+            }
+            keep_file = handshake.delta || stats.resumed_blocks > 0;
+            if (use_writer && !io::OpenBlockWriter(handshake.path_name, handshake.summation_block_size, handshake.block_size, options.direct_io, writer, keep_file, handshake.zero_blocks)) {
+                debug_printf("[receiver]: failed to open [%s] for writing\n", handshake.path_name);
+                use_writer = false;
+                goto label_cleanup;
+            }
+
+            for (; num_lanes < handshake.num_lanes; num_lanes++) {
+                io::MemMapIO first_io = keep_file ? io::MemMapIO::READ_WRITE_KEEP : io::MemMapIO::READ_WRITE;
+                io::MemMapIO map_io = num_lanes == 0 ? first_io : io::MemMapIO::READ_WRITE_EXISTING;
+                io::BlockRing* queue = use_writer ? &queues[num_lanes] : nullptr;
+                if (!CreateReceiveLane(lanes[num_lanes], handshake, options, packet_bitmap, rc_sockets.lane_sockets[num_lanes], num_lanes, map_io, queue, block_crcs, rc_sockets.route)) {
+                    goto label_cleanup;
+                }
+                lanes[num_lanes].stale_end = stale_blocks;
+                lanes[num_lanes].holes = punch_holes ? &holes : nullptr;
+                if (use_writer) {
+                    // Always room for at least one full batch, or the lane could never read again
+                    uint64_t capacity = options.writer_queue_size / handshake.num_lanes / handshake.block_size;
+                    if (capacity < (uint64_t)lanes[num_lanes].num_slots) capacity = lanes[num_lanes].num_slots;
+                    if (!io::CreateBlockRing(*queue, (uint32_t)capacity, handshake.block_size) || !io::AddBlockRing(writer, *queue)) {
+                        debug_printf("[receiver]: failed to allocate the writer queue\n");
+                        num_lanes++;
+                        goto label_cleanup;
+                    }
+                }
+                lane_args[num_lanes] = &lanes[num_lanes];
+                if (!sk::PollerAdd(poller, lanes[num_lanes].wake_handle, true)) {
+                    num_lanes++;
+                    goto label_cleanup;
+                }
+            }
+            if (use_writer && !io::StartBlockWriter(writer)) {
+                debug_printf("[receiver]: failed to start the writer thread\n");
+                goto label_cleanup;
+            }
+            th::StartWorkers(workers, DrainLaneThread, lane_args, (int)num_lanes);
+
+            // Pipelined transfers also wake up to NACK, and all of them to see whether the sender went quiet
+            wait_ms = handshake.pipelined ? options.nack_interval_ms : -1;
+            if (options.idle_timeout_ms > 0 && (wait_ms < 0 || options.idle_timeout_ms < wait_ms)) wait_ms = options.idle_timeout_ms;
+            next_nack_ns = NowNs() + (uint64_t)options.nack_interval_ms * 1000000;
+            heard_ns = NowNs();
+
+            while (true) {
+
+                // Sleep until there are packets or a control message
+                result = sk::PollerWait(poller, ready, sk::SK_MAX_POLL_SOCKETS, wait_ms);
+                if (sk::IsError(result)) {
+                    sk::ErrorMessage("[receiver]: waiting on sockets failed");
+                    break;
+                }
+                stats.poll_wakeups++;
+                if (result > 0) heard_ns = NowNs();
+                else if (options.idle_timeout_ms > 0 && NowNs() - heard_ns >= (uint64_t)options.idle_timeout_ms * 1000000) {
+                    debug_printf("[receiver]: nothing from the sender in [%d] ms, giving up\n", options.idle_timeout_ms);
+                    break;
+                }
+
+                bool control_ready;
+                uint64_t drained;
+                if (!DrainReadyLanes(lanes, num_lanes, workers, ready, result, socket_sender, control_ready, drained)) goto label_cleanup;
+                stats.datagrams_during_blast += drained;
+                NoteArrivals(arrivals, drained);
+
+                // The bitmap runs ahead of the disk, so a failed write has to end the transfer here
+                if (use_writer && io::BlockWriterFailed(writer)) {
+                    debug_printf("[receiver]: writing [%s] failed\n", handshake.path_name);
+                    goto label_cleanup;
+                }
+                UpdateCheckpoint(checkpoint, packet_bitmap, use_writer ? &writer : nullptr, stats);
+
+                // Tell the sender about any gaps while it can still fill them this round
+                if (handshake.pipelined && !control_ready && NowNs() >= next_nack_ns) {
+                    next_nack_ns = NowNs() + (uint64_t)options.nack_interval_ms * 1000000;
+                    size_t nack_size = EncodeNack(reporter, packet_bitmap, lanes, num_lanes, stats.nacked_blocks);
+                    if (nack_size > 0) {
+                        result = sk::SendAll(socket_sender, (char*)reporter.message, (int)nack_size, 0);
+                        if (sk::IsError(result)) break;
+                        stats.nacks++;
+                        stats.control_bytes += nack_size;
+                        stats.report_bytes += nack_size;
+                    }
+                }
+                if (!control_ready) continue;
+
+                // read message signifing the sender is done
+                debug_printf("[receiver]: waiting for go ahead from sender...\n");
+                uint8_t flag;
+                result = sk::RecvAll(socket_sender, (char*)&flag, sizeof(flag), 0);
+                if (sk::IsError(result)) break;
+                stats.control_bytes += sizeof(flag);
+
+                debug_printf("[receiver]: sender is telling me it sent udp stuff\n");
+                if (flag == FLAG_ABORTED) {
+                    debug_printf("[receiver]: sender gave up with [%llu] of [%llu] blocks in\n",
+                        (unsigned long long)packet_bitmap.Count(), (unsigned long long)handshake.number_packets);
+                    break;
+                }
+                if (flag == FLAG_DONE) {
+                    // the sender is done, and with checksums says what the file should come to. Only a file
+                    // with every block in counts as received, whatever the sender thinks.
+                    return_val = packet_bitmap.AllSet();
+                    if (!return_val) debug_printf("[receiver]: sender finished with [%llu] of [%llu] blocks in\n",
+                        (unsigned long long)packet_bitmap.Count(), (unsigned long long)handshake.number_packets);
+                    else debug_printf("[receiver]: sender told me it's happy with transmission and has finished\n");
+                    if (handshake.checksum) {
+                        uint32_t digest = 0;
+                        result = sk::RecvAll(socket_sender, (char*)&digest, sizeof(digest), 0);
+                        if (sk::IsError(result)) {
+                            return_val = false;
+                            break;
+                        }
+                        stats.control_bytes += sizeof(digest);
+                        sender_digest = digest;
+                        check_digest = true;
+                    }
+                    break;
+                }
+
+                stats.rounds++;
+
+                // Whatever made it here after the last wake up. On a shared port that includes what the
+                // demux hasn't sorted yet.
+                if (rc_sockets.route != nullptr) WaitDemuxPass(*rc_sockets.route->demux);
+                uint64_t total_before = 0;
+                for (uint32_t lane = 0; lane < num_lanes; lane++) {
+                    total_before += lanes[lane].stats.datagrams;
+                    lanes[lane].drain = true;
+                }
+                th::RunOnWorkers(workers);
+
+                bool lanes_ok = true;
+                uint64_t total_after = 0;
+                for (uint32_t lane = 0; lane < num_lanes; lane++) {
+                    lanes_ok = lanes_ok && lanes[lane].ok;
+                    total_after += lanes[lane].stats.datagrams;
+                }
+                if (!lanes_ok) goto label_cleanup;
+                NoteArrivals(arrivals, total_after - total_before);
+
+                // Then whatever is still on its way, until the lanes have been quiet for a while.
+                // The sender is waiting for the report, so the control connection stays quiet too.
+                while (options.drain_quiet) {
+                    result = sk::PollerWait(poller, ready, sk::SK_MAX_POLL_SOCKETS, QuietPeriodMs(arrivals));
+                    if (sk::IsError(result)) {
+                        sk::ErrorMessage("[receiver]: waiting on sockets failed");
+                        goto label_cleanup;
+                    }
+                    if (!DrainReadyLanes(lanes, num_lanes, workers, ready, result, socket_sender, control_ready, drained)) goto label_cleanup;
+                    if (drained == 0) break;
+                    stats.late_datagrams += drained;
+                    NoteArrivals(arrivals, drained);
+                }
+                if (use_writer && io::BlockWriterFailed(writer)) {
+                    debug_printf("[receiver]: writing [%s] failed\n", handshake.path_name);
+                    goto label_cleanup;
+                }
+
+                debug_printf("[receiver]: no more packets to read\n");
+
+                debug_printf("[receiver]: sending off bitmap to sender\n");
+
+                // send off our bitmap to the client, in whichever encoding is smallest. From here on
+                // anything from this round is stale.
+                size_t report_size = EncodeLossReport(reporter, packet_bitmap);
+                for (uint32_t lane = 0; lane < num_lanes; lane++) lanes[lane].epoch = stats.rounds;
+                if (rc_sockets.route != nullptr) rc_sockets.route->epoch.store(stats.rounds);
+                result = sk::SendAll(socket_sender, (char*)reporter.message, (int)report_size, 0);
+                if (sk::IsError(result)) break;
+                stats.control_bytes += report_size;
+                stats.report_bytes += report_size;
+                stats.reports_by_encoding[reporter.message[0]]++;
+                NoteReportSent(arrivals);
+
+                // The sender walks the missing blocks from the start every round
+                for (uint32_t lane = 0; lane < num_lanes; lane++) {
+                    lanes[lane].next_guess = lanes[lane].first_missing;
+                    lanes[lane].nack_from = lanes[lane].first_missing;
+                    lanes[lane].high_water = lanes[lane].first_block;
+                }
+            }
+
+        label_cleanup:
+
+            th::StopWorkers(workers);
+            sk::DestroyPoller(poller);
+            stats.num_lanes = num_lanes;
+            for (uint32_t lane = 0; lane < num_lanes; lane++) {
+                // Only a complete file is worth the wait for the disk
+                if (return_val && options.sync && !use_writer && !io::SyncWindowedMap(lanes[lane].memmap)) {
+                    debug_printf("[receiver]: failed to flush [%s] to disk\n", handshake.path_name);
+                    return_val = false;
+                }
+                if (lanes[lane].ring.active) stats.uring_lanes++;
+                DestroyReceiveLane(lanes[lane]);
+                AddLaneStats(stats, lane, lanes[lane].stats);
+                stats.misplaced_blocks += lanes[lane].misplaced_blocks;
+                stats.duplicate_blocks += lanes[lane].duplicate_blocks;
+                stats.sink_stalls += lanes[lane].sink_stalls;
+                stats.corrupt_blocks += lanes[lane].corrupt_blocks;
+                stats.zero_blocks += lanes[lane].zero_blocks;
+                stats.compressed_blocks += lanes[lane].compressed_blocks;
+                stats.compressed_bytes += lanes[lane].compressed_bytes;
+                stats.codec_ns += lanes[lane].codec_ns;
+                stats.stale_packets += lanes[lane].stale_packets;
+                stats.bad_packets += lanes[lane].bad_packets;
+                stats.parity_blocks += lanes[lane].fec.parity_blocks;
+                stats.rebuilt_blocks += lanes[lane].fec.rebuilt_blocks;
+            }
+            if (return_val && punch_holes && holes.count > 0 &&
+                !io::PunchHoles(handshake.path_name, holes, handshake.block_size, handshake.summation_block_size)) {
+                debug_printf("[receiver]: couldn't leave holes for the zero blocks of [%s]\n", handshake.path_name);
+            }
+            stats.srtt_ns = arrivals.srtt_ns;
+            stats.checksum = handshake.checksum;
+            stats.delta = handshake.delta;
+            stats.compression = handshake.compression;
+            if (use_writer) {
+                // The writer finishes whatever the lanes queued before it lets go of the file
+                if (!io::CloseBlockWriter(writer, return_val && options.sync)) {
+                    debug_printf("[receiver]: writing [%s] failed\n", handshake.path_name);
+                    return_val = false;
+                }
+                stats.disk_writes = writer.writes;
+                stats.disk_bytes = writer.bytes;
+                stats.direct_io = writer.direct;
+                for (uint32_t lane = 0; lane < num_lanes; lane++) io::DestroyBlockRing(queues[lane]);
+            }
+            // The last block landed whole, so a complete file is cut back to the size the sender's is.
+            // One still missing blocks keeps the size its checkpoint expects.
+            if (return_val && handshake.file_size < handshake.summation_block_size && !io::SetFileSize(handshake.path_name, handshake.file_size)) {
+                debug_printf("[receiver]: couldn't cut [%s] to [%llu] bytes\n", handshake.path_name, (unsigned long long)handshake.file_size);
+                return_val = false;
+            }
+            // The digest is worked out from the file once it is closed, so it covers what landed in it
+            // and not just what came off the wire
+            if (return_val && check_digest) {
+                if (!HashBlocks(handshake.path_name, handshake.block_size, handshake.number_packets, nullptr, nullptr, block_crcs)) {
+                    debug_printf("[receiver]: failed to read [%s] back\n", handshake.path_name);
+                    return_val = false;
+                }
+                stats.file_digest = FileDigest(block_crcs, handshake.number_packets);
+                if (return_val && sender_digest != stats.file_digest) {
+                    debug_printf("[receiver]: file digest [%08x] doesn't match the sender's [%08x]\n", stats.file_digest, sender_digest);
+                    return_val = false;
+                }
+            }
+            // Every block queued has been written by now, unless the writer failed
+            stats.resume = handshake.resume;
+            CloseCheckpoint(checkpoint, packet_bitmap, !use_writer || !io::BlockWriterFailed(writer), stats);
+            DestroyLossReporter(reporter);
+            delete[] block_crcs;
+            return return_val;
+        }
+
+        // This does require that sockets have been initialised.
+        // Wait to receive a file from the specifed host at the specified port
+        // The reason this is a long function is because its easier to not make a mistake that way
+        // particularly in terms of security. Ideally the whole thing would just be one long function.
+        // Its up for debate how it should get split up.
+        // Lanes after the first listen on the ports after port_num.
+        bool WaitToReceive(const char* hostname, const char* port_str, int port_num,
+            const ReceiveOptions& options = ReceiveOptions(), TransferStats* out_stats = nullptr) {
+
+            TickTock a = Tick();
+            TransferStats stats;
+            ReceiverSockets rc_sockets;
+            TransmissionInfo handshake = {};
+
+            if (!rbudp::ReceiveConnections(hostname, port_str, port_num, rc_sockets)) {
+                debug_printf("[receiver]: receiving connections failed\n");
+                return false;
+            }
+
+            if (!rbudp::ReceiveTransmissionInfoAndReply(rc_sockets, port_num, options, handshake, stats)) {
+                CloseReceiverSockets(rc_sockets);
+                debug_printf("[receiver]: receiving transmission failed\n");
+                return false;
+            }
+
+            bool ret_val = rbudp::ReceiveFile(rc_sockets, handshake, options, stats);
+
+            stats.seconds = Tock(a);
+            if (out_stats != nullptr) *out_stats = stats;
+
+            debug_printf("[receiver]: finished\n");
+            CloseReceiverSockets(rc_sockets);
+
+            return ret_val;
+        }
+
+        // Receiver daemon
+        // --> Stays listening and receives from up to max_sessions senders at once. Every session runs the
+        //     handshake and ReceiveFile on a thread of its own, just as WaitToReceive would, so sessions
+        //     share nothing but the listen socket and have their own bitmap, map and stats.
+        // --> Session slot k has its lanes on the udp ports from port_num + k * max_lanes, which the
+        //     handshake reply tells the sender. Senders before version 5 only work in slot 0.
+        // --> With shared_port every slot is on port_num instead, and the sessions are told apart by the id
+        //     in their packets, see "Shared port". Only senders that stamp their packets with it get in.
+        // --> Once every slot is busy, new senders wait in the listen backlog until one frees up.
+        // --> A session gives up on a sender it hears nothing from for receive.idle_timeout_ms, DEFAULT_SESSION_IDLE_MS
+        //     unless set, so senders that went quiet or whose host died don't hold their slot for good.
+        // --> Stopping the daemon shuts down the control connection of every session still running, which
+        //     ends it, so stopping never waits on a sender.
+        // --> Finished sessions are joined and counted by the daemon's own thread, which is the only one
+        //     that touches the stats, so read them after StopReceiverDaemon.
+
+        struct DaemonOptions {
+            uint32_t max_sessions = DEFAULT_MAX_SESSIONS; // transfers received at once, at most MAX_SESSIONS
+            bool shared_port = false; // take every session's packets on port_num, where the platform can
+            int shared_socket_buffer_size = 4 * DEFAULT_SOCKET_BUFFER_SIZE; // with shared_port, for the one socket
+            ReceiveOptions receive; // for every session
+        };
+
+        struct DaemonStats {
+            uint64_t sessions = 0; // senders accepted
+            uint64_t succeeded = 0;
+            uint64_t failed = 0;
+            uint32_t peak_sessions = 0; // most sessions running at once
+            uint64_t bytes = 0; // payload bytes received over udp by every session
+            uint64_t file_bytes = 0; // size of every file received
+            bool shared_port = false; // whether the sessions shared one udp port
+            uint64_t demux_datagrams = 0; // with a shared port, datagrams handed to a session
+            uint64_t stray_datagrams = 0; // of no session, or that fit no lane of it
+            uint64_t stale_datagrams = 0; // from an earlier round of their session
+            uint64_t overflow_datagrams = 0; // dropped since their lane's inbox was full
+        };
+
+        struct ReceiverDaemon;
+
+        struct ReceiverSession {
+            ReceiverDaemon* daemon = nullptr;
+            ReceiverSockets sockets;
+            sk::SocketHandle socket_sender = sk::SK_INVALID_SOCKET; // closed by the daemon's thread once the session is joined
+            int data_port = 0; // the slot's first udp port
+            th::ThreadHandle thread;
+            bool busy = false; // a thread has the slot. Only the daemon's thread reads or writes it
+            std::atomic<bool> done{ false }; // the thread has finished and is waiting to be joined
+            TransferStats stats;
+            uint64_t file_bytes = 0;
+            bool ok = false;
+        };
+
+        struct ReceiverDaemon {
+            DaemonOptions options;
+            int port_num = 0;
+            uint32_t port_stride = 1; // udp ports a slot takes, 0 when they share one
+            sk::SocketHandle socket_listen = sk::SK_INVALID_SOCKET;
+            sk::Poller poller;
+            ReceiverSession* sessions = nullptr;
+            Demux demux; // only with DaemonOptions::shared_port
+            bool shared_port = false;
+            uint32_t running = 0;
+            th::ThreadHandle thread;
+            std::atomic<bool> stop{ false };
+            DaemonStats stats;
+        };
+
+        void ReceiveSession(void* arg) {
+            ReceiverSession& session = *(ReceiverSession*)arg;
+            const ReceiveOptions& options = session.daemon->options.receive;
+            TickTock a = Tick();
+            TransmissionInfo handshake = {};
+            session.stats = TransferStats();
+            session.file_bytes = 0;
+
+            session.ok = ReceiveTransmissionInfoAndReply(session.sockets, session.data_port, options, handshake, session.stats,
+                session.data_port != session.daemon->port_num);
+            if (session.ok) {
+                session.ok = ReceiveFile(session.sockets, handshake, options, session.stats);
+                session.file_bytes = handshake.file_size;
+            }
+            session.stats.seconds = Tock(a);
+
+            debug_printf("[receiver]: session on port [%d] finished [%d]\n", session.data_port, (int)session.ok);
+            session.sockets.socket_sender = sk::SK_INVALID_SOCKET; // the daemon may still shut it down
+            CloseReceiverSockets(session.sockets);
+            session.done.store(true, std::memory_order_release);
+        }
+
+        // Joins the sessions that have finished and counts them. With wait it joins every session.
+        void ReapSessions(ReceiverDaemon& daemon, bool wait) {
+            for (uint32_t slot = 0; slot < daemon.options.max_sessions; slot++) {
+                ReceiverSession& session = daemon.sessions[slot];
+                if (!session.busy || (!wait && !session.done.load(std::memory_order_acquire))) continue;
+                th::JoinThread(session.thread);
+                sk::CloseSocket(session.socket_sender);
+                session.socket_sender = sk::SK_INVALID_SOCKET;
+                session.busy = false;
+                daemon.running--;
+                if (session.ok) daemon.stats.succeeded++;
+                else daemon.stats.failed++;
+                daemon.stats.bytes += session.stats.bytes;
+                if (session.ok) daemon.stats.file_bytes += session.file_bytes;
+            }
+        }
+
+        // Hands a new sender to a free slot. Returns false if it couldn't be started, and the sender is let go.
+        bool StartSession(ReceiverDaemon& daemon, ReceiverSession& session, sk::SocketHandle socket_sender) {
+            session.sockets = ReceiverSockets();
+            session.sockets.socket_sender = socket_sender;
+            if (daemon.shared_port) {
+                // The lanes are the route's, opened once the sender agrees to sessions
+                uint32_t slot = (uint32_t)(&session - daemon.sessions);
+                session.sockets.route = &daemon.demux.routes[slot];
+                session.sockets.session_id = NewSessionId(slot);
+            }
+            else {
+                session.sockets.socket_udp = sk::CreateUDPSocketReceiver(session.data_port);
+                if (sk::IsInvalidSocket(session.sockets.socket_udp)) {
+                    debug_printf("[receiver]: failed to create udp socket on port [%d]\n", session.data_port);
+                    sk::CloseSocket(socket_sender);
+                    return false;
+                }
+                session.sockets.lane_sockets[0] = session.sockets.socket_udp;
+                session.sockets.num_lanes = 1;
+            }
+
+            session.socket_sender = socket_sender;
+            session.done.store(false, std::memory_order_relaxed);
+            if (!th::StartThread(session.thread, ReceiveSession, &session)) {
+                CloseReceiverSockets(session.sockets);
+                session.socket_sender = sk::SK_INVALID_SOCKET;
+                return false;
+            }
+            session.busy = true;
+            daemon.running++;
+            if (daemon.running > daemon.stats.peak_sessions) daemon.stats.peak_sessions = daemon.running;
+            return true;
+        }
+
+        void DaemonThread(void* arg) {
+            ReceiverDaemon& daemon = *(ReceiverDaemon*)arg;
+
+            while (!daemon.stop.load(std::memory_order_relaxed)) {
+                ReapSessions(daemon, false);
+
+                // With every slot busy, new senders are left in the backlog
+                uint32_t slot = 0;
+                while (slot < daemon.options.max_sessions && daemon.sessions[slot].busy) slot++;
+                if (slot == daemon.options.max_sessions) {
+                    SleepNs((uint64_t)DAEMON_POLL_MS * 1000000);
+                    continue;
+                }
+
+                sk::SocketHandle ready;
+                sk::SocketError result = sk::PollerWait(daemon.poller, &ready, 1, DAEMON_POLL_MS);
+                if (sk::IsError(result)) {
+                    debug_printf("[receiver]: daemon failed to poll the listen socket\n");
+                    break;
+                }
+                if (result == 0) continue;
+
+                sk::SocketHandle socket_sender = sk::AcceptFirstConnectionOnListenSocket(daemon.socket_listen);
+                if (sk::IsInvalidSocket(socket_sender)) continue;
+                daemon.stats.sessions++;
+                if (!StartSession(daemon, daemon.sessions[slot], socket_sender)) daemon.stats.failed++;
+            }
+
+            // Cut off the sessions still running, so none waits on its sender, then the demux has nobody left to sort for
+            for (uint32_t slot = 0; slot < daemon.options.max_sessions; slot++) {
+                if (daemon.sessions[slot].busy) sk::Shutdown(daemon.sessions[slot].socket_sender, sk::SK_SHUT_BOTH);
+            }
+            ReapSessions(daemon, true);
+            if (daemon.shared_port) {
+                StopDemux(daemon.demux);
+                daemon.stats.demux_datagrams = daemon.demux.datagrams;
+                daemon.stats.stray_datagrams = daemon.demux.stray_datagrams;
+                daemon.stats.stale_datagrams = daemon.demux.stale_datagrams;
+                daemon.stats.overflow_datagrams = daemon.demux.overflow_datagrams;
+            }
+        }
+
+        // Starts listening on port_str and receiving in the background. This does require that sockets
+        // have been initialised. Every session's udp ports come after port_num, or are all port_num with
+        // shared_port, see "Receiver daemon".
+        bool StartReceiverDaemon(ReceiverDaemon& daemon, const char* hostname, const char* port_str, int port_num,
+            const DaemonOptions& options = DaemonOptions()) {
+
+            daemon.options = options;
+            if (daemon.options.receive.idle_timeout_ms <= 0) daemon.options.receive.idle_timeout_ms = DEFAULT_SESSION_IDLE_MS;
+            if (daemon.options.max_sessions < 1) daemon.options.max_sessions = 1;
+            if (daemon.options.max_sessions > MAX_SESSIONS) daemon.options.max_sessions = MAX_SESSIONS;
+            daemon.port_num = port_num;
+            uint32_t lane_ports = options.receive.max_lanes < 1 ? 1 : options.receive.max_lanes < MAX_LANES ? options.receive.max_lanes : MAX_LANES;
+            daemon.port_stride = lane_ports;
+            daemon.running = 0;
+            daemon.stop.store(false, std::memory_order_relaxed);
+            daemon.stats = DaemonStats();
+            daemon.shared_port = options.shared_port;
+            if (daemon.shared_port) {
+                daemon.port_stride = 0;
+                if (!StartDemux(daemon.demux, port_num, daemon.options.max_sessions, options.shared_socket_buffer_size, options.receive.batch_depth)) {
+                    debug_printf("[receiver]: can't share port [%d], giving every session its own\n", port_num);
+                    daemon.shared_port = false;
+                    daemon.port_stride = lane_ports;
+                }
+            }
+            daemon.stats.shared_port = daemon.shared_port;
+            if (port_num + (uint64_t)daemon.options.max_sessions * daemon.port_stride - 1 > 65535) {
+                debug_printf("[receiver]: not enough udp ports after [%d] for [%u] sessions\n", port_num, daemon.options.max_sessions);
+                return false;
+            }
+
+            daemon.socket_listen = sk::CreateListenSocket(hostname, port_str, true);
+            if (sk::IsInvalidSocket(daemon.socket_listen)) {
+                debug_printf("[receiver]: failed to create listen socket\n");
+                StopDemux(daemon.demux);
+                return false;
+            }
+            if (!sk::CreatePoller(daemon.poller) || !sk::PollerAdd(daemon.poller, daemon.socket_listen, false)) {
+                sk::DestroyPoller(daemon.poller);
+                sk::CloseSocket(daemon.socket_listen);
+                StopDemux(daemon.demux);
+                return false;
+            }
+
+            daemon.sessions = new ReceiverSession[daemon.options.max_sessions];
+            for (uint32_t slot = 0; slot < daemon.options.max_sessions; slot++) {
+                daemon.sessions[slot].daemon = &daemon;
+                daemon.sessions[slot].data_port = port_num + (int)(slot * daemon.port_stride);
+            }
+
+            if (!th::StartThread(daemon.thread, DaemonThread, &daemon)) {
+                delete[] daemon.sessions;
+                daemon.sessions = nullptr;
+                sk::DestroyPoller(daemon.poller);
+                sk::CloseSocket(daemon.socket_listen);
+                StopDemux(daemon.demux);
+                return false;
+            }
+            debug_printf("[receiver]: daemon listening for up to [%u] sessions\n", daemon.options.max_sessions);
+            return true;
+        }
+
+        // Stops accepting senders and ends the sessions still running, see "Receiver daemon"
+        void StopReceiverDaemon(ReceiverDaemon& daemon) {
+            if (daemon.sessions == nullptr) return;
+            daemon.stop.store(true, std::memory_order_relaxed);
+            th::JoinThread(daemon.thread);
+
+            delete[] daemon.sessions;
+            daemon.sessions = nullptr;
+            sk::DestroyPoller(daemon.poller);
+            sk::CloseSocket(daemon.socket_listen);
+            daemon.socket_listen = sk::SK_INVALID_SOCKET;
+        }
+
+        bool SenderConnect(const char* hostname, const char* port_str, SenderSockets& s_sockets) {
+
+            sockaddr serverAddr;
+            socklen_t serverAddrLen = 0;
+            s_sockets.socket_receiver = sk::CreateClientSocketForServer(hostname, port_str, serverAddr, serverAddrLen, true);
+
+            debug_printf("[sender]: connecting to receiver\n");
+            sk::SocketError result = sk::Connect(s_sockets.socket_receiver, &serverAddr, serverAddrLen);
+            if (sk::IsError(result)) {
+                sk::CloseSocket(s_sockets.socket_receiver);
+                debug_printf("[sender]: failed to connect\n");
+                return false;
+            }
+
+            s_sockets.socket_udp = rse::sk::CreateUDPSocketSender();
+            if (sk::IsInvalidSocket(s_sockets.socket_udp)) {
+                debug_printf("[sender]: invalid udp socket\n");
+                sk::CloseSocket(s_sockets.socket_receiver);
+                return false;
+            }
+
+            return true;
+        }
+
+        bool SendTransmissionInfoAndWait(
+            const SenderSockets& s_sockets,
+            const char* path_to_write, uint64_t send_file_size, const int block_size,
+            const SendOptions& options, TransmissionInfo& handshake, TransferStats& stats, uint64_t resume_token = 0) {
+
+            sk::SocketError result;
+            handshake = {};
+
+            handshake.number_packets = BlockCount(send_file_size, block_size);
+            handshake.block_size = block_size;
+            handshake.file_size = send_file_size;
+            handshake.bitmap_size = (handshake.number_packets / 8) + 1;
+            strcpy(handshake.path_name, path_to_write);
+
+            uint32_t requested_lanes = options.lanes;
+            if (requested_lanes < 1) requested_lanes = 1;
+            if (requested_lanes > MAX_LANES) requested_lanes = MAX_LANES;
+            uint32_t features = 0;
+            if (options.pipelined) features |= FEATURE_PIPELINED;
+            if (options.checksum) features |= FEATURE_CHECKSUM;
+            uint32_t fec_group_size = options.fec_group_size < fec::MAX_GROUP_SIZE ? options.fec_group_size : fec::MAX_GROUP_SIZE;
+            uint32_t fec_parity = options.fec_parity < 1 ? 1 : options.fec_parity > fec::MAX_PARITY ? fec::MAX_PARITY : options.fec_parity;
+            if (fec_group_size > 0 && handshake.number_packets < FEC_MAX_BLOCKS) features |= FEATURE_FEC;
+            if (options.delta) features |= FEATURE_DELTA;
+            if (options.zero_blocks) features |= FEATURE_ZERO_BLOCKS;
+            if (options.compression) features |= FEATURE_COMPRESSION;
+            if (options.sessions) features |= FEATURE_SESSION;
+            if (options.resume) features |= FEATURE_RESUME;
+
+            // Send off the packet info to the receiver
+            debug_printf("[sender]: sending handshake...\n");
+            uint32_t magic = PROTOCOL_MAGIC;
+            uint32_t version = PROTOCOL_VERSION;
+            result = sk::Send(s_sockets.socket_receiver, (char*)&magic, 4, 0);
+            if (sk::IsError(result)) return false;
+            result = sk::Send(s_sockets.socket_receiver, (char*)&version, 4, 0);
+            if (sk::IsError(result)) return false;
+            result = sk::Send(s_sockets.socket_receiver, (char*)&handshake.number_packets, 8, 0);
+            if (sk::IsError(result)) return false;
+            result = sk::Send(s_sockets.socket_receiver, (char*)&handshake.block_size, 4, 0);
+            if (sk::IsError(result)) return false;
+            // The path ends the request, from version 6 the receiver answers it before doing any of its setup
+            uint64_t request_sent_ns = NowNs();
+            result = sk::Send(s_sockets.socket_receiver, handshake.path_name, rse::rbudp::PATH_SIZE, 0);
+            if (sk::IsError(result)) return false;
+            stats.control_bytes += 4 + 4 + 8 + 4 + PATH_SIZE;
+
+            // Wait for a response from the receiver
+            debug_printf("[sender] sender waiting for response from receiver...\n");
+            uint8_t is_receiver_happy;
+            result = sk::RecvAll(s_sockets.socket_receiver, (char*)&is_receiver_happy, sizeof(is_receiver_happy), 0);
+            if (sk::IsError(result)) {
+                debug_printf("Error getting flag\n");
+                return false;
+            }
+            handshake.rtt_ns = NowNs() - request_sent_ns;
+            result = sk::RecvAll(s_sockets.socket_receiver, (char*)&handshake.protocol_version, 4, 0);
+            if (sk::IsError(result)) {
+                debug_printf("Error getting protocol version\n");
+                return false;
+            }
+            stats.control_bytes += sizeof(is_receiver_happy) + 4;
+            if (handshake.protocol_version < MIN_PROTOCOL_VERSION || handshake.protocol_version > PROTOCOL_VERSION) {
+                debug_printf("[sender] receiver picked version [%u] which we don't speak\n", handshake.protocol_version);
+                return false;
+            }
+
+            // A receiver that speaks them is sent the extensions, and says again whether it is happy with them
+            if (handshake.protocol_version >= EXTENSIONS_AFTER_VERSION) {
+                if (!is_receiver_happy) {
+                    debug_printf("[sender] receiver refused the transmission\n");
+                    return false;
+                }
+                result = sk::Send(s_sockets.socket_receiver, (char*)&requested_lanes, 4, 0);
+                if (sk::IsError(result)) return false;
+                result = sk::Send(s_sockets.socket_receiver, (char*)&features, 4, 0);
+                if (sk::IsError(result)) return false;
+                stats.control_bytes += 4 + 4;
+                if (features & FEATURE_FEC) {
+                    result = sk::Send(s_sockets.socket_receiver, (char*)&fec_group_size, 4, 0);
+                    if (sk::IsError(result)) return false;
+                    result = sk::Send(s_sockets.socket_receiver, (char*)&fec_parity, 4, 0);
+                    if (sk::IsError(result)) return false;
+                    stats.control_bytes += 4 + 4;
+                }
+                if (features & FEATURE_RESUME) {
+                    result = sk::Send(s_sockets.socket_receiver, (char*)&resume_token, 8, 0);
+                    if (sk::IsError(result)) return false;
+                    stats.control_bytes += 8;
+                }
+                if (handshake.protocol_version >= 7) {
+                    result = sk::Send(s_sockets.socket_receiver, (char*)&send_file_size, 8, 0);
+                    if (sk::IsError(result)) return false;
+                    stats.control_bytes += 8;
+                }
+                result = sk::RecvAll(s_sockets.socket_receiver, (char*)&is_receiver_happy, sizeof(is_receiver_happy), 0);
+                if (sk::IsError(result)) {
+                    debug_printf("Error getting flag\n");
+                    return false;
+                }
+                stats.control_bytes += sizeof(is_receiver_happy);
+            }
+            result = sk::RecvAll(s_sockets.socket_receiver, (char*)&handshake.receiver_buffer_size, 4, 0);
+            if (sk::IsError(result)) {
+                debug_printf("Error getting receiver buffer size\n");
+                return false;
+            }
+            stats.control_bytes += 4;
+
+            if (!is_receiver_happy) {
+                debug_printf("[sender] receiver refused the transmission, its version is [%u]\n", handshake.protocol_version);
+                return false;
+            }
+
+            // Version 2 receivers don't know about lanes
+            handshake.num_lanes = 1;
+            if (handshake.protocol_version >= 3) {
+                result = sk::RecvAll(s_sockets.socket_receiver, (char*)&handshake.num_lanes, 4, 0);
+                if (sk::IsError(result)) {
+                    debug_printf("Error getting number of lanes\n");
+                    return false;
+                }
+                stats.control_bytes += 4;
+                if (handshake.num_lanes < 1 || handshake.num_lanes > requested_lanes) {
+                    debug_printf("[sender] receiver opened [%u] lanes, we asked for [%u]\n", handshake.num_lanes, requested_lanes);
+                    return false;
+                }
+            }
+
+            // Version 4 receivers say which of the features we asked for they agreed to
+            if (handshake.protocol_version >= 4) {
+                uint32_t agreed = 0;
+                result = sk::RecvAll(s_sockets.socket_receiver, (char*)&agreed, 4, 0);
+                if (sk::IsError(result)) {
+                    debug_printf("Error getting features\n");
+                    return false;
+                }
+                stats.control_bytes += 4;
+                if (agreed & ~features) {
+                    debug_printf("[sender] receiver agreed to features [%x] we didn't ask for\n", agreed);
+                    return false;
+                }
+                handshake.pipelined = (agreed & FEATURE_PIPELINED) != 0;
+                handshake.checksum = (agreed & FEATURE_CHECKSUM) != 0;
+                handshake.delta = (agreed & FEATURE_DELTA) != 0;
+                handshake.zero_blocks = (agreed & FEATURE_ZERO_BLOCKS) != 0;
+                handshake.compression = (agreed & FEATURE_COMPRESSION) != 0;
+                handshake.sessions = (agreed & FEATURE_SESSION) != 0;
+                handshake.resume = (agreed & FEATURE_RESUME) != 0;
+                if (handshake.resume) handshake.resume_token = resume_token;
+                if (agreed & FEATURE_FEC) {
+                    handshake.fec_group_size = fec_group_size;
+                    handshake.fec_parity = fec_parity;
+                }
+            }
+
+            // Version 5 receivers say where the lanes are, older ones have them on the port we connected to
+            if (handshake.protocol_version >= 5) {
+                result = sk::RecvAll(s_sockets.socket_receiver, (char*)&handshake.data_port, 4, 0);
+                if (sk::IsError(result)) {
+                    debug_printf("Error getting udp port\n");
+                    return false;
+                }
+                stats.control_bytes += 4;
+                if (handshake.data_port < 1 || handshake.data_port + (int)handshake.num_lanes - 1 > 65535) {
+                    debug_printf("[sender] receiver gave a bad udp port [%d]\n", handshake.data_port);
+                    return false;
+                }
+            }
+
+            // Packets stamped with the session carry the id the receiver picked
+            if (handshake.sessions) {
+                uint32_t shared_port = 0;
+                result = sk::RecvAll(s_sockets.socket_receiver, (char*)&handshake.session_id, 4, 0);
+                if (sk::IsError(result)) {
+                    debug_printf("Error getting session id\n");
+                    return false;
+                }
+                result = sk::RecvAll(s_sockets.socket_receiver, (char*)&shared_port, 4, 0);
+                if (sk::IsError(result)) {
+                    debug_printf("Error getting session id\n");
+                    return false;
+                }
+                stats.control_bytes += 4 + 4;
+                handshake.shared_port = shared_port != 0;
+            }
+
+            // The packet layout depends on what the receiver agreed to
+            handshake.header_size = HeaderSize(handshake);
+            handshake.packet_size = block_size + handshake.header_size;
+            handshake.max_packets_per_transmission = ASSUMED_PORT_SIZE / handshake.packet_size;
+
+            debug_printf("[sender] handshake rtt [%llu]ns receiver buffer [%u] lanes [%u]\n",
+                (unsigned long long)handshake.rtt_ns, handshake.receiver_buffer_size, handshake.num_lanes);
+
+            // Flag siginifies we should start protocol
+            debug_printf("[sender] receiver is happy with handshake\n");
+            return true;
+        }
+
+        // Token bucket that paces the blast to a target rate. Tokens are bytes and
+        // a whole batch is released at once when the bucket holds enough for it.
+        struct Pacer {
+            double bytes_per_ns = 0; // 0 means unpaced
+            double tokens = 0;
+            double capacity = 0; // the largest burst the bucket allows
+            uint64_t last_ns = 0;
+        };
+
+        void InitPacer(Pacer& pacer, double rate_mbps, uint32_t min_burst_bytes) {
+            pacer = Pacer();
+            if (rate_mbps <= 0) return;
+            pacer.bytes_per_ns = rate_mbps * 1e6 / 8 / 1e9;
+            pacer.capacity = pacer.bytes_per_ns * PACER_BURST_NS;
+            if (pacer.capacity < 2.0 * min_burst_bytes) pacer.capacity = 2.0 * min_burst_bytes;
+            pacer.tokens = pacer.capacity;
+            pacer.last_ns = NowNs();
+        }
+
+        bool IsPaced(const Pacer& pacer) {
+            return pacer.bytes_per_ns > 0;
+        }
+
+        // Blocks until the bucket holds bytes tokens, then takes them. A release bigger
+        // than the bucket waits for a full bucket and leaves it in debt for the next one.
+        void PacerWait(Pacer& pacer, uint64_t bytes) {
+
+            if (!IsPaced(pacer)) return;
+
+            double needed = (double)bytes;
+            if (needed > pacer.capacity) needed = pacer.capacity;
+
+            while (true) {
+                uint64_t now = NowNs();
+                pacer.tokens += (now - pacer.last_ns) * pacer.bytes_per_ns;
+                if (pacer.tokens > pacer.capacity) pacer.tokens = pacer.capacity;
+                pacer.last_ns = now;
+
+                if (pacer.tokens >= needed) break;
+
+                // Sleep off most of the deficit and spin for the rest
+                uint64_t wait_ns = (uint64_t)((needed - pacer.tokens) / pacer.bytes_per_ns);
+                if (wait_ns > PACER_SPIN_NS) SleepNs(wait_ns - PACER_SPIN_NS);
+            }
+
+            pacer.tokens -= bytes;
+        }
+
+        // Sizes each blast and picks its rate
+        struct BlastControl {
+            uint32_t window = 0; // packets per blast
+            uint32_t max_window = 0; // what the receiver's socket buffer can hold
+            double rate_mbps = 0; // 0 is unpaced
+            double max_rate_mbps = 0; // the rate the user asked for, which is never gone past. 0 for no limit
+            uint64_t min_rtt_ns = 0;
+            uint32_t packet_size = 0;
+        };
+
+        // The window starts at a few bandwidth-delay products when we know the rate, or at the
+        // receiver's socket buffer when we don't, and is never bigger than that buffer.
+        void InitBlastControl(BlastControl& control, const TransmissionInfo& handshake, const SendOptions& options) {
+
+            control = BlastControl();
+            control.rate_mbps = options.rate_mbps;
+            control.max_rate_mbps = options.rate_mbps;
+            control.min_rtt_ns = handshake.rtt_ns;
+            control.packet_size = handshake.packet_size;
+
+            if (!options.adaptive) {
+                control.window = control.max_window = handshake.max_packets_per_transmission;
+                return;
+            }
+
+            control.max_window = handshake.receiver_buffer_size / handshake.packet_size;
+            if (control.max_window < MIN_PACKETS_PER_TRANSMISSION) control.max_window = MIN_PACKETS_PER_TRANSMISSION;
+            control.window = control.max_window;
+
+            if (control.rate_mbps > 0 && control.min_rtt_ns > 0) {
+                double bdp_bytes = control.rate_mbps * 1e6 / 8 * (control.min_rtt_ns / 1e9);
+                double window = BLAST_BDP_MULTIPLE * bdp_bytes / handshake.packet_size;
+                if (window < control.window) control.window = (uint32_t)window;
+                if (control.window < MIN_PACKETS_PER_TRANSMISSION) control.window = MIN_PACKETS_PER_TRANSMISSION;
+            }
+        }
+
+        // Feeds back the result of a round. sent is the number of packets blasted, delivered how many
+        // of them the bitmap says arrived, blast_ns how long the blast took and round_trip_ns the time
+        // from the end of the blast to the bitmap coming back.
+        void UpdateBlastControl(BlastControl& control, const SendOptions& options,
+            uint32_t sent, uint32_t delivered, uint64_t blast_ns, uint64_t round_trip_ns) {
+
+            if (!options.adaptive || sent == 0) return;
+
+            if (round_trip_ns > 0 && round_trip_ns < control.min_rtt_ns) control.min_rtt_ns = round_trip_ns;
+
+            double loss = (double)(sent - delivered) / sent;
+            if (loss > BLAST_LOSS_HIGH) {
+                control.window = (uint32_t)(control.window * 0.7);
+                if (control.window < MIN_PACKETS_PER_TRANSMISSION) control.window = MIN_PACKETS_PER_TRANSMISSION;
+
+                // Start pacing a bit below what we just managed if we weren't already
+                if (control.rate_mbps > 0) control.rate_mbps *= 0.8;
+                else if (blast_ns > 0) control.rate_mbps = 0.8 * ((double)sent * control.packet_size * 8 / blast_ns) * 1e3;
+                if (control.rate_mbps > 0 && control.rate_mbps < MIN_BLAST_RATE_MBPS) control.rate_mbps = MIN_BLAST_RATE_MBPS;
+            }
+            else if (loss < BLAST_LOSS_LOW && sent >= control.window) {
+                uint32_t window = (uint32_t)(control.window * 1.25) + 1;
+                control.window = window < control.max_window ? window : control.max_window;
+                if (control.rate_mbps > 0) control.rate_mbps *= 1.1;
+                if (control.max_rate_mbps > 0 && control.rate_mbps > control.max_rate_mbps) control.rate_mbps = control.max_rate_mbps;
+            }
+        }
+
+        // The udp side of the sender while it is blasting
+        struct BlastChannel {
+            sk::SocketHandle socket = sk::SK_INVALID_SOCKET;
+            sockaddr_in addr;
+            sk::DatagramBatch batch;
+            sk::Uring ring; // only active when sending through io_uring
+            uint64_t batch_bytes = 0; // bytes queued in the batch
+            int send_flags = 0;
+            int segments_per_send = 1; // packets packed into one send when segmentation offload is on
+            uint64_t flushes = 0; // batches sent so far, so anything queued in an earlier one is free again
+            Pacer pacer;
+#ifdef RSE_TEST_FAULTS
+            const TestFaults* faults = nullptr;
+            int fault_size = 0; // with faults, room for a whole datagram in each slot below
+            int header_size = 0; // with faults, so a packet that is only its header is never corrupted
+            char* damaged = nullptr; // a slot per datagram of the batch for copies of the ones being corrupted
+            char* held = nullptr; // late datagrams waiting for the flag
+            int* held_sizes = nullptr;
+            uint32_t held_count = 0;
+            char* replayed = nullptr; // copies of this round's first datagrams, and a slot to look at the batch's header in
+            int* replayed_sizes = nullptr;
+            uint32_t replayed_count = 0;
+            uint32_t replayed_epoch = 0; // the round they are from
+            uint64_t fault_count = 0; // datagrams seen, so the faults are spread evenly
+            uint64_t corrupt_count = 0; // of those, the ones that weren't dropped
+#endif
+        };
+
+#ifdef RSE_TEST_FAULTS
+        // Whether the count'th datagram is one of percentage in a hundred. Stepping by 61 spreads them
+        // through the hundred instead of bunching them at the start.
+        bool FaultHits(uint64_t count, uint32_t percentage) {
+            return count * 61 % 100 < percentage;
+        }
+
+        // Once a new round has started, sends the datagrams copied from the last one again as they were, and
+        // the first of them once more as another session, then copies the new round's first datagrams
+        void ReplayDatagrams(BlastChannel& channel) {
+            const TestFaults& faults = *channel.faults;
+            sk::DatagramBatch& batch = channel.batch;
+            char* look = channel.replayed + (size_t)faults.replayed_datagrams * channel.fault_size;
+            if (sk::GatherDatagram(batch, 0, look, channel.fault_size) < SESSION_HEADER_SIZE) return;
+            PacketHeader header;
+            memcpy(&header, look, SESSION_HEADER_SIZE);
+
+            if (channel.replayed_count > 0 && header.epoch != channel.replayed_epoch) {
+                for (uint32_t k = 0; k < channel.replayed_count; k++) {
+                    sk::SendTo(channel.socket, channel.replayed + (size_t)k * channel.fault_size, channel.replayed_sizes[k], 0,
+                        (const sockaddr*)&channel.addr, sizeof(channel.addr));
+                }
+                PacketHeader foreign;
+                memcpy(&foreign, channel.replayed, SESSION_HEADER_SIZE);
+                foreign.session ^= 1u << SESSION_SLOT_BITS; // same daemon slot, another session
+                foreign.epoch = header.epoch;
+                memcpy(channel.replayed, &foreign, SESSION_HEADER_SIZE);
+                sk::SendTo(channel.socket, channel.replayed, channel.replayed_sizes[0], 0, (const sockaddr*)&channel.addr, sizeof(channel.addr));
+                channel.replayed_count = 0;
+            }
+            for (int i = 0; i < batch.count && channel.replayed_count < faults.replayed_datagrams; i++) {
+                char* slot = channel.replayed + (size_t)channel.replayed_count * channel.fault_size;
+                int size = sk::GatherDatagram(batch, i, slot, channel.fault_size);
+                if (size > 0) channel.replayed_sizes[channel.replayed_count++] = size;
+            }
+            channel.replayed_epoch = header.epoch;
+        }
+
+        // Drops some of the batch's datagrams and corrupts a copy of some others in place of them, then
+        // holds back its last datagram while the round still has late ones to hold
+        void InjectFaults(BlastChannel& channel) {
+            const TestFaults& faults = *channel.faults;
+            sk::DatagramBatch& batch = channel.batch;
+            if (faults.replayed_datagrams > 0 && channel.header_size == SESSION_HEADER_SIZE && batch.count > 0) ReplayDatagrams(channel);
+            for (int i = 0; i < batch.count; ) {
+                if (FaultHits(channel.fault_count++, faults.loss_percentage)) sk::BatchRemoveDatagram(batch, i);
+                else i++;
+            }
+            for (int i = 0; i < batch.count; i++) {
+                if (!FaultHits(channel.corrupt_count++, faults.corrupt_percentage)) continue;
+                char* copy = channel.damaged + (size_t)i * channel.fault_size;
+                int size = sk::GatherDatagram(batch, i, copy, channel.fault_size);
+                if (size <= channel.header_size) continue;
+                copy[size - 1] ^= 0x5a;
+                sk::BatchReplaceDatagram(batch, i, copy, size);
+            }
+            if (channel.held_count < faults.late_datagrams && batch.count > 1) {
+                char* slot = channel.held + (size_t)channel.held_count * channel.fault_size;
+                int size = sk::GatherDatagram(batch, batch.count - 1, slot, channel.fault_size);
+                if (size > 0) {
+                    channel.held_sizes[channel.held_count++] = size;
+                    batch.count--;
+                }
+            }
+        }
+
+        // Sends what InjectFaults held back
+        void SendHeldDatagrams(BlastChannel& channel) {
+            for (uint32_t k = 0; k < channel.held_count; k++) {
+                sk::SendTo(channel.socket, channel.held + (size_t)k * channel.fault_size, channel.held_sizes[k], 0,
+                    (const sockaddr*)&channel.addr, sizeof(channel.addr));
+            }
+            channel.held_count = 0;
+        }
+#endif
+
+        // Sends every datagram queued in the batch and empties it
+        bool FlushBatch(BlastChannel& channel) {
+
+            sk::DatagramBatch& batch = channel.batch;
+            if (batch.count == 0) return true;
+
+            PacerWait(channel.pacer, channel.batch_bytes);
+            channel.batch_bytes = 0;
+#ifdef RSE_TEST_FAULTS
+            if (channel.faults != nullptr) InjectFaults(channel);
+#endif
+
+            sk::SocketError result = channel.ring.active
+                ? sk::UringSendBatch(channel.ring, channel.socket, batch, channel.send_flags, (const sockaddr*)&channel.addr, sizeof(channel.addr))
+                : sk::SendToBatch(channel.socket, batch, channel.send_flags, (const sockaddr*)&channel.addr, sizeof(channel.addr));
+            if (sk::IsError(result)) {
+                if (channel.segments_per_send > 1 && sk::IsSegmentationOffloadError()) {
+                    // The path can't take segmented sends. Fall back to one packet per datagram,
+                    // anything in this batch just shows up as missing in the next bitmap.
+                    debug_printf("[sender]: segmentation offload failed, falling back\n");
+                    sk::DisableSegmentationOffload(channel.socket);
+                    channel.segments_per_send = 1;
+                    sk::ClearBatch(batch);
+                    channel.flushes++;
+                    return true;
+                }
+                sk::ErrorMessage("[sender]: sending batch failed");
+                return false;
+            }
+
+            sk::ClearBatch(batch);
+            channel.flushes++;
+            return true;
+        }
+
+        // Reads a lane's missing blocks into ready made packets on a thread of its own, a round at
+        // a time, so the socket thread never waits on the disk. The thread lives as long as the lane.
+        struct ReadAhead {
+            io::BlockReader reader;
+            io::BlockRing ring; // packets, header and block, from the reader to the socket thread. Ids are the bytes to send
+            th::ThreadHandle thread;
+            bool started = false;
+            th::Signal go; // rung by the socket thread to start a round, or to quit
+            th::Signal finished; // rung by the reader once it is done with a round
+            bool quit = false;
+            std::atomic<bool> stop{ false }; // the socket thread gave up on the round
+            std::atomic<bool> done{ false }; // every packet of the round has been pushed
+            std::atomic<bool> failed{ false };
+            uint32_t budget = 0; // packets the reader may produce this time round
+        };
+
+        // One lane of the sender. Every round it blasts the missing blocks of its own range.
+        struct SendLane {
+            const TransmissionInfo* handshake = nullptr;
+            const SendOptions* options = nullptr;
+            Bitmap* bitmap = nullptr; // what the receiver has, shared by every lane and only read while blasting
+            uint64_t first_block = 0; // the lane carries blocks [first_block, end_block)
+            uint64_t end_block = 0;
+            uint64_t file_size = 0;
+            bool owns_socket = false; // the first lane borrows the sender's udp socket
+            BlastChannel channel;
+            BlastControl control;
+            io::WindowedMap memmap;
+            ReadAhead* read_ahead = nullptr; // only with SendOptions::read_ahead, which sends from here instead of the map
+            io::BlockRing* nacks = nullptr; // in pipelined transfers, ranges to resend first. Ids are the first block, slots the count
+            uint32_t header_slots = 0;
+            uint64_t header_cursor = 0;
+            PacketHeader* headers = nullptr;
+            char* zero_padding = nullptr; // pads the final short block out to a full packet
+            uint64_t received_packets = 0; // blocks of the lane the receiver had at the last report
+            uint32_t sent_packets = 0; // packets blasted this round
+            uint32_t sent_parity = 0; // of those, how many were parity, which the receiver's bitmap doesn't show
+            uint64_t blast_ns = 0; // how long this round's blast took
+            uint64_t read_stalls = 0;
+            uint64_t nacked_blocks = 0; // blocks resent because of a NACK
+            uint32_t* block_crcs = nullptr; // with checksums, the CRC of every block sent. Shared by every lane
+            FecEncoder fec; // built on the reader thread with read ahead, otherwise on the lane's
+            uint64_t parity_blocks = 0;
+            uint32_t zero_crc = 0; // with checksums and zero blocks, the CRC of a block of zeros
+            uint64_t zero_blocks = 0;
+            CodecControl codec; // used on the reader thread with read ahead, otherwise on the lane's
+            char* packed = nullptr; // with compression, packed_slots blocks to compress into
+            uint32_t packed_slots = 0;
+            uint64_t packed_cursor = 0;
+            uint32_t epoch = 0; // the round being blasted, stamped on packets with sessions
+            bool repairing = false; // in pipelined transfers, only resending what was NACKed once the lane's new blocks are out
+            LaneStats stats;
+            bool ok = true; // false once a round has failed
+        };
 
-        bool ReceiveConnections(const char* hostname, const char* port, int port_num, ReceiverSockets& out) {
+        // The header of a packet the lane sends this round, before its checksum and codec
+        PacketHeader LaneHeader(const SendLane& lane, uint64_t id) {
+            return { id, 0, CODEC_RAW, lane.handshake->session_id, lane.epoch };
+        }
 
-            sk::SocketHandle& socket_udp = out.socket_udp;
-            sk::SocketHandle& socket_listen = out.socket_listen;
-            sk::SocketHandle& socket_sender = out.socket_sender;
+        bool CreateSendLane(SendLane& lane, const TransmissionInfo& handshake, const SendOptions& options, Bitmap& bitmap,
+            sk::SocketHandle socket, bool owns_socket, uint32_t lane_index,
+            const char* filename, uint64_t send_file_size, const char* hostname, int port_num) {
 
-            debug_printf("[receiver]: creating udp socket\n");
-            socket_udp = sk::CreateUDPSocketReceiver(port_num);
-            if (sk::IsInvalidSocket(socket_udp)) { debug_printf("[receiver]: failed to create udp socket\n"); return false; }
+            lane.handshake = &handshake;
+            lane.options = &options;
+            lane.bitmap = &bitmap;
+            lane.file_size = send_file_size;
+            lane.owns_socket = owns_socket;
+            LaneRange(handshake, lane_index, lane.first_block, lane.end_block);
 
-            debug_printf("[receiver]: creating listen socket\n");
-            socket_listen = rse::sk::CreateListenSocket(hostname, port, true);
-            if (sk::IsInvalidSocket(socket_listen)) {
-                sk::CloseSocket(socket_udp);
+            // Filling server information for use with a udp socket. Lanes after the first
+            // go to the ports after port_num, unless the receiver has them all on one.
+            BlastChannel& channel = lane.channel;
+            channel.socket = socket;
+            memset(&channel.addr, 0, sizeof(channel.addr));
+            channel.addr.sin_family = AF_INET;
+            channel.addr.sin_port = htons(port_num + (handshake.shared_port ? 0 : lane_index));
+            channel.addr.sin_addr.s_addr = inet_addr(hostname);
+
+            sk::SetSendBufferSize(channel.socket, options.socket_buffer_size);
+
+            // With segmentation offload several packets go out in one send and the kernel splits them
+            // back into datagrams. The packets are all padded to packet_size so they split evenly.
+            if (options.segmentation_offload) {
+                int segments = sk::SK_MAX_GSO_BYTES / (int)handshake.packet_size;
+                if (segments > sk::SK_MAX_GSO_SEGMENTS) segments = sk::SK_MAX_GSO_SEGMENTS;
+                if (segments > 1 && sk::EnableSegmentationOffload(channel.socket, handshake.packet_size)) {
+                    channel.segments_per_send = segments;
+                }
+            }
+
+            // Memory map our file we want to send, a window at a time
+            if (!options.read_ahead && !rse::io::OpenWindowedMap(filename, send_file_size, rse::io::MemMapIO::READ_ONLY, options.map_window_size, lane.memmap)) {
+                debug_printf("[sender]: failed to mem map file");
                 return false;
             }
 
-            // Will wait until it connects
-            debug_printf("[receiver]: waiting for connection...\n");
-            socket_sender = sk::AcceptFirstConnectionOnListenSocket(socket_listen);
+            // A header and a block per packet, plus the padding of the final block
+            sk::DatagramBatch& batch = channel.batch;
+            if (!sk::CreateDatagramBatch(options.batch_depth, batch, 2 * channel.segments_per_send + 1)) {
+                rse::io::CloseWindowedMap(lane.memmap);
+                return false;
+            }
+
+            // Or read the file ahead into whole packets, at least a couple of batches of them
+            if (options.read_ahead) {
+                lane.read_ahead = new ReadAhead();
+                th::InitSignal(lane.read_ahead->go);
+                th::InitSignal(lane.read_ahead->finished);
+                uint64_t capacity = options.read_ahead_size / handshake.packet_size;
+                uint64_t min_capacity = 2 * (uint64_t)batch.depth * channel.segments_per_send;
+                if (capacity < min_capacity) capacity = min_capacity;
+                if (!io::OpenBlockReader(filename, lane.read_ahead->reader) ||
+                    !io::CreateBlockRing(lane.read_ahead->ring, (uint32_t)capacity, handshake.packet_size)) {
+                    debug_printf("[sender]: failed to set up read ahead\n");
+                    io::CloseBlockReader(lane.read_ahead->reader);
+                    th::DestroySignal(lane.read_ahead->go);
+                    th::DestroySignal(lane.read_ahead->finished);
+                    delete lane.read_ahead;
+                    lane.read_ahead = nullptr;
+                    sk::DestroyDatagramBatch(batch);
+                    return false;
+                }
+            }
+
+            // A ring with room for a whole batch of sends
+            if (options.uring && !sk::CreateUring(channel.ring, batch.depth, batch.depth, options.uring_sqpoll)) {
+                debug_printf("[sender]: io_uring not available, using sendmmsg\n");
+            }
+
+            // Each packet is gathered from its header and a pointer straight into the memory map,
+            // so file bytes are never copied by us. With zero copy the kernel keeps reading a header
+            // until the send completes, so headers live in a ring that is only reused once released.
+            // Read ahead packets, parity and compressed blocks are reused as soon as they are sent, so they can't go zero copy.
+            bool reused = options.read_ahead || handshake.fec_group_size > 0 || handshake.compression;
+#ifdef RSE_TEST_FAULTS
+            reused = reused || options.faults != nullptr; // nor can the copies a test corrupts
+#endif
+            if (options.zero_copy && reused) debug_printf("[sender]: packets are reused as soon as they are sent, so zero copy is off\n");
+            channel.send_flags = options.zero_copy && !reused ? sk::EnableZeroCopy(channel.socket) : 0;
+            lane.header_slots = (uint32_t)batch.depth * channel.segments_per_send * HEADER_RING_BATCHES;
+            lane.headers = new PacketHeader[lane.header_slots];
+            lane.zero_padding = new char[handshake.block_size]();
+#ifdef RSE_TEST_FAULTS
+            channel.faults = options.faults;
+            if (options.faults != nullptr) {
+                channel.fault_size = (int)handshake.packet_size * channel.segments_per_send;
+                channel.header_size = (int)handshake.header_size;
+                channel.damaged = new char[(size_t)channel.fault_size * batch.depth];
+                channel.held = new char[(size_t)channel.fault_size * options.faults->late_datagrams];
+                channel.held_sizes = new int[options.faults->late_datagrams];
+                channel.replayed = new char[(size_t)channel.fault_size * (options.faults->replayed_datagrams + 1)];
+                channel.replayed_sizes = new int[options.faults->replayed_datagrams];
+            }
+#endif
+            if (handshake.checksum && handshake.zero_blocks) lane.zero_crc = ZeroBlockCrc(handshake.block_size);
+
+            // A compressed block ends its datagram, so a batch never has more of them than it has datagrams and
+            // the slots can go round. The reader thread compresses one block at a time, straight back into its packet.
+            if (handshake.compression) {
+                lane.codec.enabled = true;
+                lane.packed_slots = options.read_ahead ? 1 : (uint32_t)batch.depth;
+                lane.packed = new char[(size_t)handshake.block_size * lane.packed_slots];
+            }
+
+            // The reader thread pushes parity into its ring as soon as it is built, sending from the
+            // map keeps a few groups of it to fill up batches with
+            CreateFecEncoder(lane.fec, handshake, lane.first_block, lane.end_block, options.read_ahead ? 1 : FEC_PARITY_SETS);
 
+            // Every lane gets an even share of the rate and of the window. When paced,
+            // batches are flushed early so no burst is bigger than the bucket.
+            InitBlastControl(lane.control, handshake, options);
+            if (handshake.num_lanes > 1) {
+                lane.control.rate_mbps /= handshake.num_lanes;
+                lane.control.max_rate_mbps /= handshake.num_lanes;
+                if (options.adaptive && lane.control.rate_mbps > 0) {
+                    lane.control.window /= handshake.num_lanes;
+                    if (lane.control.window < MIN_PACKETS_PER_TRANSMISSION) lane.control.window = MIN_PACKETS_PER_TRANSMISSION;
+                }
+            }
+            InitPacer(channel.pacer, lane.control.rate_mbps, handshake.packet_size * channel.segments_per_send);
             return true;
         }
 
-        bool ReceiveTransmissionInfoAndReply(const ReceiverSockets& in, TransmissionInfo& info) {
+        void DestroySendLane(SendLane& lane, TransferStats& stats) {
 
-            sk::SocketHandle socket_sender = in.socket_sender;
-            sk::SocketError result;
-            info = { 0 };
+            sk::DatagramBatch& batch = lane.channel.batch;
 
-            // First 4 bytes are the number packets.
-            // Next 4 bytes are the size of the packets.
-            debug_printf("[receiver]: waiting to receive tranmission header...\n");
+            // The kernel may still be reading from the headers and the memory map
+            if (!sk::WaitForZeroCopyCompletions(lane.channel.socket, batch)) {
+                debug_printf("[sender]: gave up waiting for zero copy completions\n");
+            }
+            stats.zerocopy_sends += batch.zerocopy_sent;
+            stats.zerocopy_copied += batch.zerocopy_copied;
+            stats.zerocopy_completed += batch.zerocopy_completed;
+            lane.stats.datagram_syscalls += batch.syscalls;
+            lane.stats.map_remaps += lane.memmap.remaps;
 
-            result = sk::Recv(socket_sender, (char*)&info.number_packets, 4, 0);
-            if (sk::IsError(result)) { return false; }
-            result = sk::Recv(socket_sender, (char*)&info.block_size, 4, 0);
-            if (sk::IsError(result)) { return false; }
-            result = sk::Recv(socket_sender, info.path_name, rbudp::PATH_SIZE, 0);
-            if (sk::IsError(result)) { return false; }
+            sk::DestroyDatagramBatch(batch);
+            sk::DestroyUring(lane.channel.ring);
+            stats.read_stalls += lane.read_stalls;
+            stats.nacked_blocks += lane.nacked_blocks;
+            stats.parity_blocks += lane.parity_blocks;
+            stats.zero_blocks += lane.zero_blocks;
+            stats.compressed_blocks += lane.codec.compressed_blocks;
+            stats.compressed_bytes += lane.codec.compressed_bytes;
+            stats.bypassed_blocks += lane.codec.bypassed_blocks;
+            stats.codec_ns += lane.codec.codec_ns;
+            DestroyFecEncoder(lane.fec);
+            if (lane.read_ahead != nullptr) {
+                ReadAhead& ra = *lane.read_ahead;
+                if (ra.started) {
+                    ra.quit = true;
+                    th::RingSignal(ra.go);
+                    th::JoinThread(ra.thread);
+                }
+                th::DestroySignal(ra.go);
+                th::DestroySignal(ra.finished);
+                stats.disk_reads += lane.read_ahead->reader.reads;
+                stats.disk_bytes += lane.read_ahead->reader.bytes;
+                io::CloseBlockReader(lane.read_ahead->reader);
+                io::DestroyBlockRing(lane.read_ahead->ring);
+                delete lane.read_ahead;
+                lane.read_ahead = nullptr;
+            }
+            delete[] lane.headers;
+            delete[] lane.zero_padding;
+            delete[] lane.packed;
+#ifdef RSE_TEST_FAULTS
+            delete[] lane.channel.damaged;
+            delete[] lane.channel.held;
+            delete[] lane.channel.held_sizes;
+            delete[] lane.channel.replayed;
+            delete[] lane.channel.replayed_sizes;
+            lane.channel.damaged = nullptr;
+            lane.channel.held = nullptr;
+            lane.channel.held_sizes = nullptr;
+            lane.channel.replayed = nullptr;
+            lane.channel.replayed_sizes = nullptr;
+#endif
+            lane.headers = nullptr;
+            lane.zero_padding = nullptr;
+            lane.packed = nullptr;
+            rse::io::CloseWindowedMap(lane.memmap);
+            if (lane.owns_socket) sk::CloseSocket(lane.channel.socket);
+        }
 
-            info.bitmap_size = (info.number_packets / 8) + 1;
-            info.packet_size = info.block_size + PACKET_HEADER_SIZE;
-            info.total_transmission_size = info.number_packets * info.block_size;
-            info.summation_block_size = info.block_size * info.number_packets;
-            info.max_packets_per_transmission = ASSUMED_PORT_SIZE / info.packet_size;
+        // Where a lane is up to in a round. Blocks the receiver NACKed go first, then the missing
+        // blocks in order.
+        struct BlockCursor {
+            uint64_t next_new = 0;
+        };
 
-            debug_printf("[receiver]: transmission info [%d][%d][%s]\n", info.number_packets, info.block_size, info.path_name);
+        void StartBlockCursor(SendLane& lane, BlockCursor& cursor) {
+            cursor.next_new = lane.bitmap->FindNextClear(lane.first_block);
+        }
 
-            // Send a reply saying to start transmission
-            debug_printf("[receiver]: sending reply to start transmission\n");
-            uint8_t flag = 1;
-            result = sk::Send(socket_sender, (char*)&flag, sizeof(flag), 0);
-            if (sk::IsError(result)) return false;
+        // The next run of up to max consecutive blocks to send, starting at first. Returns how many
+        // blocks are in it, 0 once the round has nothing left to send.
+        uint64_t NextRun(SendLane& lane, BlockCursor& cursor, uint64_t& first, uint64_t max) {
+
+            if (lane.nacks != nullptr && io::BlockRingFilled(*lane.nacks) > 0) {
+                uint64_t& count = *(uint64_t*)io::BlockRingHeadSlot(*lane.nacks, 0);
+                first = io::BlockRingHeadId(*lane.nacks, 0);
+                uint64_t taken = count < max ? count : max;
+                if (taken == count) io::BlockRingPop(*lane.nacks, 1);
+                else {
+                    io::BlockRingHeadId(*lane.nacks, 0) += taken;
+                    count -= taken;
+                }
+                lane.nacked_blocks += taken;
+                return taken;
+            }
+
+            if (lane.repairing || cursor.next_new >= lane.end_block) return 0;
+            first = cursor.next_new;
+            uint64_t end = lane.bitmap->FindNextSet(first);
+            if (end > lane.end_block) end = lane.end_block;
+            if (end - first > max) end = first + max;
+            cursor.next_new = lane.bitmap->FindNextClear(end);
+            return end - first;
+        }
 
+        // Puts the parity of the group the reader just finished in the ring behind it
+        bool PushParity(SendLane& lane, ReadAhead& ra, uint64_t group_first) {
+            const TransmissionInfo& handshake = *lane.handshake;
+            FecEncoder& fec = lane.fec;
+            uint64_t idle_ns = READ_AHEAD_IDLE_MIN_NS;
+            while (io::BlockRingFree(ra.ring) < fec.groups.parity) {
+                if (ra.stop.load(std::memory_order_relaxed)) return false;
+                SleepNs(idle_ns);
+                if (idle_ns < READ_AHEAD_IDLE_MAX_NS) idle_ns *= 2;
+            }
+            for (uint32_t row = 0; row < fec.groups.parity; row++) {
+                char* slot = io::BlockRingSlot(ra.ring, row);
+                const char* parity = (const char*)ParityBlock(fec, row);
+                PacketHeader header = LaneHeader(lane, ParityId(group_first, row));
+                if (handshake.checksum) header.crc = HeaderCrc(Crc32c(0, parity, handshake.block_size), header.id);
+                memcpy(slot, &header, handshake.header_size);
+                memcpy(slot + handshake.header_size, parity, handshake.block_size);
+                io::BlockRingId(ra.ring, row) = handshake.packet_size;
+            }
+            io::BlockRingPush(ra.ring, fec.groups.parity);
+            lane.parity_blocks += fec.groups.parity;
+            lane.sent_parity += fec.groups.parity;
+            FinishFecGroup(fec, 0);
             return true;
         }
 
-        bool ReceiveFile(const ReceiverSockets &rc_sockets, const TransmissionInfo &handshake) {
+        // Walks the lane's missing blocks like BlastLane does, up to its window, reading runs of them
+        // into packets in the ring as it gets room
+        void ReadAheadRound(SendLane& lane) {
+            ReadAhead& ra = *lane.read_ahead;
+            const uint32_t block_size = lane.handshake->block_size;
+            const uint32_t window = ra.budget;
+            const uint64_t advise_bytes = (uint64_t)ra.ring.capacity * block_size;
+            char* blocks[io::MAX_READ_BLOCKS];
+            uint32_t produced = 0;
+            uint64_t idle_ns = READ_AHEAD_IDLE_MIN_NS;
 
-            sk::SocketError result;
-            sk::SocketHandle socket_udp = rc_sockets.socket_udp;
-            sk::SocketHandle socket_sender = rc_sockets.socket_sender;
-            timeval tval = { 0 };
-            int len = sizeof(sockaddr_in);
+            BlockCursor cursor;
+            StartBlockCursor(lane, cursor);
+            while (produced < window && !ra.stop.load(std::memory_order_relaxed)) {
 
-            // Create a new file and memory map
-            io::MemMap memmap;
-            if (!io::MapMemory(handshake.path_name, handshake.summation_block_size, io::MemMapIO::READ_WRITE, memmap)) {
-                debug_printf("failed to memory map path [%s]\n", handshake.path_name);
-                return false;
+                uint32_t free = io::BlockRingFree(ra.ring);
+                if (free == 0) {
+                    SleepNs(idle_ns);
+                    if (idle_ns < READ_AHEAD_IDLE_MAX_NS) idle_ns *= 2;
+                    continue;
+                }
+                idle_ns = READ_AHEAD_IDLE_MIN_NS;
+
+                // The next run of blocks, as far as the ring, the window and one read go
+                uint32_t limit = window - produced;
+                if (limit > free) limit = free;
+                if (limit > io::MAX_READ_BLOCKS) limit = io::MAX_READ_BLOCKS;
+                // With FEC a run of new blocks stops at the end of a group, so its parity can follow it
+                const FecGroups& groups = lane.fec.groups;
+                if (groups.group_size > 0 && cursor.next_new < lane.end_block) {
+                    uint64_t to_end = GroupEnd(groups, GroupFirst(groups, cursor.next_new)) - cursor.next_new;
+                    if (limit > to_end) limit = (uint32_t)to_end;
+                }
+                uint64_t first = 0;
+                int count = (int)NextRun(lane, cursor, first, limit);
+                if (count == 0) break;
+                for (int k = 0; k < count; k++) {
+                    char* slot = io::BlockRingSlot(ra.ring, k);
+                    blocks[k] = slot + lane.handshake->header_size;
+                }
+
+                io::AdviseBlockReader(ra.reader, first * block_size, advise_bytes);
+                if (!io::ReadBlocks(ra.reader, blocks, count, first * block_size, block_size)) {
+                    ra.failed.store(true);
+                    break;
+                }
+                // The headers go in once the blocks are there to checksum. Zero blocks go as just the header.
+                for (int k = 0; k < count; k++) {
+                    PacketHeader header = LaneHeader(lane, first + k);
+                    bool zero_block = lane.handshake->zero_blocks && IsZero(blocks[k], block_size);
+                    if (lane.block_crcs != nullptr) {
+                        header.crc = zero_block ? SealZeroBlock(header.id, lane.zero_crc, lane.block_crcs) :
+                            SealBlock(header.id, blocks[k], block_size, nullptr, block_size, lane.block_crcs);
+                    }
+                    memcpy(io::BlockRingSlot(ra.ring, k), &header, lane.handshake->header_size);
+                    io::BlockRingId(ra.ring, k) = zero_block ? lane.handshake->header_size : lane.handshake->packet_size;
+                }
+                uint64_t finished_group = UINT64_MAX;
+                for (int k = 0; k < count && finished_group == UINT64_MAX; k++) {
+                    uint32_t size = io::BlockRingId(ra.ring, k) == lane.handshake->header_size ? 0 : block_size;
+                    if (FoldFecBlock(lane.fec, first + k, blocks[k], size)) finished_group = GroupFirst(groups, first + k);
+                }
+                // Last the blocks that shrink are compressed back over themselves
+                for (int k = 0; k < count && lane.codec.enabled; k++) {
+                    if (io::BlockRingId(ra.ring, k) == lane.handshake->header_size) continue;
+                    uint32_t packed = CompressBlock(lane.codec, blocks[k], block_size, lane.packed);
+                    if (packed == 0) continue;
+                    memcpy(blocks[k], lane.packed, packed);
+                    PacketHeader header;
+                    memcpy(&header, io::BlockRingSlot(ra.ring, k), sizeof(header));
+                    header.codec = CODEC_LZ;
+                    memcpy(io::BlockRingSlot(ra.ring, k), &header, sizeof(header));
+                    io::BlockRingId(ra.ring, k) = lane.handshake->header_size + packed;
+                }
+                io::BlockRingPush(ra.ring, count);
+                produced += count;
+                if (finished_group != UINT64_MAX) {
+                    if (!PushParity(lane, ra, finished_group)) break;
+                    produced += groups.parity;
+                }
             }
+        }
 
-            rse::Bitmap packet_bitmap(handshake.number_packets);
-            char* packet_buffer = new char[handshake.packet_size];
-            bool return_val = false;
+        // Reads a round ahead each time the socket thread asks, until it asks to quit
+        void ReadAheadThread(void* arg) {
+            SendLane& lane = *(SendLane*)arg;
+            ReadAhead& ra = *lane.read_ahead;
             while (true) {
+                th::WaitSignal(ra.go);
+                if (ra.quit) break;
+                ReadAheadRound(lane);
+                ra.done.store(true, std::memory_order_release);
+                th::RingSignal(ra.finished);
+            }
+        }
 
-                // read message signifing the sender is done
-                debug_printf("[receiver]: waiting for go ahead from sender...\n");
-                uint8_t flag;
-                result = sk::Recv(socket_sender, (char*)&flag, sizeof(flag), 0);
-                if (sk::IsError(result)) break;
+        // Blasts the packets the lane's reader thread prepares. Packets are only given back to the
+        // reader once the batch they are in has been sent.
+        bool BlastLaneReadAhead(SendLane& lane) {
 
-                debug_printf("[receiver]: sender is telling me it sent udp stuff\n");
-                if (flag == 0) {
-                    // the sender is done
-                    return_val = true;
-                    debug_printf("[receiver]: sender told me it's happy with transmission and has finished\n");
-                    break;
-                }
+            const TransmissionInfo& handshake = *lane.handshake;
+            BlastChannel& channel = lane.channel;
+            sk::DatagramBatch& batch = channel.batch;
+            ReadAhead& ra = *lane.read_ahead;
+            int segments = 0; // packets in the datagram currently being built
+            uint32_t queued = 0; // ring slots in the batch
+            bool ok = true;
 
-                // Check if udp socket is ready to be read
-                fd_set read_set;
-                FD_ZERO(&read_set);
-                FD_SET(socket_udp, &read_set);
+            // A repair pass carries on the round
+            uint64_t blast_start_ns = NowNs();
+            if (!lane.repairing) {
+                lane.sent_packets = 0;
+                lane.sent_parity = 0;
+                lane.blast_ns = 0;
+            }
+            debug_printf("[sender]: window [%u] rate [%lf]\n", lane.control.window, lane.control.rate_mbps);
 
-                // Check for udp messages
-                while (select(0, &read_set, nullptr, nullptr, &tval) > 0) {
+            // Pipelined transfers aren't held to the window, see "Streaming NACKs"
+            const uint32_t window = handshake.pipelined ? UINT32_MAX : lane.control.window;
+            ra.budget = window > lane.sent_packets ? window - lane.sent_packets : 0;
+            ra.stop.store(false);
+            ra.done.store(false);
+            ra.reader.advised_end = 0; // the missing blocks have changed, so ask for them again
+            lane.codec.rate_mbps = lane.control.rate_mbps;
+            if (!ra.started) {
+                ra.started = th::StartThread(ra.thread, ReadAheadThread, &lane);
+                if (!ra.started) {
+                    debug_printf("[sender]: failed to start the read ahead thread\n");
+                    return false;
+                }
+            }
+            th::RingSignal(ra.go);
 
-                    sockaddr_in cliaddr = { 0 };
+            uint64_t idle_ns = READ_AHEAD_IDLE_MIN_NS;
+            while (true) {
 
-                    debug_printf("[receiver]: recvfrom sender\n");
-                    memset(packet_buffer, 0, handshake.packet_size);
-                    result = sk::RecvFrom(socket_udp, packet_buffer, handshake.packet_size,
-                        0, (sockaddr*)&cliaddr,
-                        &len);
+                // Read before the ring, so nothing pushed before the reader finished is missed
+                bool reader_done = ra.done.load(std::memory_order_acquire);
+                uint32_t ready = io::BlockRingFilled(ra.ring) - queued;
 
-                    if (sk::IsError(result)) {
-                        debug_printf("[receiver]: error reading packet\n");
-                        goto label_cleanup;
+                if (ready == 0) {
+                    // Send what we have rather than wait on the disk with it
+                    if (queued > 0) {
+                        segments = 0;
+                        if (!FlushBatch(channel)) {
+                            ok = false;
+                            break;
+                        }
+                        io::BlockRingPop(ra.ring, queued);
+                        queued = 0;
+                        continue;
                     }
-                    else {
-                        uint32_t id = *(uint32_t*)packet_buffer;
-                        // This check ensures that the data we access via the
-                        // bitmap is valid
-                        if (id >= handshake.number_packets) {
-                            debug_printf("[receiver]: packet error\n");
-                            goto label_cleanup;
+                    if (reader_done) break;
+                    lane.read_stalls++;
+                    SleepNs(idle_ns);
+                    if (idle_ns < READ_AHEAD_IDLE_MAX_NS) idle_ns *= 2;
+                    continue;
+                }
+                idle_ns = READ_AHEAD_IDLE_MIN_NS;
+
+                for (uint32_t k = 0; k < ready && ok; k++) {
+                    uint32_t size = (uint32_t)io::BlockRingHeadId(ra.ring, queued);
+                    if (segments == 0) sk::BatchStartDatagram(batch);
+                    sk::BatchAppendBuffer(batch, io::BlockRingHeadSlot(ra.ring, queued), size);
+                    queued++;
+
+                    lane.sent_packets++;
+                    lane.stats.datagrams++;
+                    if (size == handshake.header_size) lane.zero_blocks++;
+                    lane.stats.bytes += size - handshake.header_size;
+                    channel.batch_bytes += size;
+
+                    // Zero and compressed blocks are short packets, so they end the datagram
+                    if (++segments == channel.segments_per_send || size < handshake.packet_size) {
+                        segments = 0;
+                        // Half a bucket, so tokens that build up while we oversleep are not lost
+                        bool burst_full = IsPaced(channel.pacer) &&
+                            channel.batch_bytes + handshake.packet_size * channel.segments_per_send > channel.pacer.capacity / 2;
+                        if (sk::IsBatchFull(batch) || burst_full) {
+                            ok = FlushBatch(channel);
+                            io::BlockRingPop(ra.ring, queued);
+                            queued = 0;
                         }
+                    }
+                }
+                if (!ok) break;
+            }
 
-                        char* block_ptr = packet_buffer + rbudp::PACKET_HEADER_SIZE;
+            // Whatever the round ended on, the ring starts the next one empty
+            ra.stop.store(true);
+            th::WaitSignal(ra.finished);
+            sk::ClearBatch(batch);
+            channel.batch_bytes = 0;
+            io::BlockRingPop(ra.ring, io::BlockRingFilled(ra.ring));
+            if (ra.failed.load()) {
+                debug_printf("[sender]: reading the file failed\n");
+                ok = false;
+            }
 
-                        // Copy the packet buffer to the mapped file
-                        char* mem_ptr = (char*)memmap.ptr + (id * (size_t)handshake.block_size);
-                        memcpy(mem_ptr, block_ptr, handshake.block_size);
+            uint64_t blast_ns = NowNs() - blast_start_ns;
+            lane.blast_ns += blast_ns;
+            lane.stats.seconds += blast_ns / 1e9;
+            return ok;
+        }
 
-                        debug_printf("[receiver]: block [%c]\n", block_ptr[0]);
+        // Blasts up to the lane's window of its missing blocks
+        // Adds a packet to the datagram being built, its payload padded out to a whole block, and sends
+        // the batch once it is full or holds as much as the pacer lets out at once. A zero block is
+        // just the header and a compressed one isn't padded, and either ends the datagram.
+        bool QueuePacket(SendLane& lane, int& segments, const PacketHeader& packet_header, const char* payload, uint32_t size, bool zero_block = false) {
 
-                        packet_bitmap.Set(id);
+            const TransmissionInfo& handshake = *lane.handshake;
+            BlastChannel& channel = lane.channel;
+            sk::DatagramBatch& batch = channel.batch;
 
-                        debug_printf("[receiver]: read packet [%d]\n", id);
-                        debug_printf("[receiver]: bitmap ");
-                        packet_bitmap.Print();
+            if (segments == 0) {
+                // Wait for the kernel to let go of the headers we are about to reuse
+                while ((batch.zerocopy_sent - batch.zerocopy_completed + batch.count + 1) * channel.segments_per_send > lane.header_slots) {
+                    sk::SocketError result = sk::ReadZeroCopyCompletions(channel.socket, batch, true);
+                    if (sk::IsError(result) || result == 0) {
+                        sk::ErrorMessage("[sender]: zero copy completions failed");
+                        return false;
                     }
-                    debug_printf("[receiver]: selecting...\n");
                 }
+                sk::BatchStartDatagram(batch);
+            }
 
-                debug_printf("[receiver]: no more packets to read\n");
-
-                debug_printf("[receiver]: sending off bitmap to sender\n");
+            PacketHeader* header = &lane.headers[lane.header_cursor++ % lane.header_slots];
+            *header = packet_header;
 
-                // send off our bitmap to the client.
-                result = sk::Send(socket_sender, (char*)packet_bitmap.Data(), packet_bitmap.SizeOf(), 0);
-                if (sk::IsError(result)) break;
+            sk::BatchAppendBuffer(batch, (char*)header, handshake.header_size);
+            lane.sent_packets++;
+            lane.stats.datagrams++;
+            bool compressed = packet_header.codec == CODEC_LZ;
+            if (zero_block) {
+                lane.zero_blocks++;
+                channel.batch_bytes += handshake.header_size;
+            }
+            else if (compressed) {
+                sk::BatchAppendBuffer(batch, (char*)payload, size);
+                lane.stats.bytes += size;
+                channel.batch_bytes += handshake.header_size + size;
+            }
+            else {
+                if (size > 0) sk::BatchAppendBuffer(batch, (char*)payload, size);
+                if (size < handshake.block_size) sk::BatchAppendBuffer(batch, lane.zero_padding, handshake.block_size - size);
+                lane.stats.bytes += handshake.block_size;
+                channel.batch_bytes += handshake.packet_size;
             }
 
-        label_cleanup:
+            if (++segments == channel.segments_per_send || zero_block || compressed) {
+                segments = 0;
+                // Half a bucket, so tokens that build up while we oversleep are not lost
+                bool burst_full = IsPaced(channel.pacer) &&
+                    channel.batch_bytes + handshake.packet_size * channel.segments_per_send > channel.pacer.capacity / 2;
+                if (sk::IsBatchFull(batch) || burst_full) {
+                    if (!FlushBatch(channel)) return false;
+                }
+            }
+            return true;
+        }
 
-            delete[] packet_buffer;
-            io::UnmapMemory(memmap);
-            return return_val;
+        // Sends the parity of the group block id just finished
+        bool QueueParity(SendLane& lane, int& segments, uint64_t id) {
+            const TransmissionInfo& handshake = *lane.handshake;
+            FecEncoder& fec = lane.fec;
+            uint64_t group_first = GroupFirst(fec.groups, id);
+            for (uint32_t row = 0; row < fec.groups.parity; row++) {
+                const char* parity = (const char*)ParityBlock(fec, row);
+                PacketHeader header = LaneHeader(lane, ParityId(group_first, row));
+                if (handshake.checksum) header.crc = HeaderCrc(Crc32c(0, parity, handshake.block_size), header.id);
+                if (!QueuePacket(lane, segments, header, parity, handshake.block_size)) return false;
+                lane.parity_blocks++;
+                lane.sent_parity++;
+            }
+            FinishFecGroup(fec, lane.channel.flushes);
+            return true;
         }
 
-        // This does require that sockets have been initialised.
-        // Wait to receive a file from the specifed host at the specified port
-        // The reason this is a long function is because its easier to not make a mistake that way
-        // particularly in terms of security. Ideally the whole thing would just be one long function.
-        // Its up for debate how it should get split up.
-        bool WaitToReceive(const char* hostname, const char* port_str, int port_num) {
+        bool BlastLane(SendLane& lane) {
 
-            ReceiverSockets rc_sockets;
-            TransmissionInfo handshake = { 0 };
+            if (lane.read_ahead != nullptr) return BlastLaneReadAhead(lane);
 
-            if (!rbudp::ReceiveConnections(hostname, port_str, port_num, rc_sockets)) {
-                debug_printf("[receiver]: receiving connections failed\n");
-                return false;
-            }
-            sk::SocketHandle socket_udp = rc_sockets.socket_udp;
-            sk::SocketHandle socket_listen = rc_sockets.socket_listen;
-            sk::SocketHandle socket_sender = rc_sockets.socket_sender;
+            const TransmissionInfo& handshake = *lane.handshake;
+            const uint32_t block_size = handshake.block_size;
+            BlastChannel& channel = lane.channel;
+            int segments = 0; // packets in the datagram currently being built
 
-            if (!rbudp::ReceiveTransmissionInfoAndReply(rc_sockets, handshake)) {
-                rse::sk::CloseSocket(socket_udp);
-                rse::sk::CloseSocket(socket_listen);
-                rse::sk::CloseSocket(socket_sender);
-                debug_printf("[receiver]: receiving transmission failed\n");
-                return false;
+            // A repair pass carries on the round
+            uint64_t blast_start_ns = NowNs();
+            if (!lane.repairing) {
+                lane.sent_packets = 0;
+                lane.sent_parity = 0;
+                lane.blast_ns = 0;
             }
+            lane.codec.rate_mbps = lane.control.rate_mbps;
+            debug_printf("[sender]: window [%u] rate [%lf]\n", lane.control.window, lane.control.rate_mbps);
 
-            bool ret_val = rbudp::ReceiveFile(rc_sockets, handshake);
+            // Pipelined transfers aren't held to the window, see "Streaming NACKs"
+            const uint32_t window = handshake.pipelined ? UINT32_MAX : lane.control.window;
+            BlockCursor cursor;
+            StartBlockCursor(lane, cursor);
+            uint64_t run_first = 0;
+            uint64_t run_left = 0;
+            while (lane.sent_packets < window) {
 
-            debug_printf("[receiver]: finished\n");
-            rse::sk::CloseSocket(socket_udp);
-            rse::sk::CloseSocket(socket_listen);
-            rse::sk::CloseSocket(socket_sender);
+                if (run_left == 0) {
+                    run_left = NextRun(lane, cursor, run_first, window - lane.sent_packets);
+                    if (run_left == 0) break;
+                }
+                uint64_t i = run_first++;
+                run_left--;
 
-            return ret_val;
-        }
+                debug_printf("[sender]: sending packet [%llu]\n", (unsigned long long)i);
 
-        bool SenderConnect(const char* hostname, const char* port_str, SenderSockets& s_sockets) {
+                uint64_t offset_start = i * (uint64_t)block_size;
+                uint64_t offset_end = offset_start + block_size;
+                if (offset_end > lane.file_size) offset_end = lane.file_size;
+                uint32_t send_size = offset_end > offset_start ? (uint32_t)(offset_end - offset_start) : 0;
 
-            sockaddr serverAddr;
-            socklen_t serverAddrLen = 0;
-            s_sockets.socket_receiver = sk::CreateClientSocketForServer(hostname, port_str, serverAddr, serverAddrLen, true);
+                // Queued datagrams point into the current window, so send them before it moves.
+                // With zero copy the kernel holds on to the pages it is still sending from.
+                // The same goes for parity about to be built over.
+                char* block = nullptr;
+                if (send_size > 0) {
+                    if (!io::InWindow(lane.memmap, offset_start, send_size)) {
+                        segments = 0;
+                        if (!FlushBatch(channel)) return false;
+                    }
+                    block = io::MapRange(lane.memmap, offset_start, send_size);
+                    if (block == nullptr) {
+                        debug_printf("[sender]: failed to map block [%llu]\n", (unsigned long long)i);
+                        return false;
+                    }
+                }
+                if (StartsFecGroup(lane.fec, i) && lane.fec.sent_in[lane.fec.current] == channel.flushes) {
+                    segments = 0;
+                    if (!FlushBatch(channel)) return false;
+                }
 
-            debug_printf("[sender]: connecting to receiver\n");
-            sk::SocketError result = sk::Connect(s_sockets.socket_receiver, &serverAddr, serverAddrLen);
-            if (sk::IsError(result)) {
-                sk::CloseSocket(s_sockets.socket_receiver);
-                debug_printf("[sender]: failed to connect\n");
-                return false;
-            }
+                bool zero_block = handshake.zero_blocks && IsZero(block, send_size);
+                PacketHeader header = LaneHeader(lane, i);
+                if (lane.block_crcs != nullptr) {
+                    header.crc = zero_block ? SealZeroBlock(i, lane.zero_crc, lane.block_crcs) :
+                        SealBlock(i, block, send_size, lane.zero_padding, block_size, lane.block_crcs);
+                }
+                char* packed = nullptr;
+                uint32_t packed_size = 0;
+                if (lane.codec.enabled && !zero_block) {
+                    packed = lane.packed + (size_t)(lane.packed_cursor % lane.packed_slots) * block_size;
+                    packed_size = CompressBlock(lane.codec, block, send_size, packed);
+                }
+                if (packed_size > 0) {
+                    header.codec = CODEC_LZ;
+                    lane.packed_cursor++;
+                    if (!QueuePacket(lane, segments, header, packed, packed_size)) return false;
+                }
+                else if (!QueuePacket(lane, segments, header, block, send_size, zero_block)) return false;
 
-            s_sockets.socket_udp = rse::sk::CreateUDPSocketSender();
-            if (sk::IsInvalidSocket(s_sockets.socket_udp)) {
-                debug_printf("[sender]: invalid udp socket\n");
-                sk::CloseSocket(s_sockets.socket_receiver);
-                return false;
+                // The first time a group's last block goes out its parity follows it
+                if (FoldFecBlock(lane.fec, i, block, zero_block ? 0 : send_size) && !QueueParity(lane, segments, i)) return false;
             }
 
+            // Send whatever is left over from this round
+            if (!FlushBatch(channel)) return false;
+
+            uint64_t blast_ns = NowNs() - blast_start_ns;
+            lane.blast_ns += blast_ns;
+            lane.stats.seconds += blast_ns / 1e9;
             return true;
         }
 
-        bool SendTransmissionInfoAndWait(
-            const SenderSockets& s_sockets,
-            const char* path_to_write, size_t send_file_size, const int block_size,
-            TransmissionInfo& handshake) {
+        void BlastLaneThread(void* arg) {
+            SendLane* lane = (SendLane*)arg;
+            lane->ok = BlastLane(*lane);
+        }
 
-            sk::SocketError result;
-            handshake = { 0 };
+        // Reads NACKs off the control connection while the lanes blast, and hands each lane the
+        // ranges that fall in it. A lane whose queue is full misses out, the report at the end of
+        // the round still has them.
+        struct NackListener {
+            sk::SocketHandle socket = sk::SK_INVALID_SOCKET;
+            const TransmissionInfo* handshake = nullptr;
+            SendLane* lanes = nullptr;
+            uint32_t num_lanes = 0;
+            uint8_t* buffer = nullptr; // bitmap_size bytes
+            sk::Poller poller;
+            th::ThreadHandle thread;
+            bool started = false;
+            std::atomic<bool> stop{ false };
+            std::atomic<bool> failed{ false };
+            uint64_t nacks = 0;
+            uint64_t bytes = 0;
+        };
 
-            handshake.number_packets = (send_file_size / block_size) + 1;
-            handshake.block_size = block_size;
-            handshake.packet_size = block_size + PACKET_HEADER_SIZE;
-            handshake.bitmap_size = (handshake.number_packets / 8) + 1;
-            handshake.max_packets_per_transmission = ASSUMED_PORT_SIZE / handshake.packet_size;
-            strcpy(handshake.path_name, path_to_write);
+        // Queues the ranges in a NACK's payload on their lanes. Returns false if it is malformed.
+        bool ApplyNack(NackListener& listener, const uint8_t* p, const uint8_t* end) {
+            const TransmissionInfo& handshake = *listener.handshake;
+            uint64_t prev_end = 0;
+            while (p < end) {
+                uint64_t gap, length;
+                if (!ReadVarint(p, end, gap) || !ReadVarint(p, end, length)) return false;
+                if (length == 0 || gap > handshake.number_packets - prev_end ||
+                    length > handshake.number_packets - prev_end - gap) return false;
+                uint64_t first = prev_end + gap;
+                prev_end = first + length;
 
-            // Send off the packet info to the receiver
-            debug_printf("[sender]: sending handshake...\n");
-            result = sk::Send(s_sockets.socket_receiver, (char*)&handshake.number_packets, 4, 0);
-            if (sk::IsError(result)) return false;
-            result = sk::Send(s_sockets.socket_receiver, (char*)&handshake.block_size, 4, 0);
+                // A range can cross from one lane into the next
+                for (uint32_t l = 0; l < listener.num_lanes && first < prev_end; l++) {
+                    SendLane& lane = listener.lanes[l];
+                    if (first < lane.first_block || first >= lane.end_block) continue;
+                    uint64_t count = (prev_end < lane.end_block ? prev_end : lane.end_block) - first;
+                    if (io::BlockRingFree(*lane.nacks) > 0) {
+                        io::BlockRingId(*lane.nacks, 0) = first;
+                        *(uint64_t*)io::BlockRingSlot(*lane.nacks, 0) = count;
+                        io::BlockRingPush(*lane.nacks, 1);
+                    }
+                    first += count;
+                }
+            }
+            return true;
+        }
+
+        // Reads one loss report or NACK. NACKs are applied when apply is set, and the encoding
+        // and payload size of whatever was read are handed back.
+        bool ReadControlMessage(NackListener& listener, bool apply, uint8_t& encoding, uint32_t& payload_size) {
+            uint8_t header[REPORT_HEADER_SIZE];
+            sk::SocketError result = sk::RecvAll(listener.socket, (char*)header, REPORT_HEADER_SIZE, 0);
             if (sk::IsError(result)) return false;
-            result = sk::Send(s_sockets.socket_receiver, handshake.path_name, rse::rbudp::PATH_SIZE, 0);
+            encoding = header[0];
+            memcpy(&payload_size, header + 1, 4);
+            if (payload_size > listener.handshake->bitmap_size) {
+                debug_printf("[sender] bad loss report\n");
+                return false;
+            }
+            result = sk::RecvAll(listener.socket, (char*)listener.buffer, payload_size, 0);
             if (sk::IsError(result)) return false;
+            listener.bytes += REPORT_HEADER_SIZE + payload_size;
 
-            // Wait for a response from the receiver
-            debug_printf("[sender] sender waiting for response from receiver...\n");
-            uint8_t is_receiver_happy;
-            result = sk::Recv(s_sockets.socket_receiver, (char*)&is_receiver_happy, sizeof(is_receiver_happy), 0);
-            if (sk::IsError(result)) {
-                debug_printf("Error getting flag\n");
+            if (encoding != (uint8_t)ReportEncoding::NACK) return true;
+            listener.nacks++;
+            if (apply && !ApplyNack(listener, listener.buffer, listener.buffer + payload_size)) {
+                debug_printf("[sender] bad nack\n");
                 return false;
             }
-
-            // Flag siginifies we should start protocol
-            debug_printf("[sender] receiver is happy with handshake\n");
             return true;
         }
 
+        void NackListenerThread(void* arg) {
+            NackListener& listener = *(NackListener*)arg;
+            sk::SocketHandle ready[1];
+            while (!listener.stop.load(std::memory_order_relaxed)) {
+                sk::SocketError result = sk::PollerWait(listener.poller, ready, 1, NACK_LISTEN_POLL_MS);
+                if (sk::IsError(result)) {
+                    listener.failed.store(true);
+                    return;
+                }
+                if (result == 0) continue;
+
+                uint8_t encoding;
+                uint32_t payload_size;
+                if (!ReadControlMessage(listener, true, encoding, payload_size) || encoding != (uint8_t)ReportEncoding::NACK) {
+                    // Nothing but NACKs should turn up before we ask for the report
+                    listener.failed.store(true);
+                    return;
+                }
+            }
+        }
 
         bool SendPackets(const TransmissionInfo &handshake, SenderSockets s_sockets,
-            const uint32_t block_size,
-            const char* filename, const char* hostname, int port_num, size_t send_file_size) {
+            const char* filename, const char* hostname, int port_num, uint64_t send_file_size,
+            const SendOptions& options, TransferStats& stats) {
 
-            sk::SocketError result;
             bool return_val = false;
 
-            // Filling server information for use with a udp socket
-            sockaddr_in servaddr;
-            memset(&servaddr, 0, sizeof(servaddr));
-            servaddr.sin_family = AF_INET;
-            servaddr.sin_port = htons(port_num);
-            servaddr.sin_addr.s_addr = inet_addr(hostname);
-
-            // Memory map our file we want to send
-            rse::io::MemMap memmap;
-            if (!rse::io::MapMemory(filename, send_file_size, rse::io::MemMapIO::READ_ONLY, memmap)) {
-                debug_printf("[sender]: failed to mem map file");
-                return false;
-            }
-
             rse::Bitmap recv_bitmap(handshake.number_packets);
-            char* packet_buffer = new char[handshake.packet_size];
-            char* recv_bitmap_buffer = new char[handshake.bitmap_size];
-            uint32_t sent_packets = 0;
+            uint8_t* report_buffer = new (std::nothrow) uint8_t[handshake.bitmap_size];
+            uint32_t* block_crcs = handshake.checksum ? new (std::nothrow) uint32_t[handshake.number_packets]() : nullptr;
+            stats.target_rate_mbps = options.rate_mbps;
 
-            // Keep sending until our bitmap is fully set
-            while (true) {
+            // The first lane uses the socket we already have, the rest get their own. Every lane gets
+            // a worker that stays up for the whole transfer to blast it.
+            SendLane lanes[MAX_LANES];
+            void* lane_args[MAX_LANES];
+            uint32_t num_lanes = 0;
+            th::Workers workers;
 
-                debug_printf("[sender]: sending udp payload\n");
-                sent_packets = 0;
+            // Reads what comes back over the control connection, and in pipelined transfers
+            // does so on a thread of its own while the lanes blast
+            NackListener listener;
+            io::BlockRing nack_queues[MAX_LANES];
+            listener.socket = s_sockets.socket_receiver;
+            listener.handshake = &handshake;
+            listener.lanes = lanes;
+            listener.buffer = report_buffer;
+            if (!recv_bitmap.Allocated() || report_buffer == nullptr || (handshake.checksum && block_crcs == nullptr)) {
+                debug_printf("[sender]: out of memory for [%llu] blocks\n", (unsigned long long)handshake.number_packets);
+                goto label_cleanup;
+            }
+            if (handshake.pipelined && (!sk::CreatePoller(listener.poller) || !sk::PollerAdd(listener.poller, listener.socket, false))) {
+                goto label_cleanup;
+            }
 
-                for (uint32_t i = 0; i < recv_bitmap.Size(); i++) {
+            // Leave out whatever the receiver already has before the lanes start walking the bitmap. That is
+            // what an earlier try got there if there was one, see "Resuming", otherwise the blocks that match.
+            if (handshake.resume) {
+                if (!RecvBlockReport(s_sockets.socket_receiver, handshake, report_buffer, recv_bitmap, stats)) {
+                    debug_printf("[sender]: bad report of the blocks to resume from\n");
+                    goto label_cleanup;
+                }
+                stats.resumed_blocks = recv_bitmap.count.load();
+                // The receiver's digest covers the blocks it kept, which are never sent to be sealed
+                if (handshake.checksum && stats.resumed_blocks > 0 &&
+                    !HashBlocks(filename, handshake.block_size, handshake.number_packets, nullptr, nullptr, block_crcs)) {
+                    goto label_cleanup;
+                }
+            }
+            if (handshake.delta && stats.resumed_blocks == 0 && !MatchBlockHashes(s_sockets.socket_receiver, handshake, filename, recv_bitmap, block_crcs, stats)) {
+                goto label_cleanup;
+            }
+
+            for (; num_lanes < handshake.num_lanes; num_lanes++) {
+                bool owns_socket = num_lanes > 0;
+                sk::SocketHandle socket = owns_socket ? sk::CreateUDPSocketSender() : s_sockets.socket_udp;
+                if (sk::IsInvalidSocket(socket)) {
+                    debug_printf("[sender]: invalid udp socket\n");
+                    goto label_cleanup;
+                }
+                if (!CreateSendLane(lanes[num_lanes], handshake, options, recv_bitmap, socket, owns_socket, num_lanes,
+                    filename, send_file_size, hostname, port_num)) {
+                    if (owns_socket) sk::CloseSocket(socket);
+                    goto label_cleanup;
+                }
+                lanes[num_lanes].block_crcs = block_crcs;
+                lanes[num_lanes].received_packets = recv_bitmap.CountRange(lanes[num_lanes].first_block, lanes[num_lanes].end_block - lanes[num_lanes].first_block);
+                lane_args[num_lanes] = &lanes[num_lanes];
+                listener.num_lanes = num_lanes + 1;
+                if (handshake.pipelined) {
+                    if (!io::CreateBlockRing(nack_queues[num_lanes], NACK_QUEUE_RANGES, sizeof(uint64_t))) {
+                        num_lanes++;
+                        goto label_cleanup;
+                    }
+                    lanes[num_lanes].nacks = &nack_queues[num_lanes];
+                }
+            }
 
-                    if (sent_packets >= handshake.max_packets_per_transmission) break;
+            th::StartWorkers(workers, BlastLaneThread, lane_args, (int)num_lanes);
 
-                    if (!recv_bitmap[i]) {
-                        sent_packets++;
+            // Keep sending until our bitmap is fully set, which a delta transfer can find it is before the first blast
+            while (!recv_bitmap.AllSet()) {
 
-                        debug_printf("[sender]: sending packet [%d]\n", i);
+#ifdef RSE_TEST_FAULTS
+                if (options.faults != nullptr && options.faults->abort_after_rounds > 0 && stats.rounds == options.faults->abort_after_rounds) {
+                    debug_printf("[sender]: giving up after [%u] rounds\n", stats.rounds);
+                    goto label_cleanup;
+                }
+#endif
 
-                        uint32_t offset_start = i * block_size;
-                        uint32_t offset_end = offset_start + block_size;
-                        if (offset_end > send_file_size) offset_end = send_file_size;
-                        uint32_t send_size = offset_end - offset_start;
+                debug_printf("[sender]: sending udp payload\n");
+                stats.rounds++;
+                uint64_t blast_start_ns = NowNs();
+                for (uint32_t lane = 0; lane < num_lanes; lane++) lanes[lane].epoch = stats.rounds - 1;
 
-                        memset(packet_buffer, 0, handshake.packet_size);
-                        // Copy packet header into packet buffer
-                        uint32_t* header_ptr = (uint32_t*)packet_buffer;
-                        *header_ptr = i;
-                        // Copy block data into packet buffer
-                        char* block_file_ptr = (char*)memmap.ptr + offset_start;
-                        char* block_mem_ptr = packet_buffer + PACKET_HEADER_SIZE;
+                if (handshake.pipelined) {
+                    listener.stop.store(false);
+                    listener.started = th::StartThread(listener.thread, NackListenerThread, &listener);
+                    if (!listener.started) goto label_cleanup;
+                }
 
-                        memcpy(block_mem_ptr, block_file_ptr, send_size);
+                th::RunOnWorkers(workers);
 
-                        result = rse::sk::SendTo(s_sockets.socket_udp, packet_buffer, handshake.packet_size, 0, (const sockaddr*)&servaddr, sizeof(servaddr));
-                        if (rse::sk::IsError(result)) {
-                            rse::sk::ErrorMessage("[sender]: sendto failed");
-                            goto label_cleanup;
+                // Out of new blocks, the lanes carry on resending what is NACKed until the NACKs stop
+                if (handshake.pipelined) {
+                    uint64_t quiet_ns = (uint64_t)NACK_QUIET_MS * 1000000 + lanes[0].control.min_rtt_ns;
+                    uint64_t last_pass_ns = NowNs();
+                    uint64_t idle_ns = READ_AHEAD_IDLE_MIN_NS;
+                    while (!listener.failed.load()) {
+                        bool repair = false;
+                        for (uint32_t lane = 0; lane < num_lanes; lane++) {
+                            repair = repair || (lanes[lane].ok && io::BlockRingFilled(nack_queues[lane]) > 0);
                         }
+                        if (!repair) {
+                            if (NowNs() - last_pass_ns >= quiet_ns) break;
+                            SleepNs(idle_ns);
+                            if (idle_ns < READ_AHEAD_IDLE_MAX_NS) idle_ns *= 2;
+                            continue;
+                        }
+                        idle_ns = READ_AHEAD_IDLE_MIN_NS;
+                        for (uint32_t lane = 0; lane < num_lanes; lane++) lanes[lane].repairing = true;
+                        th::RunOnWorkers(workers);
+                        stats.repair_passes++;
+                        last_pass_ns = NowNs();
                     }
+                    for (uint32_t lane = 0; lane < num_lanes; lane++) lanes[lane].repairing = false;
+                }
+
+                // NACKs still queued are stale once the report is in
+                if (listener.started) {
+                    listener.stop.store(true);
+                    th::JoinThread(listener.thread);
+                    listener.started = false;
+                    for (uint32_t lane = 0; lane < num_lanes; lane++) io::BlockRingPop(nack_queues[lane], io::BlockRingFilled(nack_queues[lane]));
+                }
+                if (listener.failed.load()) {
+                    debug_printf("[sender] reading nacks failed\n");
+                    goto label_cleanup;
                 }
 
+                bool lanes_ok = true;
+                for (uint32_t lane = 0; lane < num_lanes; lane++) lanes_ok = lanes_ok && lanes[lane].ok;
+                if (!lanes_ok) goto label_cleanup;
+
+                uint64_t blast_end_ns = NowNs();
+                stats.blast_seconds += (blast_end_ns - blast_start_ns) / 1e9;
+
                 // Send a message telling the receiver we are done
                 debug_printf("[sender]: telling receiver I am done\n");
-                uint8_t flag = 1;
+                uint8_t flag = FLAG_ROUND_OVER;
                 sk::Send(s_sockets.socket_receiver, (char*)&flag, sizeof(flag), 0);
+                stats.control_bytes += sizeof(flag);
+
+                // Anything a test held back turns up after the flag, like datagrams the flag overtook
+#ifdef RSE_TEST_FAULTS
+                if (options.faults != nullptr && options.faults->late_datagrams > 0) {
+                    SleepNs((uint64_t)options.faults->late_delay_us * 1000);
+                    for (uint32_t lane = 0; lane < num_lanes; lane++) SendHeldDatagrams(lanes[lane].channel);
+                }
+#endif
 
                 //Check if everything sent correctly.
                 debug_printf("[sender]: waiting for bitmap...\n");
-                result = sk::Recv(s_sockets.socket_receiver, recv_bitmap_buffer, handshake.bitmap_size, 0);
-                if (rse::sk::IsError(result)) {
-                    debug_printf("[sender] error getting bitmap\n");
-                    goto label_cleanup;
+                {
+                    // Skipping any NACKs sent before the receiver heard the blast was over
+                    uint8_t encoding;
+                    uint32_t payload_size;
+                    do {
+                        if (!ReadControlMessage(listener, false, encoding, payload_size)) {
+                            debug_printf("[sender] error getting bitmap\n");
+                            goto label_cleanup;
+                        }
+                    } while (encoding == (uint8_t)ReportEncoding::NACK);
+
+                    if (!DecodeLossReport((ReportEncoding)encoding, report_buffer, payload_size, recv_bitmap, handshake.bitmap_size)) {
+                        debug_printf("[sender] bad loss report\n");
+                        goto label_cleanup;
+                    }
+                    if (encoding < 4) stats.reports_by_encoding[encoding]++;
                 }
-                // Copy buffer directly into bitmap struct so we can have a look at it.
-                memcpy(recv_bitmap.Data(), recv_bitmap_buffer, handshake.bitmap_size);
 
-                debug_printf("[sender]: received bitmap ");
-                recv_bitmap.Print();
+                // Work out how much of each lane's blast got through and size its next one from it
+                uint64_t round_trip_ns = NowNs() - blast_end_ns;
+                for (uint32_t l = 0; l < num_lanes; l++) {
+                    SendLane& lane = lanes[l];
+                    uint64_t now_received = recv_bitmap.CountRange(lane.first_block, lane.end_block - lane.first_block);
+                    uint32_t delivered = now_received > lane.received_packets ? (uint32_t)(now_received - lane.received_packets) : 0;
+                    lane.received_packets = now_received;
 
-                bool has_sent_all_flag = true;
-                for (size_t i = 0; i < recv_bitmap.Size(); i++) {
-                    if (!recv_bitmap[i]) {
-                        has_sent_all_flag = false;
-                        break;
+                    double old_rate = lane.control.rate_mbps;
+                    UpdateBlastControl(lane.control, options, lane.sent_packets - lane.sent_parity, delivered, lane.blast_ns, round_trip_ns);
+                    if (lane.control.rate_mbps != old_rate) {
+                        InitPacer(lane.channel.pacer, lane.control.rate_mbps, handshake.packet_size * lane.channel.segments_per_send);
                     }
                 }
 
-                if (has_sent_all_flag) {
-                    return_val = true;
-                    break;
-                }
+                debug_printf("[sender]: received bitmap ");
+                recv_bitmap.Print();
             }
+            return_val = true;
 
         label_cleanup:
 
-            delete[] recv_bitmap_buffer;
-            delete[] packet_buffer;
+            th::StopWorkers(workers);
+            if (listener.started) {
+                listener.stop.store(true);
+                th::JoinThread(listener.thread);
+            }
+            sk::DestroyPoller(listener.poller);
+            stats.nacks = listener.nacks;
+            stats.control_bytes += listener.bytes;
+            stats.report_bytes += listener.bytes;
 
-            rse::io::UnmapMemory(memmap);
+            stats.num_lanes = num_lanes;
+            stats.window = 0;
+            stats.rate_mbps = 0;
+            for (uint32_t lane = 0; lane < num_lanes; lane++) {
+                stats.window += lanes[lane].control.window;
+                stats.rate_mbps += lanes[lane].control.rate_mbps;
+                if (lanes[lane].channel.ring.active) stats.uring_lanes++;
+                DestroySendLane(lanes[lane], stats);
+                AddLaneStats(stats, lane, lanes[lane].stats);
+                io::DestroyBlockRing(nack_queues[lane]);
+            }
+            // Every block has been sent by now, so every CRC is in
+            stats.checksum = handshake.checksum;
+            stats.delta = handshake.delta;
+            stats.compression = handshake.compression;
+            stats.resume = handshake.resume;
+            if (return_val && handshake.checksum) stats.file_digest = FileDigest(block_crcs, handshake.number_packets);
+            delete[] block_crcs;
+            delete[] report_buffer;
 
             return return_val;
         }
@@ -417,10 +4782,15 @@ namespace rse {
         // Path size must be less than PATH_SIZE
         // Sockets must be initialised
         // block size must be a power of 2
+        // With options.lanes above 1 the extra lanes send to the ports after port_num, or after
+        // whichever port the receiver said the first lane is on
         bool SendFile(const char* filename,
-            const char* path_to_write, const char* hostname, const char* port_str, int port_num, const int block_size = DEFAULT_BLOCK_SIZE) {
+            const char* path_to_write, const char* hostname, const char* port_str, int port_num, const int block_size = DEFAULT_BLOCK_SIZE,
+            const SendOptions& options = SendOptions(), TransferStats* out_stats = nullptr) {
 
             TickTock a;
+            TickTock total = Tick();
+            TransferStats stats;
 
             a = Tick();
             size_t path_size = strlen(path_to_write);
@@ -431,11 +4801,12 @@ namespace rse {
 
             debug_printf("[sender]: starting...\n");
 
-            // Open the file we want to send and work out how big it is
-            FILE* file = fopen(filename, "rb");
-            fseek(file, 0L, SEEK_END);
-            size_t send_file_size = ftell(file);
-            fclose(file);
+            // Work out how big the file we want to send is
+            uint64_t send_file_size = 0;
+            if (!io::GetFileSize(filename, send_file_size)) {
+                debug_printf("[sender]: failed to open [%s]\n", filename);
+                return false;
+            }
 
             SenderSockets send_sockets;
             if (!SenderConnect(hostname, port_str, send_sockets)) {
@@ -446,24 +4817,35 @@ namespace rse {
             a = Tick();
             // Specify how many packets we want to send along with the size of their payloads.
             // also calculate the size of the bitmap required to keep track of all the packets.
-            TransmissionInfo handshake = { 0 };
-            if (!SendTransmissionInfoAndWait(send_sockets, path_to_write, send_file_size, block_size, handshake)) {
+            TransmissionInfo handshake = {};
+            uint64_t resume_token = options.resume ? ResumeToken(filename, path_to_write, send_file_size, block_size) : 0;
+            if (!SendTransmissionInfoAndWait(send_sockets, path_to_write, send_file_size, block_size, options, handshake, stats, resume_token)) {
                 sk::CloseSocket(send_sockets.socket_receiver);
                 sk::CloseSocket(send_sockets.socket_udp);
                 return false;
             }
             debug_printf("[sender]: Handshake time [%lf]\n", Tock(a));
+            if (handshake.data_port == 0) handshake.data_port = port_num;
 
             a = Tick();
-            bool ret_val = SendPackets(handshake, send_sockets, block_size, filename, hostname, port_num, send_file_size);
+            bool ret_val = SendPackets(handshake, send_sockets, filename, hostname, handshake.data_port, send_file_size, options, stats);
             debug_printf("[sender]: Send time [%lf]\n", Tock(a));
 
             debug_printf("[sender]: telling sender I am finished\n");
-            uint8_t flag = 0;
+            uint8_t flag = ret_val ? FLAG_DONE : FLAG_ABORTED;
             rse::sk::Send(send_sockets.socket_receiver, (char*)&flag, sizeof(flag), 0);
+            stats.control_bytes += sizeof(flag);
+            if (ret_val && handshake.checksum) {
+                // What the receiver's digest of the file should come to
+                rse::sk::Send(send_sockets.socket_receiver, (char*)&stats.file_digest, sizeof(stats.file_digest), 0);
+                stats.control_bytes += sizeof(stats.file_digest);
+            }
 
             sk::CloseSocket(send_sockets.socket_receiver);
             sk::CloseSocket(send_sockets.socket_udp);
+
+            stats.seconds = Tock(total);
+            if (out_stats != nullptr) *out_stats = stats;
             return ret_val;
         }
 
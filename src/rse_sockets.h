@@ -4,7 +4,7 @@
 // --> Needs an api that is semi-platform agnostic (given that most of the API is posix)
 
 #ifdef _WIN32
-#define _WIN32_WINNT  0x501 // Means I can use getaddrinfo....why i dunno
+#define _WIN32_WINNT  0x600 // Means I can use getaddrinfo and WSAPoll
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
 #endif
 
@@ -12,6 +12,9 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <new>
 
 #ifdef _WIN32
 
@@ -34,7 +37,28 @@
 #include <sys/time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <linux/errqueue.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#endif
+
+// io_uring needs the sendmsg and recvmsg requests and ring features of linux 5.4 headers.
+// Without them the io_uring calls below fail and everything goes through the socket calls.
+#if defined(__linux__) && defined(IORING_FEAT_SINGLE_MMAP) && defined(__NR_io_uring_setup)
+#define RSE_HAS_URING
+#endif
 
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0 // zero copy sends are linux only
 #endif
 
 #ifdef _WIN32
@@ -50,6 +74,7 @@ namespace rse {
         const int SK_ERROR_SOCKET = SOCKET_ERROR;
         const unsigned int SK_INVALID_SOCKET = INVALID_SOCKET;
         const unsigned int SK_NO_ERROR = NO_ERROR;
+        const int SK_SHUT_BOTH = SD_BOTH;
     }
 }
 #elif __linux__
@@ -59,6 +84,7 @@ namespace rse {
         const int SK_ERROR_SOCKET = -1;
         const int SK_INVALID_SOCKET = -1;
         const int SK_NO_ERROR = 0;
+        const int SK_SHUT_BOTH = SHUT_RDWR;
     }
 }
 #endif
@@ -127,17 +153,8 @@ namespace rse {
             return SK_NO_ERROR;
         }
 
-        // Creates a socket. The isBlocking determines if the socket
-        // has blocking or non-blocking IO
-        SocketHandle Socket(addrinfo* addr, bool isBlocking) {
-
-            SocketHandle sock = SK_INVALID_SOCKET;
-            sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-            if (sock == SK_INVALID_SOCKET) {
-                ErrorMessage("Socket failed [%d]", sock);
-                return SK_INVALID_SOCKET;
-            }
-
+        // Switches a socket between blocking and non-blocking IO
+        bool SetBlocking(SocketHandle sock, bool isBlocking) {
 #ifdef _WIN32
             //-------------------------
             // Set the socket I/O mode: In this case FIONBIO
@@ -149,7 +166,7 @@ namespace rse {
             int result = ioctlsocket(sock, FIONBIO, &iMode);
             if (result != SK_NO_ERROR) {
                 ErrorMessage("ioctlsocket failed with [%d]", result);
-                return SK_INVALID_SOCKET;
+                return false;
             }
 #elif __linux__
 
@@ -163,9 +180,26 @@ namespace rse {
 
             if (result != SK_NO_ERROR) {
                 ErrorMessage("fcntl failed with error %ld", result);
-                return SK_INVALID_SOCKET;
+                return false;
             }
 #endif
+            return true;
+        }
+
+        // Creates a socket. The isBlocking determines if the socket
+        // has blocking or non-blocking IO
+        SocketHandle Socket(addrinfo* addr, bool isBlocking) {
+
+            SocketHandle sock = SK_INVALID_SOCKET;
+            sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            if (sock == SK_INVALID_SOCKET) {
+                ErrorMessage("Socket failed [%d]", sock);
+                return SK_INVALID_SOCKET;
+            }
+
+            if (!SetBlocking(sock, isBlocking)) {
+                return SK_INVALID_SOCKET;
+            }
 
             return sock;
         }
@@ -314,6 +348,47 @@ namespace rse {
             return sock;
         }
 
+        // Asks for a socket receive buffer of the given size. The OS may clamp it (net.core.rmem_max on linux).
+        // Returns the number of payload bytes the buffer can actually hold, or 0 if it can't be read back.
+        int SetReceiveBufferSize(SocketHandle sock, int bytes) {
+
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char*)&bytes, sizeof(bytes));
+
+            int actual = 0;
+            socklen_t len = sizeof(actual);
+            if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char*)&actual, &len) == SK_ERROR_SOCKET) return 0;
+#ifdef __linux__
+            actual /= 2; // linux doubles the value to leave room for its own bookkeeping
+#endif
+            return actual;
+        }
+
+        // Same as SetReceiveBufferSize but for the send buffer
+        int SetSendBufferSize(SocketHandle sock, int bytes) {
+
+            setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char*)&bytes, sizeof(bytes));
+
+            int actual = 0;
+            socklen_t len = sizeof(actual);
+            if (getsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char*)&actual, &len) == SK_ERROR_SOCKET) return 0;
+#ifdef __linux__
+            actual /= 2;
+#endif
+            return actual;
+        }
+
+        // Makes a blocking Recv on sock fail once nothing has arrived for ms milliseconds, 0 waits forever
+        bool SetReceiveTimeout(SocketHandle sock, int ms) {
+#ifdef _WIN32
+            DWORD timeout = (DWORD)ms;
+#elif __linux__
+            timeval timeout;
+            timeout.tv_sec = ms / 1000;
+            timeout.tv_usec = (ms % 1000) * 1000;
+#endif
+            return setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) != SK_ERROR_SOCKET;
+        }
+
         // Create a listen socket that will recieve incoming connections
         SocketHandle CreateListenSocket(const char* hostname, const char* port, bool isBlocking) {
 
@@ -337,6 +412,10 @@ namespace rse {
                 return SK_INVALID_SOCKET;
             }
 
+            // Let the port be reused straight away rather than waiting out TIME_WAIT from the last connection
+            int reuse = 1;
+            setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
             if (Bind(listenSocket, resultAddr) == SK_ERROR_SOCKET) {
                 freeaddrinfo(resultAddr);
                 return SK_INVALID_SOCKET;
@@ -445,5 +524,893 @@ namespace rse {
             #endif
         }
 
+        // Keeps calling Recv until len bytes have arrived. Returns len, or SK_ERROR_SOCKET
+        // if the connection fails or is closed first.
+        inline SocketError RecvAll(SocketHandle handle, char* buffer, int len, int flags) {
+            int received = 0;
+            while (received < len) {
+                int result = Recv(handle, buffer + received, len - received, flags);
+                if (result == SK_ERROR_SOCKET || result == 0) return SK_ERROR_SOCKET;
+                received += result;
+            }
+            return received;
+        }
+
+        // Keeps calling Send until all size bytes are sent. Returns size or SK_ERROR_SOCKET.
+        inline SocketError SendAll(SocketHandle handle, const char* data, int size, int flags) {
+            int sent = 0;
+            while (sent < size) {
+                int result = Send(handle, data + sent, size - sent, flags);
+                if (result == SK_ERROR_SOCKET) return SK_ERROR_SOCKET;
+                sent += result;
+            }
+            return sent;
+        }
+
+        // Batched datagram IO
+        // --> One socket call moves up to a whole batch of datagrams (sendmmsg/recvmmsg on linux)
+        // --> Windows has no equivalent so it falls back to one call per datagram
+        // --> Each datagram can be gathered from / scattered into several buffers
+
+        constexpr int SK_MAX_BATCH_DEPTH = 1024; // linux caps a single sendmmsg/recvmmsg at UIO_MAXIOV
+        constexpr int SK_DEFAULT_DATAGRAM_IOV = 4; // default max buffers a single datagram is built from
+
+        struct DatagramBatch {
+            int depth = 0;  // max number of datagrams the batch can hold
+            int count = 0;  // number of datagrams currently in the batch
+            int max_iov = 0; // max buffers per datagram
+            uint64_t syscalls = 0; // number of socket calls made through this batch
+            uint64_t zerocopy_sent = 0; // datagrams handed to the kernel with MSG_ZEROCOPY
+            uint64_t zerocopy_completed = 0; // of those, how many the kernel has released
+            uint64_t zerocopy_copied = 0; // of those, how many the kernel ended up copying anyway
+#ifdef _WIN32
+            WSABUF* bufs = nullptr; // max_iov per datagram
+            int* buf_counts = nullptr; // buffers used by each datagram
+            int* lengths = nullptr; // bytes received for each datagram
+#elif __linux__
+            mmsghdr* msgs = nullptr;
+            iovec* iovs = nullptr; // max_iov per datagram
+#endif
+        };
+
+        bool CreateDatagramBatch(int depth, DatagramBatch& out, int max_iov = SK_DEFAULT_DATAGRAM_IOV) {
+
+            if (depth < 1) depth = 1;
+            if (depth > SK_MAX_BATCH_DEPTH) depth = SK_MAX_BATCH_DEPTH;
+            if (max_iov < 1) max_iov = 1;
+
+            out = DatagramBatch();
+            out.depth = depth;
+            out.max_iov = max_iov;
+#ifdef _WIN32
+            out.bufs = new (std::nothrow) WSABUF[depth * max_iov];
+            out.buf_counts = new (std::nothrow) int[depth];
+            out.lengths = new (std::nothrow) int[depth];
+            if (out.bufs == nullptr || out.buf_counts == nullptr || out.lengths == nullptr) {
+                delete[] out.bufs;
+                delete[] out.buf_counts;
+                delete[] out.lengths;
+                return false;
+            }
+#elif __linux__
+            out.msgs = new (std::nothrow) mmsghdr[depth];
+            out.iovs = new (std::nothrow) iovec[depth * max_iov];
+            if (out.msgs == nullptr || out.iovs == nullptr) {
+                delete[] out.msgs;
+                delete[] out.iovs;
+                return false;
+            }
+            memset(out.msgs, 0, sizeof(mmsghdr) * depth);
+            memset(out.iovs, 0, sizeof(iovec) * depth * max_iov);
+#endif
+            return true;
+        }
+
+        void DestroyDatagramBatch(DatagramBatch& batch) {
+#ifdef _WIN32
+            delete[] batch.bufs;
+            delete[] batch.buf_counts;
+            delete[] batch.lengths;
+            batch.bufs = nullptr;
+            batch.buf_counts = nullptr;
+            batch.lengths = nullptr;
+#elif __linux__
+            delete[] batch.msgs;
+            delete[] batch.iovs;
+            batch.msgs = nullptr;
+            batch.iovs = nullptr;
+#endif
+            batch.depth = 0;
+            batch.count = 0;
+        }
+
+        inline void ClearBatch(DatagramBatch& batch) {
+            batch.count = 0;
+        }
+
+        inline bool IsBatchFull(const DatagramBatch& batch) {
+            return batch.count >= batch.depth;
+        }
+
+        // Starts a new, empty datagram at the end of the batch.
+        // Its contents are added with BatchAppendBuffer.
+        inline void BatchStartDatagram(DatagramBatch& batch) {
+            assert(batch.count < batch.depth);
+            int i = batch.count++;
+#ifdef _WIN32
+            batch.buf_counts[i] = 0;
+            batch.lengths[i] = 0;
+#elif __linux__
+            memset(&batch.msgs[i], 0, sizeof(mmsghdr));
+            batch.msgs[i].msg_hdr.msg_iov = &batch.iovs[(size_t)i * batch.max_iov];
+            batch.msgs[i].msg_hdr.msg_iovlen = 0;
+#endif
+        }
+
+        // Adds a buffer to the last datagram in the batch. For sends the buffers of a
+        // datagram are gathered in order, for receives they are filled in order.
+        inline void BatchAppendBuffer(DatagramBatch& batch, char* buffer, int len) {
+            assert(batch.count > 0);
+            int i = batch.count - 1;
+#ifdef _WIN32
+            assert(batch.buf_counts[i] < batch.max_iov);
+            WSABUF& buf = batch.bufs[(size_t)i * batch.max_iov + batch.buf_counts[i]++];
+            buf.buf = buffer;
+            buf.len = len;
+#elif __linux__
+            msghdr& hdr = batch.msgs[i].msg_hdr;
+            assert(hdr.msg_iovlen < (size_t)batch.max_iov);
+            hdr.msg_iov[hdr.msg_iovlen].iov_base = buffer;
+            hdr.msg_iov[hdr.msg_iovlen].iov_len = len;
+            hdr.msg_iovlen++;
+#endif
+        }
+
+        // Adds a datagram made of a single buffer to the batch
+        inline void BatchAppend(DatagramBatch& batch, char* buffer, int len) {
+            BatchStartDatagram(batch);
+            BatchAppendBuffer(batch, buffer, len);
+        }
+
+        // First buffer of the i'th datagram
+        inline char* BatchBuffer(const DatagramBatch& batch, int i) {
+#ifdef _WIN32
+            return batch.bufs[i * batch.max_iov].buf;
+#elif __linux__
+            return (char*)batch.iovs[i * batch.max_iov].iov_base;
+#endif
+        }
+
+        // Number of bytes received into the i'th datagram by the last RecvFromBatch
+        inline int BatchLength(const DatagramBatch& batch, int i) {
+#ifdef _WIN32
+            return batch.lengths[i];
+#elif __linux__
+            return (int)batch.msgs[i].msg_len;
+#endif
+        }
+
+        // Copies the buffers of the i'th datagram of a send batch, in order, into out. Returns the
+        // bytes copied, or 0 if they don't fit in size.
+        inline int GatherDatagram(const DatagramBatch& batch, int i, char* out, int size) {
+            int total = 0;
+#ifdef _WIN32
+            for (int j = 0; j < batch.buf_counts[i]; j++) {
+                const WSABUF& buf = batch.bufs[i * batch.max_iov + j];
+                if (total + (int)buf.len > size) return 0;
+                memcpy(out + total, buf.buf, buf.len);
+                total += (int)buf.len;
+            }
+#elif __linux__
+            const msghdr& hdr = batch.msgs[i].msg_hdr;
+            for (size_t j = 0; j < hdr.msg_iovlen; j++) {
+                if (total + (int)hdr.msg_iov[j].iov_len > size) return 0;
+                memcpy(out + total, hdr.msg_iov[j].iov_base, hdr.msg_iov[j].iov_len);
+                total += (int)hdr.msg_iov[j].iov_len;
+            }
+#endif
+            return total;
+        }
+
+        // Makes the i'th datagram of a send batch a single buffer instead of whatever it was gathered from
+        inline void BatchReplaceDatagram(DatagramBatch& batch, int i, char* buffer, int len) {
+#ifdef _WIN32
+            batch.bufs[i * batch.max_iov].buf = buffer;
+            batch.bufs[i * batch.max_iov].len = len;
+            batch.buf_counts[i] = 1;
+#elif __linux__
+            msghdr& hdr = batch.msgs[i].msg_hdr;
+            hdr.msg_iov = &batch.iovs[(size_t)i * batch.max_iov];
+            hdr.msg_iov[0].iov_base = buffer;
+            hdr.msg_iov[0].iov_len = len;
+            hdr.msg_iovlen = 1;
+#endif
+        }
+
+        // Takes the i'th datagram out of a send batch, keeping the rest in order
+        inline void BatchRemoveDatagram(DatagramBatch& batch, int i) {
+            for (int k = i + 1; k < batch.count; k++) {
+#ifdef _WIN32
+                for (int j = 0; j < batch.buf_counts[k]; j++) {
+                    batch.bufs[(k - 1) * batch.max_iov + j] = batch.bufs[k * batch.max_iov + j];
+                }
+                batch.buf_counts[k - 1] = batch.buf_counts[k];
+#elif __linux__
+                for (size_t j = 0; j < batch.msgs[k].msg_hdr.msg_iovlen; j++) {
+                    batch.iovs[(k - 1) * batch.max_iov + j] = batch.msgs[k].msg_hdr.msg_iov[j];
+                }
+                batch.msgs[k - 1].msg_hdr.msg_iovlen = batch.msgs[k].msg_hdr.msg_iovlen;
+                batch.msgs[k - 1].msg_hdr.msg_iov = &batch.iovs[(k - 1) * batch.max_iov];
+#endif
+            }
+            batch.count--;
+        }
+
+        // Drops datagrams from the batch but leaves them counted as sent (to simulate lost packets in testing)
+        inline void SimulatePacketLoss(DatagramBatch& batch, int flags) {
+#ifdef RSE_TEST_SOCKET_PACKET_LOSS
+            int count = batch.count;
+            int kept = 0;
+            for (int i = 0; i < count; i++) {
+                if (rand() % 100 < RSE_TEST_SOCKET_PACKET_LOSS_PERCENTAGE) {
+                    debug_printf("packet lost!\n");
+                    continue;
+                }
+                #ifdef _WIN32
+                for (int j = 0; j < batch.buf_counts[i]; j++) {
+                    batch.bufs[kept * batch.max_iov + j] = batch.bufs[i * batch.max_iov + j];
+                }
+                batch.buf_counts[kept] = batch.buf_counts[i];
+                #elif __linux__
+                for (size_t j = 0; j < batch.msgs[i].msg_hdr.msg_iovlen; j++) {
+                    batch.iovs[kept * batch.max_iov + j] = batch.iovs[i * batch.max_iov + j];
+                }
+                batch.msgs[kept].msg_hdr.msg_iovlen = batch.msgs[i].msg_hdr.msg_iovlen;
+                batch.msgs[kept].msg_hdr.msg_iov = &batch.iovs[kept * batch.max_iov];
+                #endif
+                kept++;
+            }
+            batch.count = kept;
+            // Nothing pins a dropped datagram, so count it as released straight away
+            if (flags & MSG_ZEROCOPY) {
+                batch.zerocopy_sent += count - kept;
+                batch.zerocopy_completed += count - kept;
+            }
+#else
+            (void)batch;
+            (void)flags;
+#endif
+        }
+
+        // Sends every datagram in the batch to addr. Returns the number of datagrams sent.
+        // flags may include MSG_ZEROCOPY once EnableZeroCopy has succeeded on the socket, in which
+        // case the buffers must be left untouched until ReadZeroCopyCompletions says they are released.
+        SocketError SendToBatch(SocketHandle handle, DatagramBatch& batch, int flags, const sockaddr* addr, int addrlen) {
+
+            int count = batch.count;
+            SimulatePacketLoss(batch, flags);
+
+#ifdef _WIN32
+            for (int i = 0; i < batch.count; i++) {
+                batch.syscalls++;
+                DWORD bytes_sent = 0;
+                int result = WSASendTo(handle, &batch.bufs[i * batch.max_iov], batch.buf_counts[i],
+                    &bytes_sent, flags, addr, addrlen, nullptr, nullptr);
+                if (result == SK_ERROR_SOCKET) return SK_ERROR_SOCKET;
+            }
+#elif __linux__
+            for (int i = 0; i < batch.count; i++) {
+                batch.msgs[i].msg_hdr.msg_name = (void*)addr;
+                batch.msgs[i].msg_hdr.msg_namelen = addrlen;
+            }
+
+            // sendmmsg can return having sent only part of the batch
+            int sent = 0;
+            while (sent < batch.count) {
+                batch.syscalls++;
+                int result = sendmmsg(handle, batch.msgs + sent, batch.count - sent, flags);
+                if (result == SK_ERROR_SOCKET) {
+                    if (errno == EINTR) continue;
+                    return SK_ERROR_SOCKET;
+                }
+                sent += result;
+                if (flags & MSG_ZEROCOPY) batch.zerocopy_sent += result;
+            }
+#endif
+
+            return count;
+        }
+
+        // Receives up to batch.count datagrams without blocking, one into each datagram of the batch.
+        // Returns the number of datagrams received, which is 0 when there is nothing waiting on the socket.
+        // On windows the socket has to have been made non-blocking with SetBlocking.
+        SocketError RecvFromBatch(SocketHandle handle, DatagramBatch& batch, int flags) {
+
+#ifdef _WIN32
+            int received = 0;
+            while (received < batch.count) {
+                batch.syscalls++;
+                DWORD bytes_received = 0;
+                DWORD recv_flags = flags;
+                int result = WSARecvFrom(handle, &batch.bufs[received * batch.max_iov], batch.buf_counts[received],
+                    &bytes_received, &recv_flags, nullptr, nullptr, nullptr, nullptr);
+                if (result == SK_ERROR_SOCKET) {
+                    if (WSAGetLastError() == WSAEWOULDBLOCK) break;
+                    return SK_ERROR_SOCKET;
+                }
+                batch.lengths[received++] = (int)bytes_received;
+            }
+            return received;
+#elif __linux__
+            batch.syscalls++;
+            int result = recvmmsg(handle, batch.msgs, batch.count, flags | MSG_DONTWAIT, nullptr);
+            if (result == SK_ERROR_SOCKET) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+                return SK_ERROR_SOCKET;
+            }
+            return result;
+#endif
+        }
+
+        // Readiness polling
+        // --> Waits on several sockets at once, sleeping until one of them has something to read
+        // --> epoll on linux, where a socket can be edge triggered so it only wakes us when new data
+        //     arrives and has to be read until it would block. WSAPoll on windows, which is always
+        //     level triggered
+
+        constexpr int SK_MAX_POLL_SOCKETS = 64;
+
+        struct Poller {
+#ifdef _WIN32
+            WSAPOLLFD fds[SK_MAX_POLL_SOCKETS];
+#elif __linux__
+            int epoll_fd = -1;
+#endif
+            int count = 0; // sockets added
+        };
+
+        bool CreatePoller(Poller& poller) {
+            poller = Poller();
+#ifdef __linux__
+            poller.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            if (poller.epoll_fd == -1) {
+                ErrorMessage("epoll_create1 failed");
+                return false;
+            }
+#endif
+            return true;
+        }
+
+        void DestroyPoller(Poller& poller) {
+#ifdef __linux__
+            if (poller.epoll_fd != -1) close(poller.epoll_fd);
+#endif
+            poller = Poller();
+        }
+
+        // Watches handle for reads. Edge triggered sockets should be non-blocking.
+        bool PollerAdd(Poller& poller, SocketHandle handle, bool edge_triggered) {
+            if (poller.count >= SK_MAX_POLL_SOCKETS) return false;
+#ifdef _WIN32
+            poller.fds[poller.count].fd = handle;
+            poller.fds[poller.count].events = POLLRDNORM;
+            poller.fds[poller.count].revents = 0;
+#elif __linux__
+            epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN | (edge_triggered ? (uint32_t)EPOLLET : 0);
+            event.data.fd = handle;
+            if (epoll_ctl(poller.epoll_fd, EPOLL_CTL_ADD, handle, &event) == -1) {
+                ErrorMessage("epoll_ctl failed");
+                return false;
+            }
+#endif
+            poller.count++;
+            return true;
+        }
+
+        // Sleeps until at least one socket is readable or timeout_ms passes, -1 waits forever.
+        // Fills ready with up to max_ready readable sockets. Returns how many, 0 on timeout.
+        SocketError PollerWait(Poller& poller, SocketHandle* ready, int max_ready, int timeout_ms) {
+#ifdef _WIN32
+            int result = WSAPoll(poller.fds, poller.count, timeout_ms);
+            if (result == SK_ERROR_SOCKET) return SK_ERROR_SOCKET;
+            int num_ready = 0;
+            for (int i = 0; i < poller.count && num_ready < max_ready; i++) {
+                if (poller.fds[i].revents != 0) ready[num_ready++] = poller.fds[i].fd;
+            }
+            return num_ready;
+#elif __linux__
+            epoll_event events[SK_MAX_POLL_SOCKETS];
+            if (max_ready > SK_MAX_POLL_SOCKETS) max_ready = SK_MAX_POLL_SOCKETS;
+            int result = epoll_wait(poller.epoll_fd, events, max_ready, timeout_ms);
+            if (result == -1) {
+                if (errno == EINTR) return 0;
+                return SK_ERROR_SOCKET;
+            }
+            for (int i = 0; i < result; i++) ready[i] = events[i].data.fd;
+            return result;
+#endif
+        }
+
+        // Doorbells
+        // --> Something a Poller can wait on that another thread rings, so a queue filled in userspace
+        //     can wake the same event loop as the sockets do
+        // --> An eventfd, so linux only. CreateDoorbell fails everywhere else.
+        // --> Ringing it makes it readable until it is cleared. Clear before emptying the queue, so a
+        //     ring that comes in while it is being emptied isn't lost.
+
+        struct Doorbell {
+            int fd = -1;
+        };
+
+        bool CreateDoorbell(Doorbell& doorbell) {
+            doorbell = Doorbell();
+#ifdef __linux__
+            doorbell.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (doorbell.fd == -1) {
+                ErrorMessage("eventfd failed");
+                return false;
+            }
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        void DestroyDoorbell(Doorbell& doorbell) {
+#ifdef __linux__
+            if (doorbell.fd != -1) close(doorbell.fd);
+#endif
+            doorbell = Doorbell();
+        }
+
+        void RingDoorbell(Doorbell& doorbell) {
+#ifdef __linux__
+            uint64_t one = 1;
+            ssize_t written = write(doorbell.fd, &one, sizeof(one));
+            (void)written; // only fails when the count is about to overflow, and then it is readable anyway
+#endif
+        }
+
+        void ClearDoorbell(Doorbell& doorbell) {
+#ifdef __linux__
+            uint64_t count;
+            ssize_t read_bytes = read(doorbell.fd, &count, sizeof(count));
+            (void)read_bytes; // fails when it wasn't rung, which is fine
+#endif
+        }
+
+        // The handle to give a Poller
+        SocketHandle DoorbellHandle(const Doorbell& doorbell) {
+            return (SocketHandle)doorbell.fd;
+        }
+
+        // io_uring
+        // --> Requests are queued on a ring shared with the kernel and completions come back on another,
+        //     so a whole batch goes in with at most one system call and often none at all
+        // --> Sends are one linked sendmsg per datagram, submitted and reaped together. With SQPOLL a
+        //     kernel thread picks them up and we never enter the kernel to send
+        // --> Receives are the same, one linked recvmsg per datagram scattered like recvmmsg, so payloads
+        //     land wherever the batch points them. MSG_DONTWAIT ends the chain at the first that would block
+        // --> Linux 5.4 and later. CreateUring fails everywhere else, and when io_uring is disabled,
+        //     and the socket calls above are used instead
+
+        constexpr unsigned SK_URING_SQPOLL_IDLE_MS = 100; // the kernel thread sleeps after this long without work
+        constexpr int SK_URING_SPIN = 4096; // polls of the completion ring before sleeping in the kernel
+
+        struct Uring {
+            bool active = false; // set up and usable
+            bool sqpoll = false; // a kernel thread is submitting for us
+#ifdef RSE_HAS_URING
+            int fd = -1;
+            unsigned sq_entries = 0;
+            unsigned sq_local_tail = 0; // entries written but maybe not yet handed to the kernel
+            unsigned* sq_head = nullptr;
+            unsigned* sq_tail = nullptr;
+            unsigned* sq_mask = nullptr;
+            unsigned* sq_flags = nullptr;
+            io_uring_sqe* sqes = nullptr;
+            unsigned* cq_head = nullptr;
+            unsigned* cq_tail = nullptr;
+            unsigned* cq_mask = nullptr;
+            io_uring_cqe* cqes = nullptr;
+            void* sq_map = nullptr;
+            size_t sq_map_size = 0;
+            void* cq_map = nullptr;
+            size_t cq_map_size = 0;
+            size_t sqes_size = 0;
+#endif
+        };
+
+#ifdef RSE_HAS_URING
+        inline int UringEnter(Uring& ring, unsigned to_submit, unsigned min_complete, unsigned flags) {
+            return (int)syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, nullptr, 0);
+        }
+
+        inline unsigned UringReady(const Uring& ring) {
+            return __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) - *ring.cq_head;
+        }
+
+        // Next free submission entry, zeroed, or nullptr if the ring is full
+        inline io_uring_sqe* UringGetSqe(Uring& ring) {
+            unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+            if (ring.sq_local_tail - head >= ring.sq_entries) return nullptr;
+            io_uring_sqe* sqe = &ring.sqes[ring.sq_local_tail & *ring.sq_mask];
+            memset(sqe, 0, sizeof(io_uring_sqe));
+            ring.sq_local_tail++;
+            return sqe;
+        }
+
+        // Hands every entry written since the last call to the kernel, and runs anything the kernel has
+        // waiting to complete, without waiting for it
+        bool UringFlush(Uring& ring, uint64_t& syscalls) {
+            unsigned to_submit = ring.sqpoll ? 0 : ring.sq_local_tail - *ring.sq_tail;
+            __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+            unsigned flags = IORING_ENTER_GETEVENTS;
+            if (ring.sqpoll) {
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                if (__atomic_load_n(ring.sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) flags |= IORING_ENTER_SQ_WAKEUP;
+            }
+            syscalls++;
+            while (UringEnter(ring, to_submit, 0, flags) < 0) {
+                if (errno != EINTR) return false;
+            }
+            return true;
+        }
+
+        // Hands every entry written since the last call to the kernel, and if wait_for is set sleeps
+        // until that many completions are ready. syscalls counts the times we entered the kernel.
+        bool UringSubmit(Uring& ring, unsigned wait_for, uint64_t& syscalls) {
+
+            unsigned to_submit = ring.sq_local_tail - *ring.sq_tail;
+            __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+
+            if (ring.sqpoll) {
+                // The kernel thread only needs a kick if it has gone to sleep
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                if (__atomic_load_n(ring.sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+                    syscalls++;
+                    if (UringEnter(ring, 0, 0, IORING_ENTER_SQ_WAKEUP) < 0 && errno != EINTR) return false;
+                }
+                for (int spin = 0; spin < SK_URING_SPIN && UringReady(ring) < wait_for; spin++);
+                to_submit = 0;
+            }
+
+            while (to_submit > 0 || UringReady(ring) < wait_for) {
+                syscalls++;
+                unsigned flags = UringReady(ring) < wait_for ? IORING_ENTER_GETEVENTS : 0;
+                int result = UringEnter(ring, to_submit, flags ? wait_for : 0, flags);
+                if (result < 0) {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                to_submit -= (unsigned)result < to_submit ? (unsigned)result : to_submit;
+            }
+            return true;
+        }
+#endif
+
+        void DestroyUring(Uring& ring) {
+#ifdef RSE_HAS_URING
+            if (ring.sqes != nullptr) munmap(ring.sqes, ring.sqes_size);
+            if (ring.cq_map != nullptr && ring.cq_map != ring.sq_map) munmap(ring.cq_map, ring.cq_map_size);
+            if (ring.sq_map != nullptr) munmap(ring.sq_map, ring.sq_map_size);
+            if (ring.fd != -1) close(ring.fd);
+#endif
+            ring = Uring();
+        }
+
+        // Sets up a ring with room for sq_entries requests and cq_entries completions. With sqpoll a kernel
+        // thread submits requests as they are queued, if we are allowed one. Returns false if io_uring
+        // isn't available, in which case the socket calls should be used.
+        bool CreateUring(Uring& ring, unsigned sq_entries, unsigned cq_entries, bool sqpoll) {
+
+            ring = Uring();
+#ifdef RSE_HAS_URING
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = cq_entries > sq_entries ? cq_entries : sq_entries;
+            if (sqpoll) {
+                params.flags |= IORING_SETUP_SQPOLL;
+                params.sq_thread_idle = SK_URING_SQPOLL_IDLE_MS;
+            }
+
+            ring.fd = (int)syscall(__NR_io_uring_setup, sq_entries, &params);
+            if (ring.fd < 0 && sqpoll) {
+                debug_printf("io_uring SQPOLL not allowed [%d][%s]\n", errno, strerror(errno));
+                params.flags &= ~IORING_SETUP_SQPOLL;
+                ring.fd = (int)syscall(__NR_io_uring_setup, sq_entries, &params);
+            }
+            if (ring.fd < 0) {
+                debug_printf("io_uring not available [%d][%s]\n", errno, strerror(errno));
+                ring.fd = -1;
+                return false;
+            }
+            ring.sqpoll = (params.flags & IORING_SETUP_SQPOLL) != 0;
+
+            // Both rings can share one mapping on newer kernels
+            ring.sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            ring.cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (single_map && ring.cq_map_size > ring.sq_map_size) ring.sq_map_size = ring.cq_map_size;
+
+            ring.sq_map = mmap(nullptr, ring.sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+            if (ring.sq_map == MAP_FAILED) {
+                ring.sq_map = nullptr;
+                DestroyUring(ring);
+                return false;
+            }
+            if (single_map) {
+                ring.cq_map = ring.sq_map;
+            }
+            else {
+                ring.cq_map = mmap(nullptr, ring.cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+                if (ring.cq_map == MAP_FAILED) {
+                    ring.cq_map = nullptr;
+                    DestroyUring(ring);
+                    return false;
+                }
+            }
+            ring.sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+            ring.sqes = (io_uring_sqe*)mmap(nullptr, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+            if (ring.sqes == MAP_FAILED) {
+                ring.sqes = nullptr;
+                DestroyUring(ring);
+                return false;
+            }
+
+            char* sq = (char*)ring.sq_map;
+            char* cq = (char*)ring.cq_map;
+            ring.sq_entries = params.sq_entries;
+            ring.sq_head = (unsigned*)(sq + params.sq_off.head);
+            ring.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+            ring.sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+            ring.sq_flags = (unsigned*)(sq + params.sq_off.flags);
+            ring.cq_head = (unsigned*)(cq + params.cq_off.head);
+            ring.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+            ring.cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+            ring.cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+            ring.sq_local_tail = *ring.sq_tail;
+
+            // Submission entries are always used in order, so the index array never changes
+            unsigned* sq_array = (unsigned*)(sq + params.sq_off.array);
+            for (unsigned i = 0; i < ring.sq_entries; i++) sq_array[i] = i;
+
+            ring.active = true;
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        // Sends every datagram in the batch to addr as a chain of linked sendmsg requests, in one
+        // submission, and waits for them all to complete. The same rules as SendToBatch apply,
+        // including for MSG_ZEROCOPY. The ring needs room for a whole batch.
+        SocketError UringSendBatch(Uring& ring, SocketHandle handle, DatagramBatch& batch, int flags, const sockaddr* addr, int addrlen) {
+#ifdef RSE_HAS_URING
+            int count = batch.count;
+            SimulatePacketLoss(batch, flags);
+            if (batch.count == 0) return count;
+
+            for (int i = 0; i < batch.count; i++) {
+                batch.msgs[i].msg_hdr.msg_name = (void*)addr;
+                batch.msgs[i].msg_hdr.msg_namelen = addrlen;
+
+                io_uring_sqe* sqe = UringGetSqe(ring);
+                if (sqe == nullptr) {
+                    errno = EBUSY;
+                    return SK_ERROR_SOCKET;
+                }
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->fd = handle;
+                sqe->addr = (uint64_t)(uintptr_t)&batch.msgs[i].msg_hdr;
+                sqe->len = 1;
+                sqe->msg_flags = flags;
+                sqe->user_data = i;
+                if (i + 1 < batch.count) sqe->flags = IOSQE_IO_LINK; // keeps the datagrams in order
+            }
+
+            if (!UringSubmit(ring, batch.count, batch.syscalls)) return SK_ERROR_SOCKET;
+
+            // If one send fails the rest of the chain is cancelled, report the first real error
+            int sent = 0;
+            int error = 0;
+            unsigned head = *ring.cq_head;
+            for (int i = 0; i < batch.count; i++, head++) {
+                io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+                if (cqe->res >= 0) sent++;
+                else if (error == 0 && cqe->res != -ECANCELED) error = -cqe->res;
+            }
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+            if (flags & MSG_ZEROCOPY) batch.zerocopy_sent += sent;
+            if (sent < batch.count) {
+                errno = error != 0 ? error : ECANCELED;
+                return SK_ERROR_SOCKET;
+            }
+            return count;
+#else
+            return SK_ERROR_SOCKET;
+#endif
+        }
+
+        // Receives up to a batch of datagrams as a chain of linked recvmsg requests, in one submission,
+        // and waits for the chain to finish. Like RecvFromBatch it doesn't block, so returns 0 when there
+        // is nothing to read. The ring needs room for a whole batch.
+        SocketError UringRecvBatch(Uring& ring, SocketHandle handle, DatagramBatch& batch, int flags) {
+#ifdef RSE_HAS_URING
+            for (int i = 0; i < batch.count; i++) {
+                io_uring_sqe* sqe = UringGetSqe(ring);
+                if (sqe == nullptr) {
+                    errno = EBUSY;
+                    return SK_ERROR_SOCKET;
+                }
+                sqe->opcode = IORING_OP_RECVMSG;
+                sqe->fd = handle;
+                sqe->addr = (uint64_t)(uintptr_t)&batch.msgs[i].msg_hdr;
+                sqe->len = 1;
+                sqe->msg_flags = flags | MSG_DONTWAIT;
+                sqe->user_data = i;
+                if (i + 1 < batch.count) sqe->flags = IOSQE_IO_LINK; // the first that would block cancels the rest
+            }
+
+            if (!UringSubmit(ring, batch.count, batch.syscalls)) return SK_ERROR_SOCKET;
+
+            // The chain stops at the first request without a datagram, so the ones received come first
+            int received = 0;
+            int error = 0;
+            unsigned head = *ring.cq_head;
+            for (int i = 0; i < batch.count; i++, head++) {
+                io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+                if (cqe->res >= 0) batch.msgs[cqe->user_data].msg_len = (unsigned)cqe->res;
+                if (cqe->res >= 0) received++;
+                else if (error == 0 && cqe->res != -ECANCELED && cqe->res != -EAGAIN && cqe->res != -EINTR) error = -cqe->res;
+            }
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+            if (error != 0) {
+                errno = error;
+                return SK_ERROR_SOCKET;
+            }
+            return received;
+#else
+            return SK_ERROR_SOCKET;
+#endif
+        }
+
+        // Zero copy sends
+        // --> The kernel pins the user pages instead of copying them and tells us on the socket's
+        //     error queue when it has finished with them
+        // --> Only linux supports this, everywhere else EnableZeroCopy fails and sends are copied as normal
+
+        // Returns the flag to pass to SendToBatch, or 0 if zero copy is not available on this socket
+        int EnableZeroCopy(SocketHandle handle) {
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+            int one = 1;
+            if (setsockopt(handle, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == SK_ERROR_SOCKET) {
+                debug_printf("SO_ZEROCOPY not supported [%d][%s]\n", errno, strerror(errno));
+                return 0;
+            }
+            return MSG_ZEROCOPY;
+#else
+            return 0;
+#endif
+        }
+
+        // Reads completion notifications off the socket's error queue and adds them to the batch counters.
+        // If wait is set this blocks for up to timeout_ms until at least one notification arrives.
+        // Returns the number of datagrams whose buffers were released, or SK_ERROR_SOCKET.
+        SocketError ReadZeroCopyCompletions(SocketHandle handle, DatagramBatch& batch, bool wait, int timeout_ms = 1000) {
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+            int released = 0;
+            while (true) {
+
+                char control[128];
+                msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+
+                batch.syscalls++;
+                int result = recvmsg(handle, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+                if (result == SK_ERROR_SOCKET) {
+                    if (errno == EINTR) continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) return SK_ERROR_SOCKET;
+                    if (!wait || released > 0) return released;
+
+                    // Completions are signalled with POLLERR
+                    pollfd pfd = { handle, 0, 0 };
+                    batch.syscalls++;
+                    int ready = poll(&pfd, 1, timeout_ms);
+                    if (ready == SK_ERROR_SOCKET && errno != EINTR) return SK_ERROR_SOCKET;
+                    if (ready == 0) return released;
+                    continue;
+                }
+
+                for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+                    if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                          (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+
+                    sock_extended_err* err = (sock_extended_err*)CMSG_DATA(cm);
+                    if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+                    // ee_info..ee_data is the inclusive range of send calls released
+                    uint32_t n = err->ee_data - err->ee_info + 1;
+                    released += n;
+                    batch.zerocopy_completed += n;
+                    if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) batch.zerocopy_copied += n;
+                }
+            }
+#else
+            return 0;
+#endif
+        }
+
+        // Blocks until the kernel has released every zero copy send made through the batch.
+        // Must be called before the memory that was sent from is freed or unmapped.
+        bool WaitForZeroCopyCompletions(SocketHandle handle, DatagramBatch& batch) {
+            while (batch.zerocopy_completed < batch.zerocopy_sent) {
+                SocketError result = ReadZeroCopyCompletions(handle, batch, true);
+                if (IsError(result) || result == 0) return false;
+            }
+            return true;
+        }
+
+        // UDP segmentation offload
+        // --> GSO: one send of many same sized segments is split into datagrams by the kernel/NIC
+        // --> GRO: datagrams of the same flow are merged and handed to recvmsg as one buffer
+        // --> Linux only. Everywhere else the enable calls fail and datagrams are sent/received one by one
+
+        constexpr int SK_MAX_GSO_SEGMENTS = 64; // UDP_MAX_SEGMENTS on older kernels
+        constexpr int SK_MAX_GSO_BYTES = 65507; // a segmented send is still one udp payload
+
+        // Every send on the socket larger than segment_size is split into segment_size datagrams.
+        // Returns false if the kernel doesn't support it.
+        bool EnableSegmentationOffload(SocketHandle handle, int segment_size) {
+#if defined(__linux__) && defined(UDP_SEGMENT)
+            if (setsockopt(handle, SOL_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size)) == SK_ERROR_SOCKET) {
+                debug_printf("UDP_SEGMENT not supported [%d][%s]\n", errno, strerror(errno));
+                return false;
+            }
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        void DisableSegmentationOffload(SocketHandle handle) {
+#if defined(__linux__) && defined(UDP_SEGMENT)
+            int zero = 0;
+            setsockopt(handle, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero));
+#endif
+        }
+
+        // Datagrams received on the socket may arrive merged, back to back, in a single buffer.
+        // Returns false if the kernel doesn't support it.
+        bool EnableReceiveOffload(SocketHandle handle) {
+#if defined(__linux__) && defined(UDP_GRO)
+            int one = 1;
+            if (setsockopt(handle, SOL_UDP, UDP_GRO, &one, sizeof(one)) == SK_ERROR_SOCKET) {
+                debug_printf("UDP_GRO not supported [%d][%s]\n", errno, strerror(errno));
+                return false;
+            }
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        // True if a failed send with segmentation offload looks like the device or path can't do it,
+        // rather than the socket being broken.
+        bool IsSegmentationOffloadError() {
+#ifdef __linux__
+            return errno == EINVAL || errno == EIO || errno == EMSGSIZE || errno == ENOPROTOOPT;
+#else
+            return false;
+#endif
+        }
+
     }
 };
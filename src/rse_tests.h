@@ -15,12 +15,187 @@ namespace rse {
             if (bitmap.Get(9) == false) return false;
             bitmap.Unset(3);
             if (bitmap.Get(3) == true) return false;
+            if (bitmap.Count() != 2) return false;
+            if (bitmap.Set(9)) return false; // already set
 
-            // need to test the throw at some point
+            // Finding clear bits across word and summary boundaries
+            rse::Bitmap big(64 * 64 * 3 + 5);
+            for (size_t i = 0; i < big.Size(); i++) {
+                if (i != 70 && i != 64 * 64 * 2 + 1 && i != big.Size() - 1) big.Set(i);
+            }
+            if (big.FindNextClear(0) != 70) return false;
+            if (big.FindNextClear(71) != 64 * 64 * 2 + 1) return false;
+            if (big.FindNextClear(64 * 64 * 2 + 2) != big.Size() - 1) return false;
+            big.Set(big.Size() - 1);
+            if (big.FindNextClear(64 * 64 * 2 + 2) != big.Size()) return false;
+            if (big.AllSet()) return false;
+            big.Set(70);
+            big.Set(64 * 64 * 2 + 1);
+            if (!big.AllSet() || big.FindNextClear(0) != big.Size()) return false;
+
+            // Loading raw bytes rebuilds the count and summary
+            rse::Bitmap loaded(big.Size());
+            loaded.Load(big.Data(), (big.Size() / 8) + 1);
+            if (!loaded.AllSet()) return false;
+            big.Unset(4000);
+            loaded.Load(big.Data(), (big.Size() / 8) + 1);
+            if (loaded.Count() != big.Size() - 1 || loaded.FindNextClear(0) != 4000) return false;
 
             return true;
         }
 
+        // Every encoding a report can pick must reproduce the receiver's bitmap on the sender
+        bool TestLossReport() {
+            const size_t num_blocks = 64 * 64 * 2 + 17;
+            const size_t bitmap_size = (num_blocks / 8) + 1;
+            rse::Bitmap received(num_blocks);
+            rse::Bitmap decoded(num_blocks);
+
+            rse::rbudp::LossReporter reporter;
+            rse::rbudp::CreateLossReporter(reporter, received, bitmap_size);
+
+            bool ok = true;
+            for (int round = 0; round < 4 && ok; round++) {
+                // Round 0 is all missing, then progressively scattered and clustered receives
+                for (size_t i = 0; i < num_blocks; i++) {
+                    if (round == 1 && i % 3 == 0) received.Set(i);
+                    if (round == 2 && i % 1000 < 900) received.Set(i);
+                    if (round == 3 && i != 5000) received.Set(i);
+                }
+                size_t size = rse::rbudp::EncodeLossReport(reporter, received);
+                uint32_t payload_size;
+                memcpy(&payload_size, reporter.message + 1, 4);
+                if (size != rse::rbudp::REPORT_HEADER_SIZE + payload_size || payload_size > bitmap_size) ok = false;
+                rse::rbudp::ReportEncoding encoding = (rse::rbudp::ReportEncoding)reporter.message[0];
+                if (!rse::rbudp::DecodeLossReport(encoding, reporter.message + rse::rbudp::REPORT_HEADER_SIZE, payload_size, decoded, bitmap_size)) ok = false;
+                if (memcmp(received.Data(), decoded.Data(), bitmap_size) != 0 || decoded.Count() != received.Count()) ok = false;
+            }
+            // One missing block should not cost a whole bitmap
+            if ((rse::rbudp::ReportEncoding)reporter.message[0] == rse::rbudp::ReportEncoding::RAW) ok = false;
+
+            rse::rbudp::DestroyLossReporter(reporter);
+            return ok;
+        }
+
+        // Known answers, and splitting the input or taking the software path must not change them
+        bool TestCrc32c() {
+            if (rse::Crc32c(0, "123456789", 9) != 0xE3069283) return false;
+            if (rse::Crc32c(0, "", 0) != 0) return false;
+
+            static char data[4099];
+            for (size_t i = 0; i < sizeof(data); i++) data[i] = (char)(i * 7 + 3);
+            for (size_t n = 0; n < sizeof(data); n += 257) {
+                uint32_t whole = rse::Crc32c(0, data, n);
+                uint32_t split = rse::Crc32c(rse::Crc32c(0, data, n / 3), data + n / 3, n - n / 3);
+                uint32_t software = ~rse::Crc32cSoftware(~0u, (const uint8_t*)data, n);
+                if (whole != split || whole != software) return false;
+            }
+            return true;
+        }
+
+        bool TestHash64() {
+            if (rse::Hash64("", 0) != 0xEF46DB3751D8E999ull) return false;
+            if (rse::Hash64("abc", 3) != 0x44BC2CF5AD770999ull) return false;
+
+            // A block that differs anywhere hashes differently
+            static char block[4096];
+            memset(block, 'b', sizeof(block));
+            uint64_t hash = rse::Hash64(block, sizeof(block));
+            for (size_t i = 0; i < sizeof(block); i += 511) {
+                block[i] = 'x';
+                if (rse::Hash64(block, sizeof(block)) == hash) return false;
+                block[i] = 'b';
+            }
+            return rse::Hash64(block, sizeof(block)) == hash;
+        }
+
+        // Every kernel finds a single set byte wherever it is, on any alignment and length
+        bool TestIsZero() {
+            static char data[1024 + 64];
+            memset(data, 0, sizeof(data));
+            for (size_t start = 0; start < 64; start += 7) {
+                for (size_t n = 0; n <= 1024; n += 31) {
+                    if (!rse::IsZero(data + start, n)) return false;
+                    for (size_t i = 0; i < n; i += 13) {
+                        data[start + i] = 1;
+                        bool zero = rse::IsZero(data + start, n);
+                        data[start + i] = 0;
+                        if (zero) return false;
+                    }
+                    if (n > 0) {
+                        data[start + n - 1] = (char)0x80;
+                        bool zero = rse::IsZero(data + start, n);
+                        data[start + n - 1] = 0;
+                        if (zero) return false;
+                    }
+                }
+            }
+            return rse::IsZero(nullptr, 0);
+        }
+
+        // Whatever is compressed comes back the same, and nothing that isn't a valid block gets out of bounds
+        bool TestLz() {
+            static char data[8192];
+            static char packed[8192];
+            static char unpacked[8192];
+            for (size_t i = 0; i < sizeof(data); i++) data[i] = (char)("the quick brown fox "[i % 20] + (i / 700) % 3);
+            uint32_t x = 12345;
+            for (size_t n : { (size_t)0, (size_t)1, (size_t)13, (size_t)100, (size_t)4096, sizeof(data) }) {
+                size_t size = rse::lz::Compress(data, n, packed, sizeof(packed));
+                if (size == 0 || rse::lz::Decompress(packed, size, unpacked, sizeof(unpacked)) != n || memcmp(data, unpacked, n) != 0) return false;
+                if (n == 4096 && size > n / 4) return false;
+                if (n > 0 && rse::lz::Decompress(packed, size, unpacked, n - 1) != SIZE_MAX) return false;
+            }
+            // Noise doesn't shrink, and doesn't decode either
+            for (size_t i = 0; i < sizeof(data); i++) {
+                x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+                data[i] = (char)x;
+            }
+            if (rse::lz::Compress(data, 4096, packed, 4095) != 0) return false;
+            for (size_t n = 1; n < 4096; n += 97) rse::lz::Decompress(data, n, unpacked, 4096);
+            return true;
+        }
+
+        // Any blocks of a group come back from as many parity blocks, and every kernel agrees with the tables
+        bool TestFec() {
+            const uint32_t K = 10, M = 3, SIZE = 100;
+            static uint8_t data[K][SIZE];
+            static uint8_t parity[M][SIZE];
+            for (uint32_t i = 0; i < K; i++) for (uint32_t b = 0; b < SIZE; b++) data[i][b] = (uint8_t)(i * 31 + b * 7 + 1);
+            memset(parity, 0, sizeof(parity));
+            for (uint32_t row = 0; row < M; row++) {
+                for (uint32_t i = 0; i < K; i++) rse::fec::MulAddRegion(parity[row], data[i], rse::fec::Coefficient(row, i), SIZE);
+            }
+            uint8_t expected = 0;
+            for (uint32_t i = 0; i < K; i++) expected ^= data[i][5];
+            if (parity[0][5] != expected) return false; // row 0 is plain XOR
+            for (uint32_t i = 0; i < K; i++) {
+                uint8_t check[SIZE] = { 0 };
+                rse::fec::MulAddRegionTable(check, data[i], 0x53, SIZE);
+                rse::fec::MulAddRegion(check, data[i], 0x53, SIZE);
+                for (uint32_t b = 0; b < SIZE; b++) if (check[b] != 0) return false;
+            }
+
+            // Lose blocks {0, 4, 9} and rebuild them from parity rows {2, 0, 1}, like the receiver does
+            const uint32_t lost[M] = { 0, 4, 9 };
+            const uint32_t rows[M] = { 2, 0, 1 };
+            uint8_t syndromes[M][SIZE];
+            uint8_t matrix[M * M];
+            for (uint32_t r = 0; r < M; r++) {
+                memcpy(syndromes[r], parity[rows[r]], SIZE);
+                for (uint32_t i = 0; i < K; i++) {
+                    if (i != lost[0] && i != lost[1] && i != lost[2]) rse::fec::MulAddRegion(syndromes[r], data[i], rse::fec::Coefficient(rows[r], i), SIZE);
+                }
+                for (uint32_t c = 0; c < M; c++) matrix[r * M + c] = rse::fec::Coefficient(rows[r], lost[c]);
+            }
+            if (!rse::fec::Invert(matrix, M)) return false;
+            for (uint32_t c = 0; c < M; c++) {
+                uint8_t block[SIZE] = { 0 };
+                for (uint32_t r = 0; r < M; r++) rse::fec::MulAddRegion(block, syndromes[r], matrix[c * M + r], SIZE);
+                if (memcmp(block, data[lost[c]], SIZE) != 0) return false;
+            }
+            return true;
+        }
 
 		bool TestMemMap() {
 
@@ -45,14 +220,105 @@ namespace rse {
 		const char* PORT_STR = "27055";
 		const int PORT_NUM = 27055;
 		//constexpr size_t PAYLOAD_SIZE = 1 * 1024 * 1024 * 1024;
-        constexpr size_t PAYLOAD_SIZE = 1024;
+        constexpr size_t PAYLOAD_SIZE = 16 * 1024 * 1024;
         bool g_receiver_succeed_flag = false;
         bool g_sender_succeed_flag = false;
+        rse::rbudp::SendOptions g_send_options;
+        rse::rbudp::ReceiveOptions g_receive_options;
+        rse::rbudp::TransferStats g_sender_stats;
+        rse::rbudp::TransferStats g_receiver_stats;
+        const char* g_send_filename = "send_test.txt";
+        const char* g_receive_filename = "test.txt";
+        uint64_t g_payload_size = PAYLOAD_SIZE;
+
+        void PrintStats(const char* name, const rse::rbudp::TransferStats& stats) {
+            double gbytes = (double)stats.bytes / (double)(1024 * 1024 * 1024);
+            double syscalls_per_gb = gbytes > 0 ? (double)stats.datagram_syscalls / gbytes : 0;
+            fprintf(stdout, "[%s]: [%llu] datagrams [%llu] syscalls [%u] rounds [%.0lf] syscalls/GB\n", name,
+                (unsigned long long)stats.datagrams, (unsigned long long)stats.datagram_syscalls,
+                stats.rounds, syscalls_per_gb);
+            fprintf(stdout, "[%s]: [%llu] map window moves\n", name, (unsigned long long)stats.map_remaps);
+            if (stats.uring_lanes > 0) {
+                fprintf(stdout, "[%s]: [%u] of [%u] lanes on io_uring\n", name, stats.uring_lanes, stats.num_lanes);
+            }
+            if (stats.disk_writes > 0) {
+                fprintf(stdout, "[%s]: [%llu] disk writes of [%.1lf] KB on average, direct io [%s], [%llu] stalls on the writer\n", name,
+                    (unsigned long long)stats.disk_writes, (double)stats.disk_bytes / stats.disk_writes / 1024,
+                    stats.direct_io ? "yes" : "no", (unsigned long long)stats.sink_stalls);
+            }
+            if (stats.disk_reads > 0) {
+                fprintf(stdout, "[%s]: [%llu] disk reads of [%.1lf] KB on average, [%llu] waits on the readers\n", name,
+                    (unsigned long long)stats.disk_reads, (double)stats.disk_bytes / stats.disk_reads / 1024,
+                    (unsigned long long)stats.read_stalls);
+            }
+            if (stats.zerocopy_sends > 0) {
+                fprintf(stdout, "[%s]: [%llu] zero copy sends [%llu] released [%llu] copied anyway\n", name,
+                    (unsigned long long)stats.zerocopy_sends, (unsigned long long)stats.zerocopy_completed,
+                    (unsigned long long)stats.zerocopy_copied);
+            }
+            if (stats.nacks > 0) {
+                fprintf(stdout, "[%s]: [%llu] nacks for [%llu] blocks, [%llu] repair passes\n", name,
+                    (unsigned long long)stats.nacks, (unsigned long long)stats.nacked_blocks, (unsigned long long)stats.repair_passes);
+            }
+            if (stats.duplicate_blocks > 0 || stats.late_datagrams > 0) {
+                fprintf(stdout, "[%s]: [%llu] duplicate blocks, [%llu] datagrams caught waiting for quiet, srtt [%.3lf] ms\n", name,
+                    (unsigned long long)stats.duplicate_blocks, (unsigned long long)stats.late_datagrams, stats.srtt_ns / 1e6);
+            }
+            if (stats.checksum) {
+                fprintf(stdout, "[%s]: file digest [%08x] [%llu] corrupt blocks\n", name,
+                    stats.file_digest, (unsigned long long)stats.corrupt_blocks);
+            }
+            if (stats.delta) {
+                fprintf(stdout, "[%s]: [%llu] blocks already at the receiver\n", name, (unsigned long long)stats.delta_blocks);
+            }
+            if (stats.resume) {
+                fprintf(stdout, "[%s]: [%llu] blocks resumed, [%u] checkpoints of [%.1lf] KB\n", name, (unsigned long long)stats.resumed_blocks,
+                    stats.checkpoints, (double)stats.checkpoint_bytes / 1024);
+            }
+            if (stats.zero_blocks > 0) {
+                fprintf(stdout, "[%s]: [%llu] zero blocks\n", name, (unsigned long long)stats.zero_blocks);
+            }
+            if (stats.stale_packets > 0) {
+                fprintf(stdout, "[%s]: [%llu] stale packets dropped\n", name, (unsigned long long)stats.stale_packets);
+            }
+            if (stats.bad_packets > 0) {
+                fprintf(stdout, "[%s]: [%llu] bad packets dropped\n", name, (unsigned long long)stats.bad_packets);
+            }
+            if (stats.compression) {
+                fprintf(stdout, "[%s]: [%llu] blocks compressed into [%.1lf] KB, [%llu] sent raw without trying, [%.1lf] ms in the codec\n", name,
+                    (unsigned long long)stats.compressed_blocks, (double)stats.compressed_bytes / 1024,
+                    (unsigned long long)stats.bypassed_blocks, stats.codec_ns / 1e6);
+            }
+            if (stats.parity_blocks > 0) {
+                fprintf(stdout, "[%s]: [%llu] parity blocks [%llu] blocks rebuilt from them\n", name,
+                    (unsigned long long)stats.parity_blocks, (unsigned long long)stats.rebuilt_blocks);
+            }
+            if (stats.poll_wakeups > 0) {
+                fprintf(stdout, "[%s]: [%llu] wake ups [%llu] datagrams read during the blast\n", name,
+                    (unsigned long long)stats.poll_wakeups, (unsigned long long)stats.datagrams_during_blast);
+            }
+            fprintf(stdout, "[%s]: [%llu] control bytes [%llu] in loss reports (raw/ranges/runs/delta [%u/%u/%u/%u])\n", name,
+                (unsigned long long)stats.control_bytes, (unsigned long long)stats.report_bytes,
+                stats.reports_by_encoding[0], stats.reports_by_encoding[1], stats.reports_by_encoding[2], stats.reports_by_encoding[3]);
+            if (stats.num_lanes > 1) {
+                for (uint32_t lane = 0; lane < stats.num_lanes && lane < rse::rbudp::MAX_LANES; lane++) {
+                    const rse::rbudp::LaneStats& l = stats.lanes[lane];
+                    double mbps = l.seconds > 0 ? (double)l.bytes * 8 / l.seconds / 1e6 : 0;
+                    fprintf(stdout, "[%s]: lane [%u] [%llu] datagrams [%llu] syscalls [%.1lf] Mbps while busy\n", name, lane,
+                        (unsigned long long)l.datagrams, (unsigned long long)l.datagram_syscalls, mbps);
+                }
+            }
+            if (stats.blast_seconds > 0) {
+                double blast_mbps = (double)stats.bytes * 8 / stats.blast_seconds / 1e6;
+                fprintf(stdout, "[%s]: blast rate [%.1lf] Mbps target [%.1lf] Mbps\n", name, blast_mbps, stats.target_rate_mbps);
+                fprintf(stdout, "[%s]: final window [%u] packets rate [%.1lf] Mbps\n", name, stats.window, stats.rate_mbps);
+            }
+        }
 
 #ifdef _WIN32
         unsigned __stdcall ThreadReceiver(void* payload) {
 
-            g_receiver_succeed_flag = rse::rbudp::WaitToReceive("127.0.0.1", PORT_STR, PORT_NUM);
+            g_receiver_succeed_flag = rse::rbudp::WaitToReceive("127.0.0.1", PORT_STR, PORT_NUM, g_receive_options, &g_receiver_stats);
 
             return 0;
         }
@@ -61,7 +327,7 @@ namespace rse {
 
             rse::TickTock timer = rse::Tick();
 
-            g_sender_succeed_flag = rse::rbudp::SendFile("send_test.txt", "test.txt", "127.0.0.1", PORT_STR, PORT_NUM, 4096);
+            g_sender_succeed_flag = rse::rbudp::SendFile(g_send_filename, g_receive_filename, "127.0.0.1", PORT_STR, PORT_NUM, 4096, g_send_options, &g_sender_stats);
             if (!g_sender_succeed_flag) {
                 debug_printf("[sender]: failed to send file\n");
                 return 0;
@@ -70,7 +336,7 @@ namespace rse {
             double t = rse::Tock(timer);
             fprintf(stdout, "[%lf]\n", t);
 
-            double mbytes = (double)PAYLOAD_SIZE / (double)1024 / (double)1024;
+            double mbytes = (double)g_payload_size / (double)1024 / (double)1024;
             double mbytes_per_sec = mbytes / t;
             double mbits_per_sec = (mbytes * 8) / t;
 
@@ -83,15 +349,15 @@ namespace rse {
 
 
         void* ThreadReceiver(void* payload) {
-            rse::rbudp::WaitToReceive("127.0.0.1", PORT_STR, PORT_NUM);
+            g_receiver_succeed_flag = rse::rbudp::WaitToReceive("127.0.0.1", PORT_STR, PORT_NUM, g_receive_options, &g_receiver_stats);
             return nullptr;
         }
 
         void* ThreadSender(void* payload) {
             rse::TickTock timer = rse::Tick();
 
-            bool result = rse::rbudp::SendFile("send_test.txt", "test.txt", "127.0.0.1", PORT_STR, PORT_NUM, 4096);
-            if (!result) {
+            g_sender_succeed_flag = rse::rbudp::SendFile(g_send_filename, g_receive_filename, "127.0.0.1", PORT_STR, PORT_NUM, 4096, g_send_options, &g_sender_stats);
+            if (!g_sender_succeed_flag) {
                 debug_printf("[sender]: failed to send file\n");
                 return nullptr;
             }
@@ -99,7 +365,7 @@ namespace rse {
             double t = rse::Tock(timer);
             fprintf(stdout, "[%lf]\n", t);
 
-            double mbytes = (double)PAYLOAD_SIZE / (double)1024 / (double)1024;
+            double mbytes = (double)g_payload_size / (double)1024 / (double)1024;
             double mbytes_per_sec = mbytes / t;
             double mbits_per_sec = (mbytes * 8) / t;
 
@@ -111,28 +377,18 @@ namespace rse {
 
 #endif
 
-		bool TestRBUDP() {
+        // Runs a receiver and a sender thread moving g_send_filename to g_receive_filename over loopback
+        bool RunTransfer(const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
 
-            printf("Starting Blast UDP...\n");
+            g_send_options = send_options;
+            g_receive_options = receive_options;
+            g_receiver_succeed_flag = false;
+            g_sender_succeed_flag = false;
 
             if (rse::sk::Startup() == rse::sk::SK_ERROR_SOCKET) {
                 return false;
             }
 
-            // Lets write a 2 gig file
-            debug_printf("writing and allocating file\n");
-            FILE* file = fopen("send_test.txt", "wb");
-            if (file == NULL) {
-                rse::sk::Cleanup();
-                return false;
-            }
-
-            char* data = new char[PAYLOAD_SIZE];
-            memset(data, 'b', PAYLOAD_SIZE);
-            fwrite(data, 1, PAYLOAD_SIZE, file);
-            fclose(file);
-            delete[] data;
-
             debug_printf("starting threads\n");
 #ifdef _WIN32
             unsigned thread_ID_sender;
@@ -143,6 +399,8 @@ namespace rse {
                 printf("Failed to create thread\n");
                 return false;
             }
+            // Give the receiver time to start listening before the sender connects
+            Sleep(100);
             HANDLE thread_handle_sender = (HANDLE)_beginthreadex(nullptr, 0, &ThreadSender, nullptr, 0, &thread_ID_sender);
             if (thread_handle_sender == 0) {
                 printf("Failed to create thread\n");
@@ -164,13 +422,15 @@ namespace rse {
             int return_sender;
             int return_receiver;
 
-            return_sender = pthread_create(&thread_ID_sender, nullptr, ThreadSender, nullptr);
-            if (return_sender) {
+            return_receiver = pthread_create(&thread_ID_receiver, nullptr, ThreadReceiver, nullptr);
+            if (return_receiver) {
                 printf("Failed to create thread\n");
                 return false;
             }
-            return_receiver = pthread_create(&thread_ID_receiver, nullptr, ThreadReceiver, nullptr);
-            if (return_receiver) {
+            // Give the receiver time to start listening before the sender connects
+            usleep(100 * 1000);
+            return_sender = pthread_create(&thread_ID_sender, nullptr, ThreadSender, nullptr);
+            if (return_sender) {
                 printf("Failed to create thread\n");
                 return false;
             }
@@ -186,7 +446,13 @@ namespace rse {
                 return false;
             }
 
-            // Open the file and check that it contains all 'a'
+            PrintStats("sender", g_sender_stats);
+            PrintStats("receiver", g_receiver_stats);
+            return true;
+        }
+
+        // Checks that test.txt holds PAYLOAD_SIZE bytes of 'b' and both ends came to the same digest of it
+        bool CheckReceivedFile() {
             size_t test_txt_size = 0;
             char* buffer = rse::io::AllocateIntoBuffer("test.txt", test_txt_size);
             if (buffer == nullptr) {
@@ -194,7 +460,7 @@ namespace rse {
                 return false;
             }
 
-            if (test_txt_size < PAYLOAD_SIZE) {
+            if (test_txt_size != PAYLOAD_SIZE) {
                 printf("Fail on reading test.txt due to the size [%lu] [%lu]\n", test_txt_size, PAYLOAD_SIZE);
                 free(buffer);
                 return false;
@@ -209,10 +475,992 @@ namespace rse {
             }
 
             free(buffer);
+            if (g_sender_stats.file_digest != g_receiver_stats.file_digest) {
+                printf("\nFail on the file digests [%08x][%08x]\n", g_sender_stats.file_digest, g_receiver_stats.file_digest);
+                return false;
+            }
+            return true;
+        }
+
+        // Sends a file of PAYLOAD_SIZE bytes of 'b' over loopback with the given options and checks it arrived intact
+        bool SendTestFile(const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
+            g_send_filename = "send_test.txt";
+            g_receive_filename = "test.txt";
+            g_payload_size = PAYLOAD_SIZE;
+
+            debug_printf("writing and allocating file\n");
+            FILE* file = fopen("send_test.txt", "wb");
+            if (file == NULL) {
+                return false;
+            }
+
+            char* data = new char[PAYLOAD_SIZE];
+            memset(data, 'b', PAYLOAD_SIZE);
+            fwrite(data, 1, PAYLOAD_SIZE, file);
+            fclose(file);
+            delete[] data;
+
+            return RunTransfer(send_options, receive_options) && CheckReceivedFile();
+        }
+
+        // Sends a file over loopback with the given options and checks it arrived intact
+		bool TestRBUDP(const char* name = "default",
+            const rse::rbudp::SendOptions& send_options = rse::rbudp::SendOptions(),
+            const rse::rbudp::ReceiveOptions& receive_options = rse::rbudp::ReceiveOptions()) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            if (!SendTestFile(send_options, receive_options)) {
+                return false;
+            }
             printf("\nSuccess!\n");
             return true;
 		}
 
+        // Sends paced to send_options.rate_mbps and checks the blast never went more than 10% past it
+        bool TestPacedTransfer(const char* name,
+            const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            if (!SendTestFile(send_options, receive_options)) return false;
+            // Only going over is checked. Loss slows the blast down on purpose, and so does a busy machine.
+            double blast_mbps = (double)g_sender_stats.bytes * 8 / g_sender_stats.blast_seconds / 1e6;
+            if (blast_mbps > send_options.rate_mbps * 1.1 ||
+                g_sender_stats.rate_mbps > send_options.rate_mbps * 1.001) {
+                printf("\nFail on the rate [%.1lf] Mbps blasting, [%.1lf] Mbps at the end, target [%.1lf] Mbps\n",
+                    blast_mbps, g_sender_stats.rate_mbps, send_options.rate_mbps);
+                return false;
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Sends a file to a receiver that takes fewer blocks than it has, and checks both ends give up on it
+        bool TestRefusedTransfer(const char* name,
+            const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            if (SendTestFile(send_options, receive_options) || g_receiver_succeed_flag || g_sender_succeed_flag) {
+                printf("\nFail on a transfer of more blocks than the receiver takes\n");
+                return false;
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Sends pipelined and checks the NACKs didn't make the sender send much more than the file and
+        // what was lost, which a blast bigger than the receiver can take would
+        bool TestPipelinedTransfer(const char* name,
+            const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            if (!SendTestFile(send_options, receive_options)) return false;
+#ifdef RSE_TEST_SOCKET_PACKET_LOSS
+            const size_t slack = PAYLOAD_SIZE / 100 * (1 + 2 * RSE_TEST_SOCKET_PACKET_LOSS_PERCENTAGE);
+#else
+            const size_t slack = PAYLOAD_SIZE / 100;
+#endif
+            if (g_sender_stats.bytes > PAYLOAD_SIZE + slack) {
+                printf("\nFail on [%llu] bytes in [%llu] datagrams sent for a file of [%llu]\n", (unsigned long long)g_sender_stats.bytes,
+                    (unsigned long long)g_sender_stats.datagrams, (unsigned long long)PAYLOAD_SIZE);
+                return false;
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Has the sender corrupt some of its datagrams and checks the receiver dropped them and had
+        // them sent again
+        bool TestCorruptBlocks(const char* name,
+            const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            if (!SendTestFile(send_options, receive_options)) return false;
+            if (g_receiver_stats.corrupt_blocks == 0 || g_sender_stats.rounds < 2) {
+                printf("\nFail on [%llu] corrupt blocks in [%u] rounds\n", (unsigned long long)g_receiver_stats.corrupt_blocks,
+                    g_sender_stats.rounds);
+                return false;
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Sends with the given loss once without parity and once with it, and checks the receiver rebuilt
+        // blocks from the parity and so needed fewer rounds
+        bool TestFecTransfer(const char* name,
+            const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            rse::rbudp::SendOptions plain_options = send_options;
+            plain_options.fec_group_size = 0;
+            if (!SendTestFile(plain_options, receive_options)) return false;
+            uint32_t plain_rounds = g_sender_stats.rounds;
+            if (!SendTestFile(send_options, receive_options)) return false;
+#ifdef RSE_TEST_SOCKET_PACKET_LOSS
+            // Random loss on top shrinks the window differently every run, so rounds don't compare
+            plain_rounds = UINT32_MAX;
+#endif
+            if (g_receiver_stats.rebuilt_blocks == 0 || g_sender_stats.rounds >= plain_rounds) {
+                printf("\nFail on [%llu] rebuilt blocks, [%u] rounds with parity and [%u] without\n",
+                    (unsigned long long)g_receiver_stats.rebuilt_blocks, g_sender_stats.rounds, plain_rounds);
+                return false;
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Has the sender hold datagrams back until after the flag that ends each round, and checks
+        // the receiver waited for them rather than reporting them lost
+        bool TestLateDatagrams(const char* name,
+            const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            if (!SendTestFile(send_options, receive_options)) return false;
+            if (g_receiver_stats.late_datagrams == 0) {
+                printf("\nFail on no datagrams caught waiting for quiet over [%u] rounds\n", g_receiver_stats.rounds);
+                return false;
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Has the sender replay datagrams of an earlier round, and one as another session, into each round,
+        // and checks the receiver dropped them rather than writing them over the blocks of this one
+        bool TestStalePackets(const char* name,
+            const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            if (!SendTestFile(send_options, receive_options)) return false;
+            if (g_receiver_stats.rounds < 2 || g_receiver_stats.stale_packets == 0) {
+                printf("\nFail on no stale packets dropped over [%u] rounds\n", g_receiver_stats.rounds);
+                return false;
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Sends to a receiver that speaks an older handshake than the sender, asking for lanes and features
+        // it doesn't know, and checks the file arrived with none of them
+        bool TestOlderReceiver(const char* name,
+            const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            if (!SendTestFile(send_options, receive_options)) return false;
+            if (g_sender_stats.num_lanes != 1 || g_receiver_stats.num_lanes != 1 ||
+                g_sender_stats.checksum || g_receiver_stats.checksum) {
+                printf("\nFail on the lanes [%u][%u] or checksums a version [%u] receiver doesn't speak\n",
+                    g_sender_stats.num_lanes, g_receiver_stats.num_lanes, receive_options.protocol_version);
+                return false;
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Sends through io_uring and checks both ends really used it rather than falling back to the socket calls
+        bool TestUring(const char* name,
+            const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            if (!SendTestFile(send_options, receive_options)) return false;
+            if (g_sender_stats.uring_lanes == 0 || g_receiver_stats.uring_lanes == 0) {
+                printf("\nFail on io_uring lanes [%u] sending [%u] receiving\n", g_sender_stats.uring_lanes, g_receiver_stats.uring_lanes);
+                return false;
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Sends with MSG_ZEROCOPY and checks the kernel took the sends that way and released every one of them
+        bool TestZeroCopy(const char* name,
+            const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            if (!SendTestFile(send_options, receive_options)) return false;
+            if (g_sender_stats.zerocopy_sends == 0 || g_sender_stats.zerocopy_completed != g_sender_stats.zerocopy_sends) {
+                printf("\nFail on zero copy [%llu] sends [%llu] released\n", (unsigned long long)g_sender_stats.zerocopy_sends,
+                    (unsigned long long)g_sender_stats.zerocopy_completed);
+                return false;
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Sends a file to a receiver that already has an older, shorter copy of it with a few blocks changed,
+        // and checks that only those and the blocks past its end were sent
+        bool TestDeltaTransfer(const char* name,
+            const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            g_send_filename = "send_test.txt";
+            g_receive_filename = "test.txt";
+            g_payload_size = PAYLOAD_SIZE;
+
+            const uint32_t block_size = 4096;
+            const size_t old_size = PAYLOAD_SIZE - 100000;
+            const size_t changed[] = { 5000, block_size * 1000, block_size * 1001 + 17, block_size * 3000 + block_size - 1 };
+            const uint64_t changed_blocks = 4;
+
+            char* data = new char[PAYLOAD_SIZE];
+            memset(data, 'b', PAYLOAD_SIZE);
+            FILE* file = fopen(g_send_filename, "wb");
+            if (file == NULL) {
+                delete[] data;
+                return false;
+            }
+            fwrite(data, 1, PAYLOAD_SIZE, file);
+            fclose(file);
+
+            for (size_t offset : changed) data[offset] = 'x';
+            file = fopen(g_receive_filename, "wb");
+            if (file == NULL) {
+                delete[] data;
+                return false;
+            }
+            fwrite(data, 1, old_size, file);
+            fclose(file);
+            delete[] data;
+
+            if (!RunTransfer(send_options, receive_options) || !CheckReceivedFile()) {
+                return false;
+            }
+
+            // The old copy's last block is short, so it differs too
+            uint64_t expected = old_size / block_size - changed_blocks;
+            if (g_sender_stats.delta_blocks != expected || g_receiver_stats.delta_blocks != expected) {
+                printf("\nFail on the blocks kept [%llu][%llu] expected [%llu]\n", (unsigned long long)g_sender_stats.delta_blocks,
+                    (unsigned long long)g_receiver_stats.delta_blocks, (unsigned long long)expected);
+                return false;
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Leaves the receiver what an interrupted transfer would have, half the file with a few blocks missing
+        // and its checkpoint, then checks that only the rest is sent and the checkpoint goes once it is all in
+        bool TestResumeTransfer(const char* name,
+            const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            g_send_filename = "send_test.txt";
+            g_receive_filename = "test.txt";
+            g_payload_size = PAYLOAD_SIZE;
+
+            const uint32_t block_size = 4096;
+            rse::rbudp::TransmissionInfo info = {};
+            info.number_packets = rse::rbudp::BlockCount(PAYLOAD_SIZE, block_size);
+            info.block_size = block_size;
+            info.summation_block_size = info.number_packets * block_size;
+            strcpy(info.path_name, g_receive_filename);
+
+            char* data = new char[info.summation_block_size];
+            memset(data, 'b', PAYLOAD_SIZE);
+            FILE* file = fopen(g_send_filename, "wb");
+            if (file == NULL) {
+                delete[] data;
+                return false;
+            }
+            fwrite(data, 1, PAYLOAD_SIZE, file);
+            fclose(file);
+            info.resume_token = rse::rbudp::ResumeToken(g_send_filename, g_receive_filename, PAYLOAD_SIZE, block_size);
+
+            // Whatever the checkpoint doesn't have is garbage
+            rse::Bitmap bitmap(info.number_packets);
+            for (uint64_t id = 0; id < info.number_packets / 2; id++) {
+                if (id % 97 != 5) bitmap.Set(id);
+            }
+            for (uint64_t id = 0; id < info.number_packets; id++) {
+                if (!bitmap.Get(id)) memset(data + id * block_size, 'x', block_size);
+            }
+            file = fopen(g_receive_filename, "wb");
+            if (file == NULL) {
+                delete[] data;
+                return false;
+            }
+            fwrite(data, 1, info.summation_block_size, file);
+            fclose(file);
+            delete[] data;
+
+            rse::rbudp::Checkpoint checkpoint;
+            rse::rbudp::TransferStats stats;
+            if (!rse::rbudp::OpenCheckpoint(checkpoint, info, receive_options, bitmap, stats)) {
+                printf("\nFail on making the checkpoint\n");
+                return false;
+            }
+            rse::rbudp::CloseCheckpoint(checkpoint, bitmap, true, stats);
+
+            if (!RunTransfer(send_options, receive_options) || !CheckReceivedFile()) {
+                return false;
+            }
+
+            uint64_t expected = bitmap.count.load();
+            if (g_sender_stats.resumed_blocks != expected || g_receiver_stats.resumed_blocks != expected) {
+                printf("\nFail on the blocks resumed [%llu][%llu] expected [%llu]\n", (unsigned long long)g_sender_stats.resumed_blocks,
+                    (unsigned long long)g_receiver_stats.resumed_blocks, (unsigned long long)expected);
+                return false;
+            }
+            if (g_receiver_stats.checkpoints == 0) {
+                printf("\nFail on no checkpoints taken\n");
+                return false;
+            }
+            char checkpoint_name[rse::rbudp::PATH_SIZE + 16];
+            snprintf(checkpoint_name, sizeof(checkpoint_name), "%s%s", g_receive_filename, rse::rbudp::CHECKPOINT_SUFFIX);
+            uint64_t checkpoint_size = 0;
+            if (rse::io::GetFileSize(checkpoint_name, checkpoint_size)) {
+                printf("\nFail on the checkpoint still being there\n");
+                return false;
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+#ifdef RSE_TEST_FAULTS
+        // Has the sender give up partway through, as though it died, then sends the file again and checks the
+        // second try picked up from the checkpoint the first one left
+        bool TestInterruptedTransfer(const char* name,
+            const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            g_send_filename = "send_test.txt";
+            g_receive_filename = "test.txt";
+            g_payload_size = PAYLOAD_SIZE;
+            char checkpoint_name[rse::rbudp::PATH_SIZE + 16];
+            snprintf(checkpoint_name, sizeof(checkpoint_name), "%s%s", g_receive_filename, rse::rbudp::CHECKPOINT_SUFFIX);
+            remove(g_receive_filename);
+            remove(checkpoint_name);
+
+            char* data = new char[PAYLOAD_SIZE];
+            memset(data, 'b', PAYLOAD_SIZE);
+            FILE* file = fopen(g_send_filename, "wb");
+            if (file == NULL) {
+                delete[] data;
+                return false;
+            }
+            fwrite(data, 1, PAYLOAD_SIZE, file);
+            fclose(file);
+            delete[] data;
+
+            rse::rbudp::TestFaults faults;
+            faults.abort_after_rounds = 1;
+            rse::rbudp::SendOptions interrupted = send_options;
+            interrupted.faults = &faults;
+            if (RunTransfer(interrupted, receive_options) || g_receiver_succeed_flag) {
+                printf("\nFail on the first try counting as received\n");
+                return false;
+            }
+            uint64_t checkpoint_size = 0;
+            if (!rse::io::GetFileSize(checkpoint_name, checkpoint_size)) {
+                printf("\nFail on no checkpoint left after [%u] rounds\n", g_receiver_stats.rounds);
+                return false;
+            }
+
+            if (!RunTransfer(send_options, receive_options) || !CheckReceivedFile()) {
+                return false;
+            }
+            if (g_sender_stats.resumed_blocks == 0 || g_receiver_stats.resumed_blocks != g_sender_stats.resumed_blocks) {
+                printf("\nFail on the blocks resumed [%llu][%llu]\n", (unsigned long long)g_sender_stats.resumed_blocks,
+                    (unsigned long long)g_receiver_stats.resumed_blocks);
+                return false;
+            }
+            if (rse::io::GetFileSize(checkpoint_name, checkpoint_size)) {
+                printf("\nFail on the checkpoint still being there\n");
+                return false;
+            }
+            printf("[%s]: [%llu] blocks resumed\n", name, (unsigned long long)g_receiver_stats.resumed_blocks);
+            printf("\nSuccess!\n");
+            return true;
+        }
+#endif
+
+        // Sends a file with long runs of zeros and checks they went as zero blocks and came out the same.
+        // With a delta the receiver's old copy has data where the zeros are, which has to be overwritten,
+        // otherwise they should be left as holes.
+        bool TestZeroBlockTransfer(const char* name,
+            const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            g_send_filename = "send_test.txt";
+            g_receive_filename = "test.txt";
+            g_payload_size = PAYLOAD_SIZE;
+
+            const size_t block_size = 4096;
+            const size_t MB = 1024 * 1024;
+            const size_t zeros[][2] = { { 1 * MB, 3 * MB }, { 5 * MB + 100, 6 * MB + 3000 }, { 8 * MB, 12 * MB }, { PAYLOAD_SIZE - 10000, PAYLOAD_SIZE } };
+
+            char* data = new char[PAYLOAD_SIZE];
+            memset(data, 'b', PAYLOAD_SIZE);
+            if (send_options.delta) {
+                FILE* file = fopen(g_receive_filename, "wb");
+                if (file == NULL) {
+                    delete[] data;
+                    return false;
+                }
+                fwrite(data, 1, PAYLOAD_SIZE, file);
+                fclose(file);
+            }
+            for (const size_t* range : zeros) memset(data + range[0], 0, range[1] - range[0]);
+            FILE* file = fopen(g_send_filename, "wb");
+            if (file == NULL) {
+                delete[] data;
+                return false;
+            }
+            fwrite(data, 1, PAYLOAD_SIZE, file);
+            fclose(file);
+
+            uint64_t expected = 0;
+            for (size_t offset = 0; offset < PAYLOAD_SIZE; offset += block_size) {
+                size_t n = PAYLOAD_SIZE - offset < block_size ? PAYLOAD_SIZE - offset : block_size;
+                if (rse::IsZero(data + offset, n)) expected++;
+            }
+
+            bool ok = RunTransfer(send_options, receive_options);
+            size_t received_size = 0;
+            char* received = ok ? rse::io::AllocateIntoBuffer(g_receive_filename, received_size) : nullptr;
+            if (received == nullptr || received_size != PAYLOAD_SIZE || memcmp(received, data, PAYLOAD_SIZE) != 0) {
+                printf("\nFail on the contents of test.txt\n");
+                ok = false;
+            }
+            free(received);
+            delete[] data;
+            if (!ok) return false;
+
+            // Resent zero blocks count again at the sender, and ones rebuilt from parity don't at the receiver
+            uint64_t at_receiver = g_receiver_stats.zero_blocks;
+            if (at_receiver > expected || (send_options.fec_group_size == 0 && at_receiver != expected) || g_sender_stats.zero_blocks < expected) {
+                printf("\nFail on the zero blocks [%llu][%llu] expected [%llu]\n", (unsigned long long)g_sender_stats.zero_blocks,
+                    (unsigned long long)g_receiver_stats.zero_blocks, (unsigned long long)expected);
+                return false;
+            }
+#ifdef __linux__
+            struct stat st;
+            if (!send_options.delta && (stat(g_receive_filename, &st) != 0 || (uint64_t)st.st_blocks * 512 > PAYLOAD_SIZE - expected * block_size + MB)) {
+                printf("\nFail on the holes, [%llu] bytes allocated\n", (unsigned long long)st.st_blocks * 512);
+                return false;
+            }
+#endif
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Lines of text that differ in their numbers, which compresses about as well as logs do
+        void FillText(char* data, size_t size) {
+            char line[128];
+            size_t offset = 0;
+            for (size_t n = 0; offset < size; n++) {
+                int length = snprintf(line, sizeof(line), "%08zu [info] block %zu of the transfer went out at %zu us\n", n, n * 7 % 4099, n * 131);
+                size_t take = size - offset < (size_t)length ? size - offset : (size_t)length;
+                memcpy(data + offset, line, take);
+                offset += take;
+            }
+        }
+
+        void FillNoise(char* data, size_t size) {
+            uint64_t x = 88172645463325252ull;
+            for (size_t i = 0; i < size; i++) {
+                x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+                data[i] = (char)(x >> 32);
+            }
+        }
+
+        // Sends text, which should go compressed, or noise, which the sender should soon stop trying to compress
+        bool TestCompressionTransfer(const char* name, bool text,
+            const rse::rbudp::SendOptions& send_options, const rse::rbudp::ReceiveOptions& receive_options) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            g_send_filename = "send_test.txt";
+            g_receive_filename = "test.txt";
+            g_payload_size = PAYLOAD_SIZE;
+
+            char* data = new char[PAYLOAD_SIZE];
+            if (text) FillText(data, PAYLOAD_SIZE);
+            else FillNoise(data, PAYLOAD_SIZE);
+            FILE* file = fopen(g_send_filename, "wb");
+            if (file == NULL) {
+                delete[] data;
+                return false;
+            }
+            fwrite(data, 1, PAYLOAD_SIZE, file);
+            fclose(file);
+
+            bool ok = RunTransfer(send_options, receive_options);
+            size_t received_size = 0;
+            char* received = ok ? rse::io::AllocateIntoBuffer(g_receive_filename, received_size) : nullptr;
+            if (received == nullptr || received_size != PAYLOAD_SIZE || memcmp(received, data, PAYLOAD_SIZE) != 0) {
+                printf("\nFail on the contents of test.txt\n");
+                ok = false;
+            }
+            free(received);
+            delete[] data;
+            if (!ok) return false;
+
+            const rse::rbudp::TransferStats& sent = g_sender_stats;
+            if (text ? sent.compressed_blocks == 0 || g_receiver_stats.compressed_blocks == 0 || sent.compressed_bytes * 2 > sent.compressed_blocks * 4096 :
+                sent.compressed_blocks > 0 || sent.bypassed_blocks == 0) {
+                printf("\nFail on compression, [%llu] blocks compressed [%llu] bypassed\n",
+                    (unsigned long long)sent.compressed_blocks, (unsigned long long)sent.bypassed_blocks);
+                return false;
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Sends a log-like file at a few rates with and without compression. Compression wins where the
+        // link is slower than the codec, and should bypass itself where it isn't.
+        bool BenchmarkCompression() {
+
+            printf("Starting Blast UDP [compression benchmark]...\n");
+            g_send_filename = "send_test.txt";
+            g_receive_filename = "test.txt";
+            g_payload_size = PAYLOAD_SIZE;
+
+            char* data = new char[PAYLOAD_SIZE];
+            FillText(data, PAYLOAD_SIZE);
+            FILE* file = fopen(g_send_filename, "wb");
+            if (file == NULL) {
+                delete[] data;
+                return false;
+            }
+            fwrite(data, 1, PAYLOAD_SIZE, file);
+            fclose(file);
+            delete[] data;
+
+            const double rates[] = { 100, 400, 1000, 0 };
+            double seconds[4][2] = { { 0 } };
+            for (int r = 0; r < 4; r++) {
+                for (int compress = 0; compress < 2; compress++) {
+                    rse::rbudp::SendOptions send_options;
+                    send_options.rate_mbps = rates[r];
+                    send_options.compression = compress == 1;
+                    rse::TickTock timer = rse::Tick();
+                    if (!RunTransfer(send_options, rse::rbudp::ReceiveOptions())) return false;
+                    seconds[r][compress] = rse::Tock(timer);
+                }
+            }
+
+            double mbytes = (double)PAYLOAD_SIZE / 1024 / 1024;
+            for (int r = 0; r < 4; r++) {
+                printf("[compression benchmark]: rate [%.0lf] Mbps raw [%.1lf] MB/s compressed [%.1lf] MB/s\n", rates[r],
+                    mbytes / seconds[r][0], mbytes / seconds[r][1]);
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Sends the same file over more and more lanes, to see how the lane workers scale
+        bool BenchmarkLanes() {
+
+            printf("Starting Blast UDP [lanes benchmark]...\n");
+            const size_t size = 128 * 1024 * 1024;
+            g_send_filename = "send_test.txt";
+            g_receive_filename = "test.txt";
+            g_payload_size = size;
+
+            char* data = new char[size];
+            memset(data, 'b', size);
+            FILE* file = fopen(g_send_filename, "wb");
+            if (file == NULL) {
+                delete[] data;
+                return false;
+            }
+            fwrite(data, 1, size, file);
+            fclose(file);
+            delete[] data;
+
+            const uint32_t lanes[] = { 1, 2, 4, 8 };
+            double mbytes = (double)size / 1024 / 1024;
+            for (uint32_t num_lanes : lanes) {
+                rse::rbudp::SendOptions send_options;
+                send_options.lanes = num_lanes;
+                rse::TickTock timer = rse::Tick();
+                if (!RunTransfer(send_options, rse::rbudp::ReceiveOptions())) return false;
+                double seconds = rse::Tock(timer);
+                printf("[lanes benchmark]: [%u] lanes [%.2lf] s [%.1lf] MB/s [%u] rounds\n", g_receiver_stats.num_lanes,
+                    seconds, mbytes / seconds, g_sender_stats.rounds);
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Sends a file from the map and with read ahead, once with it in the page cache and once
+        // with it dropped from there, to see what reading ahead buys when the sender has to go to disk
+        bool BenchmarkReadAhead() {
+
+            printf("Starting Blast UDP [read ahead benchmark]...\n");
+            const size_t size = 256 * 1024 * 1024;
+            g_send_filename = "send_test.txt";
+            g_receive_filename = "test.txt";
+            g_payload_size = size;
+
+            char* data = new char[size];
+            FillText(data, size);
+            FILE* file = fopen(g_send_filename, "wb");
+            if (file == NULL) {
+                delete[] data;
+                return false;
+            }
+            fwrite(data, 1, size, file);
+            fclose(file);
+            delete[] data;
+
+            double mbytes = (double)size / 1024 / 1024;
+            for (int read_ahead = 0; read_ahead < 2; read_ahead++) {
+                for (int cold = 0; cold < 2; cold++) {
+                    if (cold && !rse::io::EvictFile(g_send_filename)) {
+                        printf("Failed to drop [%s] from the page cache\n", g_send_filename);
+                        return false;
+                    }
+                    rse::rbudp::SendOptions send_options;
+                    send_options.read_ahead = read_ahead == 1;
+                    rse::TickTock timer = rse::Tick();
+                    if (!RunTransfer(send_options, rse::rbudp::ReceiveOptions())) return false;
+                    double seconds = rse::Tock(timer);
+                    printf("[read ahead benchmark]: [%s] [%s] cache [%.2lf] s [%.1lf] MB/s [%llu] read stalls\n",
+                        read_ahead ? "read ahead" : "map", cold ? "cold" : "warm", seconds, mbytes / seconds,
+                        (unsigned long long)g_sender_stats.read_stalls);
+                }
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // One of many senders to a receiver daemon
+        struct DaemonSender {
+            char send_filename[64];
+            char receive_filename[64];
+            size_t size = 0;
+            char fill = 0;
+            const rse::rbudp::SendOptions* options = nullptr;
+            rse::rbudp::TransferStats stats;
+            bool ok = false;
+        };
+
+        void DaemonSenderThread(void* arg) {
+            DaemonSender& sender = *(DaemonSender*)arg;
+            sender.ok = rse::rbudp::SendFile(sender.send_filename, sender.receive_filename, "127.0.0.1", PORT_STR, PORT_NUM,
+                4096, *sender.options, &sender.stats);
+        }
+
+        // A few datagrams to the daemon's port that belong to no session
+        void SendStrayDatagrams() {
+            rse::sk::SocketHandle socket = rse::sk::CreateUDPSocket();
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(PORT_NUM);
+            addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+            char junk[64];
+            for (int i = 0; i < 16; i++) {
+                memset(junk, 0x5A + i, sizeof(junk));
+                rse::sk::SendTo(socket, junk, 8 + i * 3, 0, (const sockaddr*)&addr, sizeof(addr));
+            }
+            rse::sk::CloseSocket(socket);
+        }
+
+        // Sends count files of their own at once to a daemon taking max_sessions of them at a time, and checks
+        // every one arrived intact. The files are a little different in size so the sessions end apart.
+        // A daemon on a shared port gets some stray datagrams first.
+        bool RunDaemonTransfers(uint32_t count, const rse::rbudp::DaemonOptions& daemon_options, size_t size, const rse::rbudp::SendOptions& send_options,
+            double& seconds, rse::rbudp::DaemonStats& daemon_stats) {
+
+            if (rse::sk::Startup() == rse::sk::SK_ERROR_SOCKET) {
+                return false;
+            }
+
+            DaemonSender* senders = new DaemonSender[count];
+            char* data = new char[size + (size_t)count * 1021];
+            bool ok = true;
+            for (uint32_t i = 0; i < count && ok; i++) {
+                DaemonSender& sender = senders[i];
+                snprintf(sender.send_filename, sizeof(sender.send_filename), "send_test_%u.txt", i);
+                snprintf(sender.receive_filename, sizeof(sender.receive_filename), "test_%u.txt", i);
+                sender.size = size + i * 1021;
+                sender.fill = (char)('a' + i % 26);
+                sender.options = &send_options;
+                memset(data, sender.fill, sender.size);
+                FILE* file = fopen(sender.send_filename, "wb");
+                if (file == NULL) {
+                    ok = false;
+                    break;
+                }
+                fwrite(data, 1, sender.size, file);
+                fclose(file);
+            }
+
+            rse::rbudp::ReceiverDaemon daemon;
+            if (ok && !rse::rbudp::StartReceiverDaemon(daemon, "127.0.0.1", PORT_STR, PORT_NUM, daemon_options)) {
+                printf("Failed to start the receiver daemon\n");
+                ok = false;
+            }
+
+            if (ok) {
+                if (daemon.shared_port) SendStrayDatagrams();
+                rse::TickTock timer = rse::Tick();
+                void** args = new void*[count];
+                for (uint32_t i = 0; i < count; i++) args[i] = &senders[i];
+                rse::th::RunOnThreads(DaemonSenderThread, args, (int)count);
+                delete[] args;
+                seconds = rse::Tock(timer);
+
+                rse::rbudp::StopReceiverDaemon(daemon);
+                daemon_stats = daemon.stats;
+            }
+
+            for (uint32_t i = 0; i < count && ok; i++) {
+                DaemonSender& sender = senders[i];
+                size_t received_size = 0;
+                char* received = sender.ok ? rse::io::AllocateIntoBuffer(sender.receive_filename, received_size) : nullptr;
+                memset(data, sender.fill, sender.size);
+                if (received == nullptr || received_size != sender.size || memcmp(received, data, sender.size) != 0) {
+                    printf("\nFail on the contents of [%s]\n", sender.receive_filename);
+                    ok = false;
+                }
+                free(received);
+            }
+            if (ok && (daemon_stats.succeeded != count || daemon_stats.failed != 0 || daemon_stats.peak_sessions > daemon_options.max_sessions)) {
+                printf("\nFail on the daemon's sessions [%llu] succeeded [%llu] failed [%u] at once\n", (unsigned long long)daemon_stats.succeeded,
+                    (unsigned long long)daemon_stats.failed, daemon_stats.peak_sessions);
+                ok = false;
+            }
+
+            for (uint32_t i = 0; i < count; i++) {
+                remove(senders[i].send_filename);
+                remove(senders[i].receive_filename);
+            }
+            delete[] data;
+            delete[] senders;
+            rse::sk::Cleanup();
+            return ok;
+        }
+
+        // Sends more files at once than the daemon takes, so some senders wait for a slot. Senders that replay
+        // datagrams of an earlier round have to have some dropped as stale.
+        bool TestDaemon(const char* name, uint32_t count, const rse::rbudp::DaemonOptions& daemon_options, const rse::rbudp::SendOptions& send_options) {
+
+            printf("Starting Blast UDP [%s]...\n", name);
+            double seconds = 0;
+            rse::rbudp::DaemonStats daemon_stats;
+            if (!RunDaemonTransfers(count, daemon_options, 2 * 1024 * 1024, send_options, seconds, daemon_stats)) {
+                return false;
+            }
+            printf("[daemon]: [%llu] sessions [%u] at once in [%lf] seconds\n", (unsigned long long)daemon_stats.sessions,
+                daemon_stats.peak_sessions, seconds);
+            if (daemon_stats.shared_port) {
+                printf("[daemon]: shared port sorted [%llu] datagrams, dropped [%llu] stray [%llu] stale [%llu] overflowing\n",
+                    (unsigned long long)daemon_stats.demux_datagrams, (unsigned long long)daemon_stats.stray_datagrams,
+                    (unsigned long long)daemon_stats.stale_datagrams, (unsigned long long)daemon_stats.overflow_datagrams);
+                if (daemon_stats.stray_datagrams == 0) {
+                    printf("\nFail on the stray datagrams, none were dropped\n");
+                    return false;
+                }
+#ifdef RSE_TEST_FAULTS
+                if (send_options.faults != nullptr && send_options.faults->replayed_datagrams > 0 && daemon_stats.stale_datagrams == 0) {
+                    printf("\nFail on the replayed datagrams, none were dropped as stale\n");
+                    return false;
+                }
+#endif
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Connects to the daemon like a sender would, and then says nothing
+        rse::sk::SocketHandle ConnectSilentSender() {
+            sockaddr addr;
+            socklen_t addr_len = 0;
+            rse::sk::SocketHandle socket = rse::sk::CreateClientSocketForServer("127.0.0.1", PORT_STR, addr, addr_len, true);
+            if (rse::sk::IsInvalidSocket(socket)) return socket;
+            if (rse::sk::IsError(rse::sk::Connect(socket, &addr, addr_len))) {
+                rse::sk::CloseSocket(socket);
+                return rse::sk::SK_INVALID_SOCKET;
+            }
+            return socket;
+        }
+
+        // A sender that goes silent has to give up its slot after the idle timeout, so the next one gets in,
+        // and stopping the daemon must not wait on one that is still connected.
+        bool TestDaemonIdleSessions() {
+
+            printf("Starting Blast UDP [daemon idle sessions]...\n");
+            if (rse::sk::Startup() == rse::sk::SK_ERROR_SOCKET) {
+                return false;
+            }
+            g_send_filename = "send_test.txt";
+            g_receive_filename = "test.txt";
+            const size_t size = 256 * 1024;
+            char* data = new char[size];
+            memset(data, 'i', size);
+            FILE* file = fopen(g_send_filename, "wb");
+            if (file == NULL) {
+                delete[] data;
+                rse::sk::Cleanup();
+                return false;
+            }
+            fwrite(data, 1, size, file);
+            fclose(file);
+
+            // One slot, taken by a sender that never speaks
+            bool ok = true;
+            rse::rbudp::DaemonOptions daemon_options;
+            daemon_options.max_sessions = 1;
+            daemon_options.receive.idle_timeout_ms = 300;
+            rse::rbudp::ReceiverDaemon daemon;
+            if (!rse::rbudp::StartReceiverDaemon(daemon, "127.0.0.1", PORT_STR, PORT_NUM, daemon_options)) {
+                printf("Failed to start the receiver daemon\n");
+                ok = false;
+            }
+            rse::sk::SocketHandle silent = ok ? ConnectSilentSender() : rse::sk::SK_INVALID_SOCKET;
+            if (ok && rse::sk::IsInvalidSocket(silent)) ok = false;
+            if (ok) {
+                rse::SleepNs(100 * 1000000ull);
+                ok = rse::rbudp::SendFile(g_send_filename, g_receive_filename, "127.0.0.1", PORT_STR, PORT_NUM, 4096);
+                if (!ok) printf("\nFail on the sender waiting behind a silent one\n");
+                rse::rbudp::StopReceiverDaemon(daemon);
+                if (ok && (daemon.stats.sessions != 2 || daemon.stats.succeeded != 1 || daemon.stats.failed != 1)) {
+                    printf("\nFail on the daemon's sessions [%llu] accepted [%llu] succeeded [%llu] failed\n", (unsigned long long)daemon.stats.sessions,
+                        (unsigned long long)daemon.stats.succeeded, (unsigned long long)daemon.stats.failed);
+                    ok = false;
+                }
+            }
+            rse::sk::CloseSocket(silent);
+
+            size_t received_size = 0;
+            char* received = ok ? rse::io::AllocateIntoBuffer(g_receive_filename, received_size) : nullptr;
+            if (ok && (received == nullptr || received_size != size || memcmp(received, data, size) != 0)) {
+                printf("\nFail on the contents of [%s]\n", g_receive_filename);
+                ok = false;
+            }
+            free(received);
+
+            // With the default timeout a silent sender is still connected when the daemon stops
+            if (ok) {
+                ok = rse::rbudp::StartReceiverDaemon(daemon, "127.0.0.1", PORT_STR, PORT_NUM);
+                silent = ok ? ConnectSilentSender() : rse::sk::SK_INVALID_SOCKET;
+                if (ok && rse::sk::IsInvalidSocket(silent)) ok = false;
+                if (ok) {
+                    rse::SleepNs(100 * 1000000ull);
+                    rse::TickTock timer = rse::Tick();
+                    rse::rbudp::StopReceiverDaemon(daemon);
+                    double seconds = rse::Tock(timer);
+                    printf("[daemon]: stopped with a silent sender connected in [%lf] seconds\n", seconds);
+                    if (seconds > 5 || daemon.stats.succeeded != 0) {
+                        printf("\nFail on stopping the daemon\n");
+                        ok = false;
+                    }
+                }
+                rse::sk::CloseSocket(silent);
+            }
+
+            remove(g_send_filename);
+            remove(g_receive_filename);
+            delete[] data;
+            rse::sk::Cleanup();
+            if (ok) printf("\nSuccess!\n");
+            return ok;
+        }
+
+        // Dozens of transfers at once through one daemon, with more and more of them allowed to run together
+        bool BenchmarkDaemon() {
+
+            printf("Starting Blast UDP [daemon benchmark]...\n");
+            const uint32_t count = 48;
+            const uint32_t limits[] = { 1, 8, 48 };
+            const size_t size = 8 * 1024 * 1024;
+            for (int shared = 0; shared < 2; shared++) {
+                for (uint32_t max_sessions : limits) {
+                    rse::rbudp::DaemonOptions daemon_options;
+                    rse::rbudp::SendOptions send_options;
+                    daemon_options.max_sessions = max_sessions;
+                    daemon_options.shared_port = shared == 1;
+                    send_options.sessions = shared == 1;
+                    double seconds = 0;
+                    rse::rbudp::DaemonStats daemon_stats;
+                    if (!RunDaemonTransfers(count, daemon_options, size, send_options, seconds, daemon_stats)) {
+                        return false;
+                    }
+                    double mbytes = (double)daemon_stats.file_bytes / 1024 / 1024;
+                    printf("[daemon benchmark]: [%u] transfers [%u] at once [%s] [%.1lf] s [%.1lf] MB/s\n", count, daemon_stats.peak_sessions,
+                        daemon_stats.shared_port ? "shared port" : "port per session", seconds, mbytes / seconds);
+                    if (daemon_stats.shared_port) {
+                        printf("[daemon benchmark]: [%llu] datagrams dropped as stale [%llu] for full inboxes\n",
+                            (unsigned long long)daemon_stats.stale_datagrams, (unsigned long long)daemon_stats.overflow_datagrams);
+                    }
+                }
+            }
+            printf("\nSuccess!\n");
+            return true;
+        }
+
+        // Just over 4 GB so block ids, offsets and sizes all have to be 64 bit
+        constexpr uint64_t LARGE_PAYLOAD_SIZE = 4ull * 1024 * 1024 * 1024 + 64 * 1024 * 1024 + 123;
+
+        bool WriteByteAt(FILE* file, uint64_t offset, char c) {
+#ifdef _WIN32
+            if (_fseeki64(file, (__int64)offset, SEEK_SET) != 0) return false;
+#else
+            if (fseeko(file, (off_t)offset, SEEK_SET) != 0) return false;
+#endif
+            return fputc(c, file) != EOF;
+        }
+
+        // Sends a sparse file bigger than 4 GB end to end and checks that marker bytes either
+        // side of the 4 GB boundary land where they should. Not part of the normal run since
+        // the receiver writes the whole file out.
+        bool BenchmarkLargeFile(const rse::rbudp::SendOptions& send_options = rse::rbudp::SendOptions(),
+            const rse::rbudp::ReceiveOptions& receive_options = rse::rbudp::ReceiveOptions()) {
+
+            printf("Starting Blast UDP [large sparse file]...\n");
+            g_send_filename = "send_large_test.bin";
+            g_receive_filename = "large_test.bin";
+            g_payload_size = LARGE_PAYLOAD_SIZE;
+
+            const uint64_t four_gb = 4ull * 1024 * 1024 * 1024;
+            const uint64_t markers[] = { 0, four_gb - 1, four_gb, four_gb + 4096 * 3 + 7, LARGE_PAYLOAD_SIZE - 1 };
+
+            // Only the markers are written, everything else is a hole
+            FILE* file = fopen(g_send_filename, "wb");
+            if (file == NULL) {
+                return false;
+            }
+            for (uint64_t offset : markers) {
+                if (!WriteByteAt(file, offset, 'L')) {
+                    fclose(file);
+                    return false;
+                }
+            }
+            fclose(file);
+
+            bool ok = RunTransfer(send_options, receive_options);
+
+            uint64_t received_size = 0;
+            if (ok && (!rse::io::GetFileSize(g_receive_filename, received_size) || received_size != LARGE_PAYLOAD_SIZE)) {
+                printf("Fail on the size of [%s] [%llu]\n", g_receive_filename, (unsigned long long)received_size);
+                ok = false;
+            }
+
+            rse::io::MemMap mem_map;
+            if (ok && !rse::io::MapMemory(g_receive_filename, LARGE_PAYLOAD_SIZE, rse::io::MemMapIO::READ_ONLY, mem_map)) {
+                printf("Failed to mem map [%s]\n", g_receive_filename);
+                ok = false;
+            }
+            if (ok) {
+                const char* received = (const char*)mem_map.ptr;
+                for (uint64_t offset : markers) {
+                    if (received[offset] != 'L') {
+                        printf("Fail on marker at [%llu]\n", (unsigned long long)offset);
+                        ok = false;
+                    }
+                    if (offset + 1 < LARGE_PAYLOAD_SIZE && offset + 1 != four_gb && received[offset + 1] != 0) {
+                        printf("Fail on the byte after marker [%llu]\n", (unsigned long long)offset);
+                        ok = false;
+                    }
+                }
+                rse::io::UnmapMemory(mem_map);
+            }
+
+            remove(g_send_filename);
+            remove(g_receive_filename);
+            if (ok) printf("\nSuccess!\n");
+            return ok;
+        }
+
 	}
 
 }
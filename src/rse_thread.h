@@ -0,0 +1,259 @@
+#pragma once
+#ifdef _WIN32
+#include <Windows.h>
+#include <process.h>
+#elif __linux__
+#include <pthread.h>
+#endif
+#include <stdint.h>
+
+namespace rse {
+
+    // Just enough threading to run a function on another thread and wait for it
+    namespace th {
+
+#ifdef _WIN32
+        typedef HANDLE ThreadHandle;
+#else
+        typedef pthread_t ThreadHandle;
+#endif
+
+        typedef void (*ThreadFunction)(void* arg);
+
+        struct ThreadStart {
+            ThreadFunction function;
+            void* arg;
+        };
+
+#ifdef _WIN32
+        unsigned __stdcall ThreadTrampoline(void* payload) {
+            ThreadStart start = *(ThreadStart*)payload;
+            delete (ThreadStart*)payload;
+            start.function(start.arg);
+            return 0;
+        }
+#else
+        void* ThreadTrampoline(void* payload) {
+            ThreadStart start = *(ThreadStart*)payload;
+            delete (ThreadStart*)payload;
+            start.function(start.arg);
+            return nullptr;
+        }
+#endif
+
+        // Runs function(arg) on a new thread. Returns false if the thread couldn't be created.
+        bool StartThread(ThreadHandle& out, ThreadFunction function, void* arg) {
+            ThreadStart* start = new ThreadStart{ function, arg };
+#ifdef _WIN32
+            out = (HANDLE)_beginthreadex(nullptr, 0, &ThreadTrampoline, start, 0, nullptr);
+            if (out == 0) {
+                delete start;
+                return false;
+            }
+#else
+            if (pthread_create(&out, nullptr, ThreadTrampoline, start) != 0) {
+                delete start;
+                return false;
+            }
+#endif
+            return true;
+        }
+
+        void JoinThread(ThreadHandle thread) {
+#ifdef _WIN32
+            WaitForSingleObject(thread, INFINITE);
+            CloseHandle(thread);
+#else
+            pthread_join(thread, nullptr);
+#endif
+        }
+
+        // Runs function(args[i]) for every i and waits for all of them. The first runs on the
+        // calling thread and the rest get a thread each, or also run here if one can't be made.
+        void RunOnThreads(ThreadFunction function, void** args, int count) {
+            if (count <= 0) return;
+
+            ThreadHandle* threads = new ThreadHandle[count];
+            bool* started = new bool[count]();
+            for (int i = 1; i < count; i++) {
+                started[i] = StartThread(threads[i], function, args[i]);
+            }
+
+            function(args[0]);
+            for (int i = 1; i < count; i++) {
+                if (started[i]) JoinThread(threads[i]);
+                else function(args[i]);
+            }
+
+            delete[] threads;
+            delete[] started;
+        }
+
+        // Locks and condition variables, just what Workers and Signal need
+#ifdef _WIN32
+        typedef CRITICAL_SECTION Mutex;
+        typedef CONDITION_VARIABLE Condition;
+        void InitMutex(Mutex& m) { InitializeCriticalSection(&m); }
+        void DestroyMutex(Mutex& m) { DeleteCriticalSection(&m); }
+        void InitCondition(Condition& c) { InitializeConditionVariable(&c); }
+        void DestroyCondition(Condition&) {}
+        void Lock(Mutex& m) { EnterCriticalSection(&m); }
+        void Unlock(Mutex& m) { LeaveCriticalSection(&m); }
+        void Wait(Mutex& m, Condition& c) { SleepConditionVariableCS(&c, &m, INFINITE); }
+        void WakeAll(Condition& c) { WakeAllConditionVariable(&c); }
+#else
+        typedef pthread_mutex_t Mutex;
+        typedef pthread_cond_t Condition;
+        void InitMutex(Mutex& m) { pthread_mutex_init(&m, nullptr); }
+        void DestroyMutex(Mutex& m) { pthread_mutex_destroy(&m); }
+        void InitCondition(Condition& c) { pthread_cond_init(&c, nullptr); }
+        void DestroyCondition(Condition& c) { pthread_cond_destroy(&c); }
+        void Lock(Mutex& m) { pthread_mutex_lock(&m); }
+        void Unlock(Mutex& m) { pthread_mutex_unlock(&m); }
+        void Wait(Mutex& m, Condition& c) { pthread_cond_wait(&c, &m); }
+        void WakeAll(Condition& c) { pthread_cond_broadcast(&c); }
+#endif
+
+        // Wakes a thread waiting for work. A ring while nobody is waiting is kept for the next wait.
+        struct Signal {
+            Mutex lock;
+            Condition cond;
+            bool rung = false;
+        };
+
+        void InitSignal(Signal& s) {
+            InitMutex(s.lock);
+            InitCondition(s.cond);
+            s.rung = false;
+        }
+
+        void DestroySignal(Signal& s) {
+            DestroyCondition(s.cond);
+            DestroyMutex(s.lock);
+        }
+
+        void RingSignal(Signal& s) {
+            Lock(s.lock);
+            s.rung = true;
+            WakeAll(s.cond);
+            Unlock(s.lock);
+        }
+
+        // Sleeps until the signal is rung, or returns straight away if it was since the last wait
+        void WaitSignal(Signal& s) {
+            Lock(s.lock);
+            while (!s.rung) Wait(s.lock, s.cond);
+            s.rung = false;
+            Unlock(s.lock);
+        }
+
+        // Workers are threads kept up between calls to RunOnWorkers, for work handed out over and over,
+        // like a lane's share of every round. Otherwise the same as RunOnThreads.
+        struct Workers;
+
+        struct WorkerSeat {
+            Workers* workers = nullptr;
+            int index = 0;
+        };
+
+        struct Workers {
+            ThreadFunction function = nullptr;
+            void** args = nullptr;
+            int count = 0;
+            ThreadHandle* threads = nullptr;
+            bool* started = nullptr;
+            WorkerSeat* seats = nullptr;
+            uint64_t generation = 0; // bumped to hand out work
+            int pending = 0; // workers still busy with it
+            bool stop = false;
+            Mutex lock;
+            Condition go;
+            Condition done;
+        };
+
+        void WorkerThread(void* arg) {
+            WorkerSeat& seat = *(WorkerSeat*)arg;
+            Workers& w = *seat.workers;
+            uint64_t seen = 0;
+            while (true) {
+                Lock(w.lock);
+                while (!w.stop && w.generation == seen) Wait(w.lock, w.go);
+                if (w.stop) {
+                    Unlock(w.lock);
+                    return;
+                }
+                seen = w.generation;
+                Unlock(w.lock);
+
+                w.function(w.args[seat.index]);
+
+                Lock(w.lock);
+                if (--w.pending == 0) WakeAll(w.done);
+                Unlock(w.lock);
+            }
+        }
+
+        // Starts a worker for every args[i] but the first, which runs on the thread calling RunOnWorkers,
+        // as do any that couldn't get a thread. args has to outlive the workers.
+        void StartWorkers(Workers& w, ThreadFunction function, void** args, int count) {
+            w.function = function;
+            w.args = args;
+            w.count = count > 0 ? count : 0;
+            w.threads = new ThreadHandle[w.count > 0 ? w.count : 1];
+            w.started = new bool[w.count > 0 ? w.count : 1]();
+            w.seats = new WorkerSeat[w.count > 0 ? w.count : 1];
+            InitMutex(w.lock);
+            InitCondition(w.go);
+            InitCondition(w.done);
+            for (int i = 1; i < w.count; i++) {
+                w.seats[i].workers = &w;
+                w.seats[i].index = i;
+                w.started[i] = StartThread(w.threads[i], WorkerThread, &w.seats[i]);
+            }
+        }
+
+        // Runs function(args[i]) for every i on the workers and waits for all of them
+        void RunOnWorkers(Workers& w) {
+            if (w.count <= 0) return;
+
+            Lock(w.lock);
+            w.pending = 0;
+            for (int i = 1; i < w.count; i++) {
+                if (w.started[i]) w.pending++;
+            }
+            w.generation++;
+            WakeAll(w.go);
+            Unlock(w.lock);
+
+            w.function(w.args[0]);
+            for (int i = 1; i < w.count; i++) {
+                if (!w.started[i]) w.function(w.args[i]);
+            }
+
+            Lock(w.lock);
+            while (w.pending > 0) Wait(w.lock, w.done);
+            Unlock(w.lock);
+        }
+
+        void StopWorkers(Workers& w) {
+            if (w.threads == nullptr) return;
+
+            Lock(w.lock);
+            w.stop = true;
+            WakeAll(w.go);
+            Unlock(w.lock);
+            for (int i = 1; i < w.count; i++) {
+                if (w.started[i]) JoinThread(w.threads[i]);
+            }
+            DestroyCondition(w.go);
+            DestroyCondition(w.done);
+            DestroyMutex(w.lock);
+            delete[] w.threads;
+            delete[] w.started;
+            delete[] w.seats;
+            w = Workers();
+        }
+
+    }
+
+}